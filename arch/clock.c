@@ -0,0 +1,128 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "clock.h"
+#include "cpu.h"
+#include "pit.h"
+
+// CPUID.01H:EDX
+#define CPUID_01_EDX_TSC (1 << 4)
+
+// 10ms on PIT counter 2 (1193182Hz)
+#define CALIBRATE_MS        10
+#define CALIBRATE_PIT_COUNT 11932
+#define CALIBRATE_ROUNDS    3
+
+static uint32_t tsc_khz = 0;
+static uint64_t tsc_base = 0;
+static uint64_t tsc_base_ns = 0;
+
+/**
+ * Check if the CPUID instruction is available. The ID flag in EFLAGS can be
+ * toggled only if CPUID is supported (late i486 and later).
+ *
+ * @return true if CPUID is supported
+ */
+static bool has_cpuid(void) {
+	uint32_t orig, toggled;
+	__asm__ volatile("pushfl\n\t"
+	                 "popl %0\n\t"
+	                 "movl %0, %1\n\t"
+	                 "xorl %2, %1\n\t"
+	                 "pushl %1\n\t"
+	                 "popfl\n\t"
+	                 "pushfl\n\t"
+	                 "popl %1\n\t"
+	                 "pushl %0\n\t"
+	                 "popfl"
+	                 : "=&r"(orig), "=&r"(toggled) /* Outputs  */
+	                 : "i"(EFLAGS_ID)              /* Inputs   */
+	                 : "cc"                        /* Clobbers */
+	);
+	return ((orig ^ toggled) & EFLAGS_ID) != 0;
+}
+
+static bool has_tsc(void) {
+	uint32_t eax = 1, ebx, ecx = 0, edx;
+
+	if (!has_cpuid())
+		return false;
+
+	__asm__ volatile("cpuid"
+	                 : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx) /* Outputs */
+	);
+	(void)ebx;
+
+	return (edx & CPUID_01_EDX_TSC) != 0;
+}
+
+/**
+ * Count TSC cycles during a CALIBRATE_MS countdown on PIT counter 2. The best
+ * of a few rounds is used to filter out SMIs and emulator hiccups.
+ *
+ * @return TSC cycles in CALIBRATE_MS
+ */
+static uint64_t calibrate_tsc(void) {
+	uint64_t best = UINT64_MAX;
+
+	for (uint8_t i = 0; i < CALIBRATE_ROUNDS; i++) {
+		uint32_t eflags = irq_save();
+
+		pit_ch2_start(CALIBRATE_PIT_COUNT);
+		uint64_t start = rdtsc();
+		while (!pit_ch2_expired())
+			;
+		uint64_t cycles = rdtsc() - start;
+
+		irq_restore(eflags);
+
+		if (cycles < best)
+			best = cycles;
+	}
+
+	return best;
+}
+
+void clock_init(void) {
+	if (!has_tsc())
+		return;
+
+	uint64_t cycles = calibrate_tsc();
+	if (cycles / CALIBRATE_MS > UINT32_MAX || cycles < CALIBRATE_MS)
+		return;
+
+	uint32_t eflags = irq_save();
+	tsc_base_ns = pit_clock_ns();
+	tsc_base = rdtsc();
+	irq_restore(eflags);
+
+	tsc_khz = (uint32_t)(cycles / CALIBRATE_MS);
+}
+
+bool clock_has_tsc(void) { return tsc_khz != 0; }
+
+uint32_t clock_tsc_khz(void) { return tsc_khz; }
+
+uint64_t clock_ns(void) {
+	if (tsc_khz == 0)
+		return pit_clock_ns();
+
+	uint64_t elapsed = rdtsc() - tsc_base;
+
+	// split to avoid overflowing elapsed * 1000000
+	return tsc_base_ns + elapsed / tsc_khz * 1000000u
+	       + elapsed % tsc_khz * 1000000u / tsc_khz;
+}
+
+void udelay(uint32_t us) {
+	if (tsc_khz == 0) {
+		uint64_t end = pit_clock_ns() + (uint64_t)us * 1000u;
+		while (pit_clock_ns() < end)
+			;
+		return;
+	}
+
+	uint64_t end = rdtsc() + (uint64_t)us * tsc_khz / 1000u;
+	while (rdtsc() < end)
+		;
+}
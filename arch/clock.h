@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Initialize the high resolution clock. If the CPU has a TSC it is calibrated
+ * against PIT counter 2, otherwise the latched PIT counter 0 is used as the
+ * time source. Must be called after `pit_init`.
+ */
+void clock_init(void);
+
+/**
+ * Check if the clock is driven by the TSC
+ *
+ * @return true if the TSC is used; false if the PIT fallback is used
+ */
+bool clock_has_tsc(void);
+
+/**
+ * Calibrated TSC frequency
+ *
+ * @return frequency in kHz or 0 if there is no TSC
+ */
+uint32_t clock_tsc_khz(void);
+
+/**
+ * Monotonic time since `pit_init`
+ *
+ * @return nanoseconds
+ */
+uint64_t clock_ns(void);
+
+/**
+ * Busy wait at least `us` microseconds. Unlike `sleep` it does not depend on
+ * the timer interrupt and is not rounded up to the next 1ms tick.
+ *
+ * @param us microseconds to wait
+ */
+void udelay(uint32_t us);
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+
+// ========================================================
+// EFLAGS
+
+#define EFLAGS_IF (1 << 9)
+#define EFLAGS_ID (1 << 21)
+
+/*
+ * Disable interrupts and return the previous EFLAGS
+ *
+ * @return EFLAGS before the interrupts were disabled
+ */
+static inline uint32_t irq_save(void) {
+	uint32_t eflags;
+	__asm__ volatile("pushfl\n\t"
+	                 "popl %0\n\t"
+	                 "cli"
+	                 : "=r"(eflags) /* Outputs  */
+	                 :              /* Inputs   */
+	                 : "memory"     /* Clobbers */
+	);
+	return eflags;
+}
+
+/*
+ * Re-enable interrupts if they were enabled before `irq_save`
+ *
+ * @param eflags value returned by `irq_save`
+ */
+static inline void irq_restore(uint32_t eflags) {
+	if ((eflags & EFLAGS_IF) != 0)
+		__asm__ volatile("sti" ::: "memory");
+}
+
+/*
+ * Read the time stamp counter. Only valid if `clock_has_tsc` is true.
+ *
+ * @return cycles since reset
+ */
+static inline uint64_t rdtsc(void) {
+	uint64_t ret;
+	__asm__ volatile("rdtsc" : "=A"(ret));
+	return ret;
+}
@@ -0,0 +1,16 @@
+#include "memmap.h"
+
+bool memmap_is_ram(uint64_t addr, uint64_t len) {
+	if (e820_count == 0)
+		return true;
+
+	for (uint32_t i = 0; i < e820_count; ++i) {
+		const struct e820_entry *entry = &e820_map[i];
+
+		if (entry->type == E820_TYPE_RAM && entry->base <= addr
+		    && addr + len <= entry->base + entry->length)
+			return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Max entries collected, keep in sync with E820_MAX in stage2_entry.asm
+#define E820_MAX 32
+
+#define E820_TYPE_RAM      1
+#define E820_TYPE_RESERVED 2
+#define E820_TYPE_ACPI     3
+#define E820_TYPE_NVS      4
+#define E820_TYPE_BAD      5
+
+struct __attribute__((__packed__)) e820_entry {
+	uint64_t base;
+	uint64_t length;
+	uint32_t type;     // E820_TYPE_*
+	uint32_t ext_attr; // ACPI 3.0 extended attributes
+};
+
+/*
+ * BIOS memory map (INT 15h, EAX = E820h), read by stage2_entry.asm in real
+ * mode before the switch to protected mode. Empty if the BIOS does not
+ * support the call.
+ */
+extern uint32_t e820_count;
+extern struct e820_entry e820_map[E820_MAX];
+
+/**
+ * Check that a range is inside one RAM region of the memory map
+ *
+ * @param addr start of the range
+ * @param len length of the range
+ * @return true if the range is RAM or there is no memory map
+ */
+bool memmap_is_ram(uint64_t addr, uint64_t len);
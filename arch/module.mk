@@ -1,2 +1,4 @@
-SRCS += arch/idt.c \
+SRCS += arch/clock.c \
+        arch/idt.c \
+        arch/memmap.c \
         arch/pit.c
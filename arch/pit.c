@@ -2,6 +2,7 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "cpu.h"
 #include "drivers/io/io.h"
 #include "idt.h"
 #include "pit.h"
@@ -57,7 +58,22 @@
 #define PIT_HZ     1193182
 #define PIT_1000HZ 1193
 
+// ========================================================
+// NMI Status and Control Register (speaker / counter 2 gate)
+
+#define NMI_SC           0x61
+#define NMI_SC_TIM2_GATE (1 << 0)
+#define NMI_SC_SPKR_DAT  (1 << 1)
+#define NMI_SC_TIM2_OUT  (1 << 5)
+
+// ========================================================
+// 8259 PIC Interrupt Request Register read (OCW3)
+
+#define PIC1_COMMAND 0x20
+#define PIC_OCW3_IRR 0x0a
+
 static volatile uint32_t timer_ms_left = 0;
+static volatile uint32_t timer_ticks = 0;
 
 bool pit_timer_isr(uint8_t, void *);
 static struct idt_int_handler int_h = {&pit_timer_isr, NULL, NULL};
@@ -79,8 +95,57 @@ void pit_init(void) {
 	outb(PIT_COUNTER_0, (uint8_t)(divisor >> 8));   // MSB
 }
 
+uint32_t pit_ticks(void) { return timer_ticks; }
+
+uint64_t pit_clock_ns(void) {
+	uint32_t ticks;
+	uint16_t count;
+	uint8_t irr;
+
+	uint32_t eflags = irq_save();
+
+	outb(PIT_TCW, TCW_COUNTER_0 | TCW_RW_LATCH);
+	count = inb(PIT_COUNTER_0);
+	count |= (uint16_t)(inb(PIT_COUNTER_0) << 8);
+	ticks = timer_ticks;
+
+	// The counter may have reloaded after the interrupts were disabled. In
+	// that case the tick is still pending in the PIC and not yet counted.
+	outb(PIC1_COMMAND, PIC_OCW3_IRR);
+	irr = inb(PIC1_COMMAND);
+	if ((irr & 1) != 0 && count > PIT_1000HZ / 2)
+		ticks++;
+
+	irq_restore(eflags);
+
+	if (count > PIT_1000HZ)
+		count = PIT_1000HZ;
+
+	// PIT_1000HZ counts are one tick, the reload is not exactly 1ms, but the
+	// drift is negligible compared to the latch resolution (~838ns)
+	return (uint64_t)ticks * 1000000u
+	       + (uint32_t)(PIT_1000HZ - count) * 1000000u / PIT_1000HZ;
+}
+
+void pit_ch2_start(uint16_t count) {
+	// gate low while programming, speaker disconnected
+	uint8_t sc = inb(NMI_SC) & (uint8_t)~(NMI_SC_TIM2_GATE | NMI_SC_SPKR_DAT);
+	outb(NMI_SC, sc);
+
+	outb(PIT_TCW,
+	     TCW_COUNTER_2 | TCW_RW_LSB_MSB | TCW_MODE_INT_ON_0 | TCW_BINARY);
+	outb(PIT_COUNTER_2, (uint8_t)(count & 0xff)); // LSB
+	outb(PIT_COUNTER_2, (uint8_t)(count >> 8));   // MSB
+
+	// rising edge on the gate starts the count
+	outb(NMI_SC, sc | NMI_SC_TIM2_GATE);
+}
+
+bool pit_ch2_expired(void) { return (inb(NMI_SC) & NMI_SC_TIM2_OUT) != 0; }
+
 bool pit_timer_isr(uint8_t int_n, void *userdata) {
 	(void)int_n, (void)userdata;
+	timer_ticks++;
 	if (timer_ms_left > 0) {
 		timer_ms_left--;
 	}
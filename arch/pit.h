@@ -1,7 +1,37 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
 void sleep(uint32_t ms);
 
 void pit_init(void);
+
+/**
+ * Number of 1ms timer ticks since `pit_init`
+ *
+ * @return tick count
+ */
+uint32_t pit_ticks(void);
+
+/**
+ * Time since `pit_init` from the tick count and the latched counter 0 value.
+ * Resolution is one PIT clock (~838ns). Used when there is no TSC.
+ *
+ * @return nanoseconds
+ */
+uint64_t pit_clock_ns(void);
+
+/**
+ * Start a one-shot countdown on counter 2. The speaker is disconnected.
+ *
+ * @param count number of PIT clocks (1193182Hz) to count
+ */
+void pit_ch2_start(uint16_t count);
+
+/**
+ * Check if the counter 2 countdown started by `pit_ch2_start` reached 0
+ *
+ * @return true if the count expired
+ */
+bool pit_ch2_expired(void);
@@ -7,7 +7,7 @@ COMTEST_TRIES equ 10000
 FLOPPY_DOR equ 0x3f2
 
 extern stage2_start
-extern stage2_size
+extern stage2_sectors
 
 ; Print one charecter in AL
 ; Uses: AX, BX
@@ -93,10 +93,8 @@ start2:
     mov ax, read_disk
     call LogString
 
-    ; calculate stage2 size in sectors
-    mov ax, stage2_size
-    add ax, 512 - 1
-    shr ax, 9   ; div 512
+    ; stage2 size in sectors, rounded up by the linker script
+    mov ax, stage2_sectors
     push ax     ; push stage2 size in sectors
 
     mov ch, 0           ; cylinder
@@ -1,16 +1,160 @@
+#include <stddef.h>
 #include <stdint.h>
 
+#include "arch/clock.h"
 #include "arch/pit.h"
+#include "drivers/block/cache.h"
+#include "drivers/block/part.h"
 #include "drivers/display/print.h"
 #include "drivers/pci/pci21.h"
 #include "drivers/serial/serial.h"
 #include "drivers/usb/uhci.h"
+#include "fs/fat.h"
+#include "loader/linux.h"
+#include "loader/multiboot.h"
+#include "loader/stream.h"
 #include "mem/mem.h"
 #include "utils/gdbstub.h"
+#include "utils/profile.h"
+
+// 64KB of sectors in front of the boot device
+#define BOOT_CACHE_BLOCKS    128
+#define BOOT_CACHE_READAHEAD 8
+
+// Multiboot or Linux kernel on the boot volume, Linux may have an initrd
+#define BOOT_KERNEL "/boot/kernel"
+#define BOOT_INITRD "/boot/initrd"
+// Optional CRC-32 of a boot file in hex, e.g. "/boot/kernel.crc32"
+#define BOOT_CRC_EXT ".crc32"
+
+static struct block_cache boot_cache;
+static struct part_table boot_parts;
+static struct fat_fs boot_fs;
+
+/**
+ * Write the last statistics and stop the devices before a kernel is started
+ */
+static void boot_handoff(void) {
+	block_cache_dump(&boot_cache, COM1);
+	profile_dump(COM1);
+
+	uhci_shutdown();
+}
+
+/**
+ * Open a boot file as a stream, with its CRC-32 to check if there is a CRC
+ * file next to it. The CRC file holds 8 hex digits, like the output of
+ * crc32(1).
+ *
+ * @param file file to open
+ * @param path path of the file
+ * @param crc_path path of the CRC file
+ * @param gunzip decompress a gzip compressed file
+ * @param stream the stream is returned here
+ * @return false if the file could not be opened
+ */
+static bool boot_open(struct fat_file *file, const char *path,
+                      const char *crc_path, bool gunzip,
+                      struct stream *stream) {
+	struct fat_file crc_file;
+	char hex[8];
+	uint32_t crc = 0;
+	uint32_t got = 0;
+
+	if (!fat_open(&boot_fs, path, file))
+		return false;
+
+	if (!stream_open(stream, file, gunzip)) {
+		fat_close(file);
+		return false;
+	}
+
+	if (!fat_open(&boot_fs, crc_path, &crc_file))
+		return true;
+
+	bool valid = fat_read(&crc_file, hex, sizeof(hex), &got)
+	             && got == sizeof(hex);
+	for (uint8_t i = 0; valid && i < sizeof(hex); ++i) {
+		char chr = hex[i];
+
+		if (chr >= '0' && chr <= '9')
+			crc = crc << 4 | (uint32_t)(chr - '0');
+		else if ((chr | 0x20) >= 'a' && (chr | 0x20) <= 'f')
+			crc = crc << 4 | (uint32_t)((chr | 0x20) - 'a' + 10);
+		else
+			valid = false;
+	}
+	fat_close(&crc_file);
+
+	if (valid) {
+		stream_expect_crc(stream, crc);
+		print_string("Checking ");
+		print_string(path);
+		print_string(" against ");
+		print_string(crc_path);
+		print_string("\n");
+	}
+
+	return true;
+}
+
+static void boot_close(struct fat_file *file, struct stream *stream) {
+	stream_close(stream);
+	fat_close(file);
+}
+
+/**
+ * Load the kernel from the boot volume and start it. Returns only if the
+ * kernel could not be loaded.
+ */
+static void boot_kernel(void) {
+	struct fat_file kernel;
+	struct fat_file initrd;
+	struct stream kernel_stream;
+	struct stream initrd_stream;
+	struct multiboot_image mb_image;
+	struct linux_image linux_image;
+
+	// Multiboot kernels may be gzip compressed, the stream unpacks them
+	if (!boot_open(&kernel, BOOT_KERNEL, BOOT_KERNEL BOOT_CRC_EXT, true,
+	               &kernel_stream)) {
+		print_string("No " BOOT_KERNEL "\n");
+		return;
+	}
+
+	if (multiboot_load(&kernel_stream, NULL, &mb_image)) {
+		boot_handoff();
+		multiboot_start(&mb_image);
+	}
+
+	boot_close(&kernel, &kernel_stream);
+
+	// a bzImage and an initrd are loaded as they are
+	if (!boot_open(&kernel, BOOT_KERNEL, BOOT_KERNEL BOOT_CRC_EXT, false,
+	               &kernel_stream)) {
+		print_string("Kernel load failed\n");
+		return;
+	}
+
+	bool has_initrd = boot_open(&initrd, BOOT_INITRD,
+	                            BOOT_INITRD BOOT_CRC_EXT, false, &initrd_stream);
+
+	if (linux_load(&kernel_stream, has_initrd ? &initrd_stream : NULL, NULL,
+	               &linux_image)) {
+		boot_handoff();
+		linux_start(&linux_image);
+	}
+
+	if (has_initrd)
+		boot_close(&initrd, &initrd_stream);
+	boot_close(&kernel, &kernel_stream);
+	print_string("Kernel load failed\n");
+}
 
 void stage2_main(void) {
 	init_output();
 	pit_init();
+	clock_init();
 
 	if (!serial_init_port(COM1, 115200))
 		print_string("COM1 fail");
@@ -25,6 +169,33 @@ void stage2_main(void) {
 	uhci_init();
 	pci_init();
 
+	struct block_device *boot_dev = block_get(0);
+	if (boot_dev == NULL
+	    || !block_cache_init(&boot_cache, boot_dev, BOOT_CACHE_BLOCKS,
+	                         BOOT_CACHE_READAHEAD)) {
+		print_string("No boot device\n");
+	} else {
+		// a partition to boot from, or the whole device as a superfloppy
+		// whose boot sector may also pass as an MBR
+		struct partition *boot_part = NULL;
+		if (part_scan(&boot_cache.blk, &boot_parts))
+			boot_part = part_find_boot(&boot_parts);
+
+		if ((boot_part != NULL && fat_mount(&boot_fs, &boot_part->blk))
+		    || fat_mount(&boot_fs, &boot_cache.blk)) {
+			print_string("FAT");
+			print_string(itoa_once(boot_fs.type, 10));
+			print_string(" boot volume\n");
+			boot_kernel();
+		} else {
+			print_string("No FAT on the boot device\n");
+		}
+
+		block_cache_dump(&boot_cache, COM1);
+	}
+
+	profile_dump(COM1);
+
 	while (1)
-		;
+		profile_poll(COM1);
 }
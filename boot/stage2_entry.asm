@@ -1,7 +1,14 @@
 %include "io.asm"
 
+; BIOS memory map, see arch/memmap.h
+E820_MAX equ 32
+E820_ENTRY_SIZE equ 24
+E820_SMAP equ 0x534d4150 ; 'SMAP'
+
 [BITS 16]
 enter_protected:
+    call e820_detect
+
     cli
     lgdt [gdtr]
     mov eax, cr0
@@ -10,6 +17,47 @@ enter_protected:
 
     jmp 0x8:protected_init
 
+; Read the BIOS memory map into e820_map and the number of entries into
+; e820_count, which is right before the map. Both may be above 64K, so they
+; are addressed through ES.
+; Clobber: EAX, EBX, ECX, EDX, SI, DI, ES
+e820_detect:
+    mov eax, e820_count
+    mov edi, eax
+    shr eax, 4
+    mov es, ax
+    and di, 0xf         ; ES:DI = e820_count
+    mov si, di
+    mov dword [es:si], 0
+    add di, 4           ; ES:DI = e820_map
+    xor ebx, ebx        ; continuation value, 0 for the first entry
+
+.next:
+    mov dword [es:di + 20], 1   ; valid, if the BIOS returns only 20 bytes
+    mov eax, 0xe820
+    mov ecx, E820_ENTRY_SIZE
+    mov edx, E820_SMAP
+    int 0x15
+    jc .done            ; not supported or past the last entry
+    cmp eax, E820_SMAP
+    jne .done
+    cmp ecx, 20
+    jb .skip
+
+    inc dword [es:si]
+    add di, E820_ENTRY_SIZE
+    cmp dword [es:si], E820_MAX
+    je .done
+
+.skip:
+    test ebx, ebx       ; 0 after the last entry
+    jnz .next
+
+.done:
+    xor ax, ax
+    mov es, ax
+    ret
+
 %define GDT_LIMIT(seg)  (((seg)  & 0x0000ffff) | \
                        ((((seg)  & 0x000f0000) >> 16) << 48))
 %define GDT_BASE(base) ((((base) & 0x00ffffff)        << 16) | \
@@ -74,6 +122,11 @@ extern stage2_main
 ; idt.c common handler
 extern idt_common_isr
 
+%ifdef PROFILE
+; profile.c PIT sample hook
+extern profile_sample
+%endif
+
 extern bss_start
 extern bss_size
 
@@ -222,6 +275,13 @@ isr_%1:
 %macro isr_int 1-2
 isr_%1:
     pusha
+%ifdef PROFILE
+%if %1 == 32
+    push dword [esp + 32]   ; interrupted EIP, above the pusha frame
+    call profile_sample
+    add esp, 4
+%endif
+%endif
     call_common_isr %1
 %ifnidni %2, nmi
     pic_send_eoi %1-32
@@ -378,3 +438,11 @@ idtr:
 idt:
     times 256 dq ?
 idt_end:
+
+global e820_count
+global e820_map
+
+e820_count:
+    dd ?
+e820_map:
+    times E820_MAX * E820_ENTRY_SIZE db ?
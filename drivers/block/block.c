@@ -0,0 +1,130 @@
+#include "block.h"
+
+#include <stddef.h>
+
+#include "mem/mem.h"
+
+static struct block_device *block_devices = NULL;
+
+void block_register(struct block_device *dev) {
+	struct block_device **pos = &block_devices;
+
+	while (*pos != NULL)
+		pos = &(*pos)->_next;
+
+	dev->_next = NULL;
+	*pos = dev;
+}
+
+struct block_device *block_get(uint8_t idx) {
+	struct block_device *dev = block_devices;
+
+	while (dev != NULL && idx-- > 0)
+		dev = dev->_next;
+
+	return dev;
+}
+
+bool block_read(struct block_device *dev, uint32_t lba, uint32_t count,
+                void *buf) {
+	if (count == 0)
+		return true;
+
+	if (lba >= dev->block_count || count > dev->block_count - lba)
+		return false;
+
+	return dev->read(dev, lba, count, buf);
+}
+
+/**
+ * Read a scatter/gather list with the plain read callback. Entries get their
+ * whole blocks directly, a block that straddles entries is bounced.
+ */
+static bool block_read_sg_fallback(struct block_device *dev, uint32_t lba,
+                                   uint32_t count, const struct sg_entry *sg,
+                                   uint8_t sg_num) {
+	uint8_t *bounce = NULL;
+	uint8_t idx = 0;
+	uint32_t off = 0;
+	bool result = true;
+
+	while (result && count > 0) {
+		while (off == sg[idx].len) {
+			++idx;
+			off = 0;
+		}
+
+		uint32_t n = (sg[idx].len - off) / dev->block_size;
+		if (n > count)
+			n = count;
+
+		if (n > 0) {
+			result = dev->read(dev, lba, n, (uint8_t *)sg[idx].buf + off);
+			off += n * dev->block_size;
+			lba += n;
+			count -= n;
+			continue;
+		}
+
+		struct sg_entry parts[SG_MAX];
+		uint8_t parts_num = 0;
+
+		if (bounce == NULL)
+			bounce = memalloc(dev->block_size);
+
+		result = bounce != NULL && dev->read(dev, lba, 1, bounce);
+		if (result)
+			parts_num = sg_slice(&sg[idx], (uint8_t)(sg_num - idx), off,
+			                     dev->block_size, parts);
+
+		uint8_t *pos = bounce;
+		for (uint8_t i = 0; i < parts_num; ++i) {
+			memcopy(parts[i].buf, pos, parts[i].len);
+			pos += parts[i].len;
+		}
+
+		// step over the block, the entry that holds its end is not finished
+		uint32_t left = dev->block_size;
+		while (result && left > 0) {
+			uint32_t part = sg[idx].len - off;
+
+			if (part > left) {
+				off += left;
+				break;
+			}
+
+			left -= part;
+			off += part;
+			if (left > 0) {
+				++idx;
+				off = 0;
+			}
+		}
+
+		++lba;
+		--count;
+	}
+
+	memfree(bounce);
+	return result;
+}
+
+bool block_read_sg(struct block_device *dev, uint32_t lba,
+                   const struct sg_entry *sg, uint8_t sg_num) {
+	uint32_t len = sg_total(sg, sg_num);
+	uint32_t count = len / dev->block_size;
+
+	if (sg_num > SG_MAX || len % dev->block_size != 0)
+		return false;
+
+	if (count == 0)
+		return true;
+
+	if (lba >= dev->block_count || count > dev->block_count - lba)
+		return false;
+
+	if (dev->read_sg != NULL)
+		return dev->read_sg(dev, lba, count, sg, sg_num);
+
+	return block_read_sg_fallback(dev, lba, count, sg, sg_num);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "utils/sg.h"
+
+struct block_device {
+	/*
+	 * Read whole blocks from the device. The range is checked by `block_read`
+	 * before the call.
+	 *
+	 * @param dev the device
+	 * @param lba first block to read
+	 * @param count number of blocks, at least 1
+	 * @param buf destination, at least `count * block_size` bytes
+	 *
+	 * @return true if every block is read
+	 */
+	bool (*read)(struct block_device *dev, uint32_t lba, uint32_t count,
+	             void *buf);
+	/*
+	 * Read whole blocks into a scatter/gather list. Optional, `block_read_sg`
+	 * falls back to `read` if it is NULL.
+	 *
+	 * @param dev the device
+	 * @param lba first block to read
+	 * @param count number of blocks, at least 1
+	 * @param sg destination, `count * block_size` bytes in total
+	 * @param sg_num number of entries, at most SG_MAX
+	 *
+	 * @return true if every block is read
+	 */
+	bool (*read_sg)(struct block_device *dev, uint32_t lba, uint32_t count,
+	                const struct sg_entry *sg, uint8_t sg_num);
+	/*
+	 * Driver private data
+	 */
+	void *priv;
+	const char *name;
+	uint32_t block_size;  // bytes
+	uint32_t block_count; // total number of blocks
+	// internal
+	struct block_device *_next; // included in this struct to push the
+	                            // allocation responsibility to the caller
+};
+
+/**
+ * Make a block device available to the filesystem layer. Devices are kept in
+ * the order they registered.
+ *
+ * @param dev device to register
+ */
+void block_register(struct block_device *dev);
+
+/**
+ * Get a registered block device
+ *
+ * @param idx index in registration order
+ * @return the device or NULL if there are less than `idx + 1` devices
+ */
+struct block_device *block_get(uint8_t idx);
+
+/**
+ * Read blocks from a device
+ *
+ * @param dev device to read from
+ * @param lba first block to read
+ * @param count number of blocks
+ * @param buf destination, at least `count * dev->block_size` bytes
+ * @return true if every block is read; false if the range is outside of the
+ * device or the read failed
+ */
+bool block_read(struct block_device *dev, uint32_t lba, uint32_t count,
+                void *buf);
+
+/**
+ * Read blocks from a device into a scatter/gather list. The entries do not
+ * need to hold whole blocks.
+ *
+ * @param dev device to read from
+ * @param lba first block to read
+ * @param sg destination, the total length must be a multiple of the block size
+ * @param sg_num number of entries, at most SG_MAX
+ * @return true if every block is read; false if the range is outside of the
+ * device or the read failed
+ */
+bool block_read_sg(struct block_device *dev, uint32_t lba,
+                   const struct sg_entry *sg, uint8_t sg_num);
@@ -0,0 +1,280 @@
+#include "cache.h"
+
+#include <stddef.h>
+
+#include "drivers/display/print.h"
+#include "mem/mem.h"
+#include "utils/sg.h"
+
+static uint8_t *block_cache_buf(const struct block_cache *cache, uint16_t idx) {
+	return cache->data + (uint32_t)idx * cache->dev->block_size;
+}
+
+static uint16_t block_cache_lookup(const struct block_cache *cache,
+                                   uint32_t lba) {
+	uint16_t idx = cache->hash[lba & cache->hash_mask];
+
+	while (idx != BLOCK_CACHE_NONE && cache->entries[idx].lba != lba)
+		idx = cache->entries[idx].hash_next;
+
+	return idx;
+}
+
+static void block_cache_hash_remove(struct block_cache *cache, uint16_t idx) {
+	uint16_t *pos = &cache->hash[cache->entries[idx].lba & cache->hash_mask];
+
+	while (*pos != idx)
+		pos = &cache->entries[*pos].hash_next;
+
+	*pos = cache->entries[idx].hash_next;
+}
+
+static void block_cache_lru_unlink(struct block_cache *cache, uint16_t idx) {
+	struct block_cache_entry *entry = &cache->entries[idx];
+
+	if (entry->lru_prev != BLOCK_CACHE_NONE)
+		cache->entries[entry->lru_prev].lru_next = entry->lru_next;
+	else
+		cache->lru_head = entry->lru_next;
+
+	if (entry->lru_next != BLOCK_CACHE_NONE)
+		cache->entries[entry->lru_next].lru_prev = entry->lru_prev;
+	else
+		cache->lru_tail = entry->lru_prev;
+}
+
+static void block_cache_lru_push(struct block_cache *cache, uint16_t idx) {
+	struct block_cache_entry *entry = &cache->entries[idx];
+
+	entry->lru_prev = BLOCK_CACHE_NONE;
+	entry->lru_next = cache->lru_head;
+
+	if (cache->lru_head != BLOCK_CACHE_NONE)
+		cache->entries[cache->lru_head].lru_prev = idx;
+	else
+		cache->lru_tail = idx;
+
+	cache->lru_head = idx;
+}
+
+static void block_cache_touch(struct block_cache *cache, uint16_t idx) {
+	if (cache->lru_head == idx)
+		return;
+
+	block_cache_lru_unlink(cache, idx);
+	block_cache_lru_push(cache, idx);
+}
+
+/**
+ * Take the least recently used buffer for a new block and make it the most
+ * recently used one
+ */
+static uint16_t block_cache_claim(struct block_cache *cache, uint32_t lba) {
+	uint16_t idx = cache->lru_tail;
+	struct block_cache_entry *entry = &cache->entries[idx];
+
+	if (entry->valid) {
+		block_cache_hash_remove(cache, idx);
+		++cache->stats.evictions;
+	}
+
+	entry->lba = lba;
+	entry->valid = true;
+	entry->hash_next = cache->hash[lba & cache->hash_mask];
+	cache->hash[lba & cache->hash_mask] = idx;
+
+	block_cache_touch(cache, idx);
+	return idx;
+}
+
+static void block_cache_invalidate(struct block_cache *cache, uint16_t idx) {
+	block_cache_hash_remove(cache, idx);
+	cache->entries[idx].valid = false;
+
+	// reuse it first
+	block_cache_lru_unlink(cache, idx);
+	struct block_cache_entry *entry = &cache->entries[idx];
+	entry->lru_next = BLOCK_CACHE_NONE;
+	entry->lru_prev = cache->lru_tail;
+	if (cache->lru_tail != BLOCK_CACHE_NONE)
+		cache->entries[cache->lru_tail].lru_next = idx;
+	else
+		cache->lru_head = idx;
+	cache->lru_tail = idx;
+}
+
+/**
+ * Read a run of uncached blocks into the pool
+ *
+ * @param cache cache
+ * @param lba first block
+ * @param count number of blocks, at most half of the pool
+ * @return true if the blocks are read
+ */
+static bool block_cache_fill(struct block_cache *cache, uint32_t lba,
+                             uint32_t count) {
+	struct sg_entry sg[SG_MAX];
+	uint16_t idx[SG_MAX];
+
+	while (count > 0) {
+		uint8_t n = (uint8_t)(count > SG_MAX ? SG_MAX : count);
+
+		for (uint8_t i = 0; i < n; ++i) {
+			idx[i] = block_cache_claim(cache, lba + i);
+			sg[i].buf = block_cache_buf(cache, idx[i]);
+			sg[i].len = cache->dev->block_size;
+		}
+
+		if (!block_read_sg(cache->dev, lba, sg, n)) {
+			for (uint8_t i = 0; i < n; ++i)
+				block_cache_invalidate(cache, idx[i]);
+			return false;
+		}
+
+		lba += n;
+		count -= n;
+	}
+
+	return true;
+}
+
+static bool block_cache_read(struct block_device *blk, uint32_t lba,
+                             uint32_t count, void *buf) {
+	struct block_cache *cache = blk->priv;
+	uint32_t block_size = cache->dev->block_size;
+	bool sequential = lba == cache->next_lba;
+	uint8_t *pos = buf;
+
+	cache->next_lba = lba + count;
+
+	if (count >= BLOCK_CACHE_BYPASS) {
+		cache->stats.bypass += count;
+		return block_read(cache->dev, lba, count, buf);
+	}
+
+	while (count > 0) {
+		uint16_t idx = block_cache_lookup(cache, lba);
+
+		if (idx != BLOCK_CACHE_NONE) {
+			block_cache_touch(cache, idx);
+			memcopy(pos, block_cache_buf(cache, idx), block_size);
+			++cache->stats.hits;
+
+			++lba;
+			--count;
+			pos += block_size;
+			continue;
+		}
+
+		// the missing run, and the blocks after it if the reader streams
+		uint32_t run = 1;
+		while (run < count
+		       && block_cache_lookup(cache, lba + run) == BLOCK_CACHE_NONE)
+			++run;
+
+		// keep every block of the request in the pool, larger runs go around
+		uint32_t half = cache->size / 2u;
+		if (run > half) {
+			cache->stats.misses += run;
+			if (!block_read(cache->dev, lba, run, pos))
+				return false;
+		} else {
+			uint32_t ahead = 0;
+
+			while (sequential && run == count && ahead < cache->readahead
+			       && run + ahead < half
+			       && lba + run + ahead < cache->dev->block_count
+			       && block_cache_lookup(cache, lba + run + ahead)
+			              == BLOCK_CACHE_NONE)
+				++ahead;
+
+			if (!block_cache_fill(cache, lba, run + ahead))
+				return false;
+
+			for (uint32_t i = 0; i < run; ++i)
+				memcopy(pos + i * block_size,
+				        block_cache_buf(cache, block_cache_lookup(cache, lba + i)),
+				        block_size);
+
+			cache->stats.misses += run;
+			cache->stats.readahead += ahead;
+		}
+
+		lba += run;
+		count -= run;
+		pos += run * block_size;
+	}
+
+	return true;
+}
+
+bool block_cache_init(struct block_cache *cache, struct block_device *dev,
+                      uint16_t size, uint16_t readahead) {
+	uint16_t buckets = 1;
+
+	if (size == 0 || size == BLOCK_CACHE_NONE)
+		return false;
+
+	while (buckets < size)
+		buckets = (uint16_t)(buckets << 1);
+
+	memfill(cache, 0, sizeof(struct block_cache));
+	cache->dev = dev;
+	cache->size = size;
+	cache->readahead = readahead;
+	cache->hash_mask = (uint16_t)(buckets - 1);
+	cache->hash = memalloc(sizeof(uint16_t) * buckets);
+	cache->entries = memalloc(sizeof(struct block_cache_entry) * size);
+	cache->data = memalloc(dev->block_size * size);
+
+	if (cache->hash == NULL || cache->entries == NULL || cache->data == NULL) {
+		block_cache_destroy(cache);
+		return false;
+	}
+
+	memfill(cache->hash, 0xff, sizeof(uint16_t) * buckets);
+
+	cache->lru_head = BLOCK_CACHE_NONE;
+	cache->lru_tail = BLOCK_CACHE_NONE;
+	for (uint16_t i = 0; i < size; ++i) {
+		cache->entries[i].valid = false;
+		block_cache_lru_push(cache, i);
+	}
+
+	cache->next_lba = UINT32_MAX;
+	cache->blk.read = block_cache_read;
+	cache->blk.priv = cache;
+	cache->blk.name = dev->name;
+	cache->blk.block_size = dev->block_size;
+	cache->blk.block_count = dev->block_count;
+
+	return true;
+}
+
+void block_cache_destroy(struct block_cache *cache) {
+	memfree(cache->hash);
+	memfree(cache->entries);
+	memfree(cache->data);
+	cache->hash = NULL;
+	cache->entries = NULL;
+	cache->data = NULL;
+}
+
+static void block_cache_dump_counter(serial_port port, const char *name,
+                                     uint32_t val) {
+	serial_print(port, " ");
+	serial_print(port, name);
+	serial_print(port, " ");
+	serial_print(port, itoa_once((int)val, 10));
+}
+
+void block_cache_dump(const struct block_cache *cache, serial_port port) {
+	serial_print(port, "CACHE ");
+	serial_print(port, cache->blk.name != NULL ? cache->blk.name : "?");
+	block_cache_dump_counter(port, "hits", cache->stats.hits);
+	block_cache_dump_counter(port, "misses", cache->stats.misses);
+	block_cache_dump_counter(port, "readahead", cache->stats.readahead);
+	block_cache_dump_counter(port, "evictions", cache->stats.evictions);
+	block_cache_dump_counter(port, "bypass", cache->stats.bypass);
+	serial_print(port, "\r\n");
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "drivers/block/block.h"
+#include "drivers/serial/serial.h"
+
+/*
+ * Block cache. A fixed pool of block buffers in front of a block device with a
+ * hash index and LRU eviction. A miss that continues the previous request also
+ * reads ahead, requests of BLOCK_CACHE_BYPASS blocks or more go straight to
+ * the device. Consumers read through `cache->blk` like any other device.
+ *
+ * Dump format (one line):
+ *   CACHE <name> hits <n> misses <n> readahead <n> evictions <n> bypass <n>
+ */
+
+// Requests at least this long are not cached
+#define BLOCK_CACHE_BYPASS 32
+
+#define BLOCK_CACHE_NONE 0xffff
+
+struct block_cache_stats {
+	uint32_t hits;      // blocks served from the pool
+	uint32_t misses;    // blocks read from the device on demand
+	uint32_t readahead; // blocks read ahead of a sequential miss
+	uint32_t evictions; // valid blocks dropped for new ones
+	uint32_t bypass;    // blocks of large requests passed through
+};
+
+struct block_cache_entry {
+	uint32_t lba;
+	uint16_t hash_next;
+	uint16_t lru_prev; // towards the most recently used
+	uint16_t lru_next; // towards the least recently used
+	bool valid;
+};
+
+struct block_cache {
+	struct block_device blk; // cached view of `dev`
+	struct block_device *dev;
+	uint16_t size;           // number of block buffers
+	uint16_t readahead;      // blocks read ahead of a sequential miss
+	uint16_t hash_mask;
+	uint16_t *hash;          // bucket heads
+	struct block_cache_entry *entries;
+	uint8_t *data;           // `size` blocks
+	uint16_t lru_head;       // most recently used
+	uint16_t lru_tail;       // least recently used
+	uint32_t next_lba;       // block after the previous request
+	struct block_cache_stats stats;
+};
+
+/**
+ * Set up a cache in front of a device
+ *
+ * @param cache cache to initialize
+ * @param dev backing device
+ * @param size number of block buffers, 1 to BLOCK_CACHE_NONE - 1
+ * @param readahead blocks to read ahead of a sequential miss, 0 to disable
+ * @return true on success; false if the allocation failed
+ */
+bool block_cache_init(struct block_cache *cache, struct block_device *dev,
+                      uint16_t size, uint16_t readahead);
+
+/**
+ * Free the buffers of a cache
+ *
+ * @param cache cache to destroy
+ */
+void block_cache_destroy(struct block_cache *cache);
+
+/**
+ * Write the hit and miss counters of a cache to a serial port
+ *
+ * @param cache cache to dump
+ * @param port port to write to
+ */
+void block_cache_dump(const struct block_cache *cache, serial_port port);
@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "cache.h"
+#include "mem/mem.h"
+#include "mem/mem_internal.h"
+#include "test/unity.h"
+
+#define TEST_HEAP_SIZE   (1024 * 1024)
+#define TEST_BLOCK_SIZE  512
+#define TEST_BLOCK_COUNT 4096
+
+uint8_t test_heap[TEST_HEAP_SIZE] __attribute__((aligned(16)));
+
+// Dummy synbols as no linker script is used
+uint8_t heap_start[1];
+uint8_t heap_end[1];
+
+static FILE *image;
+static uint32_t dev_reads;  // read callbacks
+static uint32_t dev_blocks; // blocks read from the image
+static struct block_device dev;
+static struct block_cache cache;
+static char serial_out[256];
+static uint32_t serial_len;
+
+// Serial fake for block_cache_dump
+void serial_print(serial_port port, const char *str) {
+	(void)port;
+	while (*str != '\0' && serial_len + 1 < sizeof(serial_out)) {
+		serial_out[serial_len++] = *str++;
+		serial_out[serial_len] = '\0';
+	}
+}
+
+char *itoa_once(int value, int base) {
+	static char buf[16];
+	snprintf(buf, sizeof(buf), base == 16 ? "%x" : "%d", value);
+	return buf;
+}
+
+static bool file_read(struct block_device *bdev, uint32_t lba, uint32_t count,
+                      void *buf) {
+	(void)bdev;
+	dev_reads++;
+	dev_blocks += count;
+
+	if (fseek(image, (long)lba * TEST_BLOCK_SIZE, SEEK_SET) != 0)
+		return false;
+
+	return fread(buf, TEST_BLOCK_SIZE, count, image) == count;
+}
+
+// Every block starts with its own LBA
+static void check_block(const uint8_t *buf, uint32_t lba) {
+	uint32_t stamp;
+	memcpy(&stamp, buf, sizeof(stamp));
+	TEST_ASSERT_EQUAL_UINT32(lba, stamp);
+}
+
+static void read_check(uint32_t lba, uint32_t count) {
+	static uint8_t buf[TEST_BLOCK_SIZE * 64];
+
+	TEST_ASSERT_TRUE(block_read(&cache.blk, lba, count, buf));
+	for (uint32_t i = 0; i < count; ++i)
+		check_block(&buf[i * TEST_BLOCK_SIZE], lba + i);
+}
+
+void setUp(void) {
+	uint8_t block[TEST_BLOCK_SIZE];
+
+	free_block_head = (struct free_block *)test_heap;
+	free_block_head->size = TEST_HEAP_SIZE;
+	free_block_head->next = 0;
+
+	image = tmpfile();
+	TEST_ASSERT_NOT_NULL(image);
+
+	for (uint32_t lba = 0; lba < TEST_BLOCK_COUNT; ++lba) {
+		memset(block, (int)(lba & 0xff), sizeof(block));
+		memcpy(block, &lba, sizeof(lba));
+		fwrite(block, sizeof(block), 1, image);
+	}
+
+	memset(&dev, 0, sizeof(dev));
+	dev.read = file_read;
+	dev.name = "file";
+	dev.block_size = TEST_BLOCK_SIZE;
+	dev.block_count = TEST_BLOCK_COUNT;
+
+	dev_reads = 0;
+	dev_blocks = 0;
+	serial_len = 0;
+	serial_out[0] = '\0';
+}
+
+void tearDown(void) {
+	block_cache_destroy(&cache);
+	fclose(image);
+}
+
+static void test_cache_hit_after_miss(void) {
+	TEST_ASSERT_TRUE(block_cache_init(&cache, &dev, 16, 0));
+
+	read_check(5, 1);
+	read_check(5, 1);
+
+	TEST_ASSERT_EQUAL_UINT32(1, cache.stats.misses);
+	TEST_ASSERT_EQUAL_UINT32(1, cache.stats.hits);
+	TEST_ASSERT_EQUAL_UINT32(1, dev_reads);
+}
+
+// The least recently used block is evicted, not the oldest one
+static void test_cache_lru_eviction(void) {
+	TEST_ASSERT_TRUE(block_cache_init(&cache, &dev, 4, 0));
+
+	read_check(0, 1);
+	read_check(10, 1);
+	read_check(20, 1);
+	read_check(30, 1);
+	read_check(0, 1);  // hit, 10 is the LRU now
+	read_check(40, 1); // evicts 10
+	read_check(0, 1);
+	read_check(10, 1);
+
+	TEST_ASSERT_EQUAL_UINT32(2, cache.stats.hits);
+	TEST_ASSERT_EQUAL_UINT32(6, cache.stats.misses);
+	TEST_ASSERT_EQUAL_UINT32(2, cache.stats.evictions);
+}
+
+static void test_cache_readahead_sequential(void) {
+	TEST_ASSERT_TRUE(block_cache_init(&cache, &dev, 32, 4));
+
+	read_check(100, 1); // not sequential, no read-ahead
+	read_check(101, 1); // sequential miss, reads 102..105 too
+	for (uint32_t lba = 102; lba < 106; ++lba)
+		read_check(lba, 1);
+
+	TEST_ASSERT_EQUAL_UINT32(2, cache.stats.misses);
+	TEST_ASSERT_EQUAL_UINT32(4, cache.stats.readahead);
+	TEST_ASSERT_EQUAL_UINT32(4, cache.stats.hits);
+	TEST_ASSERT_EQUAL_UINT32(6, dev_blocks);
+}
+
+// A request mixing cached and uncached blocks only reads the missing ones
+static void test_cache_partial_hit(void) {
+	TEST_ASSERT_TRUE(block_cache_init(&cache, &dev, 32, 0));
+
+	read_check(50, 1);
+	read_check(52, 1);
+	read_check(49, 5);
+
+	TEST_ASSERT_EQUAL_UINT32(2, cache.stats.hits);
+	TEST_ASSERT_EQUAL_UINT32(5, cache.stats.misses);
+	TEST_ASSERT_EQUAL_UINT32(5, dev_blocks);
+}
+
+static void test_cache_bypass_large(void) {
+	TEST_ASSERT_TRUE(block_cache_init(&cache, &dev, 32, 8));
+
+	read_check(200, BLOCK_CACHE_BYPASS);
+	read_check(200, 1);
+
+	TEST_ASSERT_EQUAL_UINT32(BLOCK_CACHE_BYPASS, cache.stats.bypass);
+	TEST_ASSERT_EQUAL_UINT32(0, cache.stats.hits);
+	TEST_ASSERT_EQUAL_UINT32(1, cache.stats.misses);
+}
+
+static void test_cache_out_of_range(void) {
+	uint8_t buf[TEST_BLOCK_SIZE * 2];
+
+	TEST_ASSERT_TRUE(block_cache_init(&cache, &dev, 8, 4));
+
+	TEST_ASSERT_FALSE(block_read(&cache.blk, TEST_BLOCK_COUNT, 1, buf));
+	TEST_ASSERT_FALSE(block_read(&cache.blk, TEST_BLOCK_COUNT - 1, 2, buf));
+	TEST_ASSERT_EQUAL_UINT32(0, dev_reads);
+
+	// read-ahead stops at the end of the device
+	read_check(TEST_BLOCK_COUNT - 3, 1);
+	read_check(TEST_BLOCK_COUNT - 2, 1);
+	TEST_ASSERT_EQUAL_UINT32(1, cache.stats.readahead);
+}
+
+/*
+ * Block accesses of a FAT16 loader: boot sector, the root directory sector by
+ * sector, then for every file its directory entry, one FAT lookup per cluster
+ * and the contiguous file data in one request.
+ *
+ *   0       boot sector
+ *   1-32    FAT, 256 entries per sector
+ *   33-64   root directory, 16 entries per sector
+ *   65-     data, 4 sectors per cluster
+ */
+#define FAT_START     1
+#define ROOT_START    33
+#define ROOT_SECTORS  32
+#define DATA_START    65
+#define CLUSTER_SIZE  4
+#define TRACE_FILES   48
+#define FILE_CLUSTERS 16
+
+static void fat_trace(void) {
+	static uint8_t buf[TEST_BLOCK_SIZE * CLUSTER_SIZE * FILE_CLUSTERS];
+	uint32_t cluster = 2;
+
+	TEST_ASSERT_TRUE(block_read(&cache.blk, 0, 1, buf));
+
+	for (uint32_t i = 0; i < ROOT_SECTORS; ++i)
+		TEST_ASSERT_TRUE(block_read(&cache.blk, ROOT_START + i, 1, buf));
+
+	for (uint32_t f = 0; f < TRACE_FILES; ++f) {
+		uint32_t first = cluster;
+
+		TEST_ASSERT_TRUE(block_read(&cache.blk, ROOT_START + f / 16, 1, buf));
+
+		for (uint32_t c = 0; c < FILE_CLUSTERS; ++c, ++cluster)
+			TEST_ASSERT_TRUE(
+			    block_read(&cache.blk, FAT_START + cluster / 256, 1, buf));
+
+		TEST_ASSERT_TRUE(block_read(&cache.blk,
+		                            DATA_START + (first - 2) * CLUSTER_SIZE,
+		                            CLUSTER_SIZE * FILE_CLUSTERS, buf));
+		check_block(buf, DATA_START + (first - 2) * CLUSTER_SIZE);
+	}
+}
+
+static void test_cache_fat_trace(void) {
+	TEST_ASSERT_TRUE(block_cache_init(&cache, &dev, 64, 8));
+
+	fat_trace();
+
+	uint32_t accesses = cache.stats.hits + cache.stats.misses;
+	// 1 + 32 + 48 * (1 + 16) metadata block accesses
+	TEST_ASSERT_EQUAL_UINT32(849, accesses);
+	// boot sector, root directory: 33, then 34 starts the read-ahead in
+	// steps of 8, FAT: 1, then 2 follows 1 and reads ahead the rest
+	TEST_ASSERT_EQUAL_UINT32(8, cache.stats.misses);
+	TEST_ASSERT_EQUAL_UINT32(841, cache.stats.hits);
+	TEST_ASSERT_GREATER_OR_EQUAL_UINT32(98, cache.stats.hits * 100 / accesses);
+	TEST_ASSERT_EQUAL_UINT32(48 * CLUSTER_SIZE * FILE_CLUSTERS,
+	                         cache.stats.bypass);
+	TEST_ASSERT_EQUAL_UINT32(0, cache.stats.evictions);
+	TEST_ASSERT_EQUAL_UINT32(dev_blocks, cache.stats.misses
+	                                         + cache.stats.readahead
+	                                         + cache.stats.bypass);
+}
+
+// Without read-ahead and with a pool smaller than the root directory, the
+// FAT sectors still stay cached
+static void test_cache_fat_trace_small_pool(void) {
+	TEST_ASSERT_TRUE(block_cache_init(&cache, &dev, 16, 0));
+
+	fat_trace();
+
+	uint32_t accesses = cache.stats.hits + cache.stats.misses;
+	TEST_ASSERT_EQUAL_UINT32(849, accesses);
+	TEST_ASSERT_GREATER_OR_EQUAL_UINT32(90, cache.stats.hits * 100 / accesses);
+}
+
+static void test_cache_dump(void) {
+	TEST_ASSERT_TRUE(block_cache_init(&cache, &dev, 16, 0));
+
+	read_check(7, 1);
+	read_check(7, 1);
+	block_cache_dump(&cache, COM1);
+
+	TEST_ASSERT_EQUAL_STRING("CACHE file hits 1 misses 1 readahead 0 "
+	                         "evictions 0 bypass 0\r\n",
+	                         serial_out);
+}
+
+int main(void) {
+	UNITY_BEGIN();
+	RUN_TEST(test_cache_hit_after_miss);
+	RUN_TEST(test_cache_lru_eviction);
+	RUN_TEST(test_cache_readahead_sequential);
+	RUN_TEST(test_cache_partial_hit);
+	RUN_TEST(test_cache_bypass_large);
+	RUN_TEST(test_cache_out_of_range);
+	RUN_TEST(test_cache_fat_trace);
+	RUN_TEST(test_cache_fat_trace_small_pool);
+	RUN_TEST(test_cache_dump);
+	return UNITY_END();
+}
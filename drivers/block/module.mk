@@ -0,0 +1,9 @@
+SRCS += drivers/block/block.c
+SRCS += drivers/block/cache.c
+SRCS += drivers/block/part.c
+
+# Add test target
+$(eval $(call test_target,test_block_cache,test/unity.c drivers/block/cache_test.c drivers/block/cache.c drivers/block/block.c mem/mem.c utils/sg.c))
+
+# Add test target
+$(eval $(call test_target,test_part,test/unity.c drivers/block/part_test.c drivers/block/part.c drivers/block/block.c mem/mem.c utils/sg.c utils/crc32.c))
\ No newline at end of file
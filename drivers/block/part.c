@@ -0,0 +1,387 @@
+#include "part.h"
+
+#include <stddef.h>
+
+#include "mem/mem.h"
+#include "utils/crc32.h"
+#include "utils/utils.h"
+
+struct __attribute__((__packed__)) mbr_entry {
+	uint8_t status;
+	uint8_t chs_first[3];
+	uint8_t type;
+	uint8_t chs_last[3];
+	uint32_t lba_start; // MBR: absolute; EBR: relative to the EBR or the
+	                    // extended partition
+	uint32_t sectors;
+};
+
+#define MBR_ENTRIES_OFF   446
+#define MBR_ENTRIES_NUM   4
+#define MBR_SIG_OFF       510
+#define MBR_SIG           0xaa55
+#define MBR_STATUS_ACTIVE 0x80
+#define MBR_FIRST_LOGICAL 5
+// Longest EBR chain followed, guards against loops
+#define MBR_EBR_MAX       64
+
+/*
+ * UEFI Specification 2.10, 5.3 GUID Partition Table (GPT) Disk Layout
+ */
+
+struct __attribute__((__packed__)) gpt_header {
+	uint8_t signature[8];
+	uint32_t revision;
+	uint32_t header_size;
+	uint32_t header_crc;
+	uint32_t reserved;
+	uint64_t my_lba;
+	uint64_t alternate_lba;
+	uint64_t first_usable_lba;
+	uint64_t last_usable_lba;
+	uint8_t disk_guid[16];
+	uint64_t entries_lba;
+	uint32_t entries_num;
+	uint32_t entry_size;
+	uint32_t entries_crc;
+};
+
+struct __attribute__((__packed__)) gpt_entry {
+	uint8_t type_guid[16];
+	uint8_t unique_guid[16];
+	uint64_t first_lba;
+	uint64_t last_lba; // inclusive
+	uint64_t attributes;
+	uint16_t name[36];
+};
+
+#define GPT_HEADER_LBA  1
+#define GPT_HEADER_MIN  92
+#define GPT_ENTRY_MIN   128
+// Largest entry array read, the spec minimum is 16KB
+#define GPT_ENTRIES_MAX 0x8000
+
+#define GPT_ATTR_LEGACY_BOOTABLE ((uint64_t)1 << 2)
+
+static const uint8_t gpt_signature[8] = {'E', 'F', 'I', ' ',
+                                         'P', 'A', 'R', 'T'};
+
+// C12A7328-F81F-11D2-BA4B-00A0C93EC93B
+static const uint8_t gpt_esp_guid[16] = {0x28, 0x73, 0x2a, 0xc1, 0x1f, 0xf8,
+                                         0xd2, 0x11, 0xba, 0x4b, 0x00, 0xa0,
+                                         0xc9, 0x3e, 0xc9, 0x3b};
+
+static bool part_bytes_eq(const uint8_t *a, const uint8_t *b, uint32_t len) {
+	for (uint32_t i = 0; i < len; ++i) {
+		if (a[i] != b[i])
+			return false;
+	}
+
+	return true;
+}
+
+static bool part_is_extended(uint8_t type) {
+	return type == PART_MBR_EXTENDED || type == PART_MBR_EXTENDED_LBA
+	       || type == PART_MBR_EXTENDED_LNX;
+}
+
+static bool part_read_blocks(struct part_table *table, uint32_t lba,
+                             uint32_t count, void *buf) {
+	++table->reads;
+	return block_read(table->dev, lba, count, buf);
+}
+
+static bool part_dev_read(struct block_device *dev, uint32_t lba,
+                          uint32_t count, void *buf) {
+	struct partition *part = dev->priv;
+	return block_read(part->dev, part->start + lba, count, buf);
+}
+
+static bool part_dev_read_sg(struct block_device *dev, uint32_t lba,
+                             uint32_t count, const struct sg_entry *sg,
+                             uint8_t sg_num) {
+	struct partition *part = dev->priv;
+	(void)count;
+	return block_read_sg(part->dev, part->start + lba, sg, sg_num);
+}
+
+/**
+ * Add a partition to the index
+ *
+ * @return the new entry or NULL if the index is full or the partition is
+ * empty or outside of the device
+ */
+static struct partition *part_add(struct part_table *table, uint64_t start,
+                                  uint64_t size) {
+	uint32_t blocks = table->dev->block_count;
+
+	if (table->num == PART_MAX || size == 0 || start >= blocks
+	    || size > blocks - start)
+		return NULL;
+
+	struct partition *part = &table->parts[table->num++];
+
+	memfill(part, 0, sizeof(struct partition));
+	part->dev = table->dev;
+	part->start = (uint32_t)start;
+	part->size = (uint32_t)size;
+
+	part->blk.read = part_dev_read;
+	part->blk.read_sg = part_dev_read_sg;
+	part->blk.priv = part;
+	part->blk.name = table->dev->name;
+	part->blk.block_size = table->dev->block_size;
+	part->blk.block_count = part->size;
+
+	return part;
+}
+
+static void part_add_mbr(struct part_table *table,
+                         const struct mbr_entry *entry, uint32_t base,
+                         uint16_t number, uint8_t flags) {
+	struct partition *part =
+	    part_add(table, (uint64_t)base + entry->lba_start, entry->sectors);
+
+	if (part == NULL)
+		return;
+
+	part->number = number;
+	part->type = entry->type;
+	part->flags = flags;
+	if (entry->status & MBR_STATUS_ACTIVE)
+		part->flags |= PART_FLAG_ACTIVE;
+	if (entry->type == PART_MBR_ESP)
+		part->flags |= PART_FLAG_ESP;
+}
+
+/**
+ * Follow the EBR chain of an extended partition. Logical partitions are
+ * relative to their EBR, the next EBR is relative to the extended partition.
+ */
+static bool part_scan_ebr(struct part_table *table,
+                          const struct mbr_entry *extended) {
+	uint8_t *ebr = memalloc(table->dev->block_size);
+	uint64_t lba = extended->lba_start;
+	uint16_t number = MBR_FIRST_LOGICAL;
+	bool result = ebr != NULL;
+
+	for (uint8_t hop = 0; result && hop < MBR_EBR_MAX; ++hop) {
+		if (lba < extended->lba_start
+		    || lba - extended->lba_start >= extended->sectors
+		    || lba >= table->dev->block_count)
+			break;
+
+		if (!part_read_blocks(table, (uint32_t)lba, 1, ebr)) {
+			result = false;
+			break;
+		}
+
+		if (*(uint16_t *)&ebr[MBR_SIG_OFF] != MBR_SIG)
+			break;
+
+		const struct mbr_entry *entries =
+		    (const struct mbr_entry *)&ebr[MBR_ENTRIES_OFF];
+
+		if (entries[0].type != 0 && !part_is_extended(entries[0].type))
+			part_add_mbr(table, &entries[0], (uint32_t)lba, number++,
+			             PART_FLAG_LOGICAL);
+
+		if (!part_is_extended(entries[1].type))
+			break;
+
+		lba = (uint64_t)extended->lba_start + entries[1].lba_start;
+	}
+
+	memfree(ebr);
+	return result;
+}
+
+static bool part_scan_mbr(struct part_table *table, const uint8_t *mbr) {
+	const struct mbr_entry *entries =
+	    (const struct mbr_entry *)&mbr[MBR_ENTRIES_OFF];
+
+	table->scheme = PART_SCHEME_MBR;
+
+	for (uint8_t i = 0; i < MBR_ENTRIES_NUM; ++i) {
+		if (entries[i].type == 0 || entries[i].type == PART_MBR_GPT)
+			continue;
+
+		if (part_is_extended(entries[i].type)) {
+			if (!part_scan_ebr(table, &entries[i]))
+				return false;
+		} else {
+			part_add_mbr(table, &entries[i], 0, (uint16_t)(i + 1), 0);
+		}
+	}
+
+	return true;
+}
+
+static bool gpt_header_valid(const struct part_table *table,
+                             struct gpt_header *hdr, uint32_t lba) {
+	uint32_t block_size = table->dev->block_size;
+	uint32_t crc = hdr->header_crc;
+
+	if (!part_bytes_eq(hdr->signature, gpt_signature, sizeof(gpt_signature))
+	    || hdr->header_size < GPT_HEADER_MIN || hdr->header_size > block_size
+	    || hdr->my_lba != lba)
+		return false;
+
+	// the CRC covers the header with its own field zeroed
+	hdr->header_crc = 0;
+	bool crc_ok = crc32(0, hdr, hdr->header_size) == crc;
+	hdr->header_crc = crc;
+
+	if (!crc_ok || hdr->entry_size < GPT_ENTRY_MIN || hdr->entry_size % 8 != 0
+	    || hdr->entries_num == 0
+	    || hdr->entries_num > GPT_ENTRIES_MAX / hdr->entry_size)
+		return false;
+
+	uint32_t blocks =
+	    DIV_CEIL(hdr->entries_num * hdr->entry_size, block_size);
+	return hdr->entries_lba < table->dev->block_count
+	       && blocks <= table->dev->block_count - hdr->entries_lba;
+}
+
+/**
+ * Validate a GPT header and read its whole entry array with one read
+ *
+ * @param table table being scanned
+ * @param hdr header read from `lba`
+ * @param lba where the header is
+ * @param entries the entry array is returned here, NULL if the header or the
+ * array is damaged
+ * @return false if a block read or the allocation failed
+ */
+static bool gpt_load(struct part_table *table, struct gpt_header *hdr,
+                     uint32_t lba, uint8_t **entries) {
+	uint32_t block_size = table->dev->block_size;
+
+	*entries = NULL;
+
+	if (!gpt_header_valid(table, hdr, lba))
+		return true;
+
+	uint32_t bytes = hdr->entries_num * hdr->entry_size;
+	uint32_t blocks = DIV_CEIL(bytes, block_size);
+	uint8_t *buf = memalloc(blocks * block_size);
+
+	if (buf == NULL
+	    || !part_read_blocks(table, (uint32_t)hdr->entries_lba, blocks, buf)) {
+		memfree(buf);
+		return false;
+	}
+
+	if (crc32(0, buf, bytes) != hdr->entries_crc) {
+		memfree(buf);
+		return true;
+	}
+
+	*entries = buf;
+	return true;
+}
+
+static void part_index_gpt(struct part_table *table,
+                           const struct gpt_header *hdr,
+                           const uint8_t *entries) {
+	static const uint8_t unused[16] = {0};
+
+	table->scheme = PART_SCHEME_GPT;
+
+	for (uint32_t i = 0; i < hdr->entries_num; ++i) {
+		const struct gpt_entry *entry =
+		    (const struct gpt_entry *)&entries[i * hdr->entry_size];
+
+		if (part_bytes_eq(entry->type_guid, unused, sizeof(unused))
+		    || entry->last_lba < entry->first_lba)
+			continue;
+
+		struct partition *part = part_add(
+		    table, entry->first_lba, entry->last_lba - entry->first_lba + 1);
+		if (part == NULL)
+			continue;
+
+		part->number = (uint16_t)(i + 1);
+		part->type = PART_MBR_GPT;
+		part->attributes = entry->attributes;
+		memcopy(part->type_guid, (void *)entry->type_guid,
+		        sizeof(part->type_guid));
+
+		if (entry->attributes & GPT_ATTR_LEGACY_BOOTABLE)
+			part->flags |= PART_FLAG_ACTIVE;
+		if (part_bytes_eq(entry->type_guid, gpt_esp_guid, sizeof(gpt_esp_guid)))
+			part->flags |= PART_FLAG_ESP;
+	}
+}
+
+bool part_scan(struct block_device *dev, struct part_table *table) {
+	uint32_t block_size = dev->block_size;
+	uint8_t *buf = NULL;
+	uint8_t *entries = NULL;
+	bool gpt = false;
+	bool result = false;
+
+	memfill(table, 0, sizeof(struct part_table));
+	table->dev = dev;
+
+	if (block_size < 512 || dev->block_count < 2)
+		return true;
+
+	// the MBR and the primary GPT header together
+	buf = memalloc(2 * block_size);
+	if (buf == NULL || !part_read_blocks(table, 0, 2, buf))
+		goto out;
+
+	result = true;
+	if (*(uint16_t *)&buf[MBR_SIG_OFF] != MBR_SIG)
+		goto out;
+
+	const struct mbr_entry *mbr =
+	    (const struct mbr_entry *)&buf[MBR_ENTRIES_OFF];
+	for (uint8_t i = 0; i < MBR_ENTRIES_NUM; ++i)
+		gpt |= mbr[i].type == PART_MBR_GPT;
+
+	if (gpt) {
+		struct gpt_header *hdr = (struct gpt_header *)&buf[block_size];
+		uint32_t backup = dev->block_count - 1;
+
+		result = gpt_load(table, hdr, GPT_HEADER_LBA, &entries);
+
+		if (result && entries == NULL) {
+			table->gpt_backup = true;
+			result = part_read_blocks(table, backup, 1, hdr)
+			         && gpt_load(table, hdr, backup, &entries);
+		}
+
+		if (entries != NULL) {
+			part_index_gpt(table, hdr, entries);
+			goto out;
+		}
+
+		table->gpt_backup = false;
+		if (!result)
+			goto out;
+	}
+
+	// no GPT or both copies are damaged, a hybrid MBR may still have entries
+	result = part_scan_mbr(table, buf);
+
+out:
+	memfree(entries);
+	memfree(buf);
+	return result;
+}
+
+struct partition *part_find_boot(struct part_table *table) {
+	for (uint8_t i = 0; i < table->num; ++i) {
+		if (table->parts[i].flags & PART_FLAG_ACTIVE)
+			return &table->parts[i];
+	}
+
+	for (uint8_t i = 0; i < table->num; ++i) {
+		if (table->parts[i].flags & PART_FLAG_ESP)
+			return &table->parts[i];
+	}
+
+	return table->num > 0 ? &table->parts[0] : NULL;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "drivers/block/block.h"
+
+/*
+ * MBR and GPT partition scanner. A scan reads the MBR and the primary GPT
+ * header with one block read and the whole GPT entry array with another; the
+ * backup GPT is only read if the primary one fails its CRCs. Logical
+ * partitions take one read per EBR. The result is kept as an index of
+ * partitions, each usable as a block device through `part->blk`.
+ */
+
+// Partitions beyond this are not indexed
+#define PART_MAX 16
+
+#define PART_SCHEME_NONE 0
+#define PART_SCHEME_MBR  1
+#define PART_SCHEME_GPT  2
+
+#define PART_FLAG_ACTIVE  0x01 // MBR boot indicator or GPT legacy BIOS bootable
+#define PART_FLAG_LOGICAL 0x02 // in the extended partition chain
+#define PART_FLAG_ESP     0x04 // EFI system partition
+
+// MBR system IDs
+#define PART_MBR_EXTENDED     0x05
+#define PART_MBR_EXTENDED_LBA 0x0f
+#define PART_MBR_EXTENDED_LNX 0x85
+#define PART_MBR_GPT          0xee
+#define PART_MBR_ESP          0xef
+
+struct partition {
+	struct block_device blk; // the partition as a block device
+	struct block_device *dev;
+	uint32_t start;          // first block on `dev`
+	uint32_t size;           // blocks
+	uint16_t number;         // MBR: 1-4 primary, 5+ logical; GPT: entry + 1
+	uint8_t type;            // MBR system ID, PART_MBR_GPT on GPT
+	uint8_t flags;           // PART_FLAG_*
+	uint8_t type_guid[16];   // GPT only, on-disk byte order
+	uint64_t attributes;     // GPT only
+};
+
+struct part_table {
+	struct block_device *dev;
+	uint8_t scheme;          // PART_SCHEME_*
+	bool gpt_backup;         // the primary GPT is damaged, the backup is used
+	uint8_t num;
+	uint32_t reads;          // block reads the scan took
+	struct partition parts[PART_MAX];
+};
+
+/**
+ * Read the partition table of a device
+ *
+ * @param dev device to scan
+ * @param table the index is returned here, empty if the device has no
+ * partition table
+ * @return true on success; false if a block read or an allocation failed
+ */
+bool part_scan(struct block_device *dev, struct part_table *table);
+
+/**
+ * Pick the partition to boot from: the first active one, then the first EFI
+ * system partition, then the first one
+ *
+ * @param table scanned table
+ * @return the partition or NULL if there is none
+ */
+struct partition *part_find_boot(struct part_table *table);
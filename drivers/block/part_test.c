@@ -0,0 +1,324 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem/mem.h"
+#include "mem/mem_internal.h"
+#include "part.h"
+#include "test/unity.h"
+#include "utils/crc32.h"
+
+#define TEST_HEAP_SIZE   (256 * 1024)
+#define TEST_BLOCK_SIZE  512
+#define TEST_BLOCK_COUNT 8192
+
+#define GPT_ENTRIES_NUM    128
+#define GPT_ENTRY_SIZE     128
+#define GPT_ENTRIES_BLOCKS (GPT_ENTRIES_NUM * GPT_ENTRY_SIZE / TEST_BLOCK_SIZE)
+
+uint8_t test_heap[TEST_HEAP_SIZE] __attribute__((aligned(16)));
+
+// Dummy synbols as no linker script is used
+uint8_t heap_start[1];
+uint8_t heap_end[1];
+
+/*
+ * Images are built in memory with the layouts sfdisk writes: 1MB aligned
+ * partitions, EBRs right before their logical partition and 128 GPT entries
+ * after the primary header and before the backup header
+ */
+static uint8_t *image;
+static uint32_t dev_reads;
+static struct block_device dev;
+static struct part_table table;
+
+static const uint8_t esp_guid[16] = {0x28, 0x73, 0x2a, 0xc1, 0x1f, 0xf8,
+                                     0xd2, 0x11, 0xba, 0x4b, 0x00, 0xa0,
+                                     0xc9, 0x3e, 0xc9, 0x3b};
+// 0FC63DAF-8483-4772-8E79-3D69D8477DE4
+static const uint8_t linux_guid[16] = {0xaf, 0x3d, 0xc6, 0x0f, 0x83, 0x84,
+                                       0x72, 0x47, 0x8e, 0x79, 0x3d, 0x69,
+                                       0xd8, 0x47, 0x7d, 0xe4};
+
+static bool ram_read(struct block_device *bdev, uint32_t lba, uint32_t count,
+                     void *buf) {
+	(void)bdev;
+	dev_reads++;
+	memcpy(buf, &image[lba * TEST_BLOCK_SIZE], count * TEST_BLOCK_SIZE);
+	return true;
+}
+
+static uint8_t *block(uint32_t lba) {
+	return &image[lba * TEST_BLOCK_SIZE];
+}
+
+static void put16(uint8_t *buf, uint16_t val) {
+	buf[0] = (uint8_t)val;
+	buf[1] = (uint8_t)(val >> 8);
+}
+
+static void put32(uint8_t *buf, uint32_t val) {
+	put16(buf, (uint16_t)val);
+	put16(buf + 2, (uint16_t)(val >> 16));
+}
+
+static void put64(uint8_t *buf, uint64_t val) {
+	put32(buf, (uint32_t)val);
+	put32(buf + 4, (uint32_t)(val >> 32));
+}
+
+static void mbr_entry(uint32_t lba, uint8_t idx, uint8_t status, uint8_t type,
+                      uint32_t start, uint32_t sectors) {
+	uint8_t *entry = &block(lba)[446 + 16 * idx];
+
+	entry[0] = status;
+	entry[4] = type;
+	put32(&entry[8], start);
+	put32(&entry[12], sectors);
+	put16(&block(lba)[510], 0xaa55);
+}
+
+static void gpt_entry(uint32_t entries_lba, uint32_t idx, const uint8_t *type,
+                      uint64_t first, uint64_t last, uint64_t attributes) {
+	uint8_t *entry = &block(entries_lba)[idx * GPT_ENTRY_SIZE];
+
+	memcpy(entry, type, 16);
+	memset(&entry[16], (int)idx + 1, 16); // unique GUID
+	put64(&entry[32], first);
+	put64(&entry[40], last);
+	put64(&entry[48], attributes);
+}
+
+static void gpt_header(uint32_t lba, uint32_t alternate, uint32_t entries_lba) {
+	uint8_t *hdr = block(lba);
+
+	memset(hdr, 0, TEST_BLOCK_SIZE);
+	memcpy(hdr, "EFI PART", 8);
+	put32(&hdr[8], 0x00010000);
+	put32(&hdr[12], 92);
+	put64(&hdr[24], lba);
+	put64(&hdr[32], alternate);
+	put64(&hdr[40], 34);
+	put64(&hdr[48], TEST_BLOCK_COUNT - 34);
+	memset(&hdr[56], 0x5a, 16); // disk GUID
+	put64(&hdr[72], entries_lba);
+	put32(&hdr[80], GPT_ENTRIES_NUM);
+	put32(&hdr[84], GPT_ENTRY_SIZE);
+	put32(&hdr[88], crc32(0, block(entries_lba),
+	                      GPT_ENTRIES_NUM * GPT_ENTRY_SIZE));
+	put32(&hdr[16], crc32(0, hdr, 92));
+}
+
+/*
+ * Protective MBR, an EFI system partition, a legacy BIOS bootable Linux
+ * partition and an empty slot between them, with both GPT copies
+ */
+static void make_gpt(void) {
+	uint32_t backup_entries = TEST_BLOCK_COUNT - 1 - GPT_ENTRIES_BLOCKS;
+
+	mbr_entry(0, 0, 0, PART_MBR_GPT, 1, TEST_BLOCK_COUNT - 1);
+
+	memset(block(2), 0, GPT_ENTRIES_BLOCKS * TEST_BLOCK_SIZE);
+	gpt_entry(2, 0, esp_guid, 2048, 4095, 0);
+	gpt_entry(2, 2, linux_guid, 4096, 8191 - 34, 1 << 2);
+	memcpy(block(backup_entries), block(2), GPT_ENTRIES_BLOCKS * TEST_BLOCK_SIZE);
+
+	gpt_header(1, TEST_BLOCK_COUNT - 1, 2);
+	gpt_header(TEST_BLOCK_COUNT - 1, 1, backup_entries);
+}
+
+void setUp(void) {
+	free_block_head = (struct free_block *)test_heap;
+	free_block_head->size = TEST_HEAP_SIZE;
+	free_block_head->next = 0;
+
+	image = calloc(TEST_BLOCK_COUNT, TEST_BLOCK_SIZE);
+	TEST_ASSERT_NOT_NULL(image);
+
+	// every block starts with its own LBA
+	for (uint32_t lba = 0; lba < TEST_BLOCK_COUNT; ++lba)
+		put32(block(lba), lba);
+	memset(block(0), 0, TEST_BLOCK_SIZE);
+
+	memset(&dev, 0, sizeof(dev));
+	dev.read = ram_read;
+	dev.name = "ram";
+	dev.block_size = TEST_BLOCK_SIZE;
+	dev.block_count = TEST_BLOCK_COUNT;
+	dev_reads = 0;
+}
+
+void tearDown(void) {
+	free(image);
+}
+
+static void test_crc32_check_value(void) {
+	const char *data = "123456789";
+
+	TEST_ASSERT_EQUAL_HEX32(0xcbf43926, crc32(0, data, 9));
+	TEST_ASSERT_EQUAL_HEX32(0xcbf43926, crc32(crc32(0, data, 4), data + 4, 5));
+	TEST_ASSERT_EQUAL_HEX32(0, crc32(0, data, 0));
+}
+
+static void test_part_no_table(void) {
+	TEST_ASSERT_TRUE(part_scan(&dev, &table));
+	TEST_ASSERT_EQUAL_UINT8(PART_SCHEME_NONE, table.scheme);
+	TEST_ASSERT_EQUAL_UINT8(0, table.num);
+	TEST_ASSERT_NULL(part_find_boot(&table));
+	TEST_ASSERT_EQUAL_UINT32(1, table.reads);
+}
+
+// Two primaries and an extended partition with two logical ones
+static void test_part_mbr_logical(void) {
+	mbr_entry(0, 0, 0, 0x83, 2048, 1024);
+	mbr_entry(0, 1, 0x80, 0x0c, 3072, 1024);
+	mbr_entry(0, 2, 0, PART_MBR_EXTENDED, 4096, 4096);
+	// first EBR, then the second one relative to the extended partition
+	mbr_entry(4096, 0, 0, 0x06, 2048, 1024);
+	mbr_entry(4096, 1, 0, PART_MBR_EXTENDED, 1024 + 2048, 2048);
+	mbr_entry(4096 + 3072, 0, 0, 0x07, 1, 1023);
+
+	TEST_ASSERT_TRUE(part_scan(&dev, &table));
+	TEST_ASSERT_EQUAL_UINT8(PART_SCHEME_MBR, table.scheme);
+	TEST_ASSERT_EQUAL_UINT8(4, table.num);
+	TEST_ASSERT_EQUAL_UINT32(3, table.reads);
+
+	const uint16_t numbers[] = {1, 2, 5, 6};
+	const uint32_t starts[] = {2048, 3072, 4096 + 2048, 4096 + 3072 + 1};
+	const uint32_t sizes[] = {1024, 1024, 1024, 1023};
+	const uint8_t types[] = {0x83, 0x0c, 0x06, 0x07};
+	for (uint8_t i = 0; i < 4; ++i) {
+		TEST_ASSERT_EQUAL_UINT16(numbers[i], table.parts[i].number);
+		TEST_ASSERT_EQUAL_UINT32(starts[i], table.parts[i].start);
+		TEST_ASSERT_EQUAL_UINT32(sizes[i], table.parts[i].size);
+		TEST_ASSERT_EQUAL_HEX8(types[i], table.parts[i].type);
+	}
+
+	TEST_ASSERT_EQUAL_HEX8(PART_FLAG_ACTIVE, table.parts[1].flags);
+	TEST_ASSERT_EQUAL_HEX8(PART_FLAG_LOGICAL, table.parts[2].flags);
+	TEST_ASSERT_EQUAL_PTR(&table.parts[1], part_find_boot(&table));
+}
+
+// An EBR that links to itself ends the chain after a bounded number of reads
+static void test_part_mbr_ebr_loop(void) {
+	mbr_entry(0, 0, 0, PART_MBR_EXTENDED_LBA, 2048, 4096);
+	mbr_entry(2048, 0, 0, 0x83, 2048, 1024);
+	mbr_entry(2048, 1, 0, PART_MBR_EXTENDED, 0, 4096);
+
+	TEST_ASSERT_TRUE(part_scan(&dev, &table));
+	TEST_ASSERT_EQUAL_UINT8(PART_MAX, table.num);
+	TEST_ASSERT_LESS_OR_EQUAL_UINT32(65, table.reads);
+}
+
+// Entries outside of the device are dropped
+static void test_part_mbr_out_of_range(void) {
+	mbr_entry(0, 0, 0, 0x83, TEST_BLOCK_COUNT - 10, 11);
+	mbr_entry(0, 1, 0, 0x83, 0xffffff00, 0x200);
+	mbr_entry(0, 3, 0, PART_MBR_ESP, 100, 10);
+
+	TEST_ASSERT_TRUE(part_scan(&dev, &table));
+	TEST_ASSERT_EQUAL_UINT8(1, table.num);
+	TEST_ASSERT_EQUAL_UINT16(4, table.parts[0].number);
+	TEST_ASSERT_EQUAL_HEX8(PART_FLAG_ESP, table.parts[0].flags);
+}
+
+static void check_gpt_index(void) {
+	TEST_ASSERT_EQUAL_UINT8(PART_SCHEME_GPT, table.scheme);
+	TEST_ASSERT_EQUAL_UINT8(2, table.num);
+
+	TEST_ASSERT_EQUAL_UINT16(1, table.parts[0].number);
+	TEST_ASSERT_EQUAL_UINT32(2048, table.parts[0].start);
+	TEST_ASSERT_EQUAL_UINT32(2048, table.parts[0].size);
+	TEST_ASSERT_EQUAL_HEX8(PART_FLAG_ESP, table.parts[0].flags);
+	TEST_ASSERT_EQUAL_MEMORY(esp_guid, table.parts[0].type_guid, 16);
+
+	TEST_ASSERT_EQUAL_UINT16(3, table.parts[1].number);
+	TEST_ASSERT_EQUAL_UINT32(4096, table.parts[1].start);
+	TEST_ASSERT_EQUAL_UINT32(8192 - 34 - 4096, table.parts[1].size);
+	TEST_ASSERT_EQUAL_HEX8(PART_FLAG_ACTIVE, table.parts[1].flags);
+	TEST_ASSERT_EQUAL_HEX64(1 << 2, table.parts[1].attributes);
+
+	TEST_ASSERT_EQUAL_PTR(&table.parts[1], part_find_boot(&table));
+}
+
+// The MBR, the primary header and the entry array take two reads
+static void test_part_gpt(void) {
+	make_gpt();
+
+	TEST_ASSERT_TRUE(part_scan(&dev, &table));
+	check_gpt_index();
+	TEST_ASSERT_FALSE(table.gpt_backup);
+	TEST_ASSERT_EQUAL_UINT32(2, table.reads);
+	TEST_ASSERT_EQUAL_UINT32(2, dev_reads);
+}
+
+static void test_part_gpt_backup_header(void) {
+	make_gpt();
+	block(1)[30] ^= 1; // my_lba, breaks the header CRC
+
+	TEST_ASSERT_TRUE(part_scan(&dev, &table));
+	check_gpt_index();
+	TEST_ASSERT_TRUE(table.gpt_backup);
+	TEST_ASSERT_EQUAL_UINT32(3, table.reads);
+}
+
+static void test_part_gpt_backup_entries(void) {
+	make_gpt();
+	block(2)[32] ^= 1; // first LBA of the first entry
+
+	TEST_ASSERT_TRUE(part_scan(&dev, &table));
+	check_gpt_index();
+	TEST_ASSERT_TRUE(table.gpt_backup);
+	TEST_ASSERT_EQUAL_UINT32(4, table.reads);
+}
+
+// Without a valid GPT only the protective MBR is left, which is not indexed
+static void test_part_gpt_both_damaged(void) {
+	make_gpt();
+	block(1)[0] = 'X';
+	block(TEST_BLOCK_COUNT - 1)[0] = 'X';
+
+	TEST_ASSERT_TRUE(part_scan(&dev, &table));
+	TEST_ASSERT_EQUAL_UINT8(PART_SCHEME_MBR, table.scheme);
+	TEST_ASSERT_EQUAL_UINT8(0, table.num);
+	TEST_ASSERT_FALSE(table.gpt_backup);
+}
+
+// Partitions read through their own block device with their own range
+static void test_part_block_device(void) {
+	uint8_t buf[2 * TEST_BLOCK_SIZE];
+	uint8_t sg_buf[2 * TEST_BLOCK_SIZE];
+	uint32_t stamp = 0;
+
+	make_gpt();
+	TEST_ASSERT_TRUE(part_scan(&dev, &table));
+
+	struct block_device *blk = &table.parts[0].blk;
+	TEST_ASSERT_EQUAL_UINT32(2048, blk->block_count);
+
+	TEST_ASSERT_TRUE(block_read(blk, 10, 2, buf));
+	memcpy(&stamp, buf, sizeof(stamp));
+	TEST_ASSERT_EQUAL_UINT32(2048 + 10, stamp);
+	memcpy(&stamp, &buf[TEST_BLOCK_SIZE], sizeof(stamp));
+	TEST_ASSERT_EQUAL_UINT32(2048 + 11, stamp);
+
+	struct sg_entry sg[2] = {{sg_buf, 700}, {sg_buf + 700, 324}};
+	TEST_ASSERT_TRUE(block_read_sg(blk, 10, sg, 2));
+	TEST_ASSERT_EQUAL_MEMORY(buf, sg_buf, sizeof(buf));
+
+	TEST_ASSERT_FALSE(block_read(blk, 2047, 2, buf));
+}
+
+int main(void) {
+	UNITY_BEGIN();
+	RUN_TEST(test_crc32_check_value);
+	RUN_TEST(test_part_no_table);
+	RUN_TEST(test_part_mbr_logical);
+	RUN_TEST(test_part_mbr_ebr_loop);
+	RUN_TEST(test_part_mbr_out_of_range);
+	RUN_TEST(test_part_gpt);
+	RUN_TEST(test_part_gpt_backup_header);
+	RUN_TEST(test_part_gpt_backup_entries);
+	RUN_TEST(test_part_gpt_both_damaged);
+	RUN_TEST(test_part_block_device);
+	return UNITY_END();
+}
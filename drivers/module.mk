@@ -1,3 +1,4 @@
+include drivers/block/module.mk
 include drivers/display/module.mk
 include drivers/io/module.mk
 include drivers/pci/module.mk
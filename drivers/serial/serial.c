@@ -1,5 +1,5 @@
 #include "drivers/serial/serial.h"
-#include "arch/pit.h"
+#include "arch/clock.h"
 #include "drivers/io/io.h"
 
 #define RECV_BUF(com)         ((uint16_t)(com + 0))
@@ -42,10 +42,10 @@ bool serial_init_port(serial_port port, uint32_t bps) {
 	// set testbyte in loopback mode to test the port
 	outb(SEND_BUF(port), 0xae);
 
-	uint8_t tries = 10; // 10 * 10ms (100ms)
+	uint16_t tries = 1000; // 1000 * 100us (100ms)
 	// check line status register data ready bit
 	while (tries > 0 && ((inb(LINE_STATUS_REG(port)) & 0x1) == 0)) {
-		sleep(10);
+		udelay(100);
 		tries--;
 	}
 
@@ -62,6 +62,11 @@ void serial_write(serial_port port, uint8_t ch) {
 	outb(SEND_BUF(port), ch);
 }
 
+void serial_print(serial_port port, const char *str) {
+	while (*str != '\0')
+		serial_write(port, (uint8_t)*str++);
+}
+
 bool serial_data_ready(serial_port port) {
 	return (inb(LINE_STATUS_REG(port)) & 0x01) != 0;
 }
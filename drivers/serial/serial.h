@@ -27,6 +27,14 @@ bool serial_init_port(serial_port port, uint32_t bps);
  */
 void serial_write(serial_port port, uint8_t ch);
 
+/**
+ * Send a NUL terminated string on a port
+ *
+ * @param port port to send on
+ * @param str string to send
+ */
+void serial_print(serial_port port, const char *str);
+
 /**
  * Check if there is any data received and waiting to be read
  *
@@ -0,0 +1,221 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arch/clock.h"
+#include "arch/cpu.h"
+#include "drivers/display/print.h"
+#include "drivers/usb/hid.h"
+#include "drivers/usb/uhci.h"
+#include "mem/mem.h"
+
+/*
+ * Device Class Definition for Human Interface Devices (HID) Version 1.11
+ * 4.2 Subclass, 4.3 Protocols, 7.2 Class-Specific Requests
+ */
+#define HID_SUBCLASS_BOOT     0x01
+#define HID_PROTOCOL_KEYBOARD 0x01
+#define HID_REQ_SET_IDLE      0x0a
+#define HID_REQ_SET_PROTOCOL  0x0b
+#define HID_PROTOCOL_BOOT     0
+
+// Boot keyboard report: modifiers, reserved, 6 key slots. Appendix B.1
+#define HID_BOOT_REPORT_LEN 8
+#define HID_REPORT_KEYS     2 // first key slot
+
+// Usage IDs below this are error codes, not keys. HUT 1.12 Table 12
+#define HID_KEY_FIRST        0x04
+#define HID_KEY_ERR_ROLLOVER 0x01
+
+#define HID_MAX_KBDS 4
+
+#define HID_EVENT_RING_SIZE 32 // power of 2
+
+#define HID_RT_IFACE_OUT                                                       \
+	(UHCI_DR_RT_XDIR_HOST_DEV | UHCI_DR_RT_TYPE_CLASS                          \
+	 | UHCI_DR_RT_RECIPIENT_INTERFACE)
+
+struct hid_kbd {
+	struct usb_device *udev;
+	uint8_t report[HID_BOOT_REPORT_LEN]; // filled by the HC
+	uint8_t last[HID_BOOT_REPORT_LEN];   // previous report
+};
+
+static struct hid_kbd *hid_kbds[HID_MAX_KBDS];
+static uint8_t hid_kbds_num = 0;
+
+// Key events, written by the ISR and read by hid_kbd_read
+static struct hid_key_event hid_events[HID_EVENT_RING_SIZE];
+static volatile uint16_t hid_events_head = 0; // next slot to fill
+static volatile uint16_t hid_events_tail = 0; // next slot to read
+
+static void hid_push(uint8_t usage, uint8_t modifiers, bool pressed,
+                     uint64_t tsc) {
+	uint16_t head = hid_events_head;
+
+	// a full ring drops the event, the consumer has not read for a while
+	if ((uint16_t)(head - hid_events_tail) == HID_EVENT_RING_SIZE)
+		return;
+
+	struct hid_key_event *event = &hid_events[head % HID_EVENT_RING_SIZE];
+
+	event->usage = usage;
+	event->modifiers = modifiers;
+	event->pressed = pressed;
+	event->tsc = tsc;
+	// publish the slot before the index
+	__asm__ volatile("" ::: "memory");
+	hid_events_head = (uint16_t)(head + 1);
+}
+
+static bool hid_has_key(const uint8_t *report, uint8_t usage) {
+	for (uint8_t i = HID_REPORT_KEYS; i < HID_BOOT_REPORT_LEN; ++i) {
+		if (report[i] == usage)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Turn the difference of a report and the previous one into key events. Runs
+ * in the ISR.
+ *
+ * @param data report
+ * @param len report length
+ * @param userdata keyboard
+ */
+static void hid_kbd_report(const void *data, uint32_t len, void *userdata) {
+	struct hid_kbd *kbd = userdata;
+	const uint8_t *report = data;
+	uint64_t tsc = clock_has_tsc() ? rdtsc() : 0;
+
+	// with too many keys held the state of the keys is unknown
+	if (len < HID_BOOT_REPORT_LEN
+	    || report[HID_REPORT_KEYS] == HID_KEY_ERR_ROLLOVER)
+		return;
+
+	uint8_t mods = report[0];
+	uint8_t changed = mods ^ kbd->last[0];
+	for (uint8_t bit = 0; bit < 8; ++bit) {
+		if ((changed & (1u << bit)) != 0)
+			hid_push((uint8_t)(HID_KEY_LCTRL + bit), mods,
+			         (mods & (1u << bit)) != 0, tsc);
+	}
+
+	for (uint8_t i = HID_REPORT_KEYS; i < HID_BOOT_REPORT_LEN; ++i) {
+		if (kbd->last[i] >= HID_KEY_FIRST && !hid_has_key(report, kbd->last[i]))
+			hid_push(kbd->last[i], mods, false, tsc);
+	}
+
+	for (uint8_t i = HID_REPORT_KEYS; i < HID_BOOT_REPORT_LEN; ++i) {
+		if (report[i] >= HID_KEY_FIRST && !hid_has_key(kbd->last, report[i]))
+			hid_push(report[i], mods, true, tsc);
+	}
+
+	for (uint8_t i = 0; i < HID_BOOT_REPORT_LEN; ++i)
+		kbd->last[i] = report[i];
+}
+
+bool hid_probe(struct usb_device *udev, const struct uhci_interface *iface) {
+	const struct uhci_endpoint *ep = NULL;
+	struct hid_kbd *kbd = NULL;
+
+	if (iface->class_code != UHCI_CLASS_HID
+	    || iface->sub_class != HID_SUBCLASS_BOOT
+	    || iface->protocol != HID_PROTOCOL_KEYBOARD
+	    || hid_kbds_num == HID_MAX_KBDS)
+		return false;
+
+	for (uint8_t i = 0; i < iface->endpoints_num; ++i) {
+		const struct uhci_endpoint *cur =
+		    &udev->endpoints[iface->endpoints_first + i];
+
+		if ((cur->attributes & UHCI_EP_ATTR_TYPE_MASK)
+		        == UHCI_EP_ATTR_INTERRUPT
+		    && (cur->address & UHCI_EP_ADDR_IN) != 0)
+			ep = cur;
+	}
+
+	if (ep == NULL || ep->max_packet_size < HID_BOOT_REPORT_LEN)
+		return false;
+
+	// report only on a change, not repeated while a key is held. Optional
+	// for keyboards, a stall is fine.
+	uhci_control_transfer(udev, HID_RT_IFACE_OUT, HID_REQ_SET_IDLE, 0,
+	                      iface->number, 0, NULL);
+
+	if (!uhci_control_transfer(udev, HID_RT_IFACE_OUT, HID_REQ_SET_PROTOCOL,
+	                           HID_PROTOCOL_BOOT, iface->number, 0, NULL)) {
+		print_string("HID: SET_PROTOCOL failed\n");
+		return false;
+	}
+
+	kbd = memalloc(sizeof(struct hid_kbd));
+	if (kbd == NULL)
+		return false;
+
+	memfill(kbd, 0, sizeof(struct hid_kbd));
+	kbd->udev = udev;
+
+	if (!uhci_interrupt_start(udev, ep->address & UHCI_EP_ADDR_NUM_MASK,
+	                          kbd->report, HID_BOOT_REPORT_LEN,
+	                          &hid_kbd_report, kbd)) {
+		memfree(kbd);
+		return false;
+	}
+
+	hid_kbds[hid_kbds_num++] = kbd;
+
+	print_string("HID: boot keyboard\n");
+	return true;
+}
+
+bool hid_kbd_read(struct hid_key_event *event) {
+	// a controller without a working interrupt is only polled from here
+	for (uint8_t i = 0; i < hid_kbds_num; ++i)
+		uhci_service(hid_kbds[i]->udev);
+
+	uint16_t tail = hid_events_tail;
+	if (tail == hid_events_head)
+		return false;
+
+	*event = hid_events[tail % HID_EVENT_RING_SIZE];
+	// read the slot before it is given back
+	__asm__ volatile("" ::: "memory");
+	hid_events_tail = (uint16_t)(tail + 1);
+	return true;
+}
+
+char hid_key_char(const struct hid_key_event *event) {
+	static const char digits[] = "1234567890";
+	static const char digits_shift[] = "!@#$%^&*()";
+	// 0x2d - 0x38
+	static const char symbols[] = "-=[]\\#;'`,./";
+	static const char symbols_shift[] = "_+{}|~:\"~<>?";
+
+	bool shift = (event->modifiers & (HID_MOD_LSHIFT | HID_MOD_RSHIFT)) != 0;
+	uint8_t usage = event->usage;
+
+	if (usage >= 0x04 && usage <= 0x1d)
+		return (char)((shift ? 'A' : 'a') + (usage - 0x04));
+	if (usage >= 0x1e && usage <= 0x27)
+		return shift ? digits_shift[usage - 0x1e] : digits[usage - 0x1e];
+	if (usage >= 0x2d && usage <= 0x38)
+		return shift ? symbols_shift[usage - 0x2d] : symbols[usage - 0x2d];
+
+	switch (usage) {
+	case 0x28:
+		return '\n';
+	case 0x29:
+		return 0x1b;
+	case 0x2a:
+		return '\b';
+	case 0x2b:
+		return '\t';
+	case 0x2c:
+		return ' ';
+	default:
+		return 0;
+	}
+}
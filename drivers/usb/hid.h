@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "drivers/usb/uhci.h"
+
+// Modifier bits of a boot keyboard report, HID 1.11 8.3
+#define HID_MOD_LCTRL  (1 << 0)
+#define HID_MOD_LSHIFT (1 << 1)
+#define HID_MOD_LALT   (1 << 2)
+#define HID_MOD_LGUI   (1 << 3)
+#define HID_MOD_RCTRL  (1 << 4)
+#define HID_MOD_RSHIFT (1 << 5)
+#define HID_MOD_RALT   (1 << 6)
+#define HID_MOD_RGUI   (1 << 7)
+
+// Usage IDs of the modifiers, reported as keys of their own
+#define HID_KEY_LCTRL 0xe0
+
+struct hid_key_event {
+	uint8_t usage;     // Keyboard/Keypad page usage ID of the key
+	uint8_t modifiers; // HID_MOD_* held after the event
+	bool pressed;      // false on release
+	uint64_t tsc;      // rdtsc() when the report arrived; 0 without a TSC
+};
+
+/**
+ * Bind the keyboard driver to an interface if it is a boot protocol
+ * keyboard. The keyboard is switched to the boot protocol and its interrupt
+ * endpoint is polled from then on.
+ *
+ * @param udev configured device
+ * @param iface interface of the device
+ * @return true if the driver is bound to the interface
+ */
+bool hid_probe(struct usb_device *udev, const struct uhci_interface *iface);
+
+/**
+ * Take the oldest key event of the bound keyboards. `rdtsc() - event->tsc`
+ * is the time from the report to its consumer.
+ *
+ * @param event set to the event
+ * @return false if there is no event
+ */
+bool hid_kbd_read(struct hid_key_event *event);
+
+/**
+ * Translate a key to ASCII with the US layout
+ *
+ * @param event key event
+ * @return the character or 0 if the key has none
+ */
+char hid_key_char(const struct hid_key_event *event);
@@ -0,0 +1,279 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arch/clock.h"
+#include "arch/pit.h"
+#include "drivers/display/print.h"
+#include "drivers/usb/hub.h"
+#include "drivers/usb/uhci.h"
+#include "mem/mem.h"
+#include "utils/utils.h"
+
+/*
+ * Universal Serial Bus Specification Revision 2.0
+ * 11.23.2.1 Hub Descriptor, 11.24.2 Class-specific Requests
+ */
+#define HUB_DESC_TYPE 0x29
+
+// Port feature selectors, Table 11-17
+#define HUB_FEAT_PORT_ENABLE       1
+#define HUB_FEAT_PORT_RESET        4
+#define HUB_FEAT_PORT_POWER        8
+#define HUB_FEAT_C_PORT_CONNECTION 16
+#define HUB_FEAT_C_PORT_RESET      20
+
+// wPortStatus, Table 11-21
+#define HUB_PORT_CONNECTION (1 << 0)
+#define HUB_PORT_ENABLE     (1 << 1)
+#define HUB_PORT_LOW_SPEED  (1 << 9)
+
+// wPortChange, Table 11-22
+#define HUB_C_PORT_CONNECTION (1 << 0)
+#define HUB_C_PORT_RESET      (1 << 4)
+
+// Ports handled per hub, the status change bitmap fits in 32 bits
+#define HUB_MAX_PORTS 31
+
+// USB 2.0 spec 7.1.7.3: TATTDB, debounce interval after a connect
+#define HUB_DEBOUNCE_MS 100
+// USB 2.0 spec 7.1.7.5: TRSTRCY, reset recovery time
+#define HUB_RESET_RECOVERY_MS 10
+// The hub ends a port reset after 10-20ms (TDRST)
+#define HUB_RESET_TIMEOUT_MS 100
+
+#define HUB_RT_PORT_OUT                                                        \
+	(UHCI_DR_RT_XDIR_HOST_DEV | UHCI_DR_RT_TYPE_CLASS                          \
+	 | UHCI_DR_RT_RECIPIENT_OTHER)
+#define HUB_RT_PORT_IN                                                         \
+	(UHCI_DR_RT_XDIR_DEV_HOST | UHCI_DR_RT_TYPE_CLASS                          \
+	 | UHCI_DR_RT_RECIPIENT_OTHER)
+
+struct __attribute__((__packed__)) hub_descriptor {
+	uint8_t length;
+	uint8_t desc_type;
+	uint8_t ports_num;
+	uint16_t characteristics;
+	uint8_t power_on_good; // unit: 2ms
+	uint8_t contr_current; // unit: 1mA
+};
+
+static bool hub_set_port_feature(struct usb_device *hub, uint8_t port,
+                                 uint16_t feature) {
+	return uhci_control_transfer(hub, HUB_RT_PORT_OUT, UHCI_DR_REQ_SET_FEATURE,
+	                             feature, port, 0, NULL);
+}
+
+static bool hub_clear_port_feature(struct usb_device *hub, uint8_t port,
+                                   uint16_t feature) {
+	return uhci_control_transfer(hub, HUB_RT_PORT_OUT,
+	                             UHCI_DR_REQ_CLEAR_FEATURE, feature, port, 0,
+	                             NULL);
+}
+
+static bool hub_port_status(struct usb_device *hub, uint8_t port,
+                            uint16_t *status, uint16_t *change) {
+	uint16_t buf[2] = {0, 0};
+
+	if (!uhci_control_transfer(hub, HUB_RT_PORT_IN, UHCI_DR_REQ_GET_STATUS, 0,
+	                           port, sizeof(buf), buf))
+		return false;
+
+	*status = buf[0];
+	*change = buf[1];
+	return true;
+}
+
+/**
+ * Read the status change endpoint once
+ *
+ * @param hub hub device
+ * @param ep status change endpoint
+ * @param ports_num number of ports
+ * @return bitmap of the ports with a change (bit N = port N), none if the
+ * hub NAKs until the timeout, every port if the endpoint could not be read
+ */
+static uint32_t hub_changed_ports(struct usb_device *hub,
+                                  const struct uhci_endpoint *ep,
+                                  uint8_t ports_num) {
+	uint32_t all = (uint32_t)(((1ull << ports_num) - 1) << 1);
+	uint8_t buf[4] = {0, 0, 0, 0};
+	uint32_t len = 0;
+
+	if (ep == NULL)
+		return all;
+
+	// The endpoint is polled every bInterval (at most 128ms), a hub without
+	// changes NAKs. Give it two polls.
+	uint32_t timeout = 2u * (ep->interval < 128 ? ep->interval : 128u) + 10u;
+
+	if (!uhci_interrupt_in(hub, ep->address & UHCI_EP_ADDR_NUM_MASK, buf,
+	                       ports_num / 8u + 1u, &len, timeout)) {
+		if (hub->error == UHCI_XFER_TIMEOUT)
+			return 0;
+		return all;
+	}
+
+	uint32_t bitmap = 0;
+	for (uint32_t i = 0; i < len; ++i)
+		bitmap |= (uint32_t)buf[i] << (i * 8);
+
+	return bitmap & all;
+}
+
+/**
+ * Wait for the hub to end the reset of a port
+ *
+ * @param hub hub device
+ * @param port port in reset
+ * @param status set to the port status after the reset
+ * @return true if the port is enabled
+ */
+static bool hub_reset_done(struct usb_device *hub, uint8_t port,
+                           uint16_t *status) {
+	uint64_t start = clock_ns();
+	uint16_t change = 0;
+
+	while (true) {
+		if (!hub_port_status(hub, port, status, &change))
+			return false;
+
+		if ((change & HUB_C_PORT_RESET) != 0)
+			break;
+
+		if (clock_ns() - start > HUB_RESET_TIMEOUT_MS * 1000000ull)
+			return false;
+
+		sleep(1);
+	}
+
+	hub_clear_port_feature(hub, port, HUB_FEAT_C_PORT_RESET);
+	return (*status & HUB_PORT_ENABLE) != 0;
+}
+
+/**
+ * Next port set in a bitmap
+ *
+ * @param mask port bitmap
+ * @param port previous port, 0 to start
+ * @param ports_num number of ports
+ * @return port number or 0 if there is none
+ */
+static uint8_t hub_next_port(uint32_t mask, uint8_t port, uint8_t ports_num) {
+	for (uint8_t p = (uint8_t)(port + 1); p <= ports_num; ++p) {
+		if ((mask & (1u << p)) != 0)
+			return p;
+	}
+
+	return 0;
+}
+
+bool hub_probe(struct usb_device *udev, const struct uhci_interface *iface) {
+	struct hub_descriptor desc;
+	const struct uhci_endpoint *ep = NULL;
+	struct usb_device *children[HUB_MAX_PORTS];
+	uint8_t children_num = 0;
+	uint32_t connected = 0;
+
+	if (iface->class_code != UHCI_CLASS_HUB)
+		return false;
+
+	for (uint8_t i = 0; i < iface->endpoints_num; ++i) {
+		const struct uhci_endpoint *cur =
+		    &udev->endpoints[iface->endpoints_first + i];
+
+		if ((cur->attributes & UHCI_EP_ATTR_TYPE_MASK)
+		        == UHCI_EP_ATTR_INTERRUPT
+		    && (cur->address & UHCI_EP_ADDR_IN) != 0)
+			ep = cur;
+	}
+
+	if (!uhci_control_transfer(udev,
+	                           UHCI_DR_RT_XDIR_DEV_HOST | UHCI_DR_RT_TYPE_CLASS
+	                               | UHCI_DR_RT_RECIPIENT_DEVICE,
+	                           UHCI_DR_REQ_GET_DESCRIPTOR, HUB_DESC_TYPE << 8,
+	                           0, sizeof(desc), &desc)) {
+		print_string("Hub: no hub descriptor\n");
+		return false;
+	}
+
+	uint8_t ports_num =
+	    desc.ports_num > HUB_MAX_PORTS ? HUB_MAX_PORTS : desc.ports_num;
+
+	print_string("Hub: ");
+	print_string(itoa_once(ports_num, 10));
+	print_string(" ports\n");
+
+	uint64_t start = clock_ns();
+
+	// Power every port and wait for all of them at once: power good, then the
+	// connect debounce
+	for (uint8_t p = 1; p <= ports_num; ++p)
+		hub_set_port_feature(udev, p, HUB_FEAT_PORT_POWER);
+
+	sleep(desc.power_on_good * 2u + HUB_DEBOUNCE_MS);
+
+	uint32_t changed = hub_changed_ports(udev, ep, ports_num);
+
+	for (uint8_t p = hub_next_port(changed, 0, ports_num); p != 0;
+	     p = hub_next_port(changed, p, ports_num)) {
+		uint16_t status = 0;
+		uint16_t change = 0;
+
+		if (!hub_port_status(udev, p, &status, &change))
+			continue;
+
+		if ((change & HUB_C_PORT_CONNECTION) != 0)
+			hub_clear_port_feature(udev, p, HUB_FEAT_C_PORT_CONNECTION);
+
+		if ((status & HUB_PORT_CONNECTION) != 0)
+			connected |= 1u << p;
+	}
+
+	// Only one device may answer on the default address. The next port is
+	// put into reset as soon as the current device has its address, so the
+	// reset runs while the descriptors of that device are read.
+	uint8_t port = hub_next_port(connected, 0, ports_num);
+	if (port != 0)
+		hub_set_port_feature(udev, port, HUB_FEAT_PORT_RESET);
+
+	while (port != 0) {
+		uint8_t next = hub_next_port(connected, port, ports_num);
+		struct usb_device *child = NULL;
+		uint16_t status = 0;
+
+		if (hub_reset_done(udev, port, &status)) {
+			sleep(HUB_RESET_RECOVERY_MS);
+			child = uhci_attach_device(udev, port,
+			                           (status & HUB_PORT_LOW_SPEED) != 0);
+		}
+
+		// a device left on the default address would answer for the next one
+		if (child == NULL)
+			hub_clear_port_feature(udev, port, HUB_FEAT_PORT_ENABLE);
+
+		if (next != 0)
+			hub_set_port_feature(udev, next, HUB_FEAT_PORT_RESET);
+
+		if (child != NULL && !uhci_setup_device(child)) {
+			uhci_detach_device(child);
+			child = NULL;
+		}
+
+		if (child != NULL)
+			children[children_num++] = child;
+
+		port = next;
+	}
+
+	print_string("Hub: ");
+	print_string(itoa_once(children_num, 10));
+	print_string(" devices enumerated in ");
+	print_string(itoa_once((int)((clock_ns() - start) / 1000000u), 10));
+	print_string(" ms\n");
+
+	for (uint8_t i = 0; i < children_num; ++i)
+		uhci_bind_device(children[i]);
+
+	return true;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "drivers/usb/uhci.h"
+
+/**
+ * Bind the hub driver to an interface if it is a hub interface. The
+ * downstream ports are powered and the devices found on them are enumerated
+ * and bound, hubs among them recursively.
+ *
+ * @param udev configured device
+ * @param iface interface of the device
+ * @return true if the driver is bound to the interface
+ */
+bool hub_probe(struct usb_device *udev, const struct uhci_interface *iface);
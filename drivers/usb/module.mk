@@ -1 +1,4 @@
-SRCS += drivers/usb/uhci.c
\ No newline at end of file
+SRCS += drivers/usb/uhci.c
+SRCS += drivers/usb/msd.c
+SRCS += drivers/usb/hub.c
+SRCS += drivers/usb/hid.c
\ No newline at end of file
@@ -0,0 +1,686 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arch/clock.h"
+#include "arch/cpu.h"
+#include "arch/pit.h"
+#include "drivers/block/block.h"
+#include "drivers/display/print.h"
+#include "drivers/usb/msd.h"
+#include "drivers/usb/uhci.h"
+#include "mem/mem.h"
+#include "utils/utils.h"
+
+/*
+ * Universal Serial Bus Mass Storage Class
+ * Bulk-Only Transport Revision 1.0
+ */
+#define MSD_SUBCLASS_SCSI  0x06
+#define MSD_PROTOCOL_BOT   0x50
+#define MSD_REQ_BOT_RESET  0xff
+#define MSD_CBW_SIGNATURE  0x43425355 // "USBC"
+#define MSD_CSW_SIGNATURE  0x53425355 // "USBS"
+#define MSD_CBW_LEN        31
+#define MSD_CSW_LEN        13
+#define MSD_CBW_FLAG_IN    (1 << 7)
+#define MSD_CSW_PASSED     0
+#define MSD_CSW_FAILED     1
+#define MSD_CSW_PHASE_ERR  2
+
+/*
+ * SCSI Primary Commands / SCSI Block Commands operation codes
+ */
+#define SCSI_TEST_UNIT_READY  0x00
+#define SCSI_REQUEST_SENSE    0x03
+#define SCSI_INQUIRY          0x12
+#define SCSI_READ_CAPACITY_10 0x25
+#define SCSI_READ_10          0x28
+
+#define SCSI_INQUIRY_LEN       36
+#define SCSI_SENSE_LEN         18
+#define SCSI_SENSE_KEY(sense)  ((sense)[2] & 0x0f)
+#define SCSI_SENSE_ASC(sense)  ((sense)[12])
+#define SCSI_SENSE_UNIT_ATTN   0x06
+
+// The unit may need some time to spin up or to report a media change
+#define MSD_READY_RETRIES 20
+#define MSD_READY_WAIT_MS 100
+
+// Bulk-Only has no way to report a transfer limit. 64KB per command is what
+// common hosts use, and every device is expected to handle it.
+#define MSD_MAX_TRANSFER 0x10000
+
+struct __attribute__((__packed__)) msd_cbw {
+	uint32_t signature;
+	uint32_t tag;
+	uint32_t data_len;
+	uint8_t flags;
+	uint8_t lun;
+	uint8_t cb_len;
+	uint8_t cb[16];
+};
+
+struct __attribute__((__packed__)) msd_csw {
+	uint32_t signature;
+	uint32_t tag;
+	uint32_t residue;
+	uint8_t status;
+};
+
+// One READ(10) of a pipelined read
+struct msd_cmd {
+	struct msd_cbw *cbw;
+	struct msd_csw *csw;
+	struct uhci_bulk_xfer *cbw_xfer;
+	struct uhci_bulk_xfer *data_xfer;
+	struct uhci_bulk_xfer *csw_xfer;
+	struct msd_cmd *next;   // submitted when this one passes, set with IRQs off
+	volatile bool submitted;
+	volatile bool finished; // no stage of the command is in flight
+};
+
+struct msd_dev {
+	struct usb_device *udev;
+	uint8_t iface; // bInterfaceNumber
+	uint8_t ep_in;
+	uint8_t ep_out;
+	uint8_t lun;
+	uint32_t tag;
+	uint32_t max_blocks; // blocks per READ(10)
+	struct msd_cbw *cbw;
+	struct msd_csw *csw;
+	struct msd_cmd cmds[2]; // current and next command of a pipelined read
+	struct block_device blk;
+};
+
+static uint32_t msd_be32(const uint8_t *buf) {
+	return (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16
+	       | (uint32_t)buf[2] << 8 | buf[3];
+}
+
+static void msd_put_be32(uint8_t *buf, uint32_t val) {
+	buf[0] = (uint8_t)(val >> 24);
+	buf[1] = (uint8_t)(val >> 16);
+	buf[2] = (uint8_t)(val >> 8);
+	buf[3] = (uint8_t)val;
+}
+
+/**
+ * Bulk-Only Mass Storage Reset followed by clearing both bulk endpoints.
+ * BOT 5.3.4 Reset Recovery
+ */
+static void msd_reset_recovery(struct msd_dev *msd) {
+	uhci_control_transfer(msd->udev,
+	                      UHCI_DR_RT_XDIR_HOST_DEV | UHCI_DR_RT_TYPE_CLASS
+	                          | UHCI_DR_RT_RECIPIENT_INTERFACE,
+	                      MSD_REQ_BOT_RESET, 0, msd->iface, 0,
+	                      NULL);
+	uhci_clear_halt(msd->udev, msd->ep_in, UHCI_DIR_IN);
+	uhci_clear_halt(msd->udev, msd->ep_out, UHCI_DIR_OUT);
+}
+
+static bool msd_read_csw(struct msd_dev *msd) {
+	uint32_t len = 0;
+
+	if (uhci_bulk_transfer(msd->udev, msd->ep_in, UHCI_DIR_IN, msd->csw,
+	                       MSD_CSW_LEN, &len))
+		return len == MSD_CSW_LEN;
+
+	// BOT 6.7.2: a stalled CSW is retried once after clearing the halt
+	uhci_clear_halt(msd->udev, msd->ep_in, UHCI_DIR_IN);
+	return uhci_bulk_transfer(msd->udev, msd->ep_in, UHCI_DIR_IN, msd->csw,
+	                          MSD_CSW_LEN, &len)
+	       && len == MSD_CSW_LEN;
+}
+
+static void msd_fill_cbw(struct msd_dev *msd, struct msd_cbw *cbw,
+                         const uint8_t *cb, uint8_t cb_len, uint8_t dir,
+                         uint32_t len) {
+	memfill(cbw, 0, sizeof(struct msd_cbw));
+	cbw->signature = MSD_CBW_SIGNATURE;
+	cbw->tag = ++msd->tag;
+	cbw->data_len = len;
+	cbw->flags = (len > 0 && dir == UHCI_DIR_IN) ? MSD_CBW_FLAG_IN : 0;
+	cbw->lun = msd->lun;
+	cbw->cb_len = cb_len;
+	memcopy(cbw->cb, (void *)cb, cb_len);
+}
+
+static void msd_fill_read10(uint8_t *cb, uint32_t lba, uint16_t count) {
+	memfill(cb, 0, 10);
+	cb[0] = SCSI_READ_10;
+	msd_put_be32(&cb[2], lba);
+	cb[7] = (uint8_t)(count >> 8);
+	cb[8] = (uint8_t)count;
+}
+
+/**
+ * Run a SCSI command through the three BOT stages
+ *
+ * @param msd device
+ * @param cb command block
+ * @param cb_len length of the command block
+ * @param dir data stage direction, UHCI_DIR_IN or UHCI_DIR_OUT
+ * @param sg data stage buffers, the total length is the data stage length
+ * @param sg_num number of entries in `sg`
+ * @param status CSW status is returned here
+ * @return true if the command reached the status stage; false if the
+ * transport failed and the device was reset
+ */
+static bool msd_command_sg(struct msd_dev *msd, const uint8_t *cb,
+                           uint8_t cb_len, uint8_t dir,
+                           const struct sg_entry *sg, uint8_t sg_num,
+                           uint8_t *status) {
+	struct msd_cbw *cbw = msd->cbw;
+	uint32_t len = sg_total(sg, sg_num);
+	uint32_t actual = 0;
+
+	msd_fill_cbw(msd, cbw, cb, cb_len, dir, len);
+
+	if (!uhci_bulk_transfer(msd->udev, msd->ep_out, UHCI_DIR_OUT, cbw,
+	                        MSD_CBW_LEN, NULL)) {
+		msd_reset_recovery(msd);
+		return false;
+	}
+
+	// a stalled data stage still ends with a CSW
+	if (len > 0
+	    && !uhci_bulk_transfer_sg(msd->udev,
+	                              dir == UHCI_DIR_IN ? msd->ep_in : msd->ep_out,
+	                              dir, sg, sg_num, &actual))
+		uhci_clear_halt(msd->udev,
+		                dir == UHCI_DIR_IN ? msd->ep_in : msd->ep_out, dir);
+
+	if (!msd_read_csw(msd) || msd->csw->signature != MSD_CSW_SIGNATURE
+	    || msd->csw->tag != cbw->tag
+	    || msd->csw->status == MSD_CSW_PHASE_ERR) {
+		msd_reset_recovery(msd);
+		return false;
+	}
+
+	*status = msd->csw->status;
+	if (*status == MSD_CSW_PASSED && msd->csw->residue == 0 && actual != len)
+		*status = MSD_CSW_FAILED; // the device lost data without telling
+
+	return true;
+}
+
+static bool msd_command(struct msd_dev *msd, const uint8_t *cb, uint8_t cb_len,
+                        uint8_t dir, void *buf, uint32_t len,
+                        uint8_t *status) {
+	struct sg_entry sg = {.buf = buf, .len = len};
+
+	return msd_command_sg(msd, cb, cb_len, dir, &sg, 1, status);
+}
+
+static bool msd_request_sense(struct msd_dev *msd, uint8_t *sense) {
+	uint8_t cb[6] = {SCSI_REQUEST_SENSE, 0, 0, 0, SCSI_SENSE_LEN, 0};
+	uint8_t status = MSD_CSW_FAILED;
+
+	return msd_command(msd, cb, sizeof(cb), UHCI_DIR_IN, sense, SCSI_SENSE_LEN,
+	                   &status)
+	       && status == MSD_CSW_PASSED;
+}
+
+static bool msd_wait_ready(struct msd_dev *msd) {
+	uint8_t cb[6] = {SCSI_TEST_UNIT_READY, 0, 0, 0, 0, 0};
+	uint8_t *sense = memalloc(SCSI_SENSE_LEN);
+	bool ready = false;
+
+	for (uint8_t i = 0; i < MSD_READY_RETRIES; ++i) {
+		uint8_t status = MSD_CSW_FAILED;
+
+		if (msd_command(msd, cb, sizeof(cb), UHCI_DIR_OUT, NULL, 0, &status)
+		    && status == MSD_CSW_PASSED) {
+			ready = true;
+			break;
+		}
+
+		// the sense data has to be read to clear the condition
+		if (msd_request_sense(msd, sense)
+		    && SCSI_SENSE_KEY(sense) == SCSI_SENSE_UNIT_ATTN)
+			continue;
+
+		sleep(MSD_READY_WAIT_MS);
+	}
+
+	memfree(sense);
+	return ready;
+}
+
+static bool msd_inquiry(struct msd_dev *msd) {
+	uint8_t cb[6] = {SCSI_INQUIRY, 0, 0, 0, SCSI_INQUIRY_LEN, 0};
+	uint8_t *data = memalloc(SCSI_INQUIRY_LEN + 1);
+	uint8_t status = MSD_CSW_FAILED;
+	bool result = false;
+
+	memfill(data, 0, SCSI_INQUIRY_LEN + 1);
+
+	if (msd_command(msd, cb, sizeof(cb), UHCI_DIR_IN, data, SCSI_INQUIRY_LEN,
+	                &status)
+	    && status == MSD_CSW_PASSED) {
+		// vendor (8) and product (16) identification, space padded
+		print_string("MSD: ");
+		print_string((char *)&data[8]);
+		print_string("\n");
+		result = true;
+	}
+
+	memfree(data);
+	return result;
+}
+
+static bool msd_read_capacity(struct msd_dev *msd) {
+	uint8_t cb[10] = {SCSI_READ_CAPACITY_10};
+	uint8_t *data = memalloc(8);
+	uint8_t status = MSD_CSW_FAILED;
+	bool result = false;
+
+	if (msd_command(msd, cb, sizeof(cb), UHCI_DIR_IN, data, 8, &status)
+	    && status == MSD_CSW_PASSED) {
+		uint32_t last_lba = msd_be32(&data[0]);
+		uint32_t block_size = msd_be32(&data[4]);
+
+		// 0xffffffff means READ CAPACITY(16) is needed, not supported here
+		if (last_lba != 0xffffffff && block_size != 0
+		    && block_size <= MSD_MAX_TRANSFER) {
+			msd->blk.block_count = last_lba + 1;
+			msd->blk.block_size = block_size;
+			msd->max_blocks = MSD_MAX_TRANSFER / block_size;
+			result = true;
+		}
+	}
+
+	memfree(data);
+	return result;
+}
+
+static bool msd_read10(struct msd_dev *msd, uint32_t lba, uint16_t count,
+                       const struct sg_entry *sg, uint8_t sg_num) {
+	uint8_t cb[10];
+	uint8_t sense[SCSI_SENSE_LEN];
+	uint8_t status = MSD_CSW_FAILED;
+
+	msd_fill_read10(cb, lba, count);
+
+	if (!msd_command_sg(msd, cb, sizeof(cb), UHCI_DIR_IN, sg, sg_num,
+	                    &status))
+		return false;
+
+	if (status != MSD_CSW_PASSED) {
+		msd_request_sense(msd, sense);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Pipelined reads
+ *
+ * BOT allows one command at a time, so the bus idles from the CSW of a command
+ * until the next CBW is scheduled. A pipelined read builds the TD chains of
+ * the next READ(10) while the data stage of the current one is in flight, and
+ * the completion callbacks link each stage as soon as the previous one is
+ * retired:
+ *
+ *   CSW n passed -> CBW n+1 -> DATA n+1 + CSW n+1
+ *
+ * Anything unexpected stops the pipeline, the caller then retries the rest
+ * with the error handling of msd_command.
+ */
+
+static bool msd_pipe_passed(const struct msd_cmd *cmd) {
+	return uhci_bulk_complete(cmd->cbw_xfer)
+	       && uhci_bulk_complete(cmd->data_xfer)
+	       && uhci_bulk_complete(cmd->csw_xfer)
+	       && cmd->csw->signature == MSD_CSW_SIGNATURE
+	       && cmd->csw->tag == cmd->cbw->tag
+	       && cmd->csw->status == MSD_CSW_PASSED && cmd->csw->residue == 0;
+}
+
+static void msd_pipe_cbw_done(struct uhci_bulk_xfer *xfer, void *userdata);
+
+static void msd_pipe_submit(struct msd_cmd *cmd) {
+	cmd->submitted = true;
+	uhci_bulk_submit(cmd->cbw_xfer, msd_pipe_cbw_done, cmd);
+}
+
+static void msd_pipe_csw_done(struct uhci_bulk_xfer *xfer, void *userdata) {
+	struct msd_cmd *cmd = userdata;
+	(void)xfer;
+
+	if (cmd->next != NULL && msd_pipe_passed(cmd))
+		msd_pipe_submit(cmd->next);
+
+	cmd->next = NULL;
+	cmd->finished = true;
+}
+
+static void msd_pipe_cbw_done(struct uhci_bulk_xfer *xfer, void *userdata) {
+	struct msd_cmd *cmd = userdata;
+
+	if (!uhci_bulk_complete(xfer)) {
+		cmd->next = NULL;
+		cmd->finished = true;
+		return;
+	}
+
+	uhci_bulk_submit(cmd->data_xfer, NULL, NULL);
+	uhci_bulk_submit(cmd->csw_xfer, msd_pipe_csw_done, cmd);
+}
+
+/**
+ * Free the transfers of a command. Unsubmitted stages are freed in reverse
+ * order to give back their data toggles.
+ */
+static void msd_pipe_release(struct msd_cmd *cmd) {
+	if (cmd->csw_xfer != NULL)
+		uhci_bulk_finish(cmd->csw_xfer, NULL);
+	if (cmd->data_xfer != NULL)
+		uhci_bulk_finish(cmd->data_xfer, NULL);
+	if (cmd->cbw_xfer != NULL)
+		uhci_bulk_finish(cmd->cbw_xfer, NULL);
+
+	cmd->csw_xfer = NULL;
+	cmd->data_xfer = NULL;
+	cmd->cbw_xfer = NULL;
+}
+
+static bool msd_pipe_prepare(struct msd_dev *msd, struct msd_cmd *cmd,
+                             uint32_t lba, uint16_t count,
+                             const struct sg_entry *sg, uint8_t sg_num) {
+	uint8_t cb[10];
+	uint32_t len = count * msd->blk.block_size;
+
+	msd_fill_read10(cb, lba, count);
+	msd_fill_cbw(msd, cmd->cbw, cb, sizeof(cb), UHCI_DIR_IN, len);
+
+	cmd->next = NULL;
+	cmd->submitted = false;
+	cmd->finished = false;
+	cmd->cbw_xfer = uhci_bulk_prepare(msd->udev, msd->ep_out, UHCI_DIR_OUT,
+	                                  cmd->cbw, MSD_CBW_LEN);
+	cmd->data_xfer = uhci_bulk_prepare_sg(msd->udev, msd->ep_in, UHCI_DIR_IN,
+	                                      sg, sg_num);
+	cmd->csw_xfer = uhci_bulk_prepare(msd->udev, msd->ep_in, UHCI_DIR_IN,
+	                                  cmd->csw, MSD_CSW_LEN);
+
+	if (cmd->cbw_xfer == NULL || cmd->data_xfer == NULL
+	    || cmd->csw_xfer == NULL) {
+		msd_pipe_release(cmd);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Read blocks with back to back READ(10) commands
+ *
+ * @param msd device
+ * @param lba first block
+ * @param count number of blocks
+ * @param sg destination
+ * @param sg_num number of entries in `sg`
+ * @param done number of blocks read is returned here
+ * @return true if every block is read
+ */
+static bool msd_read_pipelined(struct msd_dev *msd, uint32_t lba,
+                               uint32_t count, const struct sg_entry *sg,
+                               uint8_t sg_num, uint32_t *done) {
+	struct msd_cmd *cur = &msd->cmds[0];
+	struct msd_cmd *next = &msd->cmds[1];
+	struct sg_entry part[SG_MAX];
+	uint32_t block_size = msd->blk.block_size;
+	uint32_t n = count > msd->max_blocks ? msd->max_blocks : count;
+	uint32_t off = 0;
+	bool result = true;
+
+	*done = 0;
+
+	uint8_t part_num = sg_slice(sg, sg_num, off, n * block_size, part);
+	if (!msd_pipe_prepare(msd, cur, lba, (uint16_t)n, part, part_num))
+		return false;
+
+	msd_pipe_submit(cur);
+
+	while (true) {
+		bool has_next = false;
+		uint32_t cur_n = n;
+
+		lba += n;
+		count -= n;
+		off += n * block_size;
+
+		if (count > 0) {
+			n = count > msd->max_blocks ? msd->max_blocks : count;
+			part_num = sg_slice(sg, sg_num, off, n * block_size, part);
+			has_next =
+			    msd_pipe_prepare(msd, next, lba, (uint16_t)n, part, part_num);
+		}
+
+		if (has_next) {
+			uint32_t eflags = irq_save();
+			if (!cur->finished)
+				cur->next = next;
+			else if (msd_pipe_passed(cur))
+				msd_pipe_submit(next);
+			irq_restore(eflags);
+		}
+
+		uhci_wait(msd->udev, &cur->finished);
+
+		bool passed = msd_pipe_passed(cur);
+
+		if (has_next && !next->submitted) {
+			msd_pipe_release(next);
+			has_next = false;
+		}
+		msd_pipe_release(cur);
+
+		if (!passed) {
+			result = false;
+			break;
+		}
+
+		*done += cur_n;
+
+		if (!has_next) {
+			result = count == 0;
+			break;
+		}
+
+		struct msd_cmd *tmp = cur;
+		cur = next;
+		next = tmp;
+	}
+
+	return result;
+}
+
+static bool msd_block_read_sg(struct block_device *blk, uint32_t lba,
+                              uint32_t count, const struct sg_entry *sg,
+                              uint8_t sg_num) {
+	struct msd_dev *msd = blk->priv;
+	struct sg_entry part[SG_MAX];
+	uint32_t off = 0;
+
+	if (count > msd->max_blocks) {
+		uint32_t done = 0;
+
+		if (msd_read_pipelined(msd, lba, count, sg, sg_num, &done))
+			return true;
+
+		// continue one command at a time with full error handling
+		msd_reset_recovery(msd);
+		lba += done;
+		count -= done;
+		off += done * blk->block_size;
+	}
+
+	while (count > 0) {
+		uint32_t n = count > msd->max_blocks ? msd->max_blocks : count;
+		uint8_t part_num =
+		    sg_slice(sg, sg_num, off, n * blk->block_size, part);
+
+		if (!msd_read10(msd, lba, (uint16_t)n, part, part_num))
+			return false;
+
+		lba += n;
+		count -= n;
+		off += n * blk->block_size;
+	}
+
+	return true;
+}
+
+static bool msd_block_read(struct block_device *blk, uint32_t lba,
+                           uint32_t count, void *buf) {
+	struct sg_entry sg = {.buf = buf, .len = count * blk->block_size};
+
+	return msd_block_read_sg(blk, lba, count, &sg, 1);
+}
+
+#ifdef BENCH
+
+#define MSD_BENCH_BYTES 0x100000 // 1MB
+// Extended memory is free until a kernel is loaded there
+#define MSD_BENCH_BUF ((uint8_t *)0x100000)
+
+static void msd_bench_print(const char *name, uint32_t bytes, uint32_t us) {
+	if (us == 0)
+		us = 1;
+
+	print_string("BENCH msd ");
+	print_string(name);
+	print_string(": ");
+	print_string(itoa_once((int)bytes, 10));
+	print_string(" B in ");
+	print_string(itoa_once((int)us, 10));
+	print_string(" us, ");
+	print_string(itoa_once((int)((uint64_t)bytes * 1000000u / 1024u / us), 10));
+	print_string(" KB/s\n");
+}
+
+/**
+ * Read the beginning of the device with the largest commands, one command at
+ * a time and pipelined, and print the sustained throughput of both
+ */
+static void msd_bench(struct msd_dev *msd) {
+	uint32_t total = MSD_BENCH_BYTES / msd->blk.block_size;
+	uint32_t done = 0;
+
+	if (total > msd->blk.block_count)
+		total = msd->blk.block_count;
+
+	uint64_t start = clock_ns();
+
+	while (done < total) {
+		uint32_t n = total - done > msd->max_blocks ? msd->max_blocks
+		                                            : total - done;
+
+		struct sg_entry sg = {.buf = MSD_BENCH_BUF + done * msd->blk.block_size,
+		                      .len = n * msd->blk.block_size};
+
+		if (!msd_read10(msd, done, (uint16_t)n, &sg, 1)) {
+			print_string("BENCH msd: read failed\n");
+			break;
+		}
+
+		done += n;
+	}
+
+	msd_bench_print("sequential", done * msd->blk.block_size,
+	                (uint32_t)((clock_ns() - start) / 1000u));
+
+	struct sg_entry sg = {.buf = MSD_BENCH_BUF,
+	                      .len = total * msd->blk.block_size};
+
+	start = clock_ns();
+
+	if (!msd_read_pipelined(msd, 0, total, &sg, 1, &done)) {
+		print_string("BENCH msd: pipelined read failed\n");
+		msd_reset_recovery(msd);
+	}
+
+	msd_bench_print("pipelined", done * msd->blk.block_size,
+	                (uint32_t)((clock_ns() - start) / 1000u));
+}
+
+#endif
+
+bool msd_probe(struct usb_device *udev, const struct uhci_interface *iface) {
+	struct msd_dev *msd = NULL;
+
+	if (iface->class_code != UHCI_CLASS_MASS_STORAGE
+	    || iface->sub_class != MSD_SUBCLASS_SCSI
+	    || iface->protocol != MSD_PROTOCOL_BOT)
+		return false;
+
+	msd = memalloc(sizeof(struct msd_dev));
+	memfill(msd, 0, sizeof(struct msd_dev));
+	msd->udev = udev;
+	msd->iface = iface->number;
+
+	for (uint8_t i = 0; i < iface->endpoints_num; ++i) {
+		const struct uhci_endpoint *ep =
+		    &udev->endpoints[iface->endpoints_first + i];
+
+		if ((ep->attributes & UHCI_EP_ATTR_TYPE_MASK) != UHCI_EP_ATTR_BULK)
+			continue;
+
+		if ((ep->address & UHCI_EP_ADDR_IN) != 0)
+			msd->ep_in = ep->address & UHCI_EP_ADDR_NUM_MASK;
+		else
+			msd->ep_out = ep->address & UHCI_EP_ADDR_NUM_MASK;
+	}
+
+	msd->cbw = memalloc(sizeof(struct msd_cbw));
+	msd->csw = memalloc(sizeof(struct msd_csw));
+	for (uint8_t i = 0; i < ARRSIZE(msd->cmds); ++i) {
+		msd->cmds[i].cbw = memalloc(sizeof(struct msd_cbw));
+		msd->cmds[i].csw = memalloc(sizeof(struct msd_csw));
+		if (msd->cmds[i].cbw == NULL || msd->cmds[i].csw == NULL)
+			goto fail;
+	}
+
+	if (msd->ep_in == 0 || msd->ep_out == 0 || msd->cbw == NULL
+	    || msd->csw == NULL)
+		goto fail;
+
+	if (!msd_inquiry(msd) || !msd_wait_ready(msd)
+	    || !msd_read_capacity(msd)) {
+		print_string("MSD: device not ready\n");
+		goto fail;
+	}
+
+	msd->blk.read = msd_block_read;
+	msd->blk.read_sg = msd_block_read_sg;
+	msd->blk.priv = msd;
+	msd->blk.name = "usb-msd";
+	block_register(&msd->blk);
+
+	print_string("MSD: ");
+	print_string(itoa_once((int)msd->blk.block_count, 10));
+	print_string(" blocks of ");
+	print_string(itoa_once((int)msd->blk.block_size, 10));
+	print_string(" B\n");
+
+#ifdef BENCH
+	msd_bench(msd);
+#endif
+
+	return true;
+
+fail:
+	for (uint8_t i = 0; i < ARRSIZE(msd->cmds); ++i) {
+		memfree(msd->cmds[i].cbw);
+		memfree(msd->cmds[i].csw);
+	}
+	memfree(msd->cbw);
+	memfree(msd->csw);
+	memfree(msd);
+	return false;
+}
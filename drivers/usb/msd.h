@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "drivers/usb/uhci.h"
+
+/**
+ * Bind the mass storage driver to an interface if it is a SCSI Bulk-Only
+ * Transport interface. A bound device is registered as a block device.
+ *
+ * @param udev configured device
+ * @param iface interface of the device
+ * @return true if the driver is bound to the interface
+ */
+bool msd_probe(struct usb_device *udev, const struct uhci_interface *iface);
@@ -4,13 +4,19 @@
 #include <uchar.h>
 #include <wchar.h>
 
+#include "arch/clock.h"
+#include "arch/cpu.h"
 #include "arch/idt.h"
 #include "arch/pit.h"
 #include "drivers/display/print.h"
 #include "drivers/io/io.h"
 #include "drivers/pci/pci21.h"
+#include "drivers/usb/hid.h"
+#include "drivers/usb/hub.h"
+#include "drivers/usb/msd.h"
 #include "drivers/usb/uhci.h"
 #include "mem/mem.h"
+#include "utils/sg.h"
 #include "utils/utils.h"
 
 // LEGACY SUPPORT REGISTER 16bit
@@ -46,6 +52,101 @@
 // Frame list must be 4KB aligned
 #define UHCI_FRAME_LIST_ALIGN 4096
 
+// Max TDs scheduled at once by uhci_bulk_transfer, larger transfers are split.
+// 64KB at 64 byte packets.
+#define UHCI_BULK_MAX_TDS 1024
+
+/*
+ * Skeleton Queue Heads
+ *
+ * Every frame list entry points to one of the interrupt skeleton QHs. Frame N
+ * starts at the QH with the longest interval that divides N, the interrupt
+ * QHs are chained from the longest interval to the shortest, then the control
+ * and the bulk QHs follow:
+ *
+ *   int128 -> ... -> int1 -> LS control -> FS control -> bulk -> term -> T
+ *                                          ^                        |
+ *                                          +------ reclamation -----+
+ *
+ * The QH of a device endpoint is inserted right after the skeleton QH of its
+ * transfer type, so each endpoint has its own queue and a stalled / NAKing
+ * endpoint does not block the others. The skeleton QHs have no elements,
+ * except the term QH that holds an inactive TD (see uhci_init_frame_list).
+ *
+ * Full-speed bandwidth reclamation (FSBR): while full-speed control or bulk
+ * transfers are pending, the term QH links back to the FS control QH, so the
+ * HC keeps working on them for the rest of the frame instead of idling until
+ * the next SOF. Low-speed control is kept out of the loop, it would eat the
+ * frame at 1/8 of the speed.
+ */
+
+// Interrupt QH with 2^n ms interval, n = 0..7
+#define UHCI_SKEL_INT(n)     (n)
+#define UHCI_SKEL_INT_NUM    8
+#define UHCI_SKEL_LS_CONTROL 8
+#define UHCI_SKEL_FS_CONTROL 9
+#define UHCI_SKEL_BULK       10
+#define UHCI_SKEL_TERM       11
+#define UHCI_SKEL_NUM        12
+
+// Queue Head software flags
+// Transfers on the QH take part in bandwidth reclamation
+#define UHCI_QH_FSBR (1 << 0)
+
+// Bandwidth reclamation on new controllers, override with
+// CFLAGS=-DUHCI_FSBR_DEFAULT=false
+#ifndef UHCI_FSBR_DEFAULT
+#define UHCI_FSBR_DEFAULT true
+#endif
+
+/*
+ * Completion by polling
+ *
+ * Transfers are normally retired by uhci_isr. On boards where the BIOS routes
+ * the IRQ wrongly the interrupt never arrives, so a wait that takes longer
+ * than UHCI_IRQ_DEADLINE_MS looks at USBSTS itself: if the HC reports a
+ * completion that the ISR has not acknowledged for one more timer tick, the
+ * controller is switched to polling for good. A polling controller has its
+ * interrupts disabled and the wait loops retire transfers by checking the TD
+ * active bits. Start in polling mode with CFLAGS=-DUHCI_POLL_DEFAULT=true
+ */
+#ifndef UHCI_POLL_DEFAULT
+#define UHCI_POLL_DEFAULT false
+#endif
+
+#define UHCI_IRQ_DEADLINE_MS 20
+
+/*
+ * Transfer deadlines
+ *
+ * A transfer gets its deadline when it is scheduled. The wait loops cancel
+ * pending transfers that are past it (see uhci_expire), so a device that NAKs
+ * forever or is unplugged mid-transfer costs bounded time instead of a hang.
+ * USB 2.0 spec 9.2.6.4 allows 500ms for the first data packet of a standard
+ * request, bulk commands of a mass storage device may take a few seconds.
+ */
+#ifndef UHCI_CONTROL_TIMEOUT_MS
+#define UHCI_CONTROL_TIMEOUT_MS 1000
+#endif
+
+#ifndef UHCI_BULK_TIMEOUT_MS
+#define UHCI_BULK_TIMEOUT_MS 5000
+#endif
+
+/*
+ * Deferred completion
+ *
+ * The ISR only acknowledges USBSTS, takes the finished entries off the pending
+ * list and pushes them onto the completion ring of the controller. Their
+ * handlers run later from the wait loops (uhci_complete) with interrupts
+ * enabled, so a handler that prints or submits more work does not hold off
+ * the PIT tick. The ring has a single producer (uhci_retire, always with
+ * interrupts disabled) and a single consumer, each side writes only its own
+ * index. An entry that does not fit stays pending and is retired again once
+ * the ring is drained.
+ */
+#define UHCI_DONE_RING_SIZE 64 // power of 2
+
 struct frame_list_pointer {
 	uint32_t pointer;
 };
@@ -69,11 +170,17 @@ struct frame_list_pointer {
  *                                               element
  *
  * QELP is Host Controller RW
+ *
+ * The 16 byte alignment leaves 8 bytes after the hardware fields that are
+ * used by software.
  */
 
 struct queue_head {
 	struct frame_list_pointer qhlp;
 	volatile struct frame_list_pointer qelp;
+	// software fields
+	struct transfer_descriptor *tail; // last TD linked into the queue
+	uint32_t flags;                   // UHCI_QH_*
 };
 
 /*
@@ -149,10 +256,19 @@ struct queue_head {
 #define UHCI_TD_STATUS_CRC_TO       (1 << 18)
 #define UHCI_TD_STATUS_BITSTUFF_ERR (1 << 17)
 #define UHCI_TD_STATUS_MASK         (0x7f << 17)
-#define UHCI_TD_ACT_LEN_MASK        0x3ff
-
-#define UHCI_TD_MAX_LEN(len)   ((uint32_t)(((len) & 0x3f) << 21))
+#define UHCI_TD_STATUS_ERR_MASK                                                \
+	(UHCI_TD_STATUS_STALLED | UHCI_TD_STATUS_DATA_BUF_ERR                      \
+	 | UHCI_TD_STATUS_BABBLE | UHCI_TD_STATUS_CRC_TO                           \
+	 | UHCI_TD_STATUS_BITSTUFF_ERR)
+#define UHCI_TD_ACT_LEN_MASK        0x7ff
+// Actual Length is encoded as N-1, 0x7ff = 0
+#define UHCI_TD_ACT_LEN(status) (((status) + 1) & UHCI_TD_ACT_LEN_MASK)
+
+// Maximum Length is encoded as N-1 in 11 bits, 0x7ff = 0
+#define UHCI_TD_MAX_LEN(len)   ((uint32_t)(((len) & 0x7ff) << 21))
+#define UHCI_TD_MAX_LEN_GET(token) ((((token) >> 21) + 1) & 0x7ff)
 #define UHCI_TD_DATA_TOGGLE    (1 << 19)
+#define UHCI_TD_ENDPOINT(ep)   ((uint32_t)(((ep) & 0x0f) << 15))
 #define UHCI_TD_ENDPOINT_MASK  (0x0f << 15)
 #define UHCI_TD_DEV_ADDR(addr) ((uint32_t)(((addr) & 0x7f) << 8))
 #define UHCI_TD_DEV_ADDR_MASK  (0x7f << 8)
@@ -173,128 +289,6 @@ struct __attribute__((__packed__)) transfer_descriptor {
 	uint32_t swdata[4];
 };
 
-/*
- * USB Device Requests
- *
- *    3                   2                   1                   0
- *  1 0 9 8 7 6 5 4 3 2 1 0 9 8 7 6 5 4 3 2 1 0 9 8 7 6 5 4 3 2 1 0
- * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
- * |           Value               |   Request     | Request Type  |
- * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
- * |           Length              |             Index             |
- * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
- *
- * Request Type:
- *   bit 7 Data xfer direction:
- *     0 = Host to device
- *     1 = Device to host
- *   bit 6-5 Type:
- *     0 = Standard
- *     1 = Class
- *     2 = Vendor
- *     3 = Reserved
- *   bit 4-0 Recipient:
- *     0 = Device
- *     1 = Interface
- *     2 = Endpoint
- *     3 = Other
- *     4-31 = Reserved
- *
- * Request, Value, Index:
- *   Universal Serial Bus Specification Revision 1.0
- *   Table 9-2
- *
- * Length:
- *   Number of bytes to transfer if there is a data phase
- */
-
-#define UHCI_DR_RT_XDIR_HOST_DEV 0
-#define UHCI_DR_RT_XDIR_DEV_HOST (1 << 7)
-
-#define UHCI_DR_RT_TYPE_STANDARD (0 << 5)
-#define UHCI_DR_RT_TYPE_CLASS    (1 << 5)
-#define UHCI_DR_RT_TYPE_VENDOR   (2 << 5)
-
-#define UHCI_DR_RT_RECIPIENT_DEVICE    0
-#define UHCI_DR_RT_RECIPIENT_INTERFACE 1
-#define UHCI_DR_RT_RECIPIENT_ENDPOINT  2
-#define UHCI_DR_RT_RECIPIENT_OTHER     3
-
-/*
- * Universal Serial Bus Specification Revision 1.0
- * Table 9-3. Standard Request Codes
- */
-#define UHCI_DR_REQ_GET_STATUS        0
-#define UHCI_DR_REQ_CLEAR_FEATURE     1
-// 2 = reserved
-#define UHCI_DR_REQ_SET_FEATURE       3
-// 4 = reserved
-#define UHCI_DR_REQ_SET_ADDRESS       5
-#define UHCI_DR_REQ_GET_DESCRIPTOR    6
-#define UHCI_DR_REQ_SET_DESCRIPTOR    7
-#define UHCI_DR_REQ_GET_CONFIGURATION 8
-#define UHCI_DR_REQ_SET_CONFIGURATION 9
-#define UHCI_DR_REQ_GET_INTERFACE     10
-#define UHCI_DR_REQ_SET_INTERFACE     11
-#define UHCI_DR_REQ_SYNCH_FRAME       12
-
-/*
- * Universal Serial Bus Specification Revision 1.0
- * Table 9-4. Descriptor Types
- */
-#define UHCI_DR_VAL_DESC_DEVICE        (1 << 8)
-#define UHCI_DR_VAL_DESC_CONFIGURATION (2 << 8)
-#define UHCI_DR_VAL_DESC_STRING        (3 << 8)
-#define UHCI_DR_VAL_DESC_INTERFACE     (4 << 8)
-#define UHCI_DR_VAL_DESC_ENDPOINT      (5 << 8)
-
-struct device_request {
-	uint8_t request_type;
-	uint8_t request;
-	uint16_t value;
-	uint16_t index;
-	uint16_t length;
-};
-
-struct descriptor {
-	uint8_t length;
-	uint8_t desc_type;
-};
-
-struct device_descriptor {
-	uint8_t length;
-	uint8_t desc_type;
-	uint16_t bcdUSB;
-	uint8_t device_class;
-	uint8_t device_sub_class;
-	uint8_t device_protocol;
-	uint8_t max_packet_size;
-	uint16_t vendor_id;
-	uint16_t product_id;
-	uint16_t bcdDevice;
-	uint8_t manufacturer_idx;
-	uint8_t product_idx;
-	uint8_t serial_number_idx;
-	uint8_t configurations_num;
-};
-
-struct __attribute__((__packed__)) configuration_descriptor {
-	uint8_t length;
-	uint8_t desc_type;
-	uint16_t total_length;
-	uint8_t interfaces_num;
-	uint8_t configuration_value;
-	uint8_t configuration_idx;
-	uint8_t attribute;
-	uint8_t max_power; // unit: 2mA
-};
-
-struct string_descriptor {
-	uint8_t length;
-	uint8_t desc_type;
-	char16_t string[];
-};
-
 // ========================================================
 // UHCI registers
 
@@ -321,6 +315,17 @@ typedef uint16_t uhci_reg;
 #define UHCI_USBCMD_HC_RESET       (1 << 1)
 #define UHCI_USBCMD_RUN            (1 << 0)
 
+// ========================================================
+// UHCI Status register
+
+#define UHCI_USBSTS_HC_HALTED      (1 << 5)
+#define UHCI_USBSTS_HC_PROCESS_ERR (1 << 4)
+#define UHCI_USBSTS_HOST_SYS_ERR   (1 << 3)
+#define UHCI_USBSTS_RESUME_DETECT  (1 << 2)
+#define UHCI_USBSTS_USBERRINT      (1 << 1)
+#define UHCI_USBSTS_USBINT         (1 << 0)
+#define UHCI_USBSTS_INT_MASK       0x1f
+
 // ========================================================
 // UHCI Interrupt Enable register
 
@@ -343,32 +348,77 @@ typedef uint16_t uhci_reg;
 #define UHCI_PORTSC_CONNECT_STATUS_CHG (1 << 1)                // R/WC
 #define UHCI_PORTSC_CONNECT_STATUS     (1 << 0)                // RO
 
+struct transfer_entry;
+
 struct uhci_dev {
 	uint16_t iobase;
 	struct frame_list_pointer *frame_list_base;
 	uint8_t portnum;
 	struct pci_dev *pci_dev;
-	struct queue_head *qh1ms;
-};
-
-struct usb_device {
-	bool low_speed;
-	uint8_t addr;
-	struct device_descriptor dev_desc;
-	struct configuration_descriptor *conf_desc;
+	struct queue_head *skel; // UHCI_SKEL_NUM skeleton QHs
+	struct transfer_descriptor *term_td;
+	bool fsbr;               // bandwidth reclamation enabled
+	uint16_t fsbr_pending;   // pending transfers on UHCI_QH_FSBR queues
+	// transfers in flight on this controller, in submission order
+	volatile struct transfer_entry *pending_head;
+	volatile struct transfer_entry *pending_tail;
+	bool polling;           // completions are found by the wait loops
+	bool irq_stuck;         // a completion was not acknowledged by the ISR
+	volatile uint32_t irqs; // interrupts handled
+	// retired entries whose handlers have not run yet
+	struct transfer_entry *volatile done_ring[UHCI_DONE_RING_SIZE];
+	volatile uint16_t done_head; // next slot to fill, written by uhci_retire
+	volatile uint16_t done_tail; // next slot to run, written by uhci_complete
+	volatile bool done_full;     // an entry was left pending on a full ring
+	uint8_t next_addr;           // next free USB device address
+	uint8_t devices_num;         // addressed devices
+	// descriptors of present devices and of detached ones with a serial
+	struct uhci_desc_cache *cache_head;
+#ifdef BENCH
+	bool isr_inline;    // run the handlers in the ISR as before the ring
+	uint64_t isr_max;   // longest uhci_isr run in TSC cycles
+	uint32_t tds_built; // TDs built for the enumeration of the devices
+#endif
+	struct uhci_dev *next;  // initialized controllers
 };
 
+// The TDs of an entry are a contiguous array from `first` to `last`
 struct transfer_entry {
 	struct transfer_descriptor *last;
 	struct transfer_descriptor *first;
+	struct queue_head *queue;
 	void (*handler)(struct transfer_entry *te);
 	void *userdata;
+	uint64_t deadline; // clock_ns() when the transfer is cancelled; 0 = never
+	bool timed_out;    // cancelled at the deadline
+	// the handler runs in uhci_retire, it must not allocate or wait
+	bool in_isr;
 	volatile struct transfer_entry *next;
 };
 
+// Strings cached per device: manufacturer, product, serial number and one more
+#define UHCI_CACHE_STRINGS 4
+
+/*
+ * Descriptors read from a device. An entry is found by the address of the
+ * present device. After a detach it is only found by the device descriptor
+ * (VID/PID/bcdDevice) and serial number, so a device that comes back does not
+ * read its configuration and strings again.
+ */
+struct uhci_desc_cache {
+	uint8_t addr; // address of the present device; 0 = detached
+	struct device_descriptor dev_desc;
+	struct configuration_descriptor *conf_desc; // NULL until read
+	bool lang_read;   // the language ID table was read
+	uint16_t lang_id; // first language ID; 0 = the device has no strings
+	uint8_t strings_idx[UHCI_CACHE_STRINGS]; // string index; 0 = free slot
+	struct string_descriptor *strings[UHCI_CACHE_STRINGS];
+	struct uhci_desc_cache *next;
+};
+
 const uhci_reg ports[2] = {UHCI_PORTSC1, UHCI_PORTSC2};
 
-static volatile struct transfer_entry *pending_queue = NULL;
+static struct uhci_dev *uhci_devs = NULL;
 
 uint32_t uhci_read_32(const struct uhci_dev *dev, const uhci_reg reg) {
 	return inl(dev->iobase + (uint16_t)reg);
@@ -393,35 +443,434 @@ void uhci_write_8(const struct uhci_dev *dev, const uhci_reg reg,
 	outb(dev->iobase + (uint16_t)reg, data);
 }
 
+/**
+ * Close the reclamation loop (term QH -> FS control QH) or break it
+ *
+ * @param dev controller
+ * @param on true to link the loop
+ */
+static void uhci_fsbr_link(struct uhci_dev *dev, bool on) {
+	if (on)
+		dev->skel[UHCI_SKEL_TERM].qhlp.pointer =
+		    UHCI_FLP_PTR(&dev->skel[UHCI_SKEL_FS_CONTROL]) | UHCI_FLP_QH;
+	else
+		dev->skel[UHCI_SKEL_TERM].qhlp.pointer = UHCI_FLP_TERM;
+}
+
+/**
+ * Remove an entry from the controller's pending list. Must be called with
+ * interrupts disabled or from the ISR.
+ *
+ * @param dev controller
+ * @param prev entry before `entry` or NULL if `entry` is the head
+ * @param entry entry to remove
+ */
+static void uhci_pending_remove(struct uhci_dev *dev,
+                                volatile struct transfer_entry *prev,
+                                volatile struct transfer_entry *entry) {
+	if (prev != NULL)
+		prev->next = entry->next;
+	else
+		dev->pending_head = entry->next;
+
+	if (dev->pending_tail == entry)
+		dev->pending_tail = prev;
+
+	// the queue tail TD is freed by the owner after the handler
+	if (entry->queue != NULL && entry->queue->tail == entry->last)
+		entry->queue->tail = NULL;
+
+	if (entry->queue != NULL && (entry->queue->flags & UHCI_QH_FSBR) != 0
+	    && --dev->fsbr_pending == 0)
+		uhci_fsbr_link(dev, false);
+
+	entry->next = NULL;
+}
+
+/**
+ * Check if the HC stopped the queue of an entry inside its TD array. The QH
+ * element pointer stays at a TD that failed, or with SPD set at a short TD,
+ * and the TDs after it are never run. A short TD without SPD is only passed
+ * by, the HC moves on to the next TD.
+ *
+ * @param entry scheduled entry
+ * @return true if the entry ended early with an error or a short packet
+ */
+static bool uhci_entry_stopped(volatile struct transfer_entry *entry) {
+	uint32_t qelp = entry->queue->qelp.pointer;
+	if ((qelp & UHCI_FLP_TERM) != 0)
+		return false;
+
+	struct transfer_descriptor *td = LINK_PTR_TO_TD(qelp);
+	if (td < entry->first || td > entry->last)
+		return false;
+
+	uint32_t status = td->ctrl_status;
+	return (status & UHCI_TD_STATUS_ACTIVE) == 0
+	       && ((status & UHCI_TD_STATUS_ERR_MASK) != 0
+	           || ((status & UHCI_TD_SPD) != 0
+	               && UHCI_TD_ACT_LEN(status)
+	                      < UHCI_TD_MAX_LEN_GET(td->token)));
+}
+
+/**
+ * Move the element pointer of an entry's QH past the entry's chain, if it
+ * points into it
+ *
+ * @param entry scheduled entry
+ */
+static void uhci_qh_skip(volatile struct transfer_entry *entry) {
+	uint32_t qelp = entry->queue->qelp.pointer;
+	uint32_t link = entry->last->link_ptr;
+	struct transfer_descriptor *td = LINK_PTR_TO_TD(qelp);
+
+	if ((qelp & UHCI_FLP_TERM) != 0 || td < entry->first || td > entry->last)
+		return;
+
+	entry->queue->qelp.pointer =
+	    (link & UHCI_TD_LPTR_TERM) ? UHCI_FLP_TERM : UHCI_FLP_PTR(link);
+}
+
+/**
+ * Move the finished entries of the pending list to the completion ring. Must
+ * be called with interrupts disabled or from the ISR.
+ *
+ * @param uhci_dev controller
+ */
+static void uhci_retire(struct uhci_dev *uhci_dev) {
+	volatile struct transfer_entry *prev_entry = NULL;
+	volatile struct transfer_entry *entry = uhci_dev->pending_head;
+
+	while (entry != NULL) {
+		volatile struct transfer_entry *next_entry = entry->next;
+		bool finished =
+		    entry->last != NULL
+		    && (entry->last->ctrl_status & UHCI_TD_STATUS_ACTIVE) == 0;
+		bool stopped = !finished && uhci_entry_stopped(entry);
+
+		if (!finished && !stopped) {
+			prev_entry = entry;
+			entry = next_entry;
+			continue;
+		}
+
+		// no room, the entry stays pending, but the periodic entries behind
+		// it are still handed over
+		uint16_t head = uhci_dev->done_head;
+		if (!entry->in_isr
+		    && (uint16_t)(head - uhci_dev->done_tail) == UHCI_DONE_RING_SIZE) {
+			uhci_dev->done_full = true;
+			prev_entry = entry;
+			entry = next_entry;
+			continue;
+		}
+
+		// The HC stopped the queue in the chain, skip the rest so the
+		// entries queued behind it run
+		if (stopped)
+			uhci_qh_skip(entry);
+
+		uhci_pending_remove(uhci_dev, prev_entry, entry);
+
+		// periodic transfers are handed over and re-armed right away, a
+		// re-armed entry is appended behind `next_entry`
+		if (entry->in_isr) {
+			entry->handler((struct transfer_entry *)entry);
+			entry = next_entry;
+			continue;
+		}
+
+#ifdef BENCH
+		if (uhci_dev->isr_inline) {
+			entry->handler((struct transfer_entry *)entry);
+			entry = next_entry;
+			continue;
+		}
+#endif
+
+		uhci_dev->done_ring[head % UHCI_DONE_RING_SIZE] =
+		    (struct transfer_entry *)entry;
+		// publish the slot before the index
+		__asm__ volatile("" ::: "memory");
+		uhci_dev->done_head = (uint16_t)(head + 1);
+
+		entry = next_entry;
+	}
+}
+
 bool uhci_isr(uint8_t int_n, void *userdata) {
 	(void)int_n;
 	struct uhci_dev *uhci_dev = (struct uhci_dev *)userdata;
-	volatile struct transfer_entry *prev_entry = NULL;
-	volatile struct transfer_entry *entry = pending_queue;
-	if (uhci_read_16(uhci_dev, UHCI_USBSTS) == 0) {
+#ifdef BENCH
+	uint64_t isr_start = clock_has_tsc() ? rdtsc() : 0;
+#endif
+	uint16_t status = uhci_read_16(uhci_dev, UHCI_USBSTS);
+
+	if ((status & UHCI_USBSTS_INT_MASK) == 0) {
 		// Not our INT
 		return false;
 	}
 
+	// acknowledge first, a completion during the walk raises a new interrupt
+	uhci_write_16(uhci_dev, UHCI_USBSTS, status & UHCI_USBSTS_INT_MASK);
+	uhci_dev->irqs++;
+
+	uhci_retire(uhci_dev);
+
+#ifdef BENCH
+	if (clock_has_tsc()) {
+		uint64_t cycles = rdtsc() - isr_start;
+		if (cycles > uhci_dev->isr_max)
+			uhci_dev->isr_max = cycles;
+	}
+#endif
+	return true;
+}
+
+/**
+ * Retire finished transfers without an interrupt
+ *
+ * @param dev controller
+ */
+static void uhci_poll(struct uhci_dev *dev) {
+	uint32_t eflags = irq_save();
+	uint16_t status = uhci_read_16(dev, UHCI_USBSTS) & UHCI_USBSTS_INT_MASK;
+
+	if (status != 0)
+		uhci_write_16(dev, UHCI_USBSTS, status);
+
+	uhci_retire(dev);
+	irq_restore(eflags);
+}
+
+/**
+ * Run the handlers of the retired entries in normal context
+ *
+ * @param dev controller
+ */
+static void uhci_complete(struct uhci_dev *dev) {
+	while (true) {
+		while (dev->done_tail != dev->done_head) {
+			uint16_t tail = dev->done_tail;
+			struct transfer_entry *entry =
+			    dev->done_ring[tail % UHCI_DONE_RING_SIZE];
+
+			// the handler may submit more work and refill the slot
+			dev->done_tail = (uint16_t)(tail + 1);
+			entry->handler(entry);
+		}
+
+		if (!dev->done_full)
+			return;
+
+		// retire what did not fit in the ring
+		dev->done_full = false;
+		uhci_poll(dev);
+	}
+}
+
+/**
+ * Switch a controller between interrupt and polled completion
+ *
+ * @param dev controller
+ * @param on true to poll
+ */
+static void uhci_set_polling(struct uhci_dev *dev, bool on) {
+	uint32_t eflags = irq_save();
+
+	dev->polling = on;
+	dev->irq_stuck = false;
+	uhci_write_16(dev, UHCI_USBINTR,
+	              on ? 0
+	                 : UHCI_USBINTR_SHORT_PKT_INT | UHCI_USBINTR_INT_ON_COMPLETE
+	                       | UHCI_USBINTR_RESUME_INT
+	                       | UHCI_USBINTR_CRC_TIMEOUT_INT);
+	irq_restore(eflags);
+}
+
+/**
+ * Busy wait until the HC moves to the next frame. After that the HC no longer
+ * holds a reference to anything unlinked from the schedule before the call.
+ *
+ * @param dev controller
+ */
+static void uhci_wait_frame(const struct uhci_dev *dev) {
+	uint16_t frnum = uhci_read_16(dev, UHCI_FRNUM);
+	uint16_t timeout = 20; // 20 * 100us (2ms)
+
+	while (timeout > 0 && uhci_read_16(dev, UHCI_FRNUM) == frnum) {
+		udelay(100);
+		timeout--;
+	}
+}
+
+/**
+ * Take a pending entry off the schedule before it completed. Its active TDs
+ * are marked inactive with a timeout error and the chain is unlinked from the
+ * QH and from the chain queued before it. The HC may still work on a TD it
+ * fetched until the end of the frame. Must be called with interrupts
+ * disabled.
+ *
+ * @param dev controller
+ * @param prev entry before `entry` in the pending list or NULL
+ * @param entry entry to cancel
+ */
+static void uhci_cancel(struct uhci_dev *dev,
+                        volatile struct transfer_entry *prev,
+                        volatile struct transfer_entry *entry) {
+	struct queue_head *queue = entry->queue;
+	struct transfer_descriptor *before = NULL;
+	struct transfer_descriptor *td = entry->first;
+
+	while (true) {
+		uint32_t status = td->ctrl_status;
+		if ((status & UHCI_TD_STATUS_ACTIVE) != 0)
+			td->ctrl_status = (status & ~(uint32_t)UHCI_TD_STATUS_ACTIVE)
+			                  | UHCI_TD_STATUS_CRC_TO;
+
+		if (td == entry->last)
+			break;
+		td = LINK_PTR_TO_TD(td->link_ptr);
+	}
+
+	for (volatile struct transfer_entry *e = dev->pending_head; e != NULL;
+	     e = e->next) {
+		uint32_t link = e->last->link_ptr;
+		if (e != entry && e->queue == queue && (link & UHCI_TD_LPTR_TERM) == 0
+		    && LINK_PTR_TO_TD(link) == entry->first)
+			before = e->last;
+	}
+
+	if (before != NULL)
+		before->link_ptr = entry->last->link_ptr;
+
+	uhci_qh_skip(entry);
+
+	bool was_tail = queue->tail == entry->last;
+	uhci_pending_remove(dev, prev, entry);
+	if (was_tail)
+		queue->tail = before;
+
+	entry->timed_out = true;
+}
+
+/**
+ * Cancel the pending entries that are past their deadline and run their
+ * handlers
+ *
+ * @param dev controller
+ */
+static void uhci_expire(struct uhci_dev *dev) {
+	volatile struct transfer_entry *expired = NULL;
+	volatile struct transfer_entry *prev_entry = NULL;
+	uint64_t now = clock_ns();
+	uint32_t eflags = irq_save();
+	volatile struct transfer_entry *entry = dev->pending_head;
+
 	while (entry != NULL) {
-		if (entry->last != NULL
-		    && (entry->last->ctrl_status & UHCI_TD_STATUS_ACTIVE) == 0) {
-			if (prev_entry != NULL) {
-				prev_entry->next = entry->next;
-			} else {
-				pending_queue = NULL;
-			}
-			volatile struct transfer_entry *next_entry = entry->next;
-			entry->handler((struct transfer_entry *)entry);
-			entry = next_entry;
+		volatile struct transfer_entry *next_entry = entry->next;
+
+		if (entry->deadline != 0 && now >= entry->deadline) {
+			uhci_cancel(dev, prev_entry, entry);
+			entry->next = expired;
+			expired = entry;
 		} else {
 			prev_entry = entry;
-			entry = entry->next;
 		}
+
+		entry = next_entry;
 	}
 
-	uhci_write_16(uhci_dev, UHCI_USBSTS, 0x1f);
-	return true;
+	irq_restore(eflags);
+
+	if (expired == NULL)
+		return;
+
+	// A TD fetched before the cancel may complete and advance the QH element
+	// pointer into the cancelled chain again
+	uhci_wait_frame(dev);
+
+	eflags = irq_save();
+	for (entry = expired; entry != NULL; entry = entry->next)
+		uhci_qh_skip(entry);
+	irq_restore(eflags);
+
+	while (expired != NULL) {
+		entry = expired;
+		expired = entry->next;
+		entry->next = NULL;
+
+		entry->handler((struct transfer_entry *)entry);
+	}
+}
+
+/**
+ * Wait for the next completion event. Called in a loop until the awaited
+ * transfer is retired.
+ *
+ * @param dev controller
+ * @param start clock_ns() when the wait started
+ */
+static void uhci_wait_step(struct uhci_dev *dev, uint64_t start) {
+	uhci_expire(dev);
+
+	if (dev->polling) {
+		uhci_poll(dev);
+		uhci_complete(dev);
+		__asm__ volatile("pause");
+		return;
+	}
+
+	// sti takes effect after hlt, an interrupt that fills the ring after the
+	// check still wakes it up
+	__asm__ volatile("cli" ::: "memory");
+	if (dev->done_tail == dev->done_head && !dev->done_full)
+		__asm__ volatile("sti\n\thlt" ::: "memory");
+	else
+		__asm__ volatile("sti" ::: "memory");
+
+	uhci_complete(dev);
+
+	if (clock_ns() - start < UHCI_IRQ_DEADLINE_MS * 1000000ull)
+		return;
+
+	// A NAKing device or a lost interrupt. The ISR clears USBSTS, a set bit
+	// that survives a timer tick was never delivered.
+	uint16_t status = uhci_read_16(dev, UHCI_USBSTS);
+	if ((status & (UHCI_USBSTS_USBINT | UHCI_USBSTS_USBERRINT)) == 0) {
+		dev->irq_stuck = false;
+		return;
+	}
+
+	if (!dev->irq_stuck) {
+		dev->irq_stuck = true;
+		return;
+	}
+
+	print_string("UHCI: no interrupt on line ");
+	print_string(itoa_once(dev->pci_dev->header.u.type00.interrupt_line, 10));
+	print_string(", polling\n");
+
+	uhci_set_polling(dev, true);
+	uhci_poll(dev);
+	uhci_complete(dev);
+}
+
+/**
+ * Wait until a flag set by a completion handler is true
+ *
+ * @param dev controller
+ * @param done flag to wait for
+ */
+static void uhci_wait_done(struct uhci_dev *dev, volatile bool *done) {
+	uint64_t start = clock_ns();
+
+	while (!*done)
+		uhci_wait_step(dev, start);
+}
+
+void uhci_wait(struct usb_device *dev, volatile bool *done) {
+	uhci_wait_done(dev->hc, done);
 }
 
 static bool is_UHCI_device(const struct pci_header *dev_header) {
@@ -438,10 +887,10 @@ static uint8_t uhci_reset(struct uhci_dev *dev) {
 	uhci_write_16(dev, UHCI_USBCMD, UHCI_USBCMD_HC_RESET);
 
 	// wait for host controller bit to reset
-	uint8_t timeout = 100; // 100 * 10 ms (1s)
+	uint16_t timeout = 10000; // 10000 * 100us (1s)
 	while (timeout > 0
 	       && (uhci_read_16(dev, UHCI_USBCMD) & UHCI_USBCMD_HC_RESET) != 0) {
-		sleep(10);
+		udelay(100);
 		timeout--;
 	}
 
@@ -464,38 +913,141 @@ static void uhci_init_frame_list(struct uhci_dev *dev) {
 	    sizeof(struct frame_list_pointer) * UHCI_FRAME_LIST_SIZE,
 	    UHCI_FRAME_LIST_ALIGN);
 
-	// more queues can be chanined for other timings
-	struct queue_head *qh1ms = memalloc_aligned(sizeof(struct queue_head), 16);
-	qh1ms->qhlp.pointer = UHCI_FLP_TERM;
-	qh1ms->qelp.pointer = UHCI_FLP_TERM;
-	dev->qh1ms = qh1ms;
+	struct queue_head *skel =
+	    memalloc_aligned(sizeof(struct queue_head) * UHCI_SKEL_NUM, 16);
+
+	for (uint8_t i = 0; i < UHCI_SKEL_NUM; ++i) {
+		skel[i].qelp.pointer = UHCI_FLP_TERM;
+		skel[i].tail = NULL;
+		skel[i].flags = 0;
+	}
+
+	// intN -> intN/2 -> ... -> int1 -> control -> bulk -> term
+	for (uint8_t i = 1; i < UHCI_SKEL_INT_NUM; ++i)
+		skel[UHCI_SKEL_INT(i)].qhlp.pointer =
+		    UHCI_FLP_PTR(&skel[UHCI_SKEL_INT(i - 1)]) | UHCI_FLP_QH;
+
+	skel[UHCI_SKEL_INT(0)].qhlp.pointer =
+	    UHCI_FLP_PTR(&skel[UHCI_SKEL_LS_CONTROL]) | UHCI_FLP_QH;
+	skel[UHCI_SKEL_LS_CONTROL].qhlp.pointer =
+	    UHCI_FLP_PTR(&skel[UHCI_SKEL_FS_CONTROL]) | UHCI_FLP_QH;
+	skel[UHCI_SKEL_FS_CONTROL].qhlp.pointer =
+	    UHCI_FLP_PTR(&skel[UHCI_SKEL_BULK]) | UHCI_FLP_QH;
+	skel[UHCI_SKEL_BULK].qhlp.pointer =
+	    UHCI_FLP_PTR(&skel[UHCI_SKEL_TERM]) | UHCI_FLP_QH;
+	skel[UHCI_SKEL_TERM].qhlp.pointer = UHCI_FLP_TERM;
+
+	skel[UHCI_SKEL_FS_CONTROL].flags = UHCI_QH_FSBR;
+	skel[UHCI_SKEL_BULK].flags = UHCI_QH_FSBR;
+
+	// Some PIIX controllers do not end the frame in a reclamation loop
+	// without any TD in it. The TD is never activated.
+	struct transfer_descriptor *term_td =
+	    memalloc_aligned(sizeof(struct transfer_descriptor), 16);
+	memfill(term_td, 0, sizeof(struct transfer_descriptor));
+	term_td->link_ptr = UHCI_TD_LPTR_TERM;
+	term_td->token = UHCI_TD_MAX_LEN(0x7ff) | UHCI_TD_DEV_ADDR(0x7f)
+	                 | UHCI_TD_PID_IN;
+	skel[UHCI_SKEL_TERM].qelp.pointer = UHCI_FLP_PTR(term_td);
+
+	dev->skel = skel;
+	dev->term_td = term_td;
+	dev->fsbr = UHCI_FSBR_DEFAULT;
+	dev->fsbr_pending = 0;
 
 	for (uint16_t i = 0; i < UHCI_FRAME_LIST_SIZE; ++i) {
-		flist[i].pointer = UHCI_FLP_PTR(qh1ms) | UHCI_FLP_QH;
+		// the number of trailing zeros selects the longest interval
+		uint8_t n = 0;
+		while (n < UHCI_SKEL_INT_NUM - 1 && (i & (1 << n)) == 0)
+			n++;
+
+		flist[i].pointer = UHCI_FLP_PTR(&skel[UHCI_SKEL_INT(n)]) | UHCI_FLP_QH;
 	}
 
-	dev->frame_list_base->pointer = UHCI_FRBASEADD_PTR(flist);
+	dev->frame_list_base = flist;
 
 	// set frame list base address
 	uhci_write_32(dev, UHCI_FRBASEADD, UHCI_FRBASEADD_PTR(flist));
 }
 
+/**
+ * Allocate an endpoint QH and link it after a skeleton QH
+ *
+ * @param dev controller
+ * @param skel_idx UHCI_SKEL_* index of the skeleton QH
+ * @return the new QH or NULL if the allocation failed
+ */
+static struct queue_head *uhci_create_qh(struct uhci_dev *dev,
+                                         uint8_t skel_idx) {
+	struct queue_head *skel = &dev->skel[skel_idx];
+	struct queue_head *qh = memalloc_aligned(sizeof(struct queue_head), 16);
+
+	if (qh == NULL)
+		return NULL;
+
+	qh->qelp.pointer = UHCI_FLP_TERM;
+	qh->tail = NULL;
+	qh->flags = skel->flags;
+	qh->qhlp.pointer = skel->qhlp.pointer;
+
+	// the HC sees either the old or the new link, both are valid
+	skel->qhlp.pointer = UHCI_FLP_PTR(qh) | UHCI_FLP_QH;
+
+	return qh;
+}
+
+static bool uhci_is_skel_qh(const struct uhci_dev *dev, uint32_t link) {
+	uint32_t ptr = UHCI_FLP_PTR(link);
+	return ptr >= (uint32_t)&dev->skel[0]
+	       && ptr < (uint32_t)&dev->skel[UHCI_SKEL_NUM];
+}
+
+/**
+ * Unlink an endpoint QH from the schedule and free it. The QH must have no
+ * pending transfers.
+ *
+ * @param dev controller
+ * @param qh QH returned by `uhci_create_qh`
+ */
+static void uhci_delete_qh(struct uhci_dev *dev, struct queue_head *qh) {
+	uint32_t qh_link = UHCI_FLP_PTR(qh) | UHCI_FLP_QH;
+
+	for (uint8_t i = 0; i < UHCI_SKEL_NUM; ++i) {
+		struct queue_head *prev = &dev->skel[i];
+
+		// endpoint QHs are between their skeleton QH and the next one
+		while (prev->qhlp.pointer != qh_link
+		       && (prev->qhlp.pointer & UHCI_FLP_TERM) == 0
+		       && !uhci_is_skel_qh(dev, prev->qhlp.pointer))
+			prev = (struct queue_head *)UHCI_FLP_PTR(prev->qhlp.pointer);
+
+		if (prev->qhlp.pointer == qh_link) {
+			prev->qhlp.pointer = qh->qhlp.pointer;
+			break;
+		}
+	}
+
+	uhci_wait_frame(dev);
+	memfree(qh);
+}
+
 static bool uhci_enable_device_on_port(const struct uhci_dev *dev,
                                        const uhci_reg port) {
-	uint16_t timeout = 10;
+	uint16_t timeout = 1000; // 1000 * 100us (100ms)
 	uint16_t regval = uhci_read_16(dev, port);
 	// do not clear the Status Change bit yet
 	regval &= (uint16_t)~(UHCI_PORTSC_CONNECT_STATUS_CHG);
 
+	// USB 2.0 spec 7.1.7.5: TDRSTR, root port reset is at least 50ms
 	uhci_write_16(dev, port, regval | UHCI_PORTSC_RESET);
-	sleep(100);
+	sleep(50);
 
 	uhci_write_16(dev, port, regval & (uint16_t)~(UHCI_PORTSC_RESET));
-	sleep(50);
+	udelay(10);
 
 	uhci_write_16(dev, port, regval | UHCI_PORTSC_PORT_ENABLE);
 	while (timeout != 0) {
-		sleep(10);
+		udelay(100);
 		if ((uhci_read_16(dev, port) & UHCI_PORTSC_PORT_ENABLE) != 0)
 			break;
 
@@ -513,33 +1065,61 @@ static bool uhci_enable_device_on_port(const struct uhci_dev *dev,
 	// clear Status Change bit
 	regval = uhci_read_16(dev, port);
 	uhci_write_16(dev, port, regval);
+
+	// USB 2.0 spec 7.1.7.5: TRSTRCY, reset recovery time
+	sleep(10);
 	return true;
 }
 
-static void uhci_schedule_queue(struct queue_head *queue,
-                                struct transfer_entry *transfer_entry) {
-	uint32_t endptr = queue->qelp.pointer;
-	volatile struct transfer_entry *te = pending_queue;
+/**
+ * Append an entry to the pending list and link its TD chain at the end of a
+ * queue
+ *
+ * @param dev controller
+ * @param queue endpoint QH
+ * @param transfer_entry entry with its chain and handler set
+ * @param timeout_ms the entry is cancelled if it is not retired in time;
+ * 0 = never
+ */
+static void uhci_schedule_queue(struct uhci_dev *dev, struct queue_head *queue,
+                                struct transfer_entry *transfer_entry,
+                                uint32_t timeout_ms) {
+	transfer_entry->deadline =
+	    timeout_ms != 0 ? clock_ns() + timeout_ms * 1000000ull : 0;
+	transfer_entry->timed_out = false;
 
-	if (te) {
-		while (te->next != NULL) {
-			te = te->next;
-		}
-		te->next = transfer_entry;
-	} else {
-		pending_queue = transfer_entry;
-	}
+	uint32_t eflags = irq_save();
 
-	if (endptr & UHCI_TD_LPTR_TERM) {
-		queue->qelp.pointer = UHCI_FLP_PTR(transfer_entry->first);
-		return;
-	}
+	transfer_entry->queue = queue;
+	transfer_entry->next = NULL;
+
+	if (dev->pending_tail != NULL)
+		dev->pending_tail->next = transfer_entry;
+	else
+		dev->pending_head = transfer_entry;
+	dev->pending_tail = transfer_entry;
+
+	if ((queue->flags & UHCI_QH_FSBR) != 0 && dev->fsbr_pending++ == 0
+	    && dev->fsbr)
+		uhci_fsbr_link(dev, true);
+
+	struct transfer_descriptor *tail = queue->tail;
+	queue->tail = transfer_entry->last;
 
-	while (!(LINK_PTR_TO_TD(endptr)->link_ptr & UHCI_TD_LPTR_TERM)) {
-		endptr = LINK_PTR_TO_TD(endptr)->link_ptr;
+	if (tail == NULL || (queue->qelp.pointer & UHCI_FLP_TERM) != 0) {
+		queue->qelp.pointer = UHCI_FLP_PTR(transfer_entry->first);
+	} else {
+		tail->link_ptr =
+		    UHCI_TD_LPTR_PTR(transfer_entry->first) | UHCI_TD_LPTR_DEPTH;
+
+		// The HC may have retired the old tail before it saw the new link
+		if ((queue->qelp.pointer & UHCI_FLP_TERM) != 0
+		    && (transfer_entry->first->ctrl_status & UHCI_TD_STATUS_ACTIVE)
+		           != 0)
+			queue->qelp.pointer = UHCI_FLP_PTR(transfer_entry->first);
 	}
 
-	LINK_PTR_TO_TD(endptr)->link_ptr = UHCI_FLP_PTR(transfer_entry->first);
+	irq_restore(eflags);
 }
 
 static bool uhci_print_td_status(const struct transfer_descriptor *td) {
@@ -584,14 +1164,6 @@ static bool uhci_print_td_status(const struct transfer_descriptor *td) {
 	return is_ok;
 }
 
-static bool uhci_wait_entry_complete(struct transfer_entry *te) {
-	while (*((bool *)te->userdata) == false) {
-		__asm__("hlt");
-	}
-
-	return true;
-}
-
 static uint16_t uhci_create_td_control(struct transfer_descriptor **out_td,
                                        const struct usb_device *dev,
                                        uint8_t request_type, uint8_t request,
@@ -600,7 +1172,8 @@ static uint16_t uhci_create_td_control(struct transfer_descriptor **out_td,
                                        uint8_t status_stage, void *buf) {
 	bool toggle = true;
 	uint16_t td_cnt = 2;
-	uint16_t max_pkt_size = dev->dev_desc.max_packet_size;
+	uint16_t max_pkt_size = dev->ep0_max_packet;
+	uint16_t left = length;
 	struct device_request *dr = memalloc(sizeof(struct device_request));
 
 	dr->request_type = request_type;
@@ -609,13 +1182,14 @@ static uint16_t uhci_create_td_control(struct transfer_descriptor **out_td,
 	dr->index = index;
 	dr->length = length;
 
-	if (max_pkt_size < 8)
-		max_pkt_size = 8;
-
 	td_cnt += (uint16_t)DIV_CEIL(length, max_pkt_size);
 
 	*out_td = memalloc_aligned(sizeof(struct transfer_descriptor) * td_cnt, 16);
 
+#ifdef BENCH
+	dev->hc->tds_built += td_cnt;
+#endif
+
 	(*out_td)[0].link_ptr =
 	    UHCI_TD_LPTR_PTR(&(*out_td)[1]) | UHCI_TD_LPTR_DEPTH;
 	(*out_td)[0].ctrl_status = UHCI_TD_ERR_CNT(3)
@@ -629,12 +1203,14 @@ static uint16_t uhci_create_td_control(struct transfer_descriptor **out_td,
 	(*out_td)[0].swdata[0] = 1;
 
 	for (uint16_t i = 0; i < td_cnt - 2; ++i) {
+		uint16_t pkt_len = left > max_pkt_size ? max_pkt_size : left;
+
 		(*out_td)[i + 1].link_ptr =
 		    UHCI_TD_LPTR_PTR(&(*out_td)[i + 2]) | UHCI_TD_LPTR_DEPTH;
 		(*out_td)[i + 1].ctrl_status =
 		    UHCI_TD_ERR_CNT(3) | (dev->low_speed ? UHCI_TD_LOW_SPEED : 0)
 		    | UHCI_TD_STATUS_ACTIVE;
-		(*out_td)[i + 1].token = UHCI_TD_MAX_LEN(max_pkt_size - 1)
+		(*out_td)[i + 1].token = UHCI_TD_MAX_LEN(pkt_len - 1)
 		                         | UHCI_TD_DEV_ADDR(dev->addr) | data_stage;
 		(*out_td)[i + 1].buffer_ptr = (uint32_t)buf;
 		(*out_td)[i + 1].swdata[0] = i + 1;
@@ -643,7 +1219,8 @@ static uint16_t uhci_create_td_control(struct transfer_descriptor **out_td,
 			(*out_td)[i + 1].token |= UHCI_TD_DATA_TOGGLE;
 
 		toggle = !toggle;
-		buf = (uint8_t *)(buf) + max_pkt_size;
+		buf = (uint8_t *)(buf) + pkt_len;
+		left = (uint16_t)(left - pkt_len);
 	}
 
 	(*out_td)[td_cnt - 1].link_ptr = UHCI_TD_LPTR_TERM;
@@ -688,15 +1265,79 @@ static void uhci_delete_td_control(struct transfer_descriptor **td) {
 	*td = NULL;
 }
 
-static void uhci_callback_trans_end(struct transfer_entry *te) {
-	struct transfer_descriptor *td = te->first;
-	while (td != te->last) {
-		if (td->ctrl_status & UHCI_TD_STATUS_MASK) {
+/**
+ * Classify how a retired entry ended
+ *
+ * @param entry retired entry
+ * @return UHCI_XFER_* code
+ */
+static uint8_t uhci_entry_error(const struct transfer_entry *entry) {
+	const struct transfer_descriptor *td = entry->first;
+
+	if (entry->timed_out)
+		return UHCI_XFER_TIMEOUT;
+
+	while (true) {
+		uint32_t status = td->ctrl_status;
+
+		// the chain ended early on a short packet
+		if ((status & UHCI_TD_STATUS_ACTIVE) != 0)
+			return UHCI_XFER_OK;
+		if ((status & UHCI_TD_STATUS_STALLED) != 0)
+			return UHCI_XFER_STALL;
+		if ((status & UHCI_TD_STATUS_ERR_MASK) != 0)
+			return UHCI_XFER_ERROR;
+
+		if (td == entry->last)
+			return UHCI_XFER_OK;
+		td = LINK_PTR_TO_TD(td->link_ptr);
+	}
+}
+
+static void uhci_callback_trans_end(struct transfer_entry *te) {
+	struct transfer_descriptor *td = te->first;
+	while (!te->timed_out && td != te->last) {
+		if (td->ctrl_status & UHCI_TD_STATUS_ERR_MASK) {
 			uhci_print_td_status(td);
 		}
 		td = LINK_PTR_TO_TD(td->link_ptr);
 	}
-	*((bool *)te->userdata) = true;
+	*((volatile bool *)te->userdata) = true;
+}
+
+/**
+ * Schedule a control TD chain on the default pipe of a device and wait for
+ * its completion. The result is stored in `udev->error`.
+ *
+ * @param dev controller
+ * @param udev device
+ * @param first first TD of the chain
+ * @param last last TD of the chain
+ * @return true if the transfer completed without error
+ */
+static bool uhci_run_td_chain(struct uhci_dev *dev, struct usb_device *udev,
+                              struct transfer_descriptor *first,
+                              struct transfer_descriptor *last) {
+	volatile bool done = false;
+	struct transfer_entry *entry = memalloc(sizeof(struct transfer_entry));
+	memfill(entry, 0, sizeof(struct transfer_entry));
+	entry->first = first;
+	entry->last = last;
+	entry->handler = &uhci_callback_trans_end;
+	entry->userdata = (void *)&done;
+	uhci_schedule_queue(dev, udev->ctrl_qh, entry, UHCI_CONTROL_TIMEOUT_MS);
+
+	uhci_wait_done(dev, &done);
+	udev->error = uhci_entry_error(entry);
+	memfree(entry);
+
+	if (udev->error == UHCI_XFER_TIMEOUT) {
+		print_string("UHCI control transfer timed out on device ");
+		print_string(itoa_once(udev->addr, 10));
+		print_string("\n");
+	}
+
+	return udev->error == UHCI_XFER_OK;
 }
 
 static bool uhci_read_dev_desc(struct uhci_dev *dev, struct usb_device *udev,
@@ -708,17 +1349,7 @@ static bool uhci_read_dev_desc(struct uhci_dev *dev, struct usb_device *udev,
 	    uhci_create_td_control_in(&td, udev, UHCI_DR_REQ_GET_DESCRIPTOR,
 	                              UHCI_DR_VAL_DESC_DEVICE, 0, 18, dev_desc);
 
-	bool done = false;
-	struct transfer_entry *entry = memalloc(sizeof(struct transfer_entry));
-	entry->first = td;
-	entry->last = &td[ntd - 1];
-	entry->handler = &uhci_callback_trans_end;
-	entry->userdata = &done;
-	entry->next = NULL;
-	uhci_schedule_queue(dev->qh1ms, entry);
-
-	result = uhci_wait_entry_complete(entry);
-	memfree(entry);
+	result = uhci_run_td_chain(dev, udev, td, &td[ntd - 1]);
 
 	uhci_delete_td_control(&td);
 
@@ -736,17 +1367,7 @@ static bool uhci_read_dev_desc_maxpkg(struct uhci_dev *dev,
 	    &td, udev, UHCI_DR_REQ_GET_DESCRIPTOR, UHCI_DR_VAL_DESC_DEVICE, 0,
 	    udev->low_speed ? 8 : 8, dev_desc);
 
-	bool done = false;
-	struct transfer_entry *entry = memalloc(sizeof(struct transfer_entry));
-	entry->first = td;
-	entry->last = &td[ntd - 1];
-	entry->handler = &uhci_callback_trans_end;
-	entry->userdata = &done;
-	entry->next = NULL;
-	uhci_schedule_queue(dev->qh1ms, entry);
-
-	result = uhci_wait_entry_complete(entry);
-	memfree(entry);
+	result = uhci_run_td_chain(dev, udev, td, &td[ntd - 1]);
 
 	uhci_delete_td_control(&td);
 
@@ -760,17 +1381,7 @@ static bool uhci_set_device_address(struct uhci_dev *dev,
 
 	uint16_t ntd = uhci_create_td_control_out(
 	    &td, udev, UHCI_DR_REQ_SET_ADDRESS, addr, 0, 0, 0);
-	bool done = false;
-	struct transfer_entry *entry = memalloc(sizeof(struct transfer_entry));
-	entry->first = td;
-	entry->last = &td[ntd - 1];
-	entry->handler = &uhci_callback_trans_end;
-	entry->userdata = &done;
-	entry->next = NULL;
-	uhci_schedule_queue(dev->qh1ms, entry);
-
-	result = uhci_wait_entry_complete(entry);
-	memfree(entry);
+	result = uhci_run_td_chain(dev, udev, td, &td[ntd - 1]);
 	if (result) {
 		udev->addr = addr;
 	}
@@ -780,27 +1391,20 @@ static bool uhci_set_device_address(struct uhci_dev *dev,
 	return result;
 }
 
-bool uhci_read_string_desc(struct uhci_dev *dev, struct usb_device *udev,
-                           uint8_t index, struct string_descriptor **sdesc) {
+static bool uhci_read_string_desc(struct uhci_dev *dev,
+                                  struct usb_device *udev, uint8_t index,
+                                  struct string_descriptor **sdesc) {
+	uint16_t lang = udev->cache != NULL ? udev->cache->lang_id : 0;
 	uint8_t desc_len = 0;
 	struct transfer_descriptor *td = NULL;
 	bool result = true;
 
 	uint16_t ntd = uhci_create_td_control_in(
 	    &td, udev, UHCI_DR_REQ_GET_DESCRIPTOR, UHCI_DR_VAL_DESC_STRING | index,
-	    0, 1, &desc_len);
+	    lang, 1, &desc_len);
 
-	bool done = false;
-	struct transfer_entry *entry = memalloc(sizeof(struct transfer_entry));
-	entry->first = td;
-	entry->last = &td[ntd - 1];
-	entry->handler = &uhci_callback_trans_end;
-	entry->userdata = &done;
-	entry->next = NULL;
-	uhci_schedule_queue(dev->qh1ms, entry);
-	result = uhci_wait_entry_complete(entry);
-	memfree(entry);
-	if (!result) {
+	result = uhci_run_td_chain(dev, udev, td, &td[ntd - 1]);
+	if (!result || desc_len < 2) {
 		goto exit_error;
 	}
 
@@ -810,19 +1414,10 @@ bool uhci_read_string_desc(struct uhci_dev *dev, struct usb_device *udev,
 	memfill(*sdesc, 0, desc_len);
 
 	ntd = uhci_create_td_control_in(&td, udev, UHCI_DR_REQ_GET_DESCRIPTOR,
-	                                UHCI_DR_VAL_DESC_STRING | index, 0,
+	                                UHCI_DR_VAL_DESC_STRING | index, lang,
 	                                desc_len, *sdesc);
 
-	done = false;
-	entry = memalloc(sizeof(struct transfer_entry));
-	entry->first = td;
-	entry->last = &td[ntd - 1];
-	entry->handler = &uhci_callback_trans_end;
-	entry->userdata = &done;
-	entry->next = NULL;
-	uhci_schedule_queue(dev->qh1ms, entry);
-	result = uhci_wait_entry_complete(entry);
-	memfree(entry);
+	result = uhci_run_td_chain(dev, udev, td, &td[ntd - 1]);
 	if (!result) {
 		memfree(*sdesc);
 		*sdesc = NULL;
@@ -840,6 +1435,1199 @@ exit:
 	return result;
 }
 
+/**
+ * Read the language ID table of a device once and keep its first entry for
+ * the string requests
+ *
+ * @param dev controller
+ * @param udev addressed device with a cache entry
+ * @return true if the device has strings
+ */
+static bool uhci_cache_lang(struct uhci_dev *dev, struct usb_device *udev) {
+	struct uhci_desc_cache *cache = udev->cache;
+	struct string_descriptor *langs = NULL;
+
+	if (cache->lang_read)
+		return cache->lang_id != 0;
+
+	// string index 0 is the table of the supported language IDs
+	if (uhci_read_string_desc(dev, udev, 0, &langs)) {
+		if (langs->length >= 4)
+			cache->lang_id = langs->string[0];
+		memfree(langs);
+		cache->lang_read = true;
+	} else if (udev->error != UHCI_XFER_TIMEOUT) {
+		// a device without strings stalls the request
+		cache->lang_read = true;
+	}
+
+	return cache->lang_id != 0;
+}
+
+static struct string_descriptor *
+uhci_cache_string(const struct uhci_desc_cache *cache, uint8_t index) {
+	if (index == 0)
+		return NULL;
+
+	for (uint8_t i = 0; i < UHCI_CACHE_STRINGS; ++i) {
+		if (cache->strings_idx[i] == index)
+			return cache->strings[i];
+	}
+
+	return NULL;
+}
+
+const struct string_descriptor *uhci_get_string(struct usb_device *udev,
+                                                uint8_t index) {
+	struct uhci_desc_cache *cache = udev->cache;
+	struct string_descriptor *sdesc = NULL;
+
+	if (index == 0 || cache == NULL)
+		return NULL;
+
+	// a string that was read is a memory read from now on
+	sdesc = uhci_cache_string(cache, index);
+	if (sdesc != NULL)
+		return sdesc;
+
+	for (uint8_t i = 0; i < UHCI_CACHE_STRINGS; ++i) {
+		if (cache->strings_idx[i] != 0)
+			continue;
+
+		if (!uhci_cache_lang(udev->hc, udev)
+		    || !uhci_read_string_desc(udev->hc, udev, index, &sdesc))
+			return NULL;
+
+		cache->strings_idx[i] = index;
+		cache->strings[i] = sdesc;
+		return sdesc;
+	}
+
+	return NULL;
+}
+
+static bool uhci_same_bytes(const void *a, const void *b, uint32_t len) {
+	const uint8_t *pa = a;
+	const uint8_t *pb = b;
+
+	for (uint32_t i = 0; i < len; ++i) {
+		if (pa[i] != pb[i])
+			return false;
+	}
+
+	return true;
+}
+
+static void uhci_cache_free(struct uhci_desc_cache *cache) {
+	for (uint8_t i = 0; i < UHCI_CACHE_STRINGS; ++i)
+		memfree(cache->strings[i]);
+
+	memfree(cache->conf_desc);
+	memfree(cache);
+}
+
+/**
+ * Find the cache entry of a device whose device descriptor was just read. A
+ * present device set up again keeps its entry. A detached device is recognised
+ * by its device descriptor and serial number. Other devices get a new entry.
+ *
+ * @param dev controller
+ * @param udev addressed device
+ */
+static void uhci_cache_bind(struct uhci_dev *dev, struct usb_device *udev) {
+	struct uhci_desc_cache *cache = NULL;
+	uint8_t serial_idx = udev->dev_desc.serial_number_idx;
+
+	for (cache = dev->cache_head; cache != NULL; cache = cache->next) {
+		if (cache->addr == udev->addr
+		    && uhci_same_bytes(&cache->dev_desc, &udev->dev_desc,
+		                       sizeof(udev->dev_desc))) {
+			udev->cache = cache;
+			return;
+		}
+	}
+
+	cache = memalloc(sizeof(struct uhci_desc_cache));
+	memfill(cache, 0, sizeof(struct uhci_desc_cache));
+	cache->addr = udev->addr;
+	cache->dev_desc = udev->dev_desc;
+	udev->cache = cache;
+
+	const struct string_descriptor *serial = uhci_get_string(udev, serial_idx);
+
+	for (struct uhci_desc_cache *old = dev->cache_head;
+	     serial != NULL && old != NULL; old = old->next) {
+		const struct string_descriptor *old_serial =
+		    uhci_cache_string(old, serial_idx);
+
+		if (old->addr != 0 || old_serial == NULL
+		    || old_serial->length != serial->length
+		    || !uhci_same_bytes(&old->dev_desc, &udev->dev_desc,
+		                        sizeof(udev->dev_desc))
+		    || !uhci_same_bytes(old_serial, serial, serial->length))
+			continue;
+
+		uhci_cache_free(cache);
+		old->addr = udev->addr;
+		udev->cache = old;
+		return;
+	}
+
+	cache->next = dev->cache_head;
+	dev->cache_head = cache;
+}
+
+/**
+ * Drop the address of a device from its cache entry. The entry is kept only
+ * if the device has a serial number, without one it could not be told apart
+ * from another device of the same kind.
+ *
+ * @param dev controller
+ * @param udev device that goes away
+ */
+static void uhci_cache_unbind(struct uhci_dev *dev, struct usb_device *udev) {
+	struct uhci_desc_cache *cache = udev->cache;
+
+	if (cache == NULL)
+		return;
+
+	udev->cache = NULL;
+	udev->conf_desc = NULL;
+	cache->addr = 0;
+
+	if (uhci_cache_string(cache, cache->dev_desc.serial_number_idx) != NULL)
+		return;
+
+	struct uhci_desc_cache **link = &dev->cache_head;
+	while (*link != NULL && *link != cache)
+		link = &(*link)->next;
+
+	if (*link != NULL)
+		*link = cache->next;
+
+	uhci_cache_free(cache);
+}
+
+static bool uhci_read_config_desc(struct uhci_dev *dev,
+                                  struct usb_device *udev) {
+	struct configuration_descriptor header;
+	struct transfer_descriptor *td = NULL;
+	bool result = true;
+
+	// read the header first to get the total length
+	uint16_t ntd = uhci_create_td_control_in(
+	    &td, udev, UHCI_DR_REQ_GET_DESCRIPTOR, UHCI_DR_VAL_DESC_CONFIGURATION,
+	    0, sizeof(header), &header);
+	result = uhci_run_td_chain(dev, udev, td, &td[ntd - 1]);
+	uhci_delete_td_control(&td);
+
+	if (!result || header.total_length < sizeof(header))
+		return false;
+
+	struct configuration_descriptor *conf = memalloc(header.total_length);
+	memfill(conf, 0, header.total_length);
+
+	ntd = uhci_create_td_control_in(&td, udev, UHCI_DR_REQ_GET_DESCRIPTOR,
+	                                UHCI_DR_VAL_DESC_CONFIGURATION, 0,
+	                                header.total_length, conf);
+	result = uhci_run_td_chain(dev, udev, td, &td[ntd - 1]);
+	uhci_delete_td_control(&td);
+
+	if (!result) {
+		memfree(conf);
+		return false;
+	}
+
+	udev->cache->conf_desc = conf;
+	return true;
+}
+
+/**
+ * Build the interface and endpoint tables of the default alternate settings
+ * in one pass over the configuration descriptor
+ *
+ * @param udev device with `conf_desc` read
+ */
+static void uhci_parse_config(struct usb_device *udev) {
+	const uint8_t *conf = (const uint8_t *)udev->conf_desc;
+	uint16_t total = udev->conf_desc->total_length;
+	uint16_t off = udev->conf_desc->length;
+	struct uhci_interface *cur = NULL; // NULL in an alternate setting
+
+	udev->interfaces_num = 0;
+	udev->endpoints_num = 0;
+	memfill(udev->endpoint_idx, 0, sizeof(udev->endpoint_idx));
+
+	while (off + sizeof(struct descriptor) <= total) {
+		const struct descriptor *desc = (const struct descriptor *)&conf[off];
+
+		if (desc->length < sizeof(struct descriptor)
+		    || off + desc->length > total)
+			break;
+
+		if (desc->desc_type == (UHCI_DR_VAL_DESC_INTERFACE >> 8)
+		    && desc->length >= sizeof(struct interface_descriptor)) {
+			const struct interface_descriptor *iface =
+			    (const struct interface_descriptor *)desc;
+
+			cur = NULL;
+			if (iface->alternate_setting == 0
+			    && udev->interfaces_num < UHCI_MAX_INTERFACES) {
+				cur = &udev->interfaces[udev->interfaces_num++];
+				cur->number = iface->interface_num;
+				cur->class_code = iface->interface_class;
+				cur->sub_class = iface->interface_sub_class;
+				cur->protocol = iface->interface_protocol;
+				cur->endpoints_first = udev->endpoints_num;
+				cur->endpoints_num = 0;
+			}
+		} else if (desc->desc_type == (UHCI_DR_VAL_DESC_ENDPOINT >> 8)
+		           && desc->length >= sizeof(struct endpoint_descriptor)
+		           && cur != NULL
+		           && udev->endpoints_num < UHCI_MAX_ENDPOINTS) {
+			const struct endpoint_descriptor *epd =
+			    (const struct endpoint_descriptor *)desc;
+			struct uhci_endpoint *ep = &udev->endpoints[udev->endpoints_num++];
+
+			ep->address = epd->endpoint_address;
+			ep->attributes = epd->attributes;
+			ep->max_packet_size = epd->max_packet_size & 0x7ff;
+			ep->interval = epd->interval;
+			ep->toggle = false;
+			ep->qh = NULL;
+			cur->endpoints_num++;
+
+			udev->endpoint_idx[UHCI_EP_IDX(ep->address)] =
+			    udev->endpoints_num;
+		}
+
+		off = (uint16_t)(off + desc->length);
+	}
+}
+
+static bool uhci_set_configuration(struct uhci_dev *dev,
+                                   struct usb_device *udev, uint8_t value) {
+	struct transfer_descriptor *td = NULL;
+	bool result = true;
+
+	uint16_t ntd = uhci_create_td_control_out(
+	    &td, udev, UHCI_DR_REQ_SET_CONFIGURATION, value, 0, 0, 0);
+	result = uhci_run_td_chain(dev, udev, td, &td[ntd - 1]);
+
+	uhci_delete_td_control(&td);
+
+	return result;
+}
+
+/**
+ * Select the interrupt skeleton QH that polls an endpoint at least as often as
+ * its bInterval asks for
+ *
+ * @param interval bInterval in ms
+ * @return UHCI_SKEL_INT index
+ */
+static uint8_t uhci_int_skel(uint8_t interval) {
+	uint8_t n = 0;
+
+	while (n < UHCI_SKEL_INT_NUM - 1 && (2u << n) <= interval)
+		n++;
+
+	return UHCI_SKEL_INT(n);
+}
+
+/**
+ * Read the first configuration, select it, and create the queues of its bulk
+ * and interrupt endpoints
+ *
+ * @param dev controller
+ * @param udev addressed device
+ * @return true if the device is configured
+ */
+static bool uhci_configure_device(struct uhci_dev *dev,
+                                  struct usb_device *udev) {
+	// a device seen before has its configuration in the cache
+	if (udev->cache->conf_desc == NULL && !uhci_read_config_desc(dev, udev))
+		return false;
+
+	udev->conf_desc = udev->cache->conf_desc;
+	uhci_parse_config(udev);
+
+	if (!uhci_set_configuration(dev, udev,
+	                            udev->conf_desc->configuration_value))
+		return false;
+
+	for (uint8_t i = 0; i < udev->endpoints_num; ++i) {
+		struct uhci_endpoint *ep = &udev->endpoints[i];
+
+		if ((ep->attributes & UHCI_EP_ATTR_TYPE_MASK) == UHCI_EP_ATTR_BULK)
+			ep->qh = uhci_create_qh(dev, UHCI_SKEL_BULK);
+		else if ((ep->attributes & UHCI_EP_ATTR_TYPE_MASK)
+		         == UHCI_EP_ATTR_INTERRUPT)
+			ep->qh = uhci_create_qh(dev, uhci_int_skel(ep->interval));
+	}
+
+	return true;
+}
+
+static struct uhci_endpoint *uhci_find_endpoint(struct usb_device *udev,
+                                                uint8_t endpoint, uint8_t dir) {
+	uint8_t address = (endpoint & UHCI_EP_ADDR_NUM_MASK)
+	                  | (dir == UHCI_DIR_IN ? UHCI_EP_ADDR_IN : 0);
+	uint8_t idx = udev->endpoint_idx[UHCI_EP_IDX(address)];
+
+	return idx != 0 ? &udev->endpoints[idx - 1] : NULL;
+}
+
+bool uhci_control_transfer(struct usb_device *dev, uint8_t request_type,
+                           uint8_t request, uint16_t value, uint16_t index,
+                           uint16_t length, void *buf) {
+	struct transfer_descriptor *td = NULL;
+	bool dev_host = (request_type & UHCI_DR_RT_XDIR_DEV_HOST) != 0;
+
+	uint16_t ntd = uhci_create_td_control(
+	    &td, dev, request_type, request, value, index, length,
+	    dev_host ? UHCI_TD_PID_IN : UHCI_TD_PID_OUT,
+	    dev_host ? UHCI_TD_PID_OUT : UHCI_TD_PID_IN, buf);
+
+	bool result = uhci_run_td_chain(dev->hc, dev, td, &td[ntd - 1]);
+
+	uhci_delete_td_control(&td);
+
+	return result;
+}
+
+bool uhci_clear_halt(struct usb_device *dev, uint8_t endpoint, uint8_t dir) {
+	struct uhci_endpoint *ep = uhci_find_endpoint(dev, endpoint, dir);
+
+	if (ep == NULL)
+		return false;
+
+	// the halt is cleared by the device, the toggle restarts with DATA0
+	ep->toggle = false;
+
+	return uhci_control_transfer(
+	    dev,
+	    UHCI_DR_RT_XDIR_HOST_DEV | UHCI_DR_RT_TYPE_STANDARD
+	        | UHCI_DR_RT_RECIPIENT_ENDPOINT,
+	    UHCI_DR_REQ_CLEAR_FEATURE, UHCI_DR_FEAT_ENDPOINT_HALT, ep->address, 0,
+	    NULL);
+}
+
+/*
+ * A bulk transfer is described by a scatter/gather list and the TDs point
+ * straight into its entries. Only a packet that straddles two entries goes
+ * through a bounce slot of max packet size, gathered before an OUT transfer
+ * and scattered after an IN transfer.
+ */
+struct uhci_bounce {
+	uint16_t td;     // index of the bounced TD
+	uint8_t sg_idx;  // start of the packet in the list
+	uint32_t sg_off;
+};
+
+struct uhci_bulk_xfer {
+	struct transfer_entry entry;
+	struct usb_device *dev;
+	struct uhci_endpoint *ep;
+	uint8_t dir;
+	struct transfer_descriptor *td;
+	uint16_t ntd;
+	bool start_toggle;
+	volatile bool done;
+	void (*callback)(struct uhci_bulk_xfer *xfer, void *userdata);
+	void *userdata;
+	struct sg_entry sg[SG_MAX];
+	uint8_t sg_num;
+	uint8_t bounce_num;
+	uint8_t *bounce_buf; // (sg_num - 1) slots, allocated on the first bounce
+	struct uhci_bounce bounce[SG_MAX];
+};
+
+/**
+ * Copy between a bounce slot and the scatter/gather entries it stands for
+ *
+ * @param sg list
+ * @param idx entry where the packet starts
+ * @param off offset of the packet in the entry
+ * @param slot bounce slot
+ * @param len number of bytes
+ * @param gather true to copy into the slot; false to copy out of it
+ */
+static void uhci_bounce_copy(const struct sg_entry *sg, uint8_t idx,
+                             uint32_t off, uint8_t *slot, uint32_t len,
+                             bool gather) {
+	while (len > 0) {
+		uint32_t part = sg[idx].len - off;
+		uint8_t *pos = (uint8_t *)sg[idx].buf + off;
+
+		if (part > len)
+			part = len;
+
+		if (gather)
+			memcopy(slot, pos, part);
+		else
+			memcopy(pos, slot, part);
+
+		slot += part;
+		len -= part;
+		++idx;
+		off = 0;
+	}
+}
+
+/**
+ * Create the TD array of a bulk transfer from its scatter/gather list.
+ * Toggles start from the endpoint's current toggle, IN TDs have short packet
+ * detect set.
+ *
+ * @param xfer transfer with the list set
+ * @return false if an allocation failed
+ */
+static bool uhci_create_td_bulk(struct uhci_bulk_xfer *xfer) {
+	const struct usb_device *dev = xfer->dev;
+	const struct uhci_endpoint *ep = xfer->ep;
+	uint16_t max_pkt_size = ep->max_packet_size;
+	uint32_t len = sg_total(xfer->sg, xfer->sg_num);
+	uint16_t td_cnt = (uint16_t)DIV_CEIL(len, max_pkt_size);
+	bool toggle = ep->toggle;
+	uint8_t idx = 0;
+	uint32_t off = 0;
+	struct transfer_descriptor *td =
+	    memalloc_aligned(sizeof(struct transfer_descriptor) * td_cnt, 16);
+
+	xfer->td = td;
+	xfer->ntd = td_cnt;
+	if (td == NULL)
+		return false;
+
+#ifdef BENCH
+	dev->hc->tds_built += td_cnt;
+#endif
+
+	for (uint16_t i = 0; i < td_cnt; ++i) {
+		uint32_t pkt_len = len > max_pkt_size ? max_pkt_size : len;
+
+		while (off == xfer->sg[idx].len) {
+			++idx;
+			off = 0;
+		}
+
+		uint8_t *buf = (uint8_t *)xfer->sg[idx].buf + off;
+
+		if (xfer->sg[idx].len - off < pkt_len) {
+			struct uhci_bounce *bounce = &xfer->bounce[xfer->bounce_num];
+
+			if (xfer->bounce_buf == NULL) {
+				xfer->bounce_buf =
+				    memalloc((uint32_t)max_pkt_size * (xfer->sg_num - 1u));
+				if (xfer->bounce_buf == NULL)
+					return false;
+			}
+
+			bounce->td = i;
+			bounce->sg_idx = idx;
+			bounce->sg_off = off;
+			buf = xfer->bounce_buf + xfer->bounce_num * max_pkt_size;
+			++xfer->bounce_num;
+
+			if (xfer->dir == UHCI_DIR_OUT)
+				uhci_bounce_copy(xfer->sg, idx, off, buf, pkt_len, true);
+		}
+
+		td[i].link_ptr = (i + 1 < td_cnt)
+		                     ? UHCI_TD_LPTR_PTR(&td[i + 1]) | UHCI_TD_LPTR_DEPTH
+		                     : UHCI_TD_LPTR_TERM;
+		td[i].ctrl_status =
+		    UHCI_TD_ERR_CNT(3) | (dev->low_speed ? UHCI_TD_LOW_SPEED : 0)
+		    | (xfer->dir == UHCI_DIR_IN ? UHCI_TD_SPD : 0)
+		    | UHCI_TD_STATUS_ACTIVE;
+		td[i].token =
+		    UHCI_TD_MAX_LEN(pkt_len - 1) | (toggle ? UHCI_TD_DATA_TOGGLE : 0)
+		    | UHCI_TD_ENDPOINT(ep->address) | UHCI_TD_DEV_ADDR(dev->addr)
+		    | (xfer->dir == UHCI_DIR_IN ? UHCI_TD_PID_IN : UHCI_TD_PID_OUT);
+		td[i].buffer_ptr = (uint32_t)buf;
+		td[i].swdata[0] = i + 1u;
+
+		toggle = !toggle;
+		len -= pkt_len;
+
+		// step over the packet, it may span several entries
+		while (pkt_len > 0) {
+			uint32_t part = xfer->sg[idx].len - off;
+
+			if (part > pkt_len) {
+				off += pkt_len;
+				break;
+			}
+
+			pkt_len -= part;
+			off += part;
+			if (pkt_len > 0) {
+				++idx;
+				off = 0;
+			}
+		}
+	}
+
+	td[td_cnt - 1].ctrl_status |= UHCI_TD_IOC;
+
+	return true;
+}
+
+/**
+ * Collect the result of a bulk TD array
+ *
+ * @param td TD array
+ * @param ntd number of TDs
+ * @param actual_len number of bytes transferred
+ * @param short_pkt set if the transfer ended with a short packet
+ * @param toggle set to the toggle following the last acknowledged TD, left
+ * unchanged if there is none
+ * @return true if no TD failed
+ */
+static bool uhci_bulk_result(const struct transfer_descriptor *td,
+                             uint16_t ntd, uint32_t *actual_len,
+                             bool *short_pkt, bool *toggle) {
+	*actual_len = 0;
+	*short_pkt = false;
+
+	for (uint16_t i = 0; i < ntd; ++i) {
+		uint32_t status = td[i].ctrl_status;
+
+		if ((status & UHCI_TD_STATUS_ACTIVE) != 0)
+			break;
+
+		if ((status & UHCI_TD_STATUS_ERR_MASK) != 0)
+			return false;
+
+		uint32_t len = UHCI_TD_ACT_LEN(status);
+		*actual_len += len;
+		*toggle = (td[i].token & UHCI_TD_DATA_TOGGLE) == 0;
+
+		if (len < UHCI_TD_MAX_LEN_GET(td[i].token)) {
+			*short_pkt = true;
+			break;
+		}
+	}
+
+	return true;
+}
+
+static void uhci_bulk_xfer_end(struct transfer_entry *te) {
+	struct uhci_bulk_xfer *xfer = te->userdata;
+
+	xfer->done = true;
+	if (xfer->callback != NULL)
+		xfer->callback(xfer, xfer->userdata);
+}
+
+static void uhci_bulk_free(struct uhci_bulk_xfer *xfer) {
+	memfree(xfer->bounce_buf);
+	memfree(xfer->td);
+	memfree(xfer);
+}
+
+struct uhci_bulk_xfer *uhci_bulk_prepare_sg(struct usb_device *dev,
+                                            uint8_t endpoint, uint8_t dir,
+                                            const struct sg_entry *sg,
+                                            uint8_t sg_num) {
+	struct uhci_endpoint *ep = uhci_find_endpoint(dev, endpoint, dir);
+	struct uhci_bulk_xfer *xfer = NULL;
+
+	if (ep == NULL || ep->qh == NULL || ep->max_packet_size == 0
+	    || sg_num == 0 || sg_num > SG_MAX || sg_total(sg, sg_num) == 0)
+		return NULL;
+
+	xfer = memalloc(sizeof(struct uhci_bulk_xfer));
+	if (xfer == NULL)
+		return NULL;
+
+	memfill(xfer, 0, sizeof(struct uhci_bulk_xfer));
+	xfer->dev = dev;
+	xfer->ep = ep;
+	xfer->dir = dir;
+	xfer->start_toggle = ep->toggle;
+	xfer->sg_num = sg_num;
+	memcopy(xfer->sg, (void *)sg, sizeof(struct sg_entry) * sg_num);
+
+	if (!uhci_create_td_bulk(xfer)) {
+		uhci_bulk_free(xfer);
+		return NULL;
+	}
+
+	// The next chain on the endpoint continues after this one, assuming it
+	// completes in full. uhci_bulk_finish corrects it if it does not.
+	if (xfer->ntd % 2 != 0)
+		ep->toggle = !ep->toggle;
+
+	xfer->entry.first = xfer->td;
+	xfer->entry.last = &xfer->td[xfer->ntd - 1];
+	xfer->entry.handler = &uhci_bulk_xfer_end;
+	xfer->entry.userdata = xfer;
+
+	return xfer;
+}
+
+struct uhci_bulk_xfer *uhci_bulk_prepare(struct usb_device *dev,
+                                         uint8_t endpoint, uint8_t dir,
+                                         void *buf, uint32_t len) {
+	struct sg_entry sg = {.buf = buf, .len = len};
+
+	return uhci_bulk_prepare_sg(dev, endpoint, dir, &sg, 1);
+}
+
+/**
+ * Link a prepared transfer into the queue of its endpoint
+ *
+ * @param xfer prepared transfer
+ * @param callback called when the transfer is retired, may be NULL
+ * @param userdata passed to the callback
+ * @param timeout_ms deadline of the transfer
+ */
+static void uhci_xfer_submit(struct uhci_bulk_xfer *xfer,
+                             void (*callback)(struct uhci_bulk_xfer *xfer,
+                                              void *userdata),
+                             void *userdata, uint32_t timeout_ms) {
+	xfer->callback = callback;
+	xfer->userdata = userdata;
+	xfer->done = false;
+
+	uhci_schedule_queue(xfer->dev->hc, xfer->ep->qh, &xfer->entry,
+	                    timeout_ms);
+}
+
+void uhci_bulk_submit(struct uhci_bulk_xfer *xfer,
+                      void (*callback)(struct uhci_bulk_xfer *xfer,
+                                       void *userdata),
+                      void *userdata) {
+	uhci_xfer_submit(xfer, callback, userdata, UHCI_BULK_TIMEOUT_MS);
+}
+
+void uhci_bulk_wait(struct uhci_bulk_xfer *xfer) {
+	uhci_wait_done(xfer->dev->hc, &xfer->done);
+}
+
+bool uhci_bulk_complete(const struct uhci_bulk_xfer *xfer) {
+	return (xfer->entry.last->ctrl_status
+	        & (UHCI_TD_STATUS_ACTIVE | UHCI_TD_STATUS_ERR_MASK))
+	       == 0;
+}
+
+bool uhci_bulk_finish(struct uhci_bulk_xfer *xfer, uint32_t *actual_len) {
+	uint32_t len = 0;
+	bool short_pkt = false;
+	bool toggle = xfer->start_toggle;
+	bool result = false;
+
+	if (xfer->entry.queue == NULL) {
+		// never submitted, give back the toggles it reserved
+		xfer->ep->toggle = xfer->start_toggle;
+	} else {
+		result = uhci_bulk_result(xfer->td, xfer->ntd, &len, &short_pkt,
+		                          &toggle);
+		xfer->dev->error = uhci_entry_error(&xfer->entry);
+
+		if (!result || short_pkt)
+			xfer->ep->toggle = toggle;
+	}
+
+	for (uint8_t i = 0; xfer->dir == UHCI_DIR_IN && i < xfer->bounce_num;
+	     ++i) {
+		const struct uhci_bounce *bounce = &xfer->bounce[i];
+		uint32_t status = xfer->td[bounce->td].ctrl_status;
+
+		if ((status & (UHCI_TD_STATUS_ACTIVE | UHCI_TD_STATUS_ERR_MASK)) != 0)
+			continue;
+
+		uhci_bounce_copy(xfer->sg, bounce->sg_idx, bounce->sg_off,
+		                 (uint8_t *)xfer->td[bounce->td].buffer_ptr,
+		                 UHCI_TD_ACT_LEN(status), false);
+	}
+
+	if (actual_len != NULL)
+		*actual_len = len;
+
+	uhci_bulk_free(xfer);
+
+	return result;
+}
+
+bool uhci_bulk_transfer_sg(struct usb_device *dev, uint8_t endpoint,
+                           uint8_t dir, const struct sg_entry *sg,
+                           uint8_t sg_num, uint32_t *actual_len) {
+	struct uhci_endpoint *ep = uhci_find_endpoint(dev, endpoint, dir);
+	uint32_t len = sg_total(sg, sg_num);
+	uint32_t done_len = 0;
+	bool result = true;
+
+	if (actual_len != NULL)
+		*actual_len = 0;
+
+	if (ep == NULL || ep->qh == NULL || ep->max_packet_size == 0
+	    || sg_num > SG_MAX)
+		return false;
+
+	while (done_len < len) {
+		struct sg_entry chunk[SG_MAX];
+		uint32_t chunk_len = (uint32_t)ep->max_packet_size * UHCI_BULK_MAX_TDS;
+		uint32_t chunk_done = 0;
+
+		if (chunk_len > len - done_len)
+			chunk_len = len - done_len;
+
+		uint8_t chunk_num = sg_slice(sg, sg_num, done_len, chunk_len, chunk);
+		struct uhci_bulk_xfer *xfer =
+		    uhci_bulk_prepare_sg(dev, endpoint, dir, chunk, chunk_num);
+		if (xfer == NULL)
+			return false;
+
+		uhci_bulk_submit(xfer, NULL, NULL);
+		uhci_bulk_wait(xfer);
+		result = uhci_bulk_finish(xfer, &chunk_done);
+
+		done_len += chunk_done;
+
+		if (!result || chunk_done < chunk_len)
+			break;
+	}
+
+	if (actual_len != NULL)
+		*actual_len = done_len;
+
+	return result;
+}
+
+bool uhci_bulk_transfer(struct usb_device *dev, uint8_t endpoint, uint8_t dir,
+                        void *buf, uint32_t len, uint32_t *actual_len) {
+	struct sg_entry sg = {.buf = buf, .len = len};
+
+	return uhci_bulk_transfer_sg(dev, endpoint, dir, &sg, 1, actual_len);
+}
+
+/*
+ * A periodic interrupt IN transfer is a single TD. Its handler runs in the
+ * ISR, passes the packet on and links the same TD again.
+ */
+struct uhci_periodic {
+	struct uhci_bulk_xfer *xfer;
+	void (*callback)(const void *data, uint32_t len, void *userdata);
+	void *userdata;
+};
+
+static void uhci_periodic_end(struct transfer_entry *te) {
+	struct uhci_periodic *per = te->userdata;
+	struct uhci_bulk_xfer *xfer = per->xfer;
+	struct transfer_descriptor *td = xfer->td;
+	bool toggle = xfer->ep->toggle;
+	bool short_pkt = false;
+	uint32_t len = 0;
+
+	// a stalled or vanished device is left alone
+	if (!uhci_bulk_result(td, xfer->ntd, &len, &short_pkt, &toggle)) {
+		xfer->done = true;
+		return;
+	}
+
+	per->callback(xfer->sg[0].buf, len, per->userdata);
+
+	xfer->ep->toggle = toggle;
+	td->ctrl_status =
+	    (td->ctrl_status & (UHCI_TD_SPD | UHCI_TD_LOW_SPEED | UHCI_TD_IOC))
+	    | UHCI_TD_ERR_CNT(3) | UHCI_TD_STATUS_ACTIVE;
+	td->token = (td->token & ~(uint32_t)UHCI_TD_DATA_TOGGLE)
+	            | (toggle ? UHCI_TD_DATA_TOGGLE : 0);
+
+	uhci_schedule_queue(xfer->dev->hc, xfer->ep->qh, te, 0);
+}
+
+bool uhci_interrupt_start(struct usb_device *dev, uint8_t endpoint, void *buf,
+                          uint32_t len,
+                          void (*callback)(const void *data, uint32_t len,
+                                           void *userdata),
+                          void *userdata) {
+	struct uhci_endpoint *ep = uhci_find_endpoint(dev, endpoint, UHCI_DIR_IN);
+	struct uhci_periodic *per = NULL;
+
+	if (ep == NULL || len > ep->max_packet_size)
+		return false;
+
+	per = memalloc(sizeof(struct uhci_periodic));
+	if (per == NULL)
+		return false;
+
+	per->xfer = uhci_bulk_prepare(dev, endpoint, UHCI_DIR_IN, buf, len);
+	if (per->xfer == NULL) {
+		memfree(per);
+		return false;
+	}
+
+	per->callback = callback;
+	per->userdata = userdata;
+	per->xfer->entry.handler = &uhci_periodic_end;
+	per->xfer->entry.userdata = per;
+	per->xfer->entry.in_isr = true;
+
+	uhci_schedule_queue(dev->hc, ep->qh, &per->xfer->entry, 0);
+	return true;
+}
+
+void uhci_service(struct usb_device *dev) {
+	if (dev->hc->polling)
+		uhci_poll(dev->hc);
+
+	uhci_complete(dev->hc);
+}
+
+bool uhci_interrupt_in(struct usb_device *dev, uint8_t endpoint, void *buf,
+                       uint32_t len, uint32_t *actual_len,
+                       uint32_t timeout_ms) {
+	// interrupt TDs are built like bulk TDs, only their QH is periodic
+	struct uhci_bulk_xfer *xfer =
+	    uhci_bulk_prepare(dev, endpoint, UHCI_DIR_IN, buf, len);
+
+	if (actual_len != NULL)
+		*actual_len = 0;
+
+	if (xfer == NULL)
+		return false;
+
+	uhci_xfer_submit(xfer, NULL, NULL, timeout_ms);
+	uhci_bulk_wait(xfer);
+	return uhci_bulk_finish(xfer, actual_len);
+}
+
+#ifdef BENCH
+
+/**
+ * Enable or disable full-speed bandwidth reclamation on a controller
+ *
+ * @param dev controller
+ * @param on true to enable
+ */
+static void uhci_set_fsbr(struct uhci_dev *dev, bool on) {
+	uint32_t eflags = irq_save();
+	dev->fsbr = on;
+	uhci_fsbr_link(dev, on && dev->fsbr_pending != 0);
+	irq_restore(eflags);
+}
+
+#define UHCI_BENCH_TRANSFERS 16
+
+static void uhci_bench_callback(struct transfer_entry *te) {
+	(*(volatile uint16_t *)te->userdata)++;
+}
+
+/**
+ * Queue a batch of GET_DESCRIPTOR(device) transfers at once and count the
+ * frames the HC needs to complete them, with and without bandwidth
+ * reclamation.
+ *
+ * @param dev controller
+ * @param udev addressed full-speed device
+ */
+static void uhci_bench_fsbr(struct uhci_dev *dev, struct usb_device *udev) {
+	struct transfer_descriptor *tds[UHCI_BENCH_TRANSFERS];
+	struct transfer_entry entries[UHCI_BENCH_TRANSFERS];
+	struct device_descriptor desc;
+	uint32_t bytes = UHCI_BENCH_TRANSFERS * sizeof(struct device_descriptor);
+
+	for (uint8_t mode = 0; mode < 2; ++mode) {
+		volatile uint16_t done = 0;
+
+		uhci_set_fsbr(dev, mode == 1);
+		memfill(entries, 0, sizeof(entries));
+
+		for (uint16_t i = 0; i < UHCI_BENCH_TRANSFERS; ++i) {
+			uint16_t ntd = uhci_create_td_control_in(
+			    &tds[i], udev, UHCI_DR_REQ_GET_DESCRIPTOR,
+			    UHCI_DR_VAL_DESC_DEVICE, 0, sizeof(desc), &desc);
+			entries[i].first = tds[i];
+			entries[i].last = &tds[i][ntd - 1];
+			entries[i].handler = &uhci_bench_callback;
+			entries[i].userdata = (void *)&done;
+		}
+
+		uint16_t frnum = uhci_read_16(dev, UHCI_FRNUM);
+		uint64_t start = clock_ns();
+
+		for (uint16_t i = 0; i < UHCI_BENCH_TRANSFERS; ++i)
+			uhci_schedule_queue(dev, udev->ctrl_qh, &entries[i], 0);
+
+		while (done != UHCI_BENCH_TRANSFERS)
+			uhci_wait_step(dev, start);
+
+		uint32_t us = (uint32_t)((clock_ns() - start) / 1000u);
+		uint16_t frames =
+		    (uint16_t)((uhci_read_16(dev, UHCI_FRNUM) - frnum) & 0x7ff);
+		if (frames == 0)
+			frames = 1;
+
+		for (uint16_t i = 0; i < UHCI_BENCH_TRANSFERS; ++i)
+			uhci_delete_td_control(&tds[i]);
+
+		print_string(mode == 1 ? "BENCH FSBR on: " : "BENCH FSBR off: ");
+		print_string(itoa_once((int)bytes, 10));
+		print_string(" B in ");
+		print_string(itoa_once(frames, 10));
+		print_string(" frames, ");
+		print_string(itoa_once((int)(bytes / frames), 10));
+		print_string(" B/frame, ");
+		print_string(itoa_once((int)us, 10));
+		print_string(" us\n");
+	}
+
+	uhci_set_fsbr(dev, UHCI_FSBR_DEFAULT);
+}
+
+#define UHCI_BENCH_LATENCY_RUNS 32
+
+/**
+ * Time single GET_DESCRIPTOR(device) transfers with interrupt and with polled
+ * completion
+ *
+ * @param dev controller
+ * @param udev addressed device
+ */
+static void uhci_bench_poll(struct uhci_dev *dev, struct usb_device *udev) {
+	struct device_descriptor desc;
+	bool polling = dev->polling;
+
+	// a controller without a working interrupt is only measured polling
+	for (uint8_t mode = polling ? 1 : 0; mode < 2; ++mode) {
+		uint64_t total = 0;
+		uint64_t max = 0;
+
+		uhci_set_polling(dev, mode == 1);
+
+		for (uint16_t i = 0; i < UHCI_BENCH_LATENCY_RUNS; ++i) {
+			uint64_t start = clock_ns();
+
+			uhci_read_dev_desc(dev, udev, &desc);
+
+			uint64_t ns = clock_ns() - start;
+			total += ns;
+			if (ns > max)
+				max = ns;
+		}
+
+		print_string(mode == 1 ? "BENCH polling: " : "BENCH IRQ: ");
+		print_string(itoa_once(
+		    (int)(total / UHCI_BENCH_LATENCY_RUNS / 1000u), 10));
+		print_string(" us avg, ");
+		print_string(itoa_once((int)(max / 1000u), 10));
+		print_string(" us max per control transfer\n");
+	}
+
+	uhci_set_polling(dev, polling);
+}
+
+/**
+ * Compare the longest uhci_isr run with the handlers called from the ISR and
+ * with deferred completion
+ *
+ * @param dev controller with a working interrupt
+ * @param udev addressed device
+ */
+static void uhci_bench_isr(struct uhci_dev *dev, struct usb_device *udev) {
+	struct device_descriptor desc;
+
+	if (dev->polling || !clock_has_tsc())
+		return;
+
+	for (uint8_t mode = 0; mode < 2; ++mode) {
+		dev->isr_inline = mode == 0;
+		dev->isr_max = 0;
+
+		for (uint16_t i = 0; i < UHCI_BENCH_LATENCY_RUNS; ++i)
+			uhci_read_dev_desc(dev, udev, &desc);
+
+		print_string(mode == 0 ? "BENCH ISR inline: " : "BENCH ISR deferred: ");
+		print_string(itoa_once((int)dev->isr_max, 10));
+		print_string(" cycles, ");
+		print_string(itoa_once(
+		    (int)(dev->isr_max * 1000000u / clock_tsc_khz()), 10));
+		print_string(" ns max\n");
+	}
+
+	dev->isr_inline = false;
+}
+
+#endif
+
+static void uhci_destroy_usb_device(struct uhci_dev *dev,
+                                    struct usb_device *udev) {
+	for (uint8_t i = 0; i < udev->endpoints_num; ++i) {
+		if (udev->endpoints[i].qh != NULL)
+			uhci_delete_qh(dev, udev->endpoints[i].qh);
+	}
+
+	if (udev->ctrl_qh != NULL)
+		uhci_delete_qh(dev, udev->ctrl_qh);
+
+	uhci_cache_unbind(dev, udev);
+	memfree(udev);
+}
+
+/**
+ * Print a string descriptor of a device
+ *
+ * @param udev device with a cache entry
+ * @param index string index, nothing is printed for 0
+ * @return false if the descriptor could not be read
+ */
+static bool uhci_print_string_desc(struct usb_device *udev, uint8_t index) {
+	const struct string_descriptor *sdesc = uhci_get_string(udev, index);
+
+	if (index == 0)
+		return true;
+
+	if (sdesc == NULL)
+		return false;
+
+	if (sdesc->length >= 2) {
+		uint8_t buflen = (uint8_t)((sdesc->length - 2u) / 2u + 1u);
+		char *buf = memalloc(buflen);
+		memfill(buf, 0, buflen);
+
+		wstr_to_str(sdesc->string, sdesc->length - 2, buf, buflen);
+		print_string(buf);
+		memfree(buf);
+	}
+
+	return true;
+}
+
+/**
+ * Read the first descriptor bytes of a device that was just reset and give it
+ * an address. Root ports are reset once more before the address is set.
+ *
+ * @param dev controller
+ * @param parent hub of the device, NULL on a root port
+ * @param port port number on the hub or root port index
+ * @param low_speed the port reports a low-speed device
+ * @return the device or NULL on failure
+ */
+static struct usb_device *uhci_address_device(struct uhci_dev *dev,
+                                              struct usb_device *parent,
+                                              uint8_t port, bool low_speed) {
+	struct usb_device *udev = memalloc(sizeof(struct usb_device));
+
+	if (udev == NULL)
+		return NULL;
+
+	memfill(udev, 0, sizeof(struct usb_device));
+	udev->hc = dev;
+	udev->parent = parent;
+	udev->port = port;
+	udev->low_speed = low_speed;
+	udev->ep0_max_packet = 8;
+	udev->ctrl_qh = uhci_create_qh(
+	    dev, low_speed ? UHCI_SKEL_LS_CONTROL : UHCI_SKEL_FS_CONTROL);
+
+	if (!uhci_read_dev_desc_maxpkg(dev, udev, &udev->dev_desc)) {
+		print_string("Failed to retrive initial device descriptor");
+		goto fail;
+	}
+
+	// bMaxPacketSize0 is 8, 16, 32 or 64, low-speed devices are limited to 8
+	uint8_t ep0_max = udev->dev_desc.max_packet_size;
+	if (!low_speed && (ep0_max == 16 || ep0_max == 32 || ep0_max == 64))
+		udev->ep0_max_packet = ep0_max;
+
+	if (parent == NULL && !uhci_enable_device_on_port(dev, ports[port])) {
+		print_string("Device enablement failed 2");
+		goto fail;
+	}
+
+	if (dev->next_addr == 0)
+		dev->next_addr = 1;
+
+	if (dev->next_addr > 127
+	    || !uhci_set_device_address(dev, udev, dev->next_addr)) {
+		print_string("Failed to set device address");
+		goto fail;
+	}
+
+	dev->next_addr++;
+	dev->devices_num++;
+	return udev;
+
+fail:
+	uhci_destroy_usb_device(dev, udev);
+	return NULL;
+}
+
+struct usb_device *uhci_attach_device(struct usb_device *hub, uint8_t port,
+                                      bool low_speed) {
+	return uhci_address_device(hub->hc, hub, port, low_speed);
+}
+
+bool uhci_setup_device(struct usb_device *udev) {
+	struct uhci_dev *dev = udev->hc;
+
+	if (!uhci_read_dev_desc(dev, udev, &udev->dev_desc)) {
+		print_string("Failed to retrive device descriptor");
+		return false;
+	}
+
+#ifdef BENCH
+	uint32_t tds_built = dev->tds_built;
+	if (!udev->low_speed)
+		uhci_bench_fsbr(dev, udev);
+	uhci_bench_poll(dev, udev);
+	uhci_bench_isr(dev, udev);
+	// the benchmarks are not part of the enumeration
+	dev->tds_built = tds_built;
+#endif
+
+	uhci_cache_bind(dev, udev);
+
+	if (!uhci_configure_device(dev, udev)) {
+		print_string("Failed to configure device");
+		return false;
+	}
+
+	if (!uhci_print_string_desc(udev, udev->dev_desc.manufacturer_idx)) {
+		print_string("uhci_read_string_desc mfg FAIL");
+		if (udev->error == UHCI_XFER_TIMEOUT)
+			return false;
+	}
+	print_string(": ");
+
+	if (!uhci_print_string_desc(udev, udev->dev_desc.product_idx)) {
+		print_string("uhci_read_string_desc prod FAIL");
+		if (udev->error == UHCI_XFER_TIMEOUT)
+			return false;
+	}
+	print_string("\n");
+
+	return true;
+}
+
+void uhci_bind_device(struct usb_device *udev) {
+	for (uint8_t i = 0; i < udev->interfaces_num; ++i) {
+		const struct uhci_interface *iface = &udev->interfaces[i];
+
+		switch (iface->class_code) {
+		case UHCI_CLASS_HID:
+			hid_probe(udev, iface);
+			break;
+		case UHCI_CLASS_MASS_STORAGE:
+			msd_probe(udev, iface);
+			break;
+		case UHCI_CLASS_HUB:
+			hub_probe(udev, iface);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+void uhci_detach_device(struct usb_device *udev) {
+	uhci_destroy_usb_device(udev->hc, udev);
+}
+
 static bool pci_dev_init_cb(struct pci_dev *dev) {
 	struct uhci_dev *uhci_dev = NULL;
 
@@ -848,6 +2636,7 @@ static bool pci_dev_init_cb(struct pci_dev *dev) {
 	}
 
 	uhci_dev = memalloc(sizeof(struct uhci_dev));
+	memfill(uhci_dev, 0, sizeof(struct uhci_dev));
 	uhci_dev->pci_dev = dev;
 
 	print_string("UHCI found\n");
@@ -871,10 +2660,8 @@ static bool pci_dev_init_cb(struct pci_dev *dev) {
 
 	uhci_dev->portnum = uhci_find_ports(uhci_dev);
 
-	// enable interrupts
-	uhci_write_16(uhci_dev, UHCI_USBINTR,
-	              UHCI_USBINTR_SHORT_PKT_INT | UHCI_USBINTR_INT_ON_COMPLETE
-	                  | UHCI_USBINTR_RESUME_INT | UHCI_USBINTR_CRC_TIMEOUT_INT);
+	// enable interrupts, unless polling is forced
+	uhci_set_polling(uhci_dev, UHCI_POLL_DEFAULT);
 
 	// set 64 byte packet size and start the controller
 	uhci_write_16(uhci_dev, UHCI_USBCMD,
@@ -882,6 +2669,9 @@ static bool pci_dev_init_cb(struct pci_dev *dev) {
 
 	print_string("UHCI init OK\n");
 
+	uhci_dev->next = uhci_devs;
+	uhci_devs = uhci_dev;
+
 	print_string("UHCI INT line: ");
 	print_string(
 	    itoa_once(uhci_dev->pci_dev->header.u.type00.interrupt_line, 10));
@@ -897,14 +2687,13 @@ static bool pci_dev_init_cb(struct pci_dev *dev) {
 	print_string(itoa_once(uhci_dev->portnum, 10));
 	print_string("\n");
 
+	uint64_t enum_start = clock_ns();
+
 	for (uint8_t i = 0; i < uhci_dev->portnum; ++i) {
 		// TODO: Use better check for presence (UHCI_PORTSC_CONNECT_STATUS)
 		if ((uhci_read_16(uhci_dev, ports[i]) & UHCI_PORTSC_CONNECT_STATUS_CHG)
 		    != 0) {
 			struct usb_device *usb_dev = NULL;
-			struct string_descriptor *sdesc = NULL;
-			char *buf = NULL;
-			uint8_t buflen = 0;
 
 			print_string("CONNECT STATUS CHANGE detected on port ");
 			print_string(itoa_once(i, 10));
@@ -920,72 +2709,18 @@ static bool pci_dev_init_cb(struct pci_dev *dev) {
 				continue;
 			}
 
-			usb_dev = memalloc(sizeof(struct usb_device));
-			memfill(usb_dev, 0, sizeof(struct usb_device));
-			usb_dev->low_speed =
-			    UHCI_PORTSC_LOW_SPEED(uhci_read_16(uhci_dev, ports[i]));
-			if (!uhci_read_dev_desc_maxpkg(uhci_dev, usb_dev,
-			                               &usb_dev->dev_desc)) {
-				print_string("Failed to retrive initial device descriptor");
-				memfree(usb_dev);
-				continue;
-			}
-
-			if (!uhci_enable_device_on_port(uhci_dev, ports[i])) {
-				print_string("Device enablement failed 2");
-				continue;
-			}
-
-			if (!uhci_set_device_address(uhci_dev, usb_dev, i + 1)) {
-				print_string("Failed to set device address");
-				memfree(usb_dev);
+			usb_dev = uhci_address_device(
+			    uhci_dev, NULL, i,
+			    UHCI_PORTSC_LOW_SPEED(uhci_read_16(uhci_dev, ports[i])));
+			if (usb_dev == NULL)
 				continue;
-			}
 
-			if (!uhci_read_dev_desc(uhci_dev, usb_dev, &usb_dev->dev_desc)) {
-				print_string("Failed to retrive device descriptor");
-				memfree(usb_dev);
+			if (!uhci_setup_device(usb_dev)) {
+				uhci_detach_device(usb_dev);
 				continue;
 			}
 
-			if (!uhci_read_string_desc(uhci_dev, usb_dev,
-			                           usb_dev->dev_desc.manufacturer_idx,
-			                           &sdesc)) {
-				print_string("uhci_read_string_desc mfg FAIL");
-			}
-
-			buflen = (uint8_t)((sdesc->length - 2u) / 2u + 1u);
-			buf = memalloc(buflen);
-			memfill(buf, 0, buflen);
-
-			wstr_to_str(sdesc->string, sdesc->length - 2, buf, buflen);
-			print_string(buf);
-			print_string(": ");
-
-			memfree(buf);
-			buf = NULL;
-
-			memfree(sdesc);
-			sdesc = NULL;
-
-			if (!uhci_read_string_desc(uhci_dev, usb_dev,
-			                           usb_dev->dev_desc.product_idx, &sdesc)) {
-				print_string("uhci_read_string_desc prod FAIL");
-			}
-
-			buflen = (uint8_t)((sdesc->length - 2u) / 2u + 1u);
-			buf = memalloc(buflen);
-			memfill(buf, 0, buflen);
-
-			wstr_to_str(sdesc->string, sdesc->length - 2, buf, buflen);
-			print_string(buf);
-			print_string("\n");
-
-			memfree(buf);
-			buf = NULL;
-
-			memfree(sdesc);
-			sdesc = NULL;
+			uhci_bind_device(usb_dev);
 		} else {
 			print_string("Inactive port: ");
 			print_string(itoa_once(i, 10));
@@ -993,6 +2728,18 @@ static bool pci_dev_init_cb(struct pci_dev *dev) {
 		}
 	}
 
+	print_string("UHCI: ");
+	print_string(itoa_once(uhci_dev->devices_num, 10));
+	print_string(" devices enumerated in ");
+	print_string(itoa_once((int)((clock_ns() - enum_start) / 1000000u), 10));
+	print_string(" ms\n");
+
+#ifdef BENCH
+	print_string("UHCI: ");
+	print_string(itoa_once((int)uhci_dev->tds_built, 10));
+	print_string(" TDs built for the enumeration\n");
+#endif
+
 	return true;
 
 fail:
@@ -1005,3 +2752,20 @@ void uhci_init() {
 	struct pci_dev_driver drv = {.init = pci_dev_init_cb};
 	pci_register_driver(&drv);
 }
+
+void uhci_shutdown(void) {
+	for (struct uhci_dev *dev = uhci_devs; dev != NULL; dev = dev->next) {
+		uhci_write_16(dev, UHCI_USBINTR, 0);
+		uhci_write_16(dev, UHCI_USBCMD, 0);
+
+		// the HC halts at the end of the current frame
+		uint16_t timeout = 100; // 100 * 100us (10ms)
+		while (timeout > 0
+		       && (uhci_read_16(dev, UHCI_USBSTS) & UHCI_USBSTS_HC_HALTED) == 0) {
+			udelay(100);
+			timeout--;
+		}
+
+		uhci_write_16(dev, UHCI_USBSTS, 0x1f);
+	}
+}
@@ -1,3 +1,491 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <uchar.h>
+
+#include "utils/sg.h"
+
+/*
+ * USB Device Requests
+ *
+ *    3                   2                   1                   0
+ *  1 0 9 8 7 6 5 4 3 2 1 0 9 8 7 6 5 4 3 2 1 0 9 8 7 6 5 4 3 2 1 0
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |           Value               |   Request     | Request Type  |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |           Length              |             Index             |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *
+ * Request Type:
+ *   bit 7 Data xfer direction:
+ *     0 = Host to device
+ *     1 = Device to host
+ *   bit 6-5 Type:
+ *     0 = Standard
+ *     1 = Class
+ *     2 = Vendor
+ *     3 = Reserved
+ *   bit 4-0 Recipient:
+ *     0 = Device
+ *     1 = Interface
+ *     2 = Endpoint
+ *     3 = Other
+ *     4-31 = Reserved
+ *
+ * Request, Value, Index:
+ *   Universal Serial Bus Specification Revision 1.0
+ *   Table 9-2
+ *
+ * Length:
+ *   Number of bytes to transfer if there is a data phase
+ */
+
+#define UHCI_DR_RT_XDIR_HOST_DEV 0
+#define UHCI_DR_RT_XDIR_DEV_HOST (1 << 7)
+
+#define UHCI_DR_RT_TYPE_STANDARD (0 << 5)
+#define UHCI_DR_RT_TYPE_CLASS    (1 << 5)
+#define UHCI_DR_RT_TYPE_VENDOR   (2 << 5)
+
+#define UHCI_DR_RT_RECIPIENT_DEVICE    0
+#define UHCI_DR_RT_RECIPIENT_INTERFACE 1
+#define UHCI_DR_RT_RECIPIENT_ENDPOINT  2
+#define UHCI_DR_RT_RECIPIENT_OTHER     3
+
+/*
+ * Universal Serial Bus Specification Revision 1.0
+ * Table 9-3. Standard Request Codes
+ */
+#define UHCI_DR_REQ_GET_STATUS        0
+#define UHCI_DR_REQ_CLEAR_FEATURE     1
+// 2 = reserved
+#define UHCI_DR_REQ_SET_FEATURE       3
+// 4 = reserved
+#define UHCI_DR_REQ_SET_ADDRESS       5
+#define UHCI_DR_REQ_GET_DESCRIPTOR    6
+#define UHCI_DR_REQ_SET_DESCRIPTOR    7
+#define UHCI_DR_REQ_GET_CONFIGURATION 8
+#define UHCI_DR_REQ_SET_CONFIGURATION 9
+#define UHCI_DR_REQ_GET_INTERFACE     10
+#define UHCI_DR_REQ_SET_INTERFACE     11
+#define UHCI_DR_REQ_SYNCH_FRAME       12
+
+/*
+ * Universal Serial Bus Specification Revision 1.0
+ * Table 9-4. Descriptor Types
+ */
+#define UHCI_DR_VAL_DESC_DEVICE        (1 << 8)
+#define UHCI_DR_VAL_DESC_CONFIGURATION (2 << 8)
+#define UHCI_DR_VAL_DESC_STRING        (3 << 8)
+#define UHCI_DR_VAL_DESC_INTERFACE     (4 << 8)
+#define UHCI_DR_VAL_DESC_ENDPOINT      (5 << 8)
+
+/*
+ * Universal Serial Bus Specification Revision 1.0
+ * Table 9-6. Standard Feature Selectors
+ */
+#define UHCI_DR_FEAT_ENDPOINT_HALT        0
+#define UHCI_DR_FEAT_DEVICE_REMOTE_WAKEUP 1
+
+struct device_request {
+	uint8_t request_type;
+	uint8_t request;
+	uint16_t value;
+	uint16_t index;
+	uint16_t length;
+};
+
+struct descriptor {
+	uint8_t length;
+	uint8_t desc_type;
+};
+
+struct device_descriptor {
+	uint8_t length;
+	uint8_t desc_type;
+	uint16_t bcdUSB;
+	uint8_t device_class;
+	uint8_t device_sub_class;
+	uint8_t device_protocol;
+	uint8_t max_packet_size;
+	uint16_t vendor_id;
+	uint16_t product_id;
+	uint16_t bcdDevice;
+	uint8_t manufacturer_idx;
+	uint8_t product_idx;
+	uint8_t serial_number_idx;
+	uint8_t configurations_num;
+};
+
+struct __attribute__((__packed__)) configuration_descriptor {
+	uint8_t length;
+	uint8_t desc_type;
+	uint16_t total_length;
+	uint8_t interfaces_num;
+	uint8_t configuration_value;
+	uint8_t configuration_idx;
+	uint8_t attribute;
+	uint8_t max_power; // unit: 2mA
+};
+
+struct string_descriptor {
+	uint8_t length;
+	uint8_t desc_type;
+	char16_t string[];
+};
+
+struct __attribute__((__packed__)) interface_descriptor {
+	uint8_t length;
+	uint8_t desc_type;
+	uint8_t interface_num;
+	uint8_t alternate_setting;
+	uint8_t endpoints_num;
+	uint8_t interface_class;
+	uint8_t interface_sub_class;
+	uint8_t interface_protocol;
+	uint8_t interface_idx;
+};
+
+struct __attribute__((__packed__)) endpoint_descriptor {
+	uint8_t length;
+	uint8_t desc_type;
+	uint8_t endpoint_address;
+	uint8_t attributes;
+	uint16_t max_packet_size;
+	uint8_t interval;
+};
+
+/*
+ * Endpoint descriptor fields
+ * Universal Serial Bus Specification Revision 1.0
+ * Table 9-10. Standard Endpoint Descriptor
+ */
+#define UHCI_EP_ADDR_NUM_MASK  0x0f
+#define UHCI_EP_ADDR_IN        (1 << 7)
+#define UHCI_EP_ATTR_TYPE_MASK 0x03
+#define UHCI_EP_ATTR_CONTROL   0
+#define UHCI_EP_ATTR_ISO       1
+#define UHCI_EP_ATTR_BULK      2
+#define UHCI_EP_ATTR_INTERRUPT 3
+
+// Transfer direction
+#define UHCI_DIR_OUT 0
+#define UHCI_DIR_IN  1
+
+// Interfaces tracked per device, default alternate settings only
+#define UHCI_MAX_INTERFACES 4
+
+// Endpoints tracked per device, endpoint 0 excluded
+#define UHCI_MAX_ENDPOINTS 16
+
+// Index of an endpoint address in usb_device.endpoint_idx
+#define UHCI_EP_IDX(address)                                                   \
+	((((address) & UHCI_EP_ADDR_NUM_MASK) << 1)                                \
+	 | (((address) & UHCI_EP_ADDR_IN) != 0 ? 1 : 0))
+
+/*
+ * Interface class codes, bInterfaceClass
+ */
+#define UHCI_CLASS_HID          0x03
+#define UHCI_CLASS_MASS_STORAGE 0x08
+#define UHCI_CLASS_HUB          0x09
+
+// Result of the last transfer of a device, see usb_device.error
+#define UHCI_XFER_OK      0
+#define UHCI_XFER_STALL   1 // the endpoint answered with STALL
+#define UHCI_XFER_ERROR   2 // CRC, bitstuff, babble or data buffer error
+#define UHCI_XFER_TIMEOUT 3 // cancelled at its deadline
+
+struct uhci_dev;
+struct queue_head;
+struct uhci_desc_cache;
+
+struct uhci_endpoint {
+	uint8_t address;          // bEndpointAddress
+	uint8_t attributes;       // bmAttributes
+	uint16_t max_packet_size; // wMaxPacketSize
+	uint8_t interval;         // bInterval
+	bool toggle;              // data toggle of the next packet; true = DATA1
+	struct queue_head *qh;
+};
+
+struct uhci_interface {
+	uint8_t number;          // bInterfaceNumber
+	uint8_t class_code;      // bInterfaceClass
+	uint8_t sub_class;       // bInterfaceSubClass
+	uint8_t protocol;        // bInterfaceProtocol
+	uint8_t endpoints_first; // index of the first endpoint in `endpoints`
+	uint8_t endpoints_num;
+};
+
+struct usb_device {
+	struct uhci_dev *hc;
+	struct usb_device *parent; // hub of the device, NULL on a root port
+	uint8_t port;              // port number on the hub or root port index
+	bool low_speed;
+	uint8_t addr;
+	struct queue_head *ctrl_qh; // endpoint 0
+	uint8_t ep0_max_packet;     // bMaxPacketSize0, 8 until it is read
+	uint8_t error;              // UHCI_XFER_* of the last finished transfer
+	struct device_descriptor dev_desc;
+	struct configuration_descriptor *conf_desc; // whole configuration
+	struct uhci_desc_cache *cache; // owns `conf_desc` and the strings
+	// default alternate settings of the configuration
+	uint8_t interfaces_num;
+	struct uhci_interface interfaces[UHCI_MAX_INTERFACES];
+	uint8_t endpoints_num;
+	struct uhci_endpoint endpoints[UHCI_MAX_ENDPOINTS];
+	// UHCI_EP_IDX(address) -> index in `endpoints` + 1; 0 = no endpoint
+	uint8_t endpoint_idx[32];
+};
+
 void uhci_init();
+
+/**
+ * Stop every controller and disable its interrupts, so no schedule is run
+ * after the memory is handed over to an OS
+ */
+void uhci_shutdown(void);
+
+/**
+ * Wait until a flag set by a transfer callback is true. Callbacks of retired
+ * transfers run from here. The controller is polled while waiting if its
+ * interrupt does not work.
+ *
+ * @param dev device of the transfer
+ * @param done flag to wait for
+ */
+void uhci_wait(struct usb_device *dev, volatile bool *done);
+
+/**
+ * Transfer data on a bulk endpoint and wait for the completion. The buffer is
+ * split into max packet sized TDs, the data toggle is kept per endpoint across
+ * transfers. IN transfers end early on a short packet.
+ *
+ * @param dev configured device
+ * @param endpoint endpoint number
+ * @param dir UHCI_DIR_IN or UHCI_DIR_OUT
+ * @param buf data buffer, at least `len` bytes
+ * @param len number of bytes to transfer
+ * @param actual_len if not NULL, the number of bytes transferred is returned
+ * here
+ * @return true if the transfer completed without error (a short IN transfer
+ * is not an error)
+ */
+bool uhci_bulk_transfer(struct usb_device *dev, uint8_t endpoint, uint8_t dir,
+                        void *buf, uint32_t len, uint32_t *actual_len);
+
+/**
+ * Same as `uhci_bulk_transfer` over a scatter/gather list
+ *
+ * @param dev configured device
+ * @param endpoint endpoint number
+ * @param dir UHCI_DIR_IN or UHCI_DIR_OUT
+ * @param sg data buffers
+ * @param sg_num number of entries, at most SG_MAX
+ * @param actual_len if not NULL, the number of bytes transferred is returned
+ * here
+ * @return true if the transfer completed without error
+ */
+bool uhci_bulk_transfer_sg(struct usb_device *dev, uint8_t endpoint,
+                           uint8_t dir, const struct sg_entry *sg,
+                           uint8_t sg_num, uint32_t *actual_len);
+
+struct uhci_bulk_xfer;
+
+/**
+ * Build the TD chain of a bulk transfer without scheduling it. The chain takes
+ * its data toggles from the endpoint, and the endpoint continues after it, so
+ * transfers on the same endpoint must be submitted in the order they were
+ * prepared.
+ *
+ * @param dev configured device
+ * @param endpoint endpoint number
+ * @param dir UHCI_DIR_IN or UHCI_DIR_OUT
+ * @param buf data buffer, the TDs point into it
+ * @param len number of bytes to transfer, at least 1
+ * @return the transfer or NULL on failure
+ */
+struct uhci_bulk_xfer *uhci_bulk_prepare(struct usb_device *dev,
+                                         uint8_t endpoint, uint8_t dir,
+                                         void *buf, uint32_t len);
+
+/**
+ * Build the TD chain of a bulk transfer over a scatter/gather list. The TDs
+ * point straight into the entries, only packets that straddle two entries are
+ * copied through a bounce slot.
+ *
+ * @param dev configured device
+ * @param endpoint endpoint number
+ * @param dir UHCI_DIR_IN or UHCI_DIR_OUT
+ * @param sg data buffers, the list itself is copied
+ * @param sg_num number of entries, 1 to SG_MAX
+ * @return the transfer or NULL on failure
+ */
+struct uhci_bulk_xfer *uhci_bulk_prepare_sg(struct usb_device *dev,
+                                            uint8_t endpoint, uint8_t dir,
+                                            const struct sg_entry *sg,
+                                            uint8_t sg_num);
+
+/**
+ * Link a prepared transfer into the queue of its endpoint. May be called from
+ * a completion callback.
+ *
+ * @param xfer prepared transfer
+ * @param callback called from a wait loop in normal context when the transfer
+ * is retired or times out, may be NULL
+ * @param userdata passed to the callback
+ */
+void uhci_bulk_submit(struct uhci_bulk_xfer *xfer,
+                      void (*callback)(struct uhci_bulk_xfer *xfer,
+                                       void *userdata),
+                      void *userdata);
+
+/**
+ * Wait until a submitted transfer is retired
+ *
+ * @param xfer submitted transfer
+ */
+void uhci_bulk_wait(struct uhci_bulk_xfer *xfer);
+
+/**
+ * Check if a retired transfer moved all of its data without error
+ *
+ * @param xfer retired transfer
+ * @return true if the last TD completed
+ */
+bool uhci_bulk_complete(const struct uhci_bulk_xfer *xfer);
+
+/**
+ * Collect the result of a transfer and free it. A transfer that was never
+ * submitted gives its data toggles back to the endpoint, only the most
+ * recently prepared one may be dropped this way.
+ *
+ * @param xfer retired or never submitted transfer
+ * @param actual_len if not NULL, the number of bytes transferred is returned
+ * here
+ * @return true if the transfer was submitted and no TD failed, the reason of
+ * a failure is in the device's `error`
+ */
+bool uhci_bulk_finish(struct uhci_bulk_xfer *xfer, uint32_t *actual_len);
+
+/**
+ * Poll an interrupt IN endpoint at its bInterval until the device fails. Each
+ * packet is passed to the callback from the interrupt handler, then the same
+ * TD is linked again, nothing is allocated after the start.
+ *
+ * @param dev configured device
+ * @param endpoint endpoint number
+ * @param buf buffer of one packet, kept until the device goes away
+ * @param len buffer length, at most the max packet size of the endpoint
+ * @param callback gets the received bytes in interrupt context, it must not
+ * allocate or wait
+ * @param userdata passed to the callback
+ * @return true if the endpoint is polled
+ */
+bool uhci_interrupt_start(struct usb_device *dev, uint8_t endpoint, void *buf,
+                          uint32_t len,
+                          void (*callback)(const void *data, uint32_t len,
+                                           void *userdata),
+                          void *userdata);
+
+/**
+ * Retire the finished transfers of a device's controller if it is polled
+ * instead of interrupt driven, and run the pending completion handlers. For
+ * drivers that wait for periodic data outside of a transfer.
+ *
+ * @param dev device on the controller
+ */
+void uhci_service(struct usb_device *dev);
+
+/**
+ * Read an interrupt IN endpoint once. The TD waits on the periodic schedule
+ * until the device answers with data or the timeout expires.
+ *
+ * @param dev configured device
+ * @param endpoint endpoint number
+ * @param buf data buffer, at least `len` bytes
+ * @param len number of bytes to read
+ * @param actual_len if not NULL, the number of bytes read is returned here
+ * @param timeout_ms time to wait for the data
+ * @return true if data was read, on timeout `dev->error` is UHCI_XFER_TIMEOUT
+ */
+bool uhci_interrupt_in(struct usb_device *dev, uint8_t endpoint, void *buf,
+                       uint32_t len, uint32_t *actual_len, uint32_t timeout_ms);
+
+/**
+ * Address a device that was just reset on a hub port. The port of the device
+ * must be the only one that is enabled with a device on the default address.
+ *
+ * @param hub hub of the device
+ * @param port port number on the hub
+ * @param low_speed the hub reports a low-speed device
+ * @return the addressed device or NULL on failure
+ */
+struct usb_device *uhci_attach_device(struct usb_device *hub, uint8_t port,
+                                      bool low_speed);
+
+/**
+ * Read the descriptors of an addressed device and select its first
+ * configuration
+ *
+ * @param udev addressed device
+ * @return false on failure, the device should be detached
+ */
+bool uhci_setup_device(struct usb_device *udev);
+
+/**
+ * Bind the class drivers of the interfaces of a configured device
+ *
+ * @param udev configured device
+ */
+void uhci_bind_device(struct usb_device *udev);
+
+/**
+ * Free a device that is not bound to a driver, along with its queues. Its
+ * cached descriptors are dropped, unless the device has a serial number to be
+ * recognised by when it comes back.
+ *
+ * @param udev device returned by `uhci_attach_device`
+ */
+void uhci_detach_device(struct usb_device *udev);
+
+/**
+ * Get a string descriptor of a device in its first language. A string is
+ * read from the device once, later lookups return the cached copy.
+ *
+ * @param udev configured device
+ * @param index string index, 0 for none
+ * @return the string, valid until the device is detached, or NULL if it
+ * could not be read
+ */
+const struct string_descriptor *uhci_get_string(struct usb_device *udev,
+                                                uint8_t index);
+
+/**
+ * Send a request on the default control pipe and wait for the completion
+ *
+ * @param dev addressed device
+ * @param request_type bmRequestType, the direction selects the data stage
+ * @param request bRequest
+ * @param value wValue
+ * @param index wIndex
+ * @param length wLength, size of `buf`
+ * @param buf data stage buffer, may be NULL if `length` is 0
+ * @return true if every stage completed without error, the reason of a
+ * failure is in `dev->error`
+ */
+bool uhci_control_transfer(struct usb_device *dev, uint8_t request_type,
+                           uint8_t request, uint16_t value, uint16_t index,
+                           uint16_t length, void *buf);
+
+/**
+ * Clear the halt feature of a stalled endpoint and reset its data toggle
+ *
+ * @param dev configured device
+ * @param endpoint endpoint number
+ * @param dir UHCI_DIR_IN or UHCI_DIR_OUT
+ * @return true if the request completed
+ */
+bool uhci_clear_halt(struct usb_device *dev, uint8_t endpoint, uint8_t dir);
@@ -0,0 +1,651 @@
+#include "fat.h"
+
+#include <stddef.h>
+
+#include "mem/mem.h"
+#include "utils/utils.h"
+
+/*
+ * Microsoft Extensible Firmware Initiative FAT32 File System Specification
+ * 1.03, BPB and directory entry layouts
+ */
+
+struct __attribute__((__packed__)) fat_bpb {
+	uint8_t jump[3];
+	uint8_t oem_name[8];
+	uint16_t bytes_per_sector;
+	uint8_t sectors_per_cluster;
+	uint16_t reserved_sectors;
+	uint8_t fats_num;
+	uint16_t root_entries;
+	uint16_t total_sectors_16;
+	uint8_t media;
+	uint16_t fat_size_16;
+	uint16_t sectors_per_track;
+	uint16_t heads;
+	uint32_t hidden_sectors;
+	uint32_t total_sectors_32;
+	// FAT32 only
+	uint32_t fat_size_32;
+	uint16_t ext_flags;
+	uint16_t fs_version;
+	uint32_t root_cluster;
+};
+
+struct __attribute__((__packed__)) fat_dirent {
+	uint8_t name[11]; // 8.3, space padded
+	uint8_t attr;
+	uint8_t nt_res;
+	uint8_t create_time_tenth;
+	uint16_t create_time;
+	uint16_t create_date;
+	uint16_t access_date;
+	uint16_t cluster_hi;
+	uint16_t write_time;
+	uint16_t write_date;
+	uint16_t cluster_lo;
+	uint32_t size;
+};
+
+struct __attribute__((__packed__)) fat_lfn {
+	uint8_t order;
+	uint16_t name1[5];
+	uint8_t attr;
+	uint8_t type;
+	uint8_t checksum;
+	uint16_t name2[6];
+	uint16_t cluster;
+	uint16_t name3[2];
+};
+
+#define FAT_BOOT_SIG_OFF 510
+#define FAT_DIRENT_SIZE  32
+#define FAT_DIRENT_END   0x00
+#define FAT_DIRENT_FREE  0xe5
+#define FAT_DIRENT_KANJI 0x05 // first byte is 0xe5
+#define FAT_LFN_LAST     0x40
+#define FAT_LFN_SEQ_MASK 0x1f
+#define FAT_LFN_CHARS    13
+
+// Cluster counts that select the FAT type
+#define FAT12_MAX_CLUSTERS 4084
+#define FAT16_MAX_CLUSTERS 65524
+
+#define FAT12_EOC    0xff8
+#define FAT16_EOC    0xfff8
+#define FAT32_EOC    0x0ffffff8
+#define FAT32_MASK   0x0fffffff
+#define FAT_FIRST_CLUSTER 2
+
+static uint16_t fat_le16(const uint8_t *buf) {
+	return (uint16_t)(buf[0] | buf[1] << 8);
+}
+
+static uint32_t fat_le32(const uint8_t *buf) {
+	return (uint32_t)buf[0] | (uint32_t)buf[1] << 8 | (uint32_t)buf[2] << 16
+	       | (uint32_t)buf[3] << 24;
+}
+
+static char fat_upper(char ch) {
+	return (ch >= 'a' && ch <= 'z') ? (char)(ch - 'a' + 'A') : ch;
+}
+
+static bool fat_name_eq(const char *a, const char *b, uint32_t b_len) {
+	uint32_t i = 0;
+
+	for (; i < b_len; ++i) {
+		if (a[i] == '\0' || fat_upper(a[i]) != fat_upper(b[i]))
+			return false;
+	}
+
+	return a[i] == '\0';
+}
+
+static bool fat_is_pow2(uint32_t val) {
+	return val != 0 && (val & (val - 1)) == 0;
+}
+
+bool fat_mount(struct fat_fs *fs, struct block_device *dev) {
+	uint8_t *boot = memalloc(dev->block_size);
+	bool result = false;
+
+	memfill(fs, 0, sizeof(struct fat_fs));
+	fs->dev = dev;
+
+	if (boot == NULL || dev->block_size < 512
+	    || !block_read(dev, 0, 1, boot))
+		goto out;
+
+	const struct fat_bpb *bpb = (const struct fat_bpb *)boot;
+	uint16_t sector_size = bpb->bytes_per_sector;
+	uint16_t root_entries = bpb->root_entries;
+	uint32_t total = bpb->total_sectors_16;
+	uint32_t fat_size = bpb->fat_size_16;
+	uint16_t reserved = bpb->reserved_sectors;
+
+	if (fat_le16(&boot[FAT_BOOT_SIG_OFF]) != 0xaa55
+	    || sector_size != dev->block_size
+	    || !fat_is_pow2(bpb->sectors_per_cluster) || reserved == 0
+	    || bpb->fats_num == 0)
+		goto out;
+
+	if (total == 0)
+		total = bpb->total_sectors_32;
+	if (fat_size == 0)
+		fat_size = bpb->fat_size_32;
+
+	fs->sector_size = sector_size;
+	fs->sectors_per_cluster = bpb->sectors_per_cluster;
+	fs->fat_start = reserved;
+	fs->fat_sectors = fat_size;
+	fs->root_start = reserved + bpb->fats_num * fat_size;
+	fs->root_sectors =
+	    DIV_CEIL((uint32_t)root_entries * FAT_DIRENT_SIZE, sector_size);
+	fs->data_start = fs->root_start + fs->root_sectors;
+
+	if (fat_size == 0 || total <= fs->data_start || total > dev->block_count)
+		goto out;
+
+	fs->clusters = (total - fs->data_start) / fs->sectors_per_cluster;
+
+	if (fs->clusters <= FAT12_MAX_CLUSTERS) {
+		fs->type = FAT_TYPE_12;
+	} else if (fs->clusters <= FAT16_MAX_CLUSTERS) {
+		fs->type = FAT_TYPE_16;
+	} else {
+		fs->type = FAT_TYPE_32;
+		fs->root_cluster = bpb->root_cluster;
+		if (root_entries != 0)
+			goto out;
+	}
+
+	// the FAT has to cover every cluster
+	if ((uint64_t)(fs->clusters + FAT_FIRST_CLUSTER) * fs->type
+	    > (uint64_t)fat_size * sector_size * 8)
+		goto out;
+
+	fs->fat_cache = memalloc((uint32_t)sector_size * FAT_CACHE_SECTORS);
+	fs->sector_buf = memalloc(sector_size);
+	result = fs->fat_cache != NULL && fs->sector_buf != NULL;
+
+out:
+	memfree(boot);
+	if (!result)
+		fat_unmount(fs);
+	return result;
+}
+
+void fat_unmount(struct fat_fs *fs) {
+	memfree(fs->fat_cache);
+	memfree(fs->sector_buf);
+	fs->fat_cache = NULL;
+	fs->sector_buf = NULL;
+	fs->fat_cache_valid = false;
+}
+
+/**
+ * Look up the next cluster of a chain. FAT sectors are read in windows of
+ * FAT_CACHE_SECTORS.
+ *
+ * @param fs volume
+ * @param cluster current cluster
+ * @param next next cluster is returned here, 0 at the end of the chain
+ * @return false if the FAT could not be read or the entry is invalid
+ */
+static bool fat_next_cluster(struct fat_fs *fs, uint32_t cluster,
+                             uint32_t *next) {
+	uint32_t off = fs->type == FAT_TYPE_12 ? cluster + cluster / 2
+	                                       : cluster * (fs->type / 8u);
+	uint32_t sector = off / fs->sector_size;
+	uint32_t in_sector = off % fs->sector_size;
+
+	// a FAT12 entry may continue in the next sector
+	if (!fs->fat_cache_valid || sector < fs->fat_cache_start
+	    || sector + 1 >= fs->fat_cache_start + FAT_CACHE_SECTORS) {
+		uint32_t count = fs->fat_sectors - sector;
+		if (count > FAT_CACHE_SECTORS)
+			count = FAT_CACHE_SECTORS;
+
+		fs->fat_cache_valid = false;
+		if (!block_read(fs->dev, fs->fat_start + sector, count, fs->fat_cache))
+			return false;
+
+		fs->fat_cache_start = sector;
+		fs->fat_cache_valid = true;
+	}
+
+	const uint8_t *entry =
+	    fs->fat_cache + (sector - fs->fat_cache_start) * fs->sector_size
+	    + in_sector;
+	uint32_t val = 0;
+	uint32_t eoc = 0;
+
+	switch (fs->type) {
+	case FAT_TYPE_12:
+		val = fat_le16(entry);
+		val = (cluster & 1) ? val >> 4 : val & 0xfff;
+		eoc = FAT12_EOC;
+		break;
+	case FAT_TYPE_16:
+		val = fat_le16(entry);
+		eoc = FAT16_EOC;
+		break;
+	default:
+		val = fat_le32(entry) & FAT32_MASK;
+		eoc = FAT32_EOC;
+		break;
+	}
+
+	if (val >= eoc) {
+		*next = 0;
+		return true;
+	}
+
+	*next = val;
+	return val >= FAT_FIRST_CLUSTER
+	       && val < fs->clusters + FAT_FIRST_CLUSTER;
+}
+
+/**
+ * Walk a cluster chain once and store it as runs of contiguous clusters
+ *
+ * @param fs volume
+ * @param first first cluster, 0 for an empty chain
+ * @param file runs and run count are set here
+ * @return false on a broken chain or a failed allocation
+ */
+static bool fat_load_chain(struct fat_fs *fs, uint32_t first,
+                           struct fat_file *file) {
+	uint32_t cap = 4;
+	uint32_t cluster = first;
+	uint32_t file_cluster = 0;
+
+	file->runs = NULL;
+	file->runs_num = 0;
+
+	if (first == 0)
+		return true;
+
+	if (first < FAT_FIRST_CLUSTER || first >= fs->clusters + FAT_FIRST_CLUSTER)
+		return false;
+
+	file->runs = memalloc(sizeof(struct fat_run) * cap);
+
+	while (file->runs != NULL) {
+		struct fat_run *last =
+		    file->runs_num > 0 ? &file->runs[file->runs_num - 1] : NULL;
+
+		if (last != NULL && last->cluster + last->count == cluster) {
+			++last->count;
+		} else {
+			if (file->runs_num == cap) {
+				struct fat_run *runs =
+				    memalloc(sizeof(struct fat_run) * cap * 2);
+				if (runs == NULL)
+					break;
+
+				memcopy(runs, file->runs, sizeof(struct fat_run) * cap);
+				memfree(file->runs);
+				file->runs = runs;
+				cap *= 2;
+			}
+
+			file->runs[file->runs_num].file_cluster = file_cluster;
+			file->runs[file->runs_num].cluster = cluster;
+			file->runs[file->runs_num].count = 1;
+			++file->runs_num;
+		}
+
+		// a chain longer than the volume is a loop
+		if (++file_cluster > fs->clusters || !fat_next_cluster(fs, cluster, &cluster))
+			break;
+
+		if (cluster == 0)
+			return true;
+	}
+
+	memfree(file->runs);
+	file->runs = NULL;
+	file->runs_num = 0;
+	return false;
+}
+
+/**
+ * Map a sector of a file to a block of the device
+ *
+ * @param file opened file
+ * @param sector sector index in the file
+ * @param lba block of the sector is returned here
+ * @param contig number of contiguous sectors from `sector` is returned here
+ * @return false if the sector is outside of the chain
+ */
+static bool fat_map(const struct fat_file *file, uint32_t sector,
+                    uint32_t *lba, uint32_t *contig) {
+	const struct fat_fs *fs = file->fs;
+	uint32_t spc = fs->sectors_per_cluster;
+	uint32_t file_cluster = sector / spc;
+	uint32_t lo = 0;
+	uint32_t hi = file->runs_num;
+
+	if (file->fixed_root) {
+		if (sector >= fs->root_sectors)
+			return false;
+
+		*lba = fs->root_start + sector;
+		*contig = fs->root_sectors - sector;
+		return true;
+	}
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		const struct fat_run *run = &file->runs[mid];
+
+		if (file_cluster < run->file_cluster) {
+			hi = mid;
+		} else if (file_cluster >= run->file_cluster + run->count) {
+			lo = mid + 1;
+		} else {
+			uint32_t off = (file_cluster - run->file_cluster) * spc + sector % spc;
+
+			*lba = fs->data_start + (run->cluster - FAT_FIRST_CLUSTER) * spc + off;
+			*contig = run->count * spc - off;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool fat_read(struct fat_file *file, void *buf, uint32_t len,
+              uint32_t *read_len) {
+	struct fat_fs *fs = file->fs;
+	uint8_t *pos = buf;
+
+	*read_len = 0;
+
+	if (file->pos >= file->size)
+		return true;
+
+	if (len > file->size - file->pos)
+		len = file->size - file->pos;
+
+	while (len > 0) {
+		uint32_t sector = file->pos / fs->sector_size;
+		uint32_t off = file->pos % fs->sector_size;
+		uint32_t lba = 0;
+		uint32_t contig = 0;
+		uint32_t n = 0;
+
+		if (!fat_map(file, sector, &lba, &contig))
+			return false;
+
+		if (off != 0 || len < fs->sector_size) {
+			n = fs->sector_size - off;
+			if (n > len)
+				n = len;
+
+			if (!block_read(fs->dev, lba, 1, fs->sector_buf))
+				return false;
+
+			memcopy(pos, fs->sector_buf + off, n);
+		} else {
+			uint32_t sectors = len / fs->sector_size;
+			if (sectors > contig)
+				sectors = contig;
+
+			// the whole run in one read, straight into the caller's buffer
+			if (!block_read(fs->dev, lba, sectors, pos))
+				return false;
+
+			n = sectors * fs->sector_size;
+		}
+
+		file->pos += n;
+		pos += n;
+		len -= n;
+		*read_len += n;
+	}
+
+	return true;
+}
+
+bool fat_seek(struct fat_file *file, uint32_t pos) {
+	if (pos > file->size)
+		return false;
+
+	file->pos = pos;
+	return true;
+}
+
+void fat_close(struct fat_file *file) {
+	memfree(file->runs);
+	file->runs = NULL;
+	file->runs_num = 0;
+}
+
+static bool fat_open_chain(struct fat_fs *fs, uint32_t cluster, uint8_t attr,
+                           uint32_t size, struct fat_file *file) {
+	memfill(file, 0, sizeof(struct fat_file));
+	file->fs = fs;
+	file->attr = attr;
+
+	if (!fat_load_chain(fs, cluster, file))
+		return false;
+
+	if ((attr & FAT_ATTR_DIRECTORY) != 0) {
+		size = 0;
+		for (uint32_t i = 0; i < file->runs_num; ++i)
+			size += file->runs[i].count * fs->sectors_per_cluster
+			        * fs->sector_size;
+	}
+
+	file->size = size;
+
+	// the size may not be larger than the chain
+	uint32_t chain_clusters = 0;
+	for (uint32_t i = 0; i < file->runs_num; ++i)
+		chain_clusters += file->runs[i].count;
+
+	if (DIV_CEIL(size, (uint32_t)fs->sectors_per_cluster * fs->sector_size)
+	    > chain_clusters) {
+		fat_close(file);
+		return false;
+	}
+
+	return true;
+}
+
+static bool fat_open_root(struct fat_fs *fs, struct fat_file *file) {
+	if (fs->type == FAT_TYPE_32)
+		return fat_open_chain(fs, fs->root_cluster, FAT_ATTR_DIRECTORY, 0,
+		                      file);
+
+	memfill(file, 0, sizeof(struct fat_file));
+	file->fs = fs;
+	file->attr = FAT_ATTR_DIRECTORY;
+	file->fixed_root = true;
+	file->size = fs->root_sectors * fs->sector_size;
+	return true;
+}
+
+static uint8_t fat_lfn_checksum(const uint8_t *name) {
+	uint8_t sum = 0;
+
+	for (uint8_t i = 0; i < 11; ++i)
+		sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + name[i]);
+
+	return sum;
+}
+
+/**
+ * Copy the characters of a long file name entry to their place in the name.
+ * Characters outside of ASCII never match and are replaced with 0x7f.
+ */
+static void fat_lfn_collect(const struct fat_lfn *lfn, char *name) {
+	const uint8_t *raw = (const uint8_t *)lfn;
+	static const uint8_t offsets[FAT_LFN_CHARS] = {1,  3,  5,  7,  9,  14, 16,
+	                                               18, 20, 22, 24, 28, 30};
+	uint32_t base = ((lfn->order & FAT_LFN_SEQ_MASK) - 1u) * FAT_LFN_CHARS;
+
+	for (uint8_t i = 0; i < FAT_LFN_CHARS; ++i) {
+		uint16_t ch = fat_le16(&raw[offsets[i]]);
+
+		if (base + i >= FAT_NAME_MAX)
+			return;
+
+		if (ch == 0 || ch == 0xffff) {
+			name[base + i] = '\0';
+			return;
+		}
+
+		name[base + i] = ch < 0x80 ? (char)ch : 0x7f;
+	}
+
+	if ((lfn->order & FAT_LFN_LAST) != 0 && base + FAT_LFN_CHARS <= FAT_NAME_MAX)
+		name[base + FAT_LFN_CHARS] = '\0';
+}
+
+static void fat_short_name(const uint8_t *raw, char *name) {
+	uint8_t len = 0;
+
+	for (uint8_t i = 0; i < 8 && raw[i] != ' '; ++i)
+		name[len++] = (char)raw[i];
+
+	if (len > 0 && (uint8_t)name[0] == FAT_DIRENT_KANJI)
+		name[0] = (char)FAT_DIRENT_FREE;
+
+	if (raw[8] != ' ') {
+		name[len++] = '.';
+		for (uint8_t i = 8; i < 11 && raw[i] != ' '; ++i)
+			name[len++] = (char)raw[i];
+	}
+
+	name[len] = '\0';
+}
+
+/**
+ * Search a directory for a name
+ *
+ * @param dir opened directory
+ * @param name name to look for, not null terminated
+ * @param name_len length of `name`
+ * @param out the directory entry is returned here
+ * @return true if the name is found
+ */
+static bool fat_find(struct fat_file *dir, const char *name, uint32_t name_len,
+                     struct fat_dirent *out) {
+	struct fat_fs *fs = dir->fs;
+	uint8_t *sector = memalloc(fs->sector_size);
+	char *lfn = memalloc(FAT_NAME_MAX + 1);
+	char short_name[13];
+	uint8_t lfn_sum = 0;
+	uint8_t lfn_next = 0; // sequence number of the next expected LFN entry
+	bool lfn_valid = false;
+	bool found = false;
+	bool end = false;
+	uint32_t got = 0;
+
+	dir->pos = 0;
+	if (lfn != NULL)
+		lfn[FAT_NAME_MAX] = '\0';
+
+	while (!found && !end && sector != NULL && lfn != NULL
+	       && fat_read(dir, sector, fs->sector_size, &got) && got > 0) {
+		for (uint32_t off = 0; off + FAT_DIRENT_SIZE <= got; off += FAT_DIRENT_SIZE) {
+			const struct fat_dirent *ent =
+			    (const struct fat_dirent *)&sector[off];
+
+			if (ent->name[0] == FAT_DIRENT_END) {
+				end = true;
+				break;
+			}
+
+			if (ent->name[0] == FAT_DIRENT_FREE) {
+				lfn_valid = false;
+				continue;
+			}
+
+			if ((ent->attr & FAT_ATTR_LFN) == FAT_ATTR_LFN) {
+				const struct fat_lfn *entry = (const struct fat_lfn *)ent;
+				uint8_t seq = entry->order & FAT_LFN_SEQ_MASK;
+
+				if ((entry->order & FAT_LFN_LAST) != 0) {
+					lfn_valid = seq > 0;
+					lfn_sum = entry->checksum;
+				} else if (!lfn_valid || seq != lfn_next
+				           || entry->checksum != lfn_sum) {
+					lfn_valid = false;
+				}
+
+				if (lfn_valid) {
+					fat_lfn_collect(entry, lfn);
+					lfn_next = (uint8_t)(seq - 1);
+				}
+				continue;
+			}
+
+			if ((ent->attr & FAT_ATTR_VOLUME_ID) == 0) {
+				fat_short_name(ent->name, short_name);
+
+				if ((lfn_valid && lfn_next == 0
+				     && fat_lfn_checksum(ent->name) == lfn_sum
+				     && fat_name_eq(lfn, name, name_len))
+				    || fat_name_eq(short_name, name, name_len)) {
+					memcopy(out, (void *)ent, sizeof(struct fat_dirent));
+					found = true;
+					break;
+				}
+			}
+
+			lfn_valid = false;
+		}
+	}
+
+	memfree(sector);
+	memfree(lfn);
+	return found;
+}
+
+bool fat_open(struct fat_fs *fs, const char *path, struct fat_file *file) {
+	struct fat_file dir;
+
+	if (!fat_open_root(fs, &dir))
+		return false;
+
+	while (true) {
+		struct fat_dirent ent;
+		uint32_t len = 0;
+
+		while (*path == '/')
+			++path;
+
+		if (*path == '\0') {
+			*file = dir;
+			return true;
+		}
+
+		while (path[len] != '\0' && path[len] != '/')
+			++len;
+
+		bool found = (dir.attr & FAT_ATTR_DIRECTORY) != 0
+		             && fat_find(&dir, path, len, &ent);
+		fat_close(&dir);
+
+		if (!found)
+			return false;
+
+		uint32_t cluster = (uint32_t)ent.cluster_lo;
+		if (fs->type == FAT_TYPE_32)
+			cluster |= (uint32_t)ent.cluster_hi << 16;
+
+		// ".." of a first level directory points to the root as cluster 0
+		if (cluster == 0 && (ent.attr & FAT_ATTR_DIRECTORY) != 0) {
+			if (!fat_open_root(fs, &dir))
+				return false;
+		} else if (!fat_open_chain(fs, cluster, ent.attr, ent.size, &dir)) {
+			return false;
+		}
+
+		path += len;
+	}
+}
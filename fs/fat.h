@@ -0,0 +1,127 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "drivers/block/block.h"
+
+/*
+ * Read-only FAT12/16/32 driver.
+ *
+ * Opening a file walks its cluster chain once and keeps it as runs of
+ * contiguous clusters. Reads map the file position to a run and read every
+ * whole sector of the run with one block read straight into the caller's
+ * buffer. Only partial sectors at the ends of a read go through the sector
+ * buffer of the volume.
+ */
+
+#define FAT_TYPE_12 12
+#define FAT_TYPE_16 16
+#define FAT_TYPE_32 32
+
+// FAT sectors kept in memory while walking cluster chains
+#define FAT_CACHE_SECTORS 8
+
+// Longest path component, long file names included
+#define FAT_NAME_MAX 255
+
+// Directory entry attributes
+#define FAT_ATTR_READ_ONLY 0x01
+#define FAT_ATTR_HIDDEN    0x02
+#define FAT_ATTR_SYSTEM    0x04
+#define FAT_ATTR_VOLUME_ID 0x08
+#define FAT_ATTR_DIRECTORY 0x10
+#define FAT_ATTR_ARCHIVE   0x20
+#define FAT_ATTR_LFN       0x0f
+
+struct fat_fs {
+	struct block_device *dev;
+	uint8_t type;                // FAT_TYPE_*
+	uint8_t sectors_per_cluster;
+	uint16_t sector_size;        // bytes
+	uint32_t fat_start;          // first sector of the first FAT
+	uint32_t fat_sectors;        // sectors per FAT
+	uint32_t root_start;         // FAT12/16: first sector of the root directory
+	uint32_t root_sectors;       // FAT12/16: root directory length
+	uint32_t root_cluster;       // FAT32: first cluster of the root directory
+	uint32_t data_start;         // first sector of cluster 2
+	uint32_t clusters;           // number of data clusters
+	uint8_t *fat_cache;          // FAT_CACHE_SECTORS sectors of the FAT
+	uint32_t fat_cache_start;    // first cached FAT sector, relative to the FAT
+	bool fat_cache_valid;
+	uint8_t *sector_buf;         // one sector for partial reads
+};
+
+// Clusters `file_cluster` to `file_cluster + count - 1` of the file are the
+// contiguous clusters from `cluster`
+struct fat_run {
+	uint32_t file_cluster;
+	uint32_t cluster;
+	uint32_t count;
+};
+
+struct fat_file {
+	struct fat_fs *fs;
+	uint32_t size;        // bytes, directories: the length of the chain
+	uint8_t attr;         // FAT_ATTR_*
+	bool fixed_root;      // FAT12/16 root directory, outside of the data area
+	uint32_t pos;         // read position
+	struct fat_run *runs;
+	uint32_t runs_num;
+};
+
+/**
+ * Mount a FAT volume
+ *
+ * @param fs volume to initialize
+ * @param dev device holding the volume from its first block
+ * @return true if the volume is a FAT volume with the device's block size
+ */
+bool fat_mount(struct fat_fs *fs, struct block_device *dev);
+
+/**
+ * Free the buffers of a volume. Files of the volume must be closed first.
+ *
+ * @param fs volume to unmount
+ */
+void fat_unmount(struct fat_fs *fs);
+
+/**
+ * Open a file or directory by path. Components are separated by '/', names
+ * are compared without case against long and short names.
+ *
+ * @param fs mounted volume
+ * @param path absolute path, "/" is the root directory
+ * @param file the opened file is returned here
+ * @return true if the file is found and its cluster chain is valid
+ */
+bool fat_open(struct fat_fs *fs, const char *path, struct fat_file *file);
+
+/**
+ * Free the cluster runs of a file
+ *
+ * @param file opened file
+ */
+void fat_close(struct fat_file *file);
+
+/**
+ * Read from the current position and advance it
+ *
+ * @param file opened file
+ * @param buf destination
+ * @param len number of bytes to read
+ * @param read_len number of bytes read is returned here, less than `len` at
+ * the end of the file
+ * @return true on success; false if a block read failed
+ */
+bool fat_read(struct fat_file *file, void *buf, uint32_t len,
+              uint32_t *read_len);
+
+/**
+ * Set the read position
+ *
+ * @param file opened file
+ * @param pos new position, at most the file size
+ * @return true if the position is inside the file
+ */
+bool fat_seek(struct fat_file *file, uint32_t pos);
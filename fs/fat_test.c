@@ -0,0 +1,544 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fat.h"
+#include "mem/mem.h"
+#include "mem/mem_internal.h"
+#include "test/unity.h"
+
+#define TEST_HEAP_SIZE  (1024 * 1024)
+#define TEST_BLOCK_SIZE 512
+#define TEST_ROOT_ENTRIES 512
+
+uint8_t test_heap[TEST_HEAP_SIZE] __attribute__((aligned(16)));
+
+// Dummy synbols as no linker script is used
+uint8_t heap_start[1];
+uint8_t heap_end[1];
+
+/*
+ * Images are built in memory with the layout mkfs.fat uses: two FATs, a
+ * fixed 512 entry root directory on FAT12/16 and a root directory cluster on
+ * FAT32
+ */
+struct image {
+	uint8_t *data;
+	uint32_t sectors;
+	uint8_t type;
+	uint8_t spc;
+	uint32_t fat_start;
+	uint32_t fat_sectors;
+	uint32_t root_start;
+	uint32_t root_sectors;
+	uint32_t root_cluster;
+	uint32_t data_start;
+	uint32_t clusters;
+	uint32_t next_cluster; // first never allocated cluster
+};
+
+// Directories are 2 contiguous clusters, cluster 0 is the fixed root
+struct dir {
+	uint32_t cluster;
+	uint32_t slot;
+};
+
+static struct image img;
+static struct block_device dev;
+static struct fat_fs fs;
+static uint32_t dev_reads;
+static uint32_t dev_blocks;
+
+static bool ram_read(struct block_device *bdev, uint32_t lba, uint32_t count,
+                     void *buf) {
+	(void)bdev;
+	dev_reads++;
+	dev_blocks += count;
+	memcpy(buf, &img.data[lba * TEST_BLOCK_SIZE], count * TEST_BLOCK_SIZE);
+	return true;
+}
+
+static void put16(uint8_t *buf, uint16_t val) {
+	buf[0] = (uint8_t)val;
+	buf[1] = (uint8_t)(val >> 8);
+}
+
+static void put32(uint8_t *buf, uint32_t val) {
+	put16(buf, (uint16_t)val);
+	put16(buf + 2, (uint16_t)(val >> 16));
+}
+
+static uint32_t eoc(void) {
+	return img.type == FAT_TYPE_12   ? 0xfff
+	       : img.type == FAT_TYPE_16 ? 0xffff
+	                                 : 0x0fffffff;
+}
+
+static void set_fat(uint32_t cluster, uint32_t val) {
+	for (uint32_t copy = 0; copy < 2; ++copy) {
+		uint8_t *fat =
+		    &img.data[(img.fat_start + copy * img.fat_sectors) * TEST_BLOCK_SIZE];
+
+		if (img.type == FAT_TYPE_12) {
+			uint8_t *entry = &fat[cluster + cluster / 2];
+			uint16_t old = (uint16_t)(entry[0] | entry[1] << 8);
+
+			if (cluster & 1)
+				put16(entry, (uint16_t)((old & 0x000f) | (val << 4)));
+			else
+				put16(entry, (uint16_t)((old & 0xf000) | (val & 0xfff)));
+		} else if (img.type == FAT_TYPE_16) {
+			put16(&fat[cluster * 2], (uint16_t)val);
+		} else {
+			put32(&fat[cluster * 4], val);
+		}
+	}
+}
+
+static uint8_t *cluster_ptr(uint32_t cluster) {
+	return &img.data[(img.data_start + (cluster - 2) * img.spc) * TEST_BLOCK_SIZE];
+}
+
+static uint8_t pattern(uint32_t off, uint8_t seed) {
+	return (uint8_t)((off >> 9) * 7 + off + seed);
+}
+
+// Link the clusters and fill them with the pattern of a `size` byte file
+static void make_chain(const uint32_t *clusters, uint32_t num, uint32_t size,
+                       uint8_t seed) {
+	uint32_t cluster_size = img.spc * TEST_BLOCK_SIZE;
+
+	for (uint32_t i = 0; i < num; ++i) {
+		set_fat(clusters[i], i + 1 < num ? clusters[i + 1] : eoc());
+
+		for (uint32_t j = 0; j < cluster_size && i * cluster_size + j < size; ++j)
+			cluster_ptr(clusters[i])[j] = pattern(i * cluster_size + j, seed);
+	}
+}
+
+static uint32_t alloc_contig(uint32_t num, uint32_t size, uint8_t seed) {
+	uint32_t *clusters = malloc(num * sizeof(uint32_t));
+	uint32_t first = img.next_cluster;
+
+	TEST_ASSERT_NOT_NULL(clusters);
+	TEST_ASSERT_TRUE(first + num <= img.clusters + 2);
+
+	for (uint32_t i = 0; i < num; ++i)
+		clusters[i] = first + i;
+
+	make_chain(clusters, num, size, seed);
+	img.next_cluster += num;
+	free(clusters);
+	return first;
+}
+
+static uint8_t *dirent_ptr(struct dir *dir) {
+	uint8_t *ent = dir->cluster == 0
+	                   ? &img.data[img.root_start * TEST_BLOCK_SIZE]
+	                   : cluster_ptr(dir->cluster);
+	TEST_ASSERT_TRUE(dir->slot < 2 * img.spc * TEST_BLOCK_SIZE / 32);
+	return &ent[32 * dir->slot++];
+}
+
+static uint8_t lfn_checksum(const char *name83) {
+	uint8_t sum = 0;
+
+	for (uint8_t i = 0; i < 11; ++i)
+		sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + (uint8_t)name83[i]);
+
+	return sum;
+}
+
+static void add_entry(struct dir *dir, const char *name83, const char *lfn,
+                      uint8_t attr, uint32_t cluster, uint32_t size) {
+	static const uint8_t offsets[13] = {1,  3,  5,  7,  9,  14, 16,
+	                                    18, 20, 22, 24, 28, 30};
+
+	if (lfn != NULL) {
+		uint32_t len = (uint32_t)strlen(lfn);
+		uint32_t num = (len + 12) / 13;
+
+		for (uint32_t seq = num; seq > 0; --seq) {
+			uint8_t *ent = dirent_ptr(dir);
+
+			ent[0] = (uint8_t)(seq | (seq == num ? 0x40 : 0));
+			ent[11] = FAT_ATTR_LFN;
+			ent[13] = lfn_checksum(name83);
+
+			for (uint32_t i = 0; i < 13; ++i) {
+				uint32_t idx = (seq - 1) * 13 + i;
+				uint16_t ch = idx < len ? (uint8_t)lfn[idx]
+				              : idx == len ? 0
+				                           : 0xffff;
+				put16(&ent[offsets[i]], ch);
+			}
+		}
+	}
+
+	uint8_t *ent = dirent_ptr(dir);
+	memcpy(ent, name83, 11);
+	ent[11] = attr;
+	put16(&ent[20], (uint16_t)(cluster >> 16));
+	put16(&ent[26], (uint16_t)cluster);
+	put32(&ent[28], size);
+}
+
+static struct dir make_dir(struct dir *parent, const char *name83,
+                           const char *lfn) {
+	struct dir dir = {alloc_contig(2, 0, 0), 0};
+
+	memset(cluster_ptr(dir.cluster), 0, 2 * img.spc * TEST_BLOCK_SIZE);
+	add_entry(&dir, ".          ", NULL, FAT_ATTR_DIRECTORY, dir.cluster, 0);
+	add_entry(&dir, "..         ", NULL, FAT_ATTR_DIRECTORY,
+	          parent->cluster == img.root_cluster ? 0 : parent->cluster, 0);
+	add_entry(parent, name83, lfn, FAT_ATTR_DIRECTORY, dir.cluster, 0);
+	return dir;
+}
+
+static struct dir format(uint8_t type, uint32_t sectors, uint8_t spc) {
+	uint32_t reserved = type == FAT_TYPE_32 ? 32 : 1;
+	uint16_t root_entries = type == FAT_TYPE_32 ? 0 : TEST_ROOT_ENTRIES;
+
+	free(img.data);
+	memset(&img, 0, sizeof(img));
+	img.data = calloc(sectors, TEST_BLOCK_SIZE);
+	TEST_ASSERT_NOT_NULL(img.data);
+
+	img.sectors = sectors;
+	img.type = type;
+	img.spc = spc;
+	img.fat_start = reserved;
+	img.root_sectors = root_entries * 32u / TEST_BLOCK_SIZE;
+	// the cluster count before the FATs are subtracted is an upper bound
+	img.fat_sectors =
+	    (((sectors - reserved) / spc + 2) * type / 8 + TEST_BLOCK_SIZE - 1)
+	    / TEST_BLOCK_SIZE;
+	img.root_start = reserved + 2 * img.fat_sectors;
+	img.data_start = img.root_start + img.root_sectors;
+	img.clusters = (sectors - img.data_start) / spc;
+	img.next_cluster = 2;
+
+	uint8_t *boot = img.data;
+	boot[0] = 0xeb;
+	boot[1] = 0x58;
+	boot[2] = 0x90;
+	memcpy(&boot[3], "mkfs.fat", 8);
+	put16(&boot[11], TEST_BLOCK_SIZE);
+	boot[13] = spc;
+	put16(&boot[14], (uint16_t)reserved);
+	boot[16] = 2;
+	put16(&boot[17], root_entries);
+	if (sectors < 0x10000)
+		put16(&boot[19], (uint16_t)sectors);
+	else
+		put32(&boot[32], sectors);
+	boot[21] = 0xf8;
+	if (type == FAT_TYPE_32)
+		put32(&boot[36], img.fat_sectors);
+	else
+		put16(&boot[22], (uint16_t)img.fat_sectors);
+	boot[510] = 0x55;
+	boot[511] = 0xaa;
+
+	set_fat(0, eoc() & 0xfffffff8);
+	set_fat(1, eoc());
+
+	if (type == FAT_TYPE_32) {
+		img.root_cluster = alloc_contig(2, 0, 0);
+		put32(&boot[44], img.root_cluster);
+	}
+
+	memset(&dev, 0, sizeof(dev));
+	dev.read = ram_read;
+	dev.name = "ram";
+	dev.block_size = TEST_BLOCK_SIZE;
+	dev.block_count = sectors;
+
+	return (struct dir){img.root_cluster, 0};
+}
+
+// Files of the tree that every FAT type gets
+#define KERNEL_SIZE (400 * 512 - 123)
+#define CONFIG_SIZE 1000
+#define CONFIG_NAME "Menu List Configuration.cfg"
+
+static void make_tree(struct dir *root) {
+	uint32_t cluster_size = img.spc * TEST_BLOCK_SIZE;
+	uint32_t kernel_clusters = (KERNEL_SIZE + cluster_size - 1) / cluster_size;
+
+	add_entry(root, "USBLOADR   ", NULL, FAT_ATTR_VOLUME_ID, 0, 0);
+	add_entry(root, "KERNEL  BIN", NULL, FAT_ATTR_ARCHIVE,
+	          alloc_contig(kernel_clusters, KERNEL_SIZE, 1), KERNEL_SIZE);
+	add_entry(root, "EMPTY   TXT", NULL, FAT_ATTR_ARCHIVE, 0, 0);
+
+	struct dir boot = make_dir(root, "BOOT       ", NULL);
+	struct dir grub = make_dir(&boot, "GRUB       ", NULL);
+	add_entry(&grub, "MENULI~1CFG", CONFIG_NAME, FAT_ATTR_ARCHIVE,
+	          alloc_contig(1 + CONFIG_SIZE / cluster_size, CONFIG_SIZE, 2),
+	          CONFIG_SIZE);
+}
+
+static void check_pattern(const uint8_t *buf, uint32_t off, uint32_t len,
+                          uint8_t seed) {
+	for (uint32_t i = 0; i < len; ++i) {
+		if (buf[i] != pattern(off + i, seed))
+			TEST_FAIL_MESSAGE("file content mismatch");
+	}
+}
+
+static void read_check(const char *path, uint32_t size, uint8_t seed) {
+	struct fat_file file;
+	uint32_t got = 0;
+	uint8_t *buf = malloc(size + 1);
+
+	TEST_ASSERT_NOT_NULL(buf);
+	TEST_ASSERT_TRUE(fat_open(&fs, path, &file));
+	TEST_ASSERT_EQUAL_UINT32(size, file.size);
+	TEST_ASSERT_TRUE(fat_read(&file, buf, size + 1, &got));
+	TEST_ASSERT_EQUAL_UINT32(size, got);
+	check_pattern(buf, 0, size, seed);
+
+	// at the end of the file
+	TEST_ASSERT_TRUE(fat_read(&file, buf, 1, &got));
+	TEST_ASSERT_EQUAL_UINT32(0, got);
+
+	fat_close(&file);
+	free(buf);
+}
+
+void setUp(void) {
+	free_block_head = (struct free_block *)test_heap;
+	free_block_head->size = TEST_HEAP_SIZE;
+	free_block_head->next = 0;
+
+	dev_reads = 0;
+	dev_blocks = 0;
+}
+
+void tearDown(void) {
+	fat_unmount(&fs);
+	free(img.data);
+	img.data = NULL;
+}
+
+static void check_tree(uint8_t type, uint32_t sectors, uint8_t spc) {
+	struct dir root = format(type, sectors, spc);
+	make_tree(&root);
+
+	TEST_ASSERT_TRUE(fat_mount(&fs, &dev));
+	TEST_ASSERT_EQUAL_UINT8(type, fs.type);
+	TEST_ASSERT_EQUAL_UINT32(img.clusters, fs.clusters);
+
+	read_check("/KERNEL.BIN", KERNEL_SIZE, 1);
+	read_check("kernel.bin", KERNEL_SIZE, 1);
+	read_check("/EMPTY.TXT", 0, 0);
+	read_check("/boot/grub/" CONFIG_NAME, CONFIG_SIZE, 2);
+	read_check("/BOOT/GRUB/menu list configuration.CFG", CONFIG_SIZE, 2);
+	read_check("/boot/grub/MENULI~1.CFG", CONFIG_SIZE, 2);
+	read_check("/boot/grub/../../kernel.bin", KERNEL_SIZE, 1);
+	read_check("//boot///grub/" CONFIG_NAME, CONFIG_SIZE, 2);
+}
+
+static void test_fat12_tree(void) {
+	check_tree(FAT_TYPE_12, 4096, 1);
+}
+
+static void test_fat16_tree(void) {
+	check_tree(FAT_TYPE_16, 32768, 4);
+}
+
+static void test_fat32_tree(void) {
+	check_tree(FAT_TYPE_32, 81920, 1);
+}
+
+static void test_fat_open_missing(void) {
+	struct dir root = format(FAT_TYPE_16, 32768, 4);
+	struct fat_file file;
+
+	make_tree(&root);
+	TEST_ASSERT_TRUE(fat_mount(&fs, &dev));
+
+	TEST_ASSERT_FALSE(fat_open(&fs, "/missing.bin", &file));
+	TEST_ASSERT_FALSE(fat_open(&fs, "/KERNEL.BI", &file));
+	TEST_ASSERT_FALSE(fat_open(&fs, "/KERNEL.BIN/x", &file));
+	TEST_ASSERT_FALSE(fat_open(&fs, "/boot/Menu List", &file));
+	// the volume label is not a file
+	TEST_ASSERT_FALSE(fat_open(&fs, "/USBLOADR", &file));
+
+	TEST_ASSERT_TRUE(fat_open(&fs, "/", &file));
+	TEST_ASSERT_TRUE((file.attr & FAT_ATTR_DIRECTORY) != 0);
+	fat_close(&file);
+}
+
+static void test_fat_mount_invalid(void) {
+	format(FAT_TYPE_16, 32768, 4);
+
+	img.data[510] = 0;
+	TEST_ASSERT_FALSE(fat_mount(&fs, &dev));
+	img.data[510] = 0x55;
+
+	img.data[13] = 3; // sectors per cluster
+	TEST_ASSERT_FALSE(fat_mount(&fs, &dev));
+	img.data[13] = 4;
+
+	dev.block_size = 4096;
+	TEST_ASSERT_FALSE(fat_mount(&fs, &dev));
+	dev.block_size = TEST_BLOCK_SIZE;
+
+	TEST_ASSERT_TRUE(fat_mount(&fs, &dev));
+}
+
+// A fragmented file is read with one block read per run of clusters
+static void test_fat_fragmented(void) {
+	struct dir root = format(FAT_TYPE_16, 32768, 4);
+	uint32_t c = img.next_cluster;
+	const uint32_t clusters[] = {c, c + 1, c + 5, c + 8, c + 9, c + 10};
+	uint32_t size = 6 * 4 * TEST_BLOCK_SIZE;
+	uint8_t *buf = malloc(size);
+	struct fat_file file;
+	uint32_t got = 0;
+
+	TEST_ASSERT_NOT_NULL(buf);
+	make_chain(clusters, 6, size, 3);
+	img.next_cluster = c + 11;
+	add_entry(&root, "FRAG    BIN", NULL, FAT_ATTR_ARCHIVE, c, size);
+
+	TEST_ASSERT_TRUE(fat_mount(&fs, &dev));
+	TEST_ASSERT_TRUE(fat_open(&fs, "/FRAG.BIN", &file));
+	TEST_ASSERT_EQUAL_UINT32(3, file.runs_num);
+
+	dev_reads = 0;
+	TEST_ASSERT_TRUE(fat_read(&file, buf, size, &got));
+	TEST_ASSERT_EQUAL_UINT32(size, got);
+	TEST_ASSERT_EQUAL_UINT32(3, dev_reads);
+	check_pattern(buf, 0, size, 3);
+
+	/*
+	 * Unaligned: the partial first sector, the rest of the first run, one
+	 * whole sector of the second run, then the partial last sector
+	 */
+	dev_reads = 0;
+	TEST_ASSERT_TRUE(fat_seek(&file, 100));
+	TEST_ASSERT_TRUE(fat_read(&file, buf, 5000, &got));
+	TEST_ASSERT_EQUAL_UINT32(5000, got);
+	TEST_ASSERT_EQUAL_UINT32(4, dev_reads);
+	check_pattern(buf, 100, 5000, 3);
+
+	TEST_ASSERT_FALSE(fat_seek(&file, size + 1));
+
+	fat_close(&file);
+	free(buf);
+}
+
+// FAT12 entries that continue in the next sector, also across the FAT window
+static void test_fat12_entry_across_sectors(void) {
+	struct dir root = format(FAT_TYPE_12, 4096, 1);
+	// 341 and 2730 start at the last byte of FAT sector 0 and 7
+	const uint32_t clusters[] = {5, 341, 342, 2729, 2730, 2731, 6};
+	uint32_t size = 7 * TEST_BLOCK_SIZE - 1;
+	uint8_t *buf = malloc(size);
+	struct fat_file file;
+	uint32_t got = 0;
+
+	TEST_ASSERT_NOT_NULL(buf);
+	make_chain(clusters, 7, size, 4);
+	add_entry(&root, "SPLIT   BIN", NULL, FAT_ATTR_ARCHIVE, 5, size);
+
+	TEST_ASSERT_TRUE(fat_mount(&fs, &dev));
+	TEST_ASSERT_TRUE(fat_open(&fs, "/SPLIT.BIN", &file));
+	TEST_ASSERT_EQUAL_UINT32(4, file.runs_num);
+	TEST_ASSERT_TRUE(fat_read(&file, buf, size, &got));
+	TEST_ASSERT_EQUAL_UINT32(size, got);
+	check_pattern(buf, 0, size, 4);
+
+	fat_close(&file);
+	free(buf);
+}
+
+// A looping chain or a size beyond the chain is rejected at open
+static void test_fat_broken_chain(void) {
+	struct dir root = format(FAT_TYPE_32, 81920, 1);
+	uint32_t c = alloc_contig(4, 2048, 5);
+	struct fat_file file;
+
+	add_entry(&root, "LOOP    BIN", NULL, FAT_ATTR_ARCHIVE, c, 2048);
+	add_entry(&root, "SHORT   BIN", NULL, FAT_ATTR_ARCHIVE, c, 4096);
+	add_entry(&root, "BAD     BIN", NULL, FAT_ATTR_ARCHIVE, img.clusters + 2,
+	          512);
+
+	TEST_ASSERT_TRUE(fat_mount(&fs, &dev));
+	TEST_ASSERT_TRUE(fat_open(&fs, "/LOOP.BIN", &file));
+	fat_close(&file);
+	TEST_ASSERT_FALSE(fat_open(&fs, "/SHORT.BIN", &file));
+	TEST_ASSERT_FALSE(fat_open(&fs, "/BAD.BIN", &file));
+
+	set_fat(c + 3, c + 1);
+	fs.fat_cache_valid = false;
+	TEST_ASSERT_FALSE(fat_open(&fs, "/LOOP.BIN", &file));
+
+	set_fat(c + 3, 0x0ffffff7); // bad cluster
+	fs.fat_cache_valid = false;
+	TEST_ASSERT_FALSE(fat_open(&fs, "/LOOP.BIN", &file));
+}
+
+/*
+ * Block reads to load a 10MB kernel from FAT32 with 512 byte clusters, as a
+ * whole and in 64KB pieces. Reading cluster by cluster would take 20480 data
+ * reads and a FAT sector read for every 128 clusters.
+ */
+static void test_fat_bench_10mb(void) {
+	const uint32_t size = 10 * 1024 * 1024;
+	struct dir root = format(FAT_TYPE_32, 81920, 1);
+	uint8_t *buf = malloc(size);
+	struct fat_file file;
+	uint32_t got = 0;
+
+	TEST_ASSERT_NOT_NULL(buf);
+	add_entry(&root, "VMLINUZ    ", NULL, FAT_ATTR_ARCHIVE,
+	          alloc_contig(size / TEST_BLOCK_SIZE, size, 6), size);
+
+	TEST_ASSERT_TRUE(fat_mount(&fs, &dev));
+
+	dev_reads = 0;
+	TEST_ASSERT_TRUE(fat_open(&fs, "/VMLINUZ", &file));
+	uint32_t open_reads = dev_reads;
+
+	dev_reads = 0;
+	dev_blocks = 0;
+	TEST_ASSERT_TRUE(fat_read(&file, buf, size, &got));
+	TEST_ASSERT_EQUAL_UINT32(size, got);
+	TEST_ASSERT_EQUAL_UINT32(1, dev_reads);
+	TEST_ASSERT_EQUAL_UINT32(size / TEST_BLOCK_SIZE, dev_blocks);
+	check_pattern(buf, 0, size, 6);
+	uint32_t whole_reads = dev_reads;
+
+	dev_reads = 0;
+	TEST_ASSERT_TRUE(fat_seek(&file, 0));
+	for (uint32_t off = 0; off < size; off += 64 * 1024) {
+		TEST_ASSERT_TRUE(fat_read(&file, buf + off, 64 * 1024, &got));
+		TEST_ASSERT_EQUAL_UINT32(64 * 1024, got);
+	}
+	TEST_ASSERT_EQUAL_UINT32(size / (64 * 1024), dev_reads);
+
+	printf("FAT 10MB: open %u reads (%u runs), whole file %u reads, 64KB "
+	       "pieces %u reads, cluster by cluster %u reads\n",
+	       open_reads, file.runs_num, whole_reads, dev_reads,
+	       size / TEST_BLOCK_SIZE + size / TEST_BLOCK_SIZE / 128);
+
+	fat_close(&file);
+	free(buf);
+}
+
+int main(void) {
+	UNITY_BEGIN();
+	RUN_TEST(test_fat12_tree);
+	RUN_TEST(test_fat16_tree);
+	RUN_TEST(test_fat32_tree);
+	RUN_TEST(test_fat_open_missing);
+	RUN_TEST(test_fat_mount_invalid);
+	RUN_TEST(test_fat_fragmented);
+	RUN_TEST(test_fat12_entry_across_sectors);
+	RUN_TEST(test_fat_broken_chain);
+	RUN_TEST(test_fat_bench_10mb);
+	return UNITY_END();
+}
@@ -0,0 +1,4 @@
+SRCS += fs/fat.c
+
+# Add test target
+$(eval $(call test_target,test_fat,test/unity.c fs/fat_test.c fs/fat.c drivers/block/block.c mem/mem.c utils/sg.c))
\ No newline at end of file
@@ -0,0 +1,52 @@
+#include <stdint.h>
+
+#include "linux.h"
+#include "multiboot.h"
+
+/*
+ * Jumps to loaded kernels. Kept apart from the loaders, which are also built
+ * for the host tests.
+ */
+
+// Flat 4GB code and data at the selectors of the Linux 32-bit boot protocol
+static const uint64_t linux_gdt[4] __attribute__((aligned(8))) = {
+    0, 0, 0x00cf9a000000ffff, 0x00cf92000000ffff};
+
+void multiboot_start(const struct multiboot_image *image) {
+	__asm__ volatile("cli\n\t"
+	                 "jmp *%0"
+	                 :                                         /* Outputs  */
+	                 : "r"(image->entry),                      /* Inputs   */
+	                   "a"(MULTIBOOT_BOOTLOADER_MAGIC), "b"(image->info)
+	                 : "memory"                                /* Clobbers */
+	);
+	__builtin_unreachable();
+}
+
+void linux_start(const struct linux_image *image) {
+	struct __attribute__((__packed__)) {
+		uint16_t limit;
+		uint32_t base;
+	} gdtr = {sizeof(linux_gdt) - 1, (uint32_t)(uintptr_t)linux_gdt};
+
+	__asm__ volatile("cli\n\t"
+	                 "lgdt %0\n\t"
+	                 "ljmp $0x10, $1f\n"
+	                 "1:\n\t"
+	                 "movl $0x18, %%eax\n\t"
+	                 "movl %%eax, %%ds\n\t"
+	                 "movl %%eax, %%es\n\t"
+	                 "movl %%eax, %%fs\n\t"
+	                 "movl %%eax, %%gs\n\t"
+	                 "movl %%eax, %%ss\n\t"
+	                 "xorl %%ebp, %%ebp\n\t"
+	                 "xorl %%edi, %%edi\n\t"
+	                 "xorl %%ebx, %%ebx\n\t"
+	                 "jmp *%%ecx"
+	                 :                                         /* Outputs  */
+	                 : "m"(gdtr), "S"(image->boot_params),     /* Inputs   */
+	                   "c"(image->entry)
+	                 : "eax", "ebx", "edi", "memory"           /* Clobbers */
+	);
+	__builtin_unreachable();
+}
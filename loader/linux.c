@@ -0,0 +1,246 @@
+#include "linux.h"
+
+#include <stddef.h>
+
+#include "arch/memmap.h"
+#include "mem/mem.h"
+
+/*
+ * The Linux/x86 Boot Protocol (Documentation/arch/x86/boot.rst) and the
+ * zero page layout (Documentation/arch/x86/zero-page.rst)
+ */
+
+// Setup header, offsets in the image and in `struct boot_params`
+#define LINUX_SETUP_SECTS      0x1f1
+#define LINUX_BOOT_FLAG        0x1fe
+#define LINUX_JUMP             0x200 // the header ends at 0x202 + byte at 0x201
+#define LINUX_HEADER           0x202
+#define LINUX_VERSION          0x206
+#define LINUX_TYPE_OF_LOADER   0x210
+#define LINUX_LOADFLAGS        0x211
+#define LINUX_CODE32_START     0x214
+#define LINUX_RAMDISK_IMAGE    0x218
+#define LINUX_RAMDISK_SIZE     0x21c
+#define LINUX_CMD_LINE_PTR     0x228
+#define LINUX_INITRD_ADDR_MAX  0x22c
+#define LINUX_CMDLINE_SIZE     0x238
+#define LINUX_INIT_SIZE        0x260
+#define LINUX_HEADER_PARSE_END 0x264
+
+// Rest of `struct boot_params`
+#define LINUX_BP_VIDEO_MODE  0x006
+#define LINUX_BP_VIDEO_COLS  0x007
+#define LINUX_BP_VIDEO_LINES 0x00e
+#define LINUX_BP_VIDEO_VGA   0x00f
+#define LINUX_BP_VIDEO_FONT  0x010
+#define LINUX_BP_E820_COUNT  0x1e8
+#define LINUX_BP_E820_TABLE  0x2d0
+#define LINUX_BP_E820_MAX    128
+#define LINUX_BP_E820_SIZE   20 // packed e820 entry, no extended attributes
+#define LINUX_BP_SIZE        0x1000
+
+#define LINUX_BOOT_FLAG_MAGIC 0xaa55
+#define LINUX_HEADER_MAGIC    0x53726448 // "HdrS"
+#define LINUX_LOADED_HIGH     0x01       // bzImage, loaded at 0x100000
+#define LINUX_LOADER_UNKNOWN  0xff
+#define LINUX_SETUP_SECTS_DEF 4          // setup_sects of 0 means 4
+#define LINUX_SECTOR_SIZE     512
+#define LINUX_PAGE_MASK       0xfff
+
+extern uint8_t heap_end[];
+
+static uint16_t linux_get16(const uint8_t *buf, uint32_t off) {
+	return (uint16_t)(buf[off] | buf[off + 1] << 8);
+}
+
+static uint32_t linux_get32(const uint8_t *buf, uint32_t off) {
+	return linux_get16(buf, off) | (uint32_t)linux_get16(buf, off + 2) << 16;
+}
+
+static void linux_put32(uint8_t *buf, uint32_t off, uint32_t val) {
+	memcopy(&buf[off], &val, sizeof(val));
+}
+
+bool linux_parse_header(const uint8_t *buf, uint32_t len, uint32_t file_size,
+                        struct linux_header *hdr) {
+	if (len < LINUX_HEADER_PARSE_END + sizeof(uint32_t)
+	    || linux_get16(buf, LINUX_BOOT_FLAG) != LINUX_BOOT_FLAG_MAGIC
+	    || linux_get32(buf, LINUX_HEADER) != LINUX_HEADER_MAGIC)
+		return false;
+
+	hdr->version = linux_get16(buf, LINUX_VERSION);
+
+	// zImage is loaded under 1MB, it is not supported
+	if (hdr->version < LINUX_PROTOCOL_MIN
+	    || (buf[LINUX_LOADFLAGS] & LINUX_LOADED_HIGH) == 0)
+		return false;
+
+	uint32_t setup_sects = buf[LINUX_SETUP_SECTS];
+	if (setup_sects == 0)
+		setup_sects = LINUX_SETUP_SECTS_DEF;
+
+	hdr->setup_len = (setup_sects + 1) * LINUX_SECTOR_SIZE;
+	if (hdr->setup_len > LINUX_SETUP_MAX || hdr->setup_len >= file_size)
+		return false;
+
+	hdr->kernel_len = file_size - hdr->setup_len;
+
+	hdr->hdr_len = LINUX_HEADER + buf[LINUX_JUMP + 1] - LINUX_HDR_OFF;
+	if (hdr->hdr_len > LINUX_HDR_END - LINUX_HDR_OFF)
+		hdr->hdr_len = LINUX_HDR_END - LINUX_HDR_OFF;
+	if (hdr->hdr_len > len - LINUX_HDR_OFF)
+		return false;
+
+	// init_size is 2.10+, older kernels are assumed to fit in their image
+	hdr->init_size = hdr->version >= 0x020a
+	                     ? linux_get32(buf, LINUX_INIT_SIZE)
+	                     : 0;
+	if (hdr->init_size < hdr->kernel_len)
+		hdr->init_size = hdr->kernel_len;
+
+	hdr->initrd_addr_max = linux_get32(buf, LINUX_INITRD_ADDR_MAX);
+	hdr->cmdline_size = linux_get32(buf, LINUX_CMDLINE_SIZE);
+
+	return true;
+}
+
+bool linux_initrd_addr(uint32_t size, uint32_t addr_max, uint32_t low,
+                       uint32_t *addr) {
+	bool found = false;
+
+	for (uint32_t i = 0; i < e820_count; ++i) {
+		const struct e820_entry *entry = &e820_map[i];
+		uint64_t end = entry->base + entry->length;
+
+		if (entry->type != E820_TYPE_RAM)
+			continue;
+
+		if (end > (uint64_t)addr_max + 1)
+			end = (uint64_t)addr_max + 1;
+
+		if (end < (uint64_t)size || end - size < entry->base)
+			continue;
+
+		uint64_t start = (end - size) & ~(uint64_t)LINUX_PAGE_MASK;
+		if (start < entry->base || start < low)
+			continue;
+
+		if (!found || start > *addr) {
+			*addr = (uint32_t)start;
+			found = true;
+		}
+	}
+
+	return found;
+}
+
+/**
+ * Read a whole file to a physical address
+ */
+static bool linux_read_to(struct stream *file, uint32_t offset,
+                          uint32_t len, uint32_t addr) {
+	uint32_t got = 0;
+
+	return stream_seek(file, offset)
+	       && stream_read(file, (void *)(uintptr_t)addr, len, &got)
+	       && got == len;
+}
+
+static void linux_fill_boot_params(uint8_t *bp, const uint8_t *window,
+                                   const struct linux_header *hdr) {
+	memfill(bp, 0, LINUX_BP_SIZE);
+	memcopy(&bp[LINUX_HDR_OFF], (void *)&window[LINUX_HDR_OFF], hdr->hdr_len);
+
+	bp[LINUX_TYPE_OF_LOADER] = LINUX_LOADER_UNKNOWN;
+	linux_put32(bp, LINUX_CODE32_START, LINUX_KERNEL_ADDR);
+
+	// 80x25 VGA text mode, as left by print.c
+	bp[LINUX_BP_VIDEO_MODE] = 3;
+	bp[LINUX_BP_VIDEO_COLS] = 80;
+	bp[LINUX_BP_VIDEO_LINES] = 25;
+	bp[LINUX_BP_VIDEO_VGA] = 1;
+	bp[LINUX_BP_VIDEO_FONT] = 16;
+
+	uint32_t count = e820_count < LINUX_BP_E820_MAX ? e820_count
+	                                                : LINUX_BP_E820_MAX;
+	for (uint32_t i = 0; i < count; ++i)
+		memcopy(&bp[LINUX_BP_E820_TABLE + i * LINUX_BP_E820_SIZE], &e820_map[i],
+		        LINUX_BP_E820_SIZE);
+	bp[LINUX_BP_E820_COUNT] = (uint8_t)count;
+}
+
+bool linux_load(struct stream *kernel, struct stream *initrd,
+                const char *cmdline, struct linux_image *image) {
+	uint8_t *window = memalloc(LINUX_HEADER_WINDOW);
+	uint8_t *bp = NULL;
+	char *cmdline_copy = NULL;
+	struct linux_header hdr;
+	uint32_t window_len = 0;
+
+	if (window == NULL || !stream_seek(kernel, 0)
+	    || !stream_read(kernel, window, LINUX_HEADER_WINDOW, &window_len)
+	    || !linux_parse_header(window, window_len, kernel->size, &hdr))
+		goto fail;
+
+	// the setup area may not overlap the loader
+	if ((uintptr_t)heap_end > LINUX_SETUP_ADDR
+	    || !memmap_is_ram(LINUX_SETUP_ADDR, LINUX_SETUP_MAX)
+	    || !memmap_is_ram(LINUX_KERNEL_ADDR, hdr.init_size))
+		goto fail;
+
+	// no copy of the image, both parts are read to their places front to
+	// back, the start of the setup code is already in the window
+	uint32_t head = window_len < hdr.setup_len ? window_len : hdr.setup_len;
+	memcopy((void *)(uintptr_t)LINUX_SETUP_ADDR, window, head);
+
+	if (!linux_read_to(kernel, head, hdr.setup_len - head,
+	                   LINUX_SETUP_ADDR + head)
+	    || !linux_read_to(kernel, hdr.setup_len, hdr.kernel_len,
+	                      LINUX_KERNEL_ADDR)
+	    || !stream_finish(kernel))
+		goto fail;
+
+	bp = memalloc(LINUX_BP_SIZE);
+	if (bp == NULL)
+		goto fail;
+
+	linux_fill_boot_params(bp, window, &hdr);
+
+	if (initrd != NULL && initrd->size > 0) {
+		uint32_t addr = 0;
+
+		if (!linux_initrd_addr(initrd->size, hdr.initrd_addr_max,
+		                       LINUX_KERNEL_ADDR + hdr.init_size, &addr)
+		    || !linux_read_to(initrd, 0, initrd->size, addr)
+		    || !stream_finish(initrd))
+			goto fail;
+
+		linux_put32(bp, LINUX_RAMDISK_IMAGE, addr);
+		linux_put32(bp, LINUX_RAMDISK_SIZE, initrd->size);
+	}
+
+	if (cmdline != NULL) {
+		uint32_t len = 0;
+		while (cmdline[len] != '\0' && len < hdr.cmdline_size)
+			++len;
+
+		cmdline_copy = memalloc(len + 1);
+		if (cmdline_copy == NULL)
+			goto fail;
+
+		memcopy(cmdline_copy, (void *)cmdline, len);
+		cmdline_copy[len] = '\0';
+		linux_put32(bp, LINUX_CMD_LINE_PTR, (uint32_t)(uintptr_t)cmdline_copy);
+	}
+
+	memfree(window);
+	image->entry = LINUX_KERNEL_ADDR;
+	image->boot_params = (uint32_t)(uintptr_t)bp;
+	return true;
+
+fail:
+	memfree(cmdline_copy);
+	memfree(bp);
+	memfree(window);
+	return false;
+}
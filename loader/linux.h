@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "loader/stream.h"
+
+/*
+ * Linux x86 boot protocol loader, 32-bit entry. The real-mode setup code is
+ * read to LINUX_SETUP_ADDR and the protected-mode kernel straight to
+ * LINUX_KERNEL_ADDR; only the first LINUX_HEADER_WINDOW bytes of the image
+ * are buffered to parse the setup header. The initrd goes to the top of RAM
+ * allowed by the kernel.
+ */
+
+// Parsed from a buffer of this many bytes from the start of the image
+#define LINUX_HEADER_WINDOW 1024
+
+#define LINUX_SETUP_ADDR  0x90000
+#define LINUX_SETUP_MAX   0x8000 // setup code, boot sector included
+#define LINUX_KERNEL_ADDR 0x100000
+
+// Oldest boot protocol with cmdline_size and initrd_addr_max
+#define LINUX_PROTOCOL_MIN 0x0206
+
+// Where the setup header is and ends at most in `struct boot_params`
+#define LINUX_HDR_OFF 0x1f1
+#define LINUX_HDR_END 0x290
+
+struct linux_header {
+	uint16_t version;         // boot protocol version
+	uint32_t setup_len;       // bytes of real-mode code, boot sector included
+	uint32_t kernel_len;      // bytes of protected-mode code
+	uint32_t init_size;       // memory the kernel needs from its load address
+	uint32_t initrd_addr_max; // highest address the initrd may occupy
+	uint32_t cmdline_size;    // longest command line, without the terminator
+	uint32_t hdr_len;         // bytes of the setup header from LINUX_HDR_OFF
+};
+
+struct linux_image {
+	uint32_t entry;       // 32-bit entry point
+	uint32_t boot_params; // physical address of `struct boot_params`
+};
+
+/**
+ * Parse and check the setup header of a bzImage
+ *
+ * @param buf start of the image
+ * @param len length of `buf`, at least LINUX_HEADER_WINDOW unless the file is
+ * shorter
+ * @param file_size size of the whole image
+ * @param hdr the parsed header is returned here
+ * @return true if the image is a bzImage with a supported boot protocol
+ */
+bool linux_parse_header(const uint8_t *buf, uint32_t len, uint32_t file_size,
+                        struct linux_header *hdr);
+
+/**
+ * Find the highest page aligned place for an initrd in RAM
+ *
+ * @param size initrd size
+ * @param addr_max highest address the initrd may occupy
+ * @param low lowest address the initrd may start at
+ * @param addr the address is returned here
+ * @return true if there is a place
+ */
+bool linux_initrd_addr(uint32_t size, uint32_t addr_max, uint32_t low,
+                       uint32_t *addr);
+
+/**
+ * Load a bzImage and an optional initrd and fill `struct boot_params`
+ *
+ * @param kernel bzImage stream, opened without gunzip
+ * @param initrd initrd stream opened without gunzip, the kernel unpacks it,
+ * NULL for none
+ * @param cmdline kernel command line, NULL for none
+ * @param image entry and boot_params addresses are returned here
+ * @return false if the image is not supported, does not fit into memory, a
+ * read failed or a CRC does not match
+ */
+bool linux_load(struct stream *kernel, struct stream *initrd,
+                const char *cmdline, struct linux_image *image);
+
+/**
+ * Enter a loaded kernel through the 32-bit boot protocol: interrupts off, flat
+ * __BOOT_CS (0x10) and __BOOT_DS (0x18) segments, ESI at boot_params. Devices
+ * doing DMA must be stopped before.
+ *
+ * @param image loaded kernel
+ */
+void linux_start(const struct linux_image *image) __attribute__((noreturn));
@@ -0,0 +1,203 @@
+#include <string.h>
+
+#include "arch/memmap.h"
+#include "linux.h"
+#include "mem/mem_internal.h"
+#include "test/unity.h"
+
+#define TEST_HEAP_SIZE (64 * 1024)
+#define TEST_MB        0x100000u
+
+uint8_t test_heap[TEST_HEAP_SIZE] __attribute__((aligned(16)));
+
+// Dummy synbols as no linker script is used
+uint8_t heap_start[1];
+uint8_t heap_end[1];
+
+// Filled by stage2_entry.asm on the target
+uint32_t e820_count;
+struct e820_entry e820_map[E820_MAX];
+
+static uint8_t image[LINUX_HEADER_WINDOW];
+static struct linux_header hdr;
+
+static void put16(uint32_t off, uint16_t val) {
+	image[off] = (uint8_t)val;
+	image[off + 1] = (uint8_t)(val >> 8);
+}
+
+static void put32(uint32_t off, uint32_t val) {
+	put16(off, (uint16_t)val);
+	put16(off + 2, (uint16_t)(val >> 16));
+}
+
+/*
+ * The first KB of a bzImage with the setup header fields the loader reads.
+ * No kernel image is available to the tests, the values follow the header
+ * of kernels built with the given protocol version.
+ */
+static void make_header(uint16_t version, uint8_t setup_sects,
+                        uint8_t jump) {
+	memset(image, 0, sizeof(image));
+
+	image[0x1f1] = setup_sects;
+	put16(0x1fe, 0xaa55);
+	image[0x200] = 0xeb;
+	image[0x201] = jump;
+	memcpy(&image[0x202], "HdrS", 4);
+	put16(0x206, version);
+	image[0x211] = 0x01; // LOADED_HIGH
+	put32(0x214, TEST_MB);
+	put32(0x22c, version >= 0x020a ? 0x7fffffff : 0x37ffffff);
+	put32(0x238, version >= 0x020a ? 2047 : 255);
+	put32(0x260, 0x2000000); // init_size, 2.10+
+}
+
+static void add_e820(uint64_t base, uint64_t length, uint32_t type) {
+	e820_map[e820_count].base = base;
+	e820_map[e820_count].length = length;
+	e820_map[e820_count].type = type;
+	e820_map[e820_count].ext_attr = 1;
+	++e820_count;
+}
+
+void setUp(void) {
+	free_block_head = (struct free_block *)test_heap;
+	free_block_head->size = TEST_HEAP_SIZE;
+	free_block_head->next = 0;
+
+	e820_count = 0;
+	memset(&hdr, 0, sizeof(hdr));
+}
+
+void tearDown(void) {}
+
+// Protocol 2.15 (6.x), init_size above the image size
+static void test_linux_header_modern(void) {
+	make_header(0x020f, 27, 0x6a);
+
+	TEST_ASSERT_TRUE(linux_parse_header(image, sizeof(image), 10 * TEST_MB, &hdr));
+	TEST_ASSERT_EQUAL_HEX16(0x020f, hdr.version);
+	TEST_ASSERT_EQUAL_UINT32(28 * 512, hdr.setup_len);
+	TEST_ASSERT_EQUAL_UINT32(10 * TEST_MB - 28 * 512, hdr.kernel_len);
+	TEST_ASSERT_EQUAL_HEX32(0x2000000, hdr.init_size);
+	TEST_ASSERT_EQUAL_HEX32(0x7fffffff, hdr.initrd_addr_max);
+	TEST_ASSERT_EQUAL_UINT32(2047, hdr.cmdline_size);
+	TEST_ASSERT_EQUAL_UINT32(0x202 + 0x6a - 0x1f1, hdr.hdr_len);
+}
+
+// Protocol 2.06 (2.6.22) has no init_size, the image size is used
+static void test_linux_header_2_06(void) {
+	make_header(0x0206, 12, 0x4c);
+
+	TEST_ASSERT_TRUE(linux_parse_header(image, sizeof(image), 2 * TEST_MB, &hdr));
+	TEST_ASSERT_EQUAL_UINT32(13 * 512, hdr.setup_len);
+	TEST_ASSERT_EQUAL_UINT32(hdr.kernel_len, hdr.init_size);
+	TEST_ASSERT_EQUAL_HEX32(0x37ffffff, hdr.initrd_addr_max);
+	TEST_ASSERT_EQUAL_UINT32(255, hdr.cmdline_size);
+}
+
+static void test_linux_header_setup_sects_zero(void) {
+	make_header(0x020f, 0, 0x6a);
+
+	TEST_ASSERT_TRUE(linux_parse_header(image, sizeof(image), TEST_MB, &hdr));
+	TEST_ASSERT_EQUAL_UINT32(5 * 512, hdr.setup_len);
+}
+
+// The copied header never runs past its place in boot_params
+static void test_linux_header_long_jump(void) {
+	make_header(0x020f, 27, 0xff);
+
+	TEST_ASSERT_TRUE(linux_parse_header(image, sizeof(image), TEST_MB, &hdr));
+	TEST_ASSERT_EQUAL_UINT32(LINUX_HDR_END - LINUX_HDR_OFF, hdr.hdr_len);
+}
+
+static void test_linux_header_invalid(void) {
+	make_header(0x020f, 27, 0x6a);
+	image[0x1fe] = 0;
+	TEST_ASSERT_FALSE(linux_parse_header(image, sizeof(image), TEST_MB, &hdr));
+
+	make_header(0x020f, 27, 0x6a);
+	image[0x202] = 'h';
+	TEST_ASSERT_FALSE(linux_parse_header(image, sizeof(image), TEST_MB, &hdr));
+
+	make_header(0x0205, 27, 0x6a);
+	TEST_ASSERT_FALSE(linux_parse_header(image, sizeof(image), TEST_MB, &hdr));
+
+	// zImage
+	make_header(0x020f, 27, 0x6a);
+	image[0x211] = 0;
+	TEST_ASSERT_FALSE(linux_parse_header(image, sizeof(image), TEST_MB, &hdr));
+
+	// setup code larger than its area
+	make_header(0x020f, 64, 0x6a);
+	TEST_ASSERT_FALSE(linux_parse_header(image, sizeof(image), TEST_MB, &hdr));
+
+	// nothing after the setup code
+	make_header(0x020f, 27, 0x6a);
+	TEST_ASSERT_FALSE(linux_parse_header(image, sizeof(image), 28 * 512, &hdr));
+
+	// truncated before the fields the loader reads
+	TEST_ASSERT_FALSE(linux_parse_header(image, 0x250, TEST_MB, &hdr));
+}
+
+// A typical PC map: low memory, the BIOS area, RAM up to 2GB with ACPI on top
+static void make_pc_map(void) {
+	add_e820(0, 0x9fc00, E820_TYPE_RAM);
+	add_e820(0x9fc00, 0x400, E820_TYPE_RESERVED);
+	add_e820(0xf0000, 0x10000, E820_TYPE_RESERVED);
+	add_e820(TEST_MB, 0x7ff00000 - TEST_MB, E820_TYPE_RAM);
+	add_e820(0x7ff00000, 0x100000, E820_TYPE_ACPI);
+}
+
+static void test_linux_initrd_top(void) {
+	uint32_t addr = 0;
+	uint32_t size = 5 * TEST_MB + 123;
+
+	make_pc_map();
+
+	// below initrd_addr_max, page aligned
+	TEST_ASSERT_TRUE(linux_initrd_addr(size, 0x37ffffff, 0x2100000, &addr));
+	TEST_ASSERT_EQUAL_HEX32((0x38000000 - size) & ~0xfffu, addr);
+
+	// below the end of RAM
+	TEST_ASSERT_TRUE(linux_initrd_addr(size, 0x7fffffff, 0x2100000, &addr));
+	TEST_ASSERT_EQUAL_HEX32((0x7ff00000 - size) & ~0xfffu, addr);
+	TEST_ASSERT_TRUE(addr + size <= 0x7ff00000);
+
+	// not below the kernel, and not in low memory
+	TEST_ASSERT_FALSE(linux_initrd_addr(size, 0x2100000 + 5 * TEST_MB, 0x2100000,
+	                                    &addr));
+}
+
+// The highest region that fits wins, not the largest
+static void test_linux_initrd_regions(void) {
+	uint32_t addr = 0;
+
+	add_e820(TEST_MB, 63 * TEST_MB, E820_TYPE_RAM);
+	add_e820(64 * TEST_MB, TEST_MB, E820_TYPE_BAD);
+	add_e820(65 * TEST_MB, 2 * TEST_MB, E820_TYPE_RAM);
+
+	TEST_ASSERT_TRUE(linux_initrd_addr(TEST_MB, 0x37ffffff, 16 * TEST_MB, &addr));
+	TEST_ASSERT_EQUAL_HEX32(66 * TEST_MB, addr);
+
+	TEST_ASSERT_TRUE(linux_initrd_addr(3 * TEST_MB, 0x37ffffff, 16 * TEST_MB,
+	                                   &addr));
+	TEST_ASSERT_EQUAL_HEX32(61 * TEST_MB, addr);
+
+	// without a memory map the top of RAM is not known
+	e820_count = 0;
+	TEST_ASSERT_FALSE(linux_initrd_addr(TEST_MB, 0x37ffffff, 0, &addr));
+}
+
+int main(void) {
+	UNITY_BEGIN();
+	RUN_TEST(test_linux_header_modern);
+	RUN_TEST(test_linux_header_2_06);
+	RUN_TEST(test_linux_header_setup_sects_zero);
+	RUN_TEST(test_linux_header_long_jump);
+	RUN_TEST(test_linux_header_invalid);
+	RUN_TEST(test_linux_initrd_top);
+	RUN_TEST(test_linux_initrd_regions);
+	return UNITY_END();
+}
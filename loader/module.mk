@@ -0,0 +1,7 @@
+SRCS += loader/handoff.c \
+        loader/linux.c \
+        loader/multiboot.c \
+        loader/stream.c
+
+# Add test target
+$(eval $(call test_target,test_linux,test/unity.c loader/linux_test.c loader/linux.c loader/stream.c utils/inflate.c utils/crc32.c arch/memmap.c fs/fat.c drivers/block/block.c mem/mem.c utils/sg.c))
\ No newline at end of file
@@ -0,0 +1,386 @@
+#include "multiboot.h"
+
+#include <stddef.h>
+
+#include "arch/memmap.h"
+#include "mem/mem.h"
+
+/*
+ * Multiboot Specification version 0.6.96 and the ELF-32 format of the
+ * System V ABI
+ */
+
+#define MULTIBOOT_HEADER_MAGIC 0x1badb002
+
+#define MULTIBOOT_FLAG_PAGE_ALIGN  0x00000001 // modules on page boundaries
+#define MULTIBOOT_FLAG_MEMORY      0x00000002 // mem_* and mmap_* are required
+#define MULTIBOOT_FLAG_AOUT_KLUDGE 0x00010000 // load addresses in the header
+// A loader has to refuse a kernel that requires a feature it does not know
+#define MULTIBOOT_FLAGS_REQUIRED  0x0000ffff
+#define MULTIBOOT_FLAGS_SUPPORTED (MULTIBOOT_FLAG_PAGE_ALIGN | MULTIBOOT_FLAG_MEMORY)
+
+#define MULTIBOOT_INFO_MEMORY      0x00000001
+#define MULTIBOOT_INFO_CMDLINE     0x00000004
+#define MULTIBOOT_INFO_MEM_MAP     0x00000040
+#define MULTIBOOT_INFO_LOADER_NAME 0x00000200
+
+struct __attribute__((__packed__)) multiboot_header {
+	uint32_t magic;
+	uint32_t flags;
+	uint32_t checksum;
+	// MULTIBOOT_FLAG_AOUT_KLUDGE only
+	uint32_t header_addr;
+	uint32_t load_addr;
+	uint32_t load_end_addr; // 0: to the end of the file
+	uint32_t bss_end_addr;  // 0: no BSS
+	uint32_t entry_addr;
+};
+
+struct __attribute__((__packed__)) multiboot_info {
+	uint32_t flags;       // MULTIBOOT_INFO_*
+	uint32_t mem_lower;   // KB from 0
+	uint32_t mem_upper;   // KB from 1MB
+	uint32_t boot_device;
+	uint32_t cmdline;
+	uint32_t mods_count;
+	uint32_t mods_addr;
+	uint32_t syms[4];
+	uint32_t mmap_length; // bytes
+	uint32_t mmap_addr;
+	uint32_t drives_length;
+	uint32_t drives_addr;
+	uint32_t config_table;
+	uint32_t boot_loader_name;
+	uint32_t apm_table;
+};
+
+struct __attribute__((__packed__)) multiboot_mmap_entry {
+	uint32_t size; // of the rest of the entry
+	uint64_t base_addr;
+	uint64_t length;
+	uint32_t type;
+};
+
+struct __attribute__((__packed__)) elf32_ehdr {
+	uint8_t ident[16];
+	uint16_t type;
+	uint16_t machine;
+	uint32_t version;
+	uint32_t entry;
+	uint32_t phoff;
+	uint32_t shoff;
+	uint32_t flags;
+	uint16_t ehsize;
+	uint16_t phentsize;
+	uint16_t phnum;
+	uint16_t shentsize;
+	uint16_t shnum;
+	uint16_t shstrndx;
+};
+
+struct __attribute__((__packed__)) elf32_phdr {
+	uint32_t type;
+	uint32_t offset;
+	uint32_t vaddr;
+	uint32_t paddr;
+	uint32_t filesz;
+	uint32_t memsz;
+	uint32_t flags;
+	uint32_t align;
+};
+
+#define ELF_CLASS_32    1
+#define ELF_DATA_LSB    1
+#define ELF_TYPE_EXEC   2
+#define ELF_MACHINE_386 3
+#define ELF_PT_LOAD     1
+// Most program headers accepted
+#define ELF_PHNUM_MAX 32
+
+static const char loader_name[] = "USBLoader";
+
+/**
+ * Check that a load range is above the loader and inside RAM
+ */
+static bool multiboot_usable(uint32_t addr, uint32_t len) {
+	return len == 0
+	       || (addr >= MULTIBOOT_LOAD_MIN
+	           && (uint64_t)addr + len <= 0x100000000ull
+	           && memmap_is_ram(addr, len));
+}
+
+/**
+ * Place one segment. The part of the segment already in the header window is
+ * copied from there, the rest is read from the file to its address.
+ *
+ * @param file kernel stream
+ * @param window the first `window_len` bytes of the file
+ * @param window_len length of `window`
+ * @param offset file offset of the segment
+ * @param filesz bytes in the file
+ * @param memsz bytes in memory, the rest after `filesz` is zeroed
+ * @param addr load address
+ * @return false if the segment is outside of usable memory or the file
+ */
+static bool multiboot_load_segment(struct stream *file, uint8_t *window,
+                                   uint32_t window_len, uint32_t offset,
+                                   uint32_t filesz, uint32_t memsz,
+                                   uint32_t addr) {
+	uint8_t *dst = (uint8_t *)(uintptr_t)addr;
+	uint32_t copied = 0;
+	uint32_t got = 0;
+
+	if (filesz > memsz || !multiboot_usable(addr, memsz)
+	    || offset > file->size || filesz > file->size - offset)
+		return false;
+
+	if (offset < window_len) {
+		copied = window_len - offset;
+		if (copied > filesz)
+			copied = filesz;
+
+		memcopy(dst, window + offset, copied);
+	}
+
+	if (copied < filesz) {
+		if (!stream_seek(file, offset + copied)
+		    || !stream_read(file, dst + copied, filesz - copied, &got)
+		    || got != filesz - copied)
+			return false;
+	}
+
+	memfill(dst + filesz, 0, memsz - filesz);
+	return true;
+}
+
+static bool multiboot_load_aout(struct stream *file, uint8_t *window,
+                                uint32_t window_len,
+                                const struct multiboot_header *hdr,
+                                uint32_t hdr_offset, uint32_t *entry) {
+	if (hdr->header_addr < hdr->load_addr
+	    || hdr->header_addr - hdr->load_addr > hdr_offset)
+		return false;
+
+	uint32_t offset = hdr_offset - (hdr->header_addr - hdr->load_addr);
+	uint32_t filesz = file->size - offset;
+	uint32_t memsz = 0;
+
+	if (hdr->load_end_addr != 0) {
+		if (hdr->load_end_addr < hdr->load_addr)
+			return false;
+		filesz = hdr->load_end_addr - hdr->load_addr;
+	}
+
+	memsz = filesz;
+	if (hdr->bss_end_addr != 0) {
+		if (hdr->bss_end_addr < hdr->load_addr + filesz)
+			return false;
+		memsz = hdr->bss_end_addr - hdr->load_addr;
+	}
+
+	*entry = hdr->entry_addr;
+	return multiboot_load_segment(file, window, window_len, offset, filesz,
+	                              memsz, hdr->load_addr);
+}
+
+static bool multiboot_load_elf(struct stream *file, uint8_t *window,
+                               uint32_t window_len, uint32_t *entry) {
+	const struct elf32_ehdr *ehdr = (const struct elf32_ehdr *)window;
+	uint8_t *phdrs = NULL;
+	uint8_t order[ELF_PHNUM_MAX];
+	uint8_t loads = 0;
+	bool result = false;
+
+	if (window_len < sizeof(struct elf32_ehdr) || ehdr->ident[0] != 0x7f
+	    || ehdr->ident[1] != 'E' || ehdr->ident[2] != 'L'
+	    || ehdr->ident[3] != 'F' || ehdr->ident[4] != ELF_CLASS_32
+	    || ehdr->ident[5] != ELF_DATA_LSB || ehdr->type != ELF_TYPE_EXEC
+	    || ehdr->machine != ELF_MACHINE_386
+	    || ehdr->phentsize < sizeof(struct elf32_phdr) || ehdr->phnum == 0
+	    || ehdr->phnum > ELF_PHNUM_MAX)
+		return false;
+
+	uint32_t phdrs_len = (uint32_t)ehdr->phnum * ehdr->phentsize;
+
+	// program headers are almost always in the window, read them otherwise
+	if (ehdr->phoff <= window_len && phdrs_len <= window_len - ehdr->phoff) {
+		phdrs = window + ehdr->phoff;
+	} else {
+		uint32_t got = 0;
+
+		phdrs = memalloc(phdrs_len);
+		if (phdrs == NULL || !stream_seek(file, ehdr->phoff)
+		    || !stream_read(file, phdrs, phdrs_len, &got) || got != phdrs_len)
+			goto out;
+	}
+
+	// load in file order, so the file is read front to back
+	for (uint8_t i = 0; i < ehdr->phnum; ++i) {
+		const struct elf32_phdr *ph =
+		    (const struct elf32_phdr *)&phdrs[i * ehdr->phentsize];
+
+		if (ph->type != ELF_PT_LOAD || ph->memsz == 0)
+			continue;
+
+		uint8_t pos = loads++;
+		while (pos > 0
+		       && ((const struct elf32_phdr *)&phdrs[order[pos - 1]
+		                                             * ehdr->phentsize])
+		                  ->offset
+		              > ph->offset) {
+			order[pos] = order[pos - 1];
+			--pos;
+		}
+		order[pos] = i;
+	}
+
+	result = loads > 0;
+	for (uint8_t i = 0; result && i < loads; ++i) {
+		const struct elf32_phdr *ph =
+		    (const struct elf32_phdr *)&phdrs[order[i] * ehdr->phentsize];
+
+		result = multiboot_load_segment(file, window, window_len, ph->offset,
+		                                ph->filesz, ph->memsz, ph->paddr);
+	}
+
+	*entry = ehdr->entry;
+
+out:
+	if (phdrs != NULL && (phdrs < window || phdrs >= window + window_len))
+		memfree(phdrs);
+	return result;
+}
+
+/**
+ * Build the Multiboot information from the BIOS memory map
+ *
+ * @return the information or NULL if an allocation failed
+ */
+static struct multiboot_info *multiboot_build_info(const char *cmdline) {
+	struct multiboot_info *info = memalloc(sizeof(struct multiboot_info));
+
+	if (info == NULL)
+		return NULL;
+
+	memfill(info, 0, sizeof(struct multiboot_info));
+	info->flags = MULTIBOOT_INFO_LOADER_NAME;
+	info->boot_loader_name = (uint32_t)(uintptr_t)loader_name;
+
+	if (cmdline != NULL) {
+		uint32_t len = 0;
+		while (cmdline[len] != '\0')
+			++len;
+
+		char *copy = memalloc(len + 1);
+		if (copy == NULL)
+			goto fail;
+
+		memcopy(copy, (void *)cmdline, len + 1);
+		info->cmdline = (uint32_t)(uintptr_t)copy;
+		info->flags |= MULTIBOOT_INFO_CMDLINE;
+	}
+
+	if (e820_count == 0)
+		return info;
+
+	struct multiboot_mmap_entry *mmap =
+	    memalloc(sizeof(struct multiboot_mmap_entry) * e820_count);
+	if (mmap == NULL)
+		goto fail;
+
+	bool lower = false;
+	bool upper = false;
+
+	for (uint32_t i = 0; i < e820_count; ++i) {
+		const struct e820_entry *entry = &e820_map[i];
+
+		mmap[i].size = sizeof(struct multiboot_mmap_entry) - sizeof(uint32_t);
+		mmap[i].base_addr = entry->base;
+		mmap[i].length = entry->length;
+		mmap[i].type = entry->type;
+
+		if (entry->type != E820_TYPE_RAM)
+			continue;
+
+		// mem_lower is at most 640KB, mem_upper is the first hole from 1MB
+		if (entry->base == 0) {
+			uint64_t len = entry->length < 0xa0000 ? entry->length : 0xa0000;
+			info->mem_lower = (uint32_t)(len / 1024);
+			lower = true;
+		} else if (entry->base == MULTIBOOT_LOAD_MIN) {
+			uint64_t len = entry->length / 1024;
+			info->mem_upper = len > 0xffffffff ? 0xffffffff : (uint32_t)len;
+			upper = true;
+		}
+	}
+
+	info->mmap_addr = (uint32_t)(uintptr_t)mmap;
+	info->mmap_length = sizeof(struct multiboot_mmap_entry) * e820_count;
+	info->flags |= MULTIBOOT_INFO_MEM_MAP;
+	if (lower && upper)
+		info->flags |= MULTIBOOT_INFO_MEMORY;
+
+	return info;
+
+fail:
+	memfree((void *)(uintptr_t)info->cmdline);
+	memfree(info);
+	return NULL;
+}
+
+bool multiboot_load(struct stream *file, const char *cmdline,
+                    struct multiboot_image *image) {
+	uint8_t *window = memalloc(MULTIBOOT_SEARCH);
+	const struct multiboot_header *hdr = NULL;
+	uint32_t hdr_offset = 0;
+	uint32_t window_len = 0;
+	uint32_t entry = 0;
+	bool result = false;
+
+	if (window == NULL || !stream_seek(file, 0)
+	    || !stream_read(file, window, MULTIBOOT_SEARCH, &window_len))
+		goto out;
+
+	// 32 bit aligned, the a.out kludge fields included
+	for (uint32_t off = 0; off + sizeof(struct multiboot_header) <= window_len;
+	     off += 4) {
+		const struct multiboot_header *cand =
+		    (const struct multiboot_header *)&window[off];
+
+		if (cand->magic == MULTIBOOT_HEADER_MAGIC
+		    && cand->magic + cand->flags + cand->checksum == 0) {
+			hdr = cand;
+			hdr_offset = off;
+			break;
+		}
+	}
+
+	if (hdr == NULL)
+		goto out;
+
+	// refuse required features that are not provided
+	uint32_t required = hdr->flags & MULTIBOOT_FLAGS_REQUIRED;
+	if ((required & ~(uint32_t)MULTIBOOT_FLAGS_SUPPORTED) != 0
+	    || ((required & MULTIBOOT_FLAG_MEMORY) != 0 && e820_count == 0))
+		goto out;
+
+	if (hdr->flags & MULTIBOOT_FLAG_AOUT_KLUDGE)
+		result = multiboot_load_aout(file, window, window_len, hdr, hdr_offset,
+		                             &entry);
+	else
+		result = multiboot_load_elf(file, window, window_len, &entry);
+
+	result = result && stream_finish(file);
+
+	if (result) {
+		struct multiboot_info *info = multiboot_build_info(cmdline);
+
+		image->entry = entry;
+		image->info = (uint32_t)(uintptr_t)info;
+		result = info != NULL;
+	}
+
+out:
+	memfree(window);
+	return result;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "loader/stream.h"
+
+/*
+ * Multiboot (v1) kernel loader. The kernel is streamed from a file: only the
+ * first MULTIBOOT_SEARCH bytes are kept in a buffer to find the Multiboot and
+ * ELF headers, every segment is read from the file straight to its load
+ * address. ELF32 kernels and a.out kludge kernels (header flag bit 16) are
+ * supported, modules and video modes are not. Gzip compressed kernels are
+ * decompressed on the fly, see loader/stream.h.
+ */
+
+// The Multiboot header must be in this many bytes at the start of the file
+#define MULTIBOOT_SEARCH 8192
+
+// Segments may not be loaded below this, the loader lives there
+#define MULTIBOOT_LOAD_MIN 0x100000
+
+// EAX at the kernel entry
+#define MULTIBOOT_BOOTLOADER_MAGIC 0x2badb002
+
+struct multiboot_image {
+	uint32_t entry; // physical entry address
+	uint32_t info;  // physical address of the Multiboot information
+};
+
+/**
+ * Load a kernel to its load addresses and build the Multiboot information
+ * with the BIOS memory map
+ *
+ * @param file kernel stream, opened with gunzip to accept compressed kernels,
+ * read from its start and finished
+ * @param cmdline kernel command line, NULL for none
+ * @param image entry and information addresses are returned here
+ * @return false if the file is not a loadable Multiboot kernel, a segment is
+ * outside of usable memory, a read failed or the CRC does not match
+ */
+bool multiboot_load(struct stream *file, const char *cmdline,
+                    struct multiboot_image *image);
+
+/**
+ * Jump to a loaded kernel with interrupts disabled. Devices doing DMA must be
+ * stopped before.
+ *
+ * @param image loaded kernel
+ */
+void multiboot_start(const struct multiboot_image *image)
+    __attribute__((noreturn));
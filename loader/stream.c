@@ -0,0 +1,199 @@
+#include "stream.h"
+
+#include <stddef.h>
+
+#include "mem/mem.h"
+#include "utils/crc32.h"
+
+/**
+ * Read from the file and add the data to the CRC. Checked reads are split into
+ * STREAM_CHECK_PIECE pieces, each is summed right after it arrived.
+ */
+static bool stream_file_read(struct stream *stream, uint8_t *buf,
+                             uint32_t len, uint32_t *read_len) {
+	uint32_t got = 0;
+
+	*read_len = 0;
+	if (!stream->check)
+		return fat_read(stream->file, buf, len, read_len);
+
+	while (len > 0) {
+		uint32_t piece = len < STREAM_CHECK_PIECE ? len : STREAM_CHECK_PIECE;
+
+		if (!fat_read(stream->file, buf, piece, &got))
+			return false;
+
+		stream->crc = crc32(stream->crc, buf, got);
+		stream->file_pos += got;
+		*read_len += got;
+		if (got < piece)
+			break;
+
+		buf += got;
+		len -= got;
+	}
+
+	return true;
+}
+
+/**
+ * inflate input callback: read the next chunk of the file
+ */
+static bool stream_fill(void *ctx, const uint8_t **buf, uint32_t *len) {
+	struct stream *stream = ctx;
+
+	*buf = stream->chunk;
+	return stream_file_read(stream, stream->chunk, STREAM_CHUNK, len);
+}
+
+bool stream_open(struct stream *stream, struct fat_file *file, bool gunzip) {
+	uint8_t magic[4];
+	uint32_t got = 0;
+
+	stream->file = file;
+	stream->inflate = NULL;
+	stream->chunk = NULL;
+	stream->size = file->size;
+	stream->pos = 0;
+	stream->crc = 0;
+	stream->file_pos = 0;
+	stream->expected = 0;
+	stream->check = false;
+
+	if (!gunzip)
+		return fat_seek(file, 0);
+
+	if (!fat_seek(file, 0) || !fat_read(file, magic, 2, &got))
+		return false;
+
+	if (got < 2 || magic[0] != 0x1f || magic[1] != 0x8b)
+		return fat_seek(file, 0);
+
+	// the decompressed size modulo 4GB closes the gzip trailer
+	if (file->size < 18 || !fat_seek(file, file->size - 4)
+	    || !fat_read(file, magic, 4, &got) || got != 4 || !fat_seek(file, 0))
+		return false;
+
+	stream->size = (uint32_t)magic[0] | (uint32_t)magic[1] << 8
+	               | (uint32_t)magic[2] << 16 | (uint32_t)magic[3] << 24;
+
+	stream->inflate = memalloc(sizeof(struct inflate_state));
+	stream->chunk = memalloc(STREAM_CHUNK);
+	if (stream->inflate == NULL || stream->chunk == NULL) {
+		stream_close(stream);
+		return false;
+	}
+
+	// the gzip header is parsed at the first read, after stream_expect_crc()
+	inflate_init(stream->inflate, NULL, NULL);
+	return true;
+}
+
+void stream_close(struct stream *stream) {
+	memfree(stream->inflate);
+	memfree(stream->chunk);
+	stream->inflate = NULL;
+	stream->chunk = NULL;
+}
+
+void stream_expect_crc(struct stream *stream, uint32_t crc) {
+	stream->expected = crc;
+	stream->check = true;
+}
+
+/**
+ * Parse the gzip header before the first compressed read
+ */
+static bool stream_start(struct stream *stream) {
+	return stream->inflate->fill != NULL
+	       || inflate_init_gzip(stream->inflate, stream_fill, stream);
+}
+
+/**
+ * At the end of a compressed stream the trailer is checked, a longer stream
+ * is corrupted
+ */
+static bool stream_end(struct stream *stream) {
+	uint8_t end = 0;
+	uint32_t got = 0;
+
+	return stream->inflate == NULL || stream->pos < stream->size
+	       || (inflate_read(stream->inflate, &end, 1, &got) && got == 0);
+}
+
+bool stream_read(struct stream *stream, void *buf, uint32_t len,
+                 uint32_t *read_len) {
+	if (stream->inflate == NULL) {
+		if (!stream_file_read(stream, buf, len, read_len))
+			return false;
+		stream->pos += *read_len;
+		return true;
+	}
+
+	if (len > stream->size - stream->pos)
+		len = stream->size - stream->pos;
+
+	if (!stream_start(stream)
+	    || !inflate_read(stream->inflate, buf, len, read_len)
+	    || *read_len != len)
+		return false;
+
+	stream->pos += len;
+	return stream_end(stream);
+}
+
+bool stream_seek(struct stream *stream, uint32_t pos) {
+	if (pos > stream->size)
+		return false;
+
+	if (stream->inflate != NULL) {
+		if (pos < stream->pos || !stream_start(stream)
+		    || !inflate_skip(stream->inflate, pos - stream->pos))
+			return false;
+
+		stream->pos = pos;
+		return stream_end(stream);
+	}
+
+	if (!stream->check) {
+		if (!fat_seek(stream->file, pos))
+			return false;
+
+		stream->pos = pos;
+		return true;
+	}
+
+	// every byte of a checked file passes the CRC, skipped ones too
+	while (stream->pos < pos) {
+		uint8_t buf[512];
+		uint32_t len = pos - stream->pos;
+		uint32_t got = 0;
+
+		if (len > sizeof(buf))
+			len = sizeof(buf);
+		if (!stream_read(stream, buf, len, &got) || got != len)
+			return false;
+	}
+
+	return stream->pos == pos;
+}
+
+bool stream_finish(struct stream *stream) {
+	uint8_t buf[512];
+	uint32_t got = 0;
+
+	if (!stream->check)
+		return true;
+
+	if (!stream_seek(stream, stream->size))
+		return false;
+
+	// the end of a compressed file after the trailer, if any
+	do {
+		if (!stream_file_read(stream, buf, sizeof(buf), &got))
+			return false;
+	} while (got > 0);
+
+	return stream->file_pos == stream->file->size
+	       && stream->crc == stream->expected;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fs/fat.h"
+#include "utils/inflate.h"
+
+/*
+ * Sequential reader for kernel files. A gzip compressed file is decompressed
+ * while it is read: each chunk read from the device is handed to inflate as
+ * it arrives and the output is written straight to the destination. Seeking
+ * is free for plain files and forward only for compressed ones.
+ *
+ * The CRC-32 of the file is computed on the same chunks right after they
+ * are read, a stream with an expected CRC is checked by stream_finish().
+ */
+
+// Bytes of compressed input read from the file at once
+#define STREAM_CHUNK (32 * 1024)
+
+// Piece size of checked plain reads. It spans several 64KB mass storage
+// commands, so the device pipelines them as it does for unchecked reads.
+#define STREAM_CHECK_PIECE (256 * 1024)
+
+struct stream {
+	struct fat_file *file;
+	struct inflate_state *inflate; // NULL if the file is not compressed
+	uint8_t *chunk;
+	uint32_t size;     // decompressed size
+	uint32_t pos;      // position in the decompressed data
+	uint32_t crc;      // CRC-32 of the file bytes read so far
+	uint32_t file_pos; // file bytes covered by `crc`
+	uint32_t expected; // CRC-32 of the whole file
+	bool check;        // compare `crc` with `expected` at the end
+};
+
+/**
+ * Open a file for streaming
+ *
+ * @param stream stream to initialize
+ * @param file opened file, read from its start
+ * @param gunzip decompress the file if it has a gzip header
+ * @return false if a read or an allocation failed or the gzip header is
+ * corrupted
+ */
+bool stream_open(struct stream *stream, struct fat_file *file, bool gunzip);
+
+/**
+ * Release the buffers of a stream, the file stays open
+ */
+void stream_close(struct stream *stream);
+
+/**
+ * Check the file against a CRC-32 when the stream is finished. The whole file
+ * has to be read front to back, so backward seeks fail from now on.
+ *
+ * @param stream stream not read yet
+ * @param crc CRC-32 of the file
+ */
+void stream_expect_crc(struct stream *stream, uint32_t crc);
+
+/**
+ * Read from the current position
+ *
+ * @param stream opened stream
+ * @param buf destination
+ * @param len bytes to read
+ * @param read_len bytes read are returned here, less than `len` only at the
+ * end of the data
+ * @return false if a read failed or the compressed data is corrupted
+ */
+bool stream_read(struct stream *stream, void *buf, uint32_t len,
+                 uint32_t *read_len);
+
+/**
+ * Set the position
+ *
+ * @param stream opened stream
+ * @param pos new position
+ * @return false if `pos` is past the end or before the current position of a
+ * compressed or checked stream
+ */
+bool stream_seek(struct stream *stream, uint32_t pos);
+
+/**
+ * Read the rest of a checked stream and compare its CRC
+ *
+ * @param stream opened stream
+ * @return false if the CRC does not match or a read failed, true for
+ * unchecked streams
+ */
+bool stream_finish(struct stream *stream);
@@ -1,4 +1,5 @@
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "mem.h"
@@ -297,8 +298,19 @@ void *memcopy(void *dst, void *src, uint32_t size) {
 }
 
 void *memfill(void *buf, uint8_t byte, uint32_t size) {
+	typedef uint32_t __attribute__((__may_alias__)) word;
 	uint8_t *dst8 = buf;
 	uint8_t *end8 = dst8 + size;
+	word pattern = byte * 0x01010101u;
+
+	// head bytes up to a word boundary, whole words, then the tail
+	while (dst8 < end8 && ((uintptr_t)dst8 & (sizeof(word) - 1)) != 0)
+		*dst8++ = byte;
+
+	while (end8 - dst8 >= (ptrdiff_t)sizeof(word)) {
+		*(word *)dst8 = pattern;
+		dst8 += sizeof(word);
+	}
 
 	while (dst8 < end8)
 		*dst8++ = byte;
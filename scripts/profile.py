@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+"""Symbolize a USBLoader PIT profiler dump and print a flat profile.
+
+Build with `make PROFILE=true`, capture COM1 (e.g. QEMU `-serial file:com1.log`)
+and run:
+
+    scripts/profile.py com1.log [--elf build/usbloader.elf] [--map build/usbloader.map]
+
+Symbols are read with `nm` from the ELF. If that fails, the linker map is used.
+"""
+
+import argparse
+import bisect
+import re
+import subprocess
+import sys
+
+
+def symbols_from_elf(elf):
+    out = subprocess.run(["nm", "-n", "--defined-only", elf],
+                         check=True, capture_output=True, text=True).stdout
+    syms = []
+    for line in out.splitlines():
+        parts = line.split()
+        if len(parts) != 3 or parts[1] not in "tTwW":
+            continue
+        syms.append((int(parts[0], 16), parts[2]))
+    return syms
+
+
+def symbols_from_map(path):
+    # GNU ld map lines: "                0x00008123                stage2_main"
+    sym_re = re.compile(r"^\s+0x([0-9a-fA-F]+)\s+([A-Za-z_.][\w.]*)\s*$")
+    syms = []
+    with open(path) as f:
+        for line in f:
+            m = sym_re.match(line)
+            if m:
+                syms.append((int(m.group(1), 16), m.group(2)))
+    syms.sort()
+    return syms
+
+
+def parse_dump(path):
+    samples = []
+    total = other = 0
+    in_dump = False
+    with open(path, errors="replace") as f:
+        for line in f:
+            line = line.strip()
+            if line.startswith("PROFILE BEGIN"):
+                # keep only the last dump in the log
+                samples = []
+                in_dump = True
+            elif line.startswith("PROFILE END"):
+                _, _, total, other = line.split()
+                total, other = int(total), int(other)
+                in_dump = False
+            elif in_dump:
+                addr, cnt = line.split()
+                samples.append((int(addr, 16), int(cnt)))
+    return samples, total, other
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__,
+                                 formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("dump", help="serial log containing a PROFILE dump")
+    ap.add_argument("--elf", default="build/usbloader.elf")
+    ap.add_argument("--map", default="build/usbloader.map")
+    args = ap.parse_args()
+
+    try:
+        syms = symbols_from_elf(args.elf)
+    except (OSError, subprocess.CalledProcessError):
+        syms = symbols_from_map(args.map)
+
+    if not syms:
+        sys.exit("no symbols found")
+
+    samples, total, other = parse_dump(args.dump)
+    if total == 0:
+        sys.exit("no PROFILE dump found")
+
+    addrs = [a for a, _ in syms]
+    per_func = {}
+    for addr, cnt in samples:
+        idx = bisect.bisect_right(addrs, addr) - 1
+        name = syms[idx][1] if idx >= 0 else "??"
+        per_func[name] = per_func.get(name, 0) + cnt
+
+    if other:
+        per_func["<outside stage2>"] = other
+
+    print(f"{'%':>7} {'samples':>9}  function")
+    for name, cnt in sorted(per_func.items(), key=lambda x: -x[1]):
+        print(f"{100.0 * cnt / total:7.2f} {cnt:9d}  {name}")
+    print(f"{100.0:7.2f} {total:9d}  total (1 sample = 1ms)")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,68 @@
+#include "crc32.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CRC32_POLY 0xedb88320
+
+/*
+ * Slice-by-8: table k holds the CRC of a byte followed by k zero bytes, so
+ * eight bytes are folded in with eight independent lookups per iteration
+ * instead of a dependent chain of eight.
+ */
+static uint32_t crc32_table[8][256];
+static bool crc32_table_ready = false;
+
+static void crc32_init(void) {
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t crc = i;
+
+		for (uint8_t bit = 0; bit < 8; ++bit)
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32_POLY : crc >> 1;
+
+		crc32_table[0][i] = crc;
+	}
+
+	for (uint32_t i = 0; i < 256; ++i) {
+		for (uint8_t k = 1; k < 8; ++k)
+			crc32_table[k][i] = crc32_table[0][crc32_table[k - 1][i] & 0xff]
+			                    ^ (crc32_table[k - 1][i] >> 8);
+	}
+
+	crc32_table_ready = true;
+}
+
+uint32_t crc32(uint32_t crc, const void *buf, uint32_t len) {
+	typedef uint32_t __attribute__((__may_alias__)) word;
+	const uint8_t *pos = buf;
+
+	if (!crc32_table_ready)
+		crc32_init();
+
+	crc = ~crc;
+
+	// bytes up to a word boundary, 8 byte slices, then the tail
+	while (len > 0 && ((uintptr_t)pos & (sizeof(word) - 1)) != 0) {
+		crc = crc32_table[0][(crc ^ *pos++) & 0xff] ^ (crc >> 8);
+		--len;
+	}
+
+	// little endian: the first byte is in the low bits of a word
+	while (len >= 8) {
+		uint32_t lo = *(const word *)pos ^ crc;
+		uint32_t hi = *(const word *)(pos + 4);
+
+		crc = crc32_table[7][lo & 0xff] ^ crc32_table[6][(lo >> 8) & 0xff]
+		      ^ crc32_table[5][(lo >> 16) & 0xff] ^ crc32_table[4][lo >> 24]
+		      ^ crc32_table[3][hi & 0xff] ^ crc32_table[2][(hi >> 8) & 0xff]
+		      ^ crc32_table[1][(hi >> 16) & 0xff] ^ crc32_table[0][hi >> 24];
+
+		pos += 8;
+		len -= 8;
+	}
+
+	while (len-- > 0)
+		crc = crc32_table[0][(crc ^ *pos++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
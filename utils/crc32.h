@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * CRC-32 (IEEE 802.3, reflected, as used by GPT and zlib)
+ *
+ * @param crc result of the previous call, 0 for the first call
+ * @param buf data
+ * @param len length of `buf` in bytes
+ * @return CRC of all data passed so far
+ */
+uint32_t crc32(uint32_t crc, const void *buf, uint32_t len);
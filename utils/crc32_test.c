@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc32.h"
+#include "test/unity.h"
+
+#define TEST_PATTERN_LEN 4096
+#define TEST_BENCH_LEN   (16 * 1024 * 1024)
+
+static uint8_t pattern[TEST_PATTERN_LEN];
+
+// Bit at a time, straight from the definition
+static uint32_t crc32_bitwise(uint32_t crc, const uint8_t *buf, uint32_t len) {
+	crc = ~crc;
+	while (len-- > 0) {
+		crc ^= *buf++;
+		for (uint8_t bit = 0; bit < 8; ++bit)
+			crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+	}
+
+	return ~crc;
+}
+
+// One table lookup per byte, the previous implementation
+static uint32_t crc32_bytewise(uint32_t crc, const uint8_t *buf,
+                               uint32_t len) {
+	static uint32_t table[256];
+
+	if (table[1] == 0) {
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t val = i;
+			for (uint8_t bit = 0; bit < 8; ++bit)
+				val = (val & 1) ? (val >> 1) ^ 0xedb88320 : val >> 1;
+			table[i] = val;
+		}
+	}
+
+	crc = ~crc;
+	while (len-- > 0)
+		crc = table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+void setUp(void) {
+	for (uint32_t i = 0; i < TEST_PATTERN_LEN; ++i)
+		pattern[i] = (uint8_t)(i * i * 31 + 7 * i);
+}
+
+void tearDown(void) {}
+
+/*
+ * Expected values are from zlib's crc32(), the CRC of GPT and gzip
+ */
+static void test_crc32_zlib_vectors(void) {
+	uint8_t *zeros = calloc(1024 * 1024, 1);
+
+	TEST_ASSERT_EQUAL_HEX32(0x00000000, crc32(0, "", 0));
+	TEST_ASSERT_EQUAL_HEX32(0xe8b7be43, crc32(0, "a", 1));
+	TEST_ASSERT_EQUAL_HEX32(0xcbf43926, crc32(0, "123456789", 9));
+	TEST_ASSERT_EQUAL_HEX32(
+	    0x414fa339, crc32(0, "The quick brown fox jumps over the lazy dog", 43));
+	TEST_ASSERT_EQUAL_HEX32(0x01b9d3c9, crc32(0, pattern, sizeof(pattern)));
+	TEST_ASSERT_EQUAL_HEX32(0xa738ea1c, crc32(0, zeros, 1024 * 1024));
+
+	free(zeros);
+}
+
+static void test_crc32_alignment(void) {
+	// every start alignment and tail length of the 8 byte loop
+	for (uint32_t off = 0; off < 8; ++off) {
+		for (uint32_t len = 0; len < 40; ++len)
+			TEST_ASSERT_EQUAL_HEX32(crc32_bitwise(0, pattern + off, len),
+			                        crc32(0, pattern + off, len));
+
+		TEST_ASSERT_EQUAL_HEX32(
+		    crc32_bitwise(0, pattern + off, TEST_PATTERN_LEN - 8),
+		    crc32(0, pattern + off, TEST_PATTERN_LEN - 8));
+	}
+}
+
+static void test_crc32_incremental(void) {
+	uint32_t whole = crc32(0, pattern, 300);
+
+	// chunks as they arrive from a transfer, split anywhere
+	for (uint32_t split = 0; split <= 300; ++split)
+		TEST_ASSERT_EQUAL_HEX32(
+		    whole,
+		    crc32(crc32(0, pattern, split), pattern + split, 300 - split));
+
+	uint32_t crc = 0;
+	for (uint32_t pos = 0; pos < TEST_PATTERN_LEN; pos += 13) {
+		uint32_t len = TEST_PATTERN_LEN - pos < 13 ? TEST_PATTERN_LEN - pos : 13;
+		crc = crc32(crc, pattern + pos, len);
+	}
+	TEST_ASSERT_EQUAL_HEX32(0x01b9d3c9, crc);
+}
+
+static double bench(uint32_t (*fn)(uint32_t, const uint8_t *, uint32_t),
+                    const uint8_t *buf, uint32_t len, uint32_t *crc) {
+	clock_t start = clock();
+
+	*crc = fn(0, buf, len);
+	return (double)len / (1024 * 1024)
+	       / ((double)(clock() - start) / CLOCKS_PER_SEC);
+}
+
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *buf, uint32_t len) {
+	return crc32(crc, buf, len);
+}
+
+static void test_crc32_bench_16mb(void) {
+	uint8_t *buf = malloc(TEST_BENCH_LEN);
+	uint32_t crc_bit = 0;
+	uint32_t crc_byte = 0;
+	uint32_t crc_slice = 0;
+
+	for (uint32_t i = 0; i < TEST_BENCH_LEN; ++i)
+		buf[i] = pattern[i % TEST_PATTERN_LEN] ^ (uint8_t)(i >> 12);
+
+	double bit = bench(crc32_bitwise, buf, TEST_BENCH_LEN, &crc_bit);
+	double byte = bench(crc32_bytewise, buf, TEST_BENCH_LEN, &crc_byte);
+	double slice = bench(crc32_slice8, buf, TEST_BENCH_LEN, &crc_slice);
+
+	TEST_ASSERT_EQUAL_HEX32(crc_bit, crc_byte);
+	TEST_ASSERT_EQUAL_HEX32(crc_bit, crc_slice);
+
+	printf("CRC32 16MB: bitwise %.0f MB/s, bytewise %.0f MB/s, slice-by-8 "
+	       "%.0f MB/s\n",
+	       bit, byte, slice);
+
+	free(buf);
+}
+
+int main(void) {
+	UNITY_BEGIN();
+	RUN_TEST(test_crc32_zlib_vectors);
+	RUN_TEST(test_crc32_alignment);
+	RUN_TEST(test_crc32_incremental);
+	RUN_TEST(test_crc32_bench_16mb);
+	return UNITY_END();
+}
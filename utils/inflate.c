@@ -0,0 +1,661 @@
+#include "inflate.h"
+
+#include <stddef.h>
+
+#include "mem/mem.h"
+#include "utils/crc32.h"
+
+#define INFLATE_MODE_HEADER  0 // next block header
+#define INFLATE_MODE_STORED  1 // in a stored block
+#define INFLATE_MODE_HUFFMAN 2 // in a fixed or dynamic Huffman block
+#define INFLATE_MODE_TRAILER 3 // after the last block
+#define INFLATE_MODE_DONE    4
+
+#define INFLATE_BLOCK_STORED  0
+#define INFLATE_BLOCK_FIXED   1
+#define INFLATE_BLOCK_DYNAMIC 2
+
+#define INFLATE_MAX_BITS  15
+#define INFLATE_END_BLOCK 256
+#define INFLATE_FAST_MASK ((1u << INFLATE_FAST_BITS) - 1)
+
+// zero bytes fed after the end of the input, so a code can be looked up
+#define INFLATE_PAD     4
+#define INFLATE_PAD_MAX 8
+
+#define GZIP_ID1     0x1f
+#define GZIP_ID2     0x8b
+#define GZIP_CM_DEFL 8
+
+#define GZIP_FLAG_HCRC     0x02
+#define GZIP_FLAG_EXTRA    0x04
+#define GZIP_FLAG_NAME     0x08
+#define GZIP_FLAG_COMMENT  0x10
+#define GZIP_FLAG_RESERVED 0xe0
+
+static const uint16_t len_base[29] = {3,  4,  5,  6,   7,   8,   9,   10,
+                                      11, 13, 15, 17,  19,  23,  27,  31,
+                                      35, 43, 51, 59,  67,  83,  99,  115,
+                                      131, 163, 195, 227, 258};
+static const uint8_t len_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                      1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                      4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t dist_base[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t dist_extra[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                       4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                       9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// order of the code length code lengths in a dynamic block header
+static const uint8_t clen_order[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                       11, 4,  12, 3, 13, 2, 14, 1, 15};
+
+static const uint8_t inflate_pad[INFLATE_PAD] = {0};
+
+/**
+ * Get the next input buffer. After the end of the input zeros are supplied a
+ * few times, decoding the last code may look ahead past the end.
+ */
+static bool inflate_refill(struct inflate_state *state) {
+	const uint8_t *buf = NULL;
+	uint32_t len = 0;
+
+	if (state->pad_bytes == 0) {
+		if (!state->fill(state->ctx, &buf, &len))
+			return false;
+
+		if (len > 0) {
+			state->in = buf;
+			state->in_end = buf + len;
+			return true;
+		}
+	}
+
+	if (state->pad_bytes >= INFLATE_PAD_MAX)
+		return false;
+
+	state->pad_bytes += INFLATE_PAD;
+	state->in = inflate_pad;
+	state->in_end = inflate_pad + INFLATE_PAD;
+	return true;
+}
+
+/**
+ * Make at least `num` bits available, at most 25
+ */
+static bool inflate_need(struct inflate_state *state, uint8_t num) {
+	while (state->bits_num < num) {
+		if (state->in == state->in_end && !inflate_refill(state)) {
+			state->error = true;
+			return false;
+		}
+
+		state->bits |= (uint32_t)*state->in++ << state->bits_num;
+		state->bits_num += 8;
+	}
+
+	return true;
+}
+
+static inline void inflate_drop(struct inflate_state *state, uint8_t num) {
+	state->bits >>= num;
+	state->bits_num -= num;
+}
+
+static bool inflate_bits(struct inflate_state *state, uint8_t num,
+                         uint32_t *val) {
+	if (!inflate_need(state, num))
+		return false;
+
+	*val = state->bits & ((1u << num) - 1);
+	inflate_drop(state, num);
+	return true;
+}
+
+/**
+ * Check whether bits of the zero padding were consumed, so the input was
+ * truncated
+ */
+static bool inflate_overrun(const struct inflate_state *state) {
+	if (state->pad_bytes == 0)
+		return false;
+
+	uint32_t loaded =
+	    8u * (state->pad_bytes - (uint32_t)(state->in_end - state->in));
+	return loaded > state->bits_num;
+}
+
+/**
+ * Build the decoding tables of a canonical Huffman code
+ *
+ * @param huff tables to fill
+ * @param lengths code length of each symbol, 0 if unused
+ * @param num number of symbols
+ * @return false if the code is over-subscribed
+ */
+static bool inflate_build(struct inflate_huffman *huff, const uint8_t *lengths,
+                          uint16_t num) {
+	uint16_t offs[INFLATE_MAX_BITS + 1];
+	int32_t left = 1;
+
+	memfill(huff->count, 0, sizeof(huff->count));
+	for (uint16_t sym = 0; sym < num; ++sym)
+		huff->count[lengths[sym]]++;
+
+	huff->count[0] = 0;
+	for (uint8_t len = 1; len <= INFLATE_MAX_BITS; ++len) {
+		left = left * 2 - huff->count[len];
+		if (left < 0)
+			return false;
+	}
+
+	offs[1] = 0;
+	for (uint8_t len = 1; len < INFLATE_MAX_BITS; ++len)
+		offs[len + 1] = (uint16_t)(offs[len] + huff->count[len]);
+
+	for (uint16_t sym = 0; sym < num; ++sym) {
+		if (lengths[sym] != 0)
+			huff->symbol[offs[lengths[sym]]++] = sym;
+	}
+
+	// codes are stored MSB first, the lookup index is the reversed code
+	memfill(huff->fast, 0, sizeof(huff->fast));
+
+	uint32_t code = 0;
+	uint16_t index = 0;
+	for (uint8_t len = 1; len <= INFLATE_FAST_BITS; ++len) {
+		for (uint16_t i = 0; i < huff->count[len]; ++i) {
+			uint32_t rev = 0;
+
+			for (uint8_t bit = 0; bit < len; ++bit)
+				rev |= ((code >> bit) & 1) << (len - 1 - bit);
+
+			for (uint32_t fill = rev; fill <= INFLATE_FAST_MASK;
+			     fill += 1u << len)
+				huff->fast[fill] =
+				    (uint16_t)((len << 9) | huff->symbol[index]);
+
+			++index;
+			++code;
+		}
+		code <<= 1;
+	}
+
+	return true;
+}
+
+/**
+ * Decode one symbol
+ *
+ * @return the symbol or -1 on invalid code or input error
+ */
+static int32_t inflate_decode(struct inflate_state *state,
+                              const struct inflate_huffman *huff) {
+	if (!inflate_need(state, INFLATE_MAX_BITS))
+		return -1;
+
+	uint16_t entry = huff->fast[state->bits & INFLATE_FAST_MASK];
+	if (entry != 0) {
+		inflate_drop(state, (uint8_t)(entry >> 9));
+		return entry & 0x1ff;
+	}
+
+	int32_t code = 0;
+	int32_t first = 0;
+	int32_t index = 0;
+
+	for (uint8_t len = 1; len <= INFLATE_MAX_BITS; ++len) {
+		int32_t count = huff->count[len];
+
+		code |= (int32_t)((state->bits >> (len - 1)) & 1);
+		if (code - first < count) {
+			inflate_drop(state, len);
+			return huff->symbol[index + code - first];
+		}
+
+		index += count;
+		first = (first + count) << 1;
+		code <<= 1;
+	}
+
+	state->error = true;
+	return -1;
+}
+
+static bool inflate_fixed(struct inflate_state *state) {
+	uint8_t lengths[288];
+	uint16_t sym = 0;
+
+	for (; sym < 144; ++sym)
+		lengths[sym] = 8;
+	for (; sym < 256; ++sym)
+		lengths[sym] = 9;
+	for (; sym < 280; ++sym)
+		lengths[sym] = 7;
+	for (; sym < 288; ++sym)
+		lengths[sym] = 8;
+
+	inflate_build(&state->litlen, lengths, 288);
+
+	// distance codes 30 and 31 are left out, they are invalid
+	memfill(lengths, 5, 30);
+	inflate_build(&state->dist, lengths, 30);
+	return true;
+}
+
+static bool inflate_dynamic(struct inflate_state *state) {
+	uint8_t lengths[286 + 30];
+	uint32_t hlit = 0;
+	uint32_t hdist = 0;
+	uint32_t hclen = 0;
+	uint32_t val = 0;
+
+	if (!inflate_bits(state, 5, &hlit) || !inflate_bits(state, 5, &hdist)
+	    || !inflate_bits(state, 4, &hclen))
+		return false;
+
+	hlit += 257;
+	hdist += 1;
+	hclen += 4;
+	if (hlit > 286 || hdist > 30)
+		return false;
+
+	for (uint8_t i = 0; i < 19; ++i) {
+		val = 0;
+		if (i < hclen && !inflate_bits(state, 3, &val))
+			return false;
+		lengths[clen_order[i]] = (uint8_t)val;
+	}
+
+	// the distance tables hold the code length code for a while
+	if (!inflate_build(&state->dist, lengths, 19))
+		return false;
+
+	uint32_t index = 0;
+	while (index < hlit + hdist) {
+		int32_t sym = inflate_decode(state, &state->dist);
+		uint8_t prev = 0;
+		uint32_t repeat = 0;
+
+		if (sym < 0)
+			return false;
+
+		if (sym < 16) {
+			lengths[index++] = (uint8_t)sym;
+			continue;
+		}
+
+		if (sym == 16) {
+			if (index == 0 || !inflate_bits(state, 2, &repeat))
+				return false;
+			prev = lengths[index - 1];
+			repeat += 3;
+		} else if (sym == 17) {
+			if (!inflate_bits(state, 3, &repeat))
+				return false;
+			repeat += 3;
+		} else {
+			if (!inflate_bits(state, 7, &repeat))
+				return false;
+			repeat += 11;
+		}
+
+		if (index + repeat > hlit + hdist)
+			return false;
+
+		memfill(&lengths[index], prev, repeat);
+		index += repeat;
+	}
+
+	if (lengths[INFLATE_END_BLOCK] == 0)
+		return false;
+
+	return inflate_build(&state->litlen, lengths, (uint16_t)hlit)
+	       && inflate_build(&state->dist, lengths + hlit, (uint16_t)hdist);
+}
+
+/**
+ * Read the gzip trailer and check it against the output
+ */
+static bool inflate_trailer(struct inflate_state *state) {
+	uint32_t lo = 0;
+	uint32_t hi = 0;
+
+	inflate_drop(state, state->bits_num % 8);
+
+	if (!inflate_bits(state, 16, &lo) || !inflate_bits(state, 16, &hi)
+	    || (lo | hi << 16) != state->crc)
+		return false;
+
+	if (!inflate_bits(state, 16, &lo) || !inflate_bits(state, 16, &hi)
+	    || (lo | hi << 16) != state->total)
+		return false;
+
+	return !inflate_overrun(state);
+}
+
+static bool inflate_block_header(struct inflate_state *state) {
+	uint32_t final = 0;
+	uint32_t type = 0;
+	uint32_t len = 0;
+	uint32_t nlen = 0;
+
+	if (state->final) {
+		state->mode = INFLATE_MODE_TRAILER;
+		return true;
+	}
+
+	if (!inflate_bits(state, 1, &final) || !inflate_bits(state, 2, &type))
+		return false;
+
+	state->final = final != 0;
+
+	switch (type) {
+	case INFLATE_BLOCK_STORED:
+		inflate_drop(state, state->bits_num % 8);
+		if (!inflate_bits(state, 16, &len) || !inflate_bits(state, 16, &nlen)
+		    || len != (~nlen & 0xffff))
+			return false;
+
+		state->stored_left = len;
+		state->mode = INFLATE_MODE_STORED;
+		return true;
+	case INFLATE_BLOCK_FIXED:
+		state->mode = INFLATE_MODE_HUFFMAN;
+		return inflate_fixed(state);
+	case INFLATE_BLOCK_DYNAMIC:
+		state->mode = INFLATE_MODE_HUFFMAN;
+		return inflate_dynamic(state);
+	default:
+		return false;
+	}
+}
+
+/**
+ * Copy the stored block into the output, the bytes are taken from the input
+ * buffer directly
+ */
+static bool inflate_stored(struct inflate_state *state, uint8_t **out,
+                           uint8_t *end) {
+	// whole bytes left in the bit buffer come first
+	while (state->stored_left > 0 && state->bits_num >= 8 && *out < end) {
+		*(*out)++ = (uint8_t)state->bits;
+		inflate_drop(state, 8);
+		--state->stored_left;
+	}
+
+	while (state->stored_left > 0 && *out < end) {
+		if (state->in == state->in_end && !inflate_refill(state))
+			return false;
+
+		uint32_t len = (uint32_t)(state->in_end - state->in);
+		if (len > state->stored_left)
+			len = state->stored_left;
+		if (len > (uint32_t)(end - *out))
+			len = (uint32_t)(end - *out);
+
+		memcopy(*out, (void *)state->in, len);
+		state->in += len;
+		*out += len;
+		state->stored_left -= len;
+
+		if (inflate_overrun(state))
+			return false;
+	}
+
+	if (state->stored_left == 0)
+		state->mode = INFLATE_MODE_HEADER;
+
+	return true;
+}
+
+/**
+ * Copy the pending back reference, from the output of this call if it is
+ * recent enough and from the window otherwise
+ */
+static void inflate_copy(struct inflate_state *state, const uint8_t *start,
+                         uint8_t **out, uint8_t *end) {
+	while (state->match_len > 0 && *out < end) {
+		uint32_t produced = (uint32_t)(*out - start);
+		uint32_t len = state->match_len;
+		const uint8_t *src = NULL;
+
+		if (len > (uint32_t)(end - *out))
+			len = (uint32_t)(end - *out);
+
+		if (state->match_dist <= produced) {
+			src = *out - state->match_dist;
+		} else {
+			uint32_t back = state->match_dist - produced;
+			uint32_t pos = (state->window_pos + INFLATE_WINDOW - back)
+			               % INFLATE_WINDOW;
+
+			if (len > back)
+				len = back;
+			if (len > INFLATE_WINDOW - pos)
+				len = INFLATE_WINDOW - pos;
+			src = &state->window[pos];
+		}
+
+		// byte by byte: the source may overlap the destination
+		for (uint32_t i = 0; i < len; ++i)
+			(*out)[i] = src[i];
+
+		*out += len;
+		state->match_len = (uint16_t)(state->match_len - len);
+	}
+}
+
+static bool inflate_huffman(struct inflate_state *state, const uint8_t *start,
+                            uint8_t **out, uint8_t *end) {
+	while (*out < end) {
+		int32_t sym = inflate_decode(state, &state->litlen);
+		uint32_t extra = 0;
+
+		if (sym < 0)
+			return false;
+
+		if (sym < INFLATE_END_BLOCK) {
+			*(*out)++ = (uint8_t)sym;
+			continue;
+		}
+
+		if (sym == INFLATE_END_BLOCK) {
+			state->mode = INFLATE_MODE_HEADER;
+			return true;
+		}
+
+		sym -= INFLATE_END_BLOCK + 1;
+		if (sym >= 29 || !inflate_bits(state, len_extra[sym], &extra))
+			return false;
+		state->match_len = (uint16_t)(len_base[sym] + extra);
+
+		sym = inflate_decode(state, &state->dist);
+		if (sym < 0 || sym >= 30
+		    || !inflate_bits(state, dist_extra[sym], &extra))
+			return false;
+		state->match_dist = (uint16_t)(dist_base[sym] + extra);
+
+		if (state->match_dist > state->window_len + (uint32_t)(*out - start))
+			return false;
+
+		inflate_copy(state, start, out, end);
+	}
+
+	return true;
+}
+
+/**
+ * Keep the last INFLATE_WINDOW bytes of the output
+ */
+static void inflate_window_update(struct inflate_state *state,
+                                  const uint8_t *data, uint32_t len) {
+	if (len >= INFLATE_WINDOW) {
+		memcopy(state->window, (void *)(data + len - INFLATE_WINDOW),
+		        INFLATE_WINDOW);
+		state->window_pos = 0;
+		state->window_len = INFLATE_WINDOW;
+		return;
+	}
+
+	uint32_t first = INFLATE_WINDOW - state->window_pos;
+	if (first > len)
+		first = len;
+
+	memcopy(&state->window[state->window_pos], (void *)data, first);
+	memcopy(state->window, (void *)(data + first), len - first);
+
+	state->window_pos = (state->window_pos + len) % INFLATE_WINDOW;
+	state->window_len += len;
+	if (state->window_len > INFLATE_WINDOW)
+		state->window_len = INFLATE_WINDOW;
+}
+
+void inflate_init(struct inflate_state *state, inflate_fill_cb fill,
+                  void *ctx) {
+	state->fill = fill;
+	state->ctx = ctx;
+	state->in = NULL;
+	state->in_end = NULL;
+	state->bits = 0;
+	state->bits_num = 0;
+	state->pad_bytes = 0;
+	state->mode = INFLATE_MODE_HEADER;
+	state->final = false;
+	state->gzip = false;
+	state->error = false;
+	state->stored_left = 0;
+	state->match_len = 0;
+	state->match_dist = 0;
+	state->crc = 0;
+	state->total = 0;
+	state->window_pos = 0;
+	state->window_len = 0;
+}
+
+/**
+ * Skip a zero terminated string of the gzip header
+ */
+static bool inflate_skip_string(struct inflate_state *state) {
+	uint32_t chr = 0;
+
+	do {
+		if (!inflate_bits(state, 8, &chr))
+			return false;
+	} while (chr != 0);
+
+	return true;
+}
+
+bool inflate_init_gzip(struct inflate_state *state, inflate_fill_cb fill,
+                       void *ctx) {
+	uint32_t id1 = 0;
+	uint32_t id2 = 0;
+	uint32_t method = 0;
+	uint32_t flags = 0;
+	uint32_t val = 0;
+
+	inflate_init(state, fill, ctx);
+	state->gzip = true;
+
+	if (!inflate_bits(state, 8, &id1) || !inflate_bits(state, 8, &id2)
+	    || !inflate_bits(state, 8, &method) || !inflate_bits(state, 8, &flags)
+	    || id1 != GZIP_ID1 || id2 != GZIP_ID2 || method != GZIP_CM_DEFL
+	    || (flags & GZIP_FLAG_RESERVED) != 0)
+		goto fail;
+
+	// modification time, extra flags and operating system
+	for (uint8_t i = 0; i < 3; ++i) {
+		if (!inflate_bits(state, 16, &val))
+			goto fail;
+	}
+
+	if (flags & GZIP_FLAG_EXTRA) {
+		uint32_t xlen = 0;
+
+		if (!inflate_bits(state, 16, &xlen))
+			goto fail;
+		while (xlen-- > 0) {
+			if (!inflate_bits(state, 8, &val))
+				goto fail;
+		}
+	}
+
+	if ((flags & GZIP_FLAG_NAME) && !inflate_skip_string(state))
+		goto fail;
+	if ((flags & GZIP_FLAG_COMMENT) && !inflate_skip_string(state))
+		goto fail;
+	if ((flags & GZIP_FLAG_HCRC) && !inflate_bits(state, 16, &val))
+		goto fail;
+
+	if (!inflate_overrun(state))
+		return true;
+
+fail:
+	state->error = true;
+	return false;
+}
+
+bool inflate_read(struct inflate_state *state, void *buf, uint32_t len,
+                  uint32_t *got) {
+	uint8_t *start = buf;
+	uint8_t *out = start;
+	uint8_t *end = start + len;
+	bool result = !state->error;
+
+	while (result && out < end && state->mode < INFLATE_MODE_TRAILER) {
+		if (state->match_len > 0) {
+			inflate_copy(state, start, &out, end);
+			continue;
+		}
+
+		switch (state->mode) {
+		case INFLATE_MODE_HEADER:
+			result = inflate_block_header(state);
+			break;
+		case INFLATE_MODE_STORED:
+			result = inflate_stored(state, &out, end);
+			break;
+		default:
+			result = inflate_huffman(state, start, &out, end);
+			break;
+		}
+	}
+
+	uint32_t produced = (uint32_t)(out - start);
+
+	inflate_window_update(state, start, produced);
+	state->total += produced;
+	if (state->gzip)
+		state->crc = crc32(state->crc, start, produced);
+
+	// the trailer covers the output, check it once everything is counted
+	if (result && state->mode == INFLATE_MODE_TRAILER) {
+		state->mode = INFLATE_MODE_DONE;
+		result = !inflate_overrun(state)
+		         && (!state->gzip || inflate_trailer(state));
+	}
+
+	if (!result)
+		state->error = true;
+
+	*got = produced;
+	return result;
+}
+
+bool inflate_skip(struct inflate_state *state, uint32_t len) {
+	uint8_t buf[512];
+	uint32_t got = 0;
+
+	while (len > 0) {
+		uint32_t chunk = len < sizeof(buf) ? len : (uint32_t)sizeof(buf);
+
+		if (!inflate_read(state, buf, chunk, &got) || got != chunk)
+			return false;
+		len -= chunk;
+	}
+
+	return true;
+}
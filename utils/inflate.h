@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Streaming inflate (RFC 1951) with an optional gzip wrapper (RFC 1952).
+ *
+ * Input is pulled through a callback one buffer at a time, output is decoded
+ * straight into the caller's buffer. Back references beyond the current call
+ * come from a fixed INFLATE_WINDOW byte window. The state holds the window
+ * and the Huffman tables, so decoding never allocates.
+ */
+
+#define INFLATE_WINDOW    32768
+#define INFLATE_FAST_BITS 9 // codes this long or shorter decode with one lookup
+
+/**
+ * Supply the next input buffer
+ *
+ * @param ctx user data
+ * @param buf the buffer is returned here, it has to stay valid until the
+ * next call
+ * @param len length of the buffer is returned here, 0 at the end of the input
+ * @return false if the input could not be read
+ */
+typedef bool (*inflate_fill_cb)(void *ctx, const uint8_t **buf, uint32_t *len);
+
+struct inflate_huffman {
+	uint16_t fast[1 << INFLATE_FAST_BITS]; // (length << 9) | symbol, 0: longer
+	uint16_t count[16];                    // codes of each length
+	uint16_t symbol[288];                  // symbols in code order
+};
+
+struct inflate_state {
+	inflate_fill_cb fill;
+	void *ctx;
+	const uint8_t *in;
+	const uint8_t *in_end;
+	uint32_t bits;      // input bits not consumed yet, LSB first
+	uint8_t bits_num;
+	uint8_t pad_bytes;  // zero bytes fed after the end of the input
+	uint8_t mode;       // INFLATE_MODE_*, internal
+	bool final;         // the current block is the last one
+	bool gzip;
+	bool error;
+	uint32_t stored_left;
+	uint16_t match_len; // back reference not copied yet
+	uint16_t match_dist;
+	uint32_t crc;       // gzip: CRC-32 of the output so far
+	uint32_t total;     // bytes of output so far
+	struct inflate_huffman litlen;
+	struct inflate_huffman dist;
+	uint32_t window_pos;
+	uint32_t window_len;
+	uint8_t window[INFLATE_WINDOW];
+};
+
+/**
+ * Start decoding a raw deflate stream
+ *
+ * @param state state to initialize
+ * @param fill input callback
+ * @param ctx passed to `fill`
+ */
+void inflate_init(struct inflate_state *state, inflate_fill_cb fill,
+                  void *ctx);
+
+/**
+ * Start decoding a gzip stream and parse its header. The CRC and the size in
+ * the trailer are checked at the end of the stream.
+ *
+ * @param state state to initialize
+ * @param fill input callback
+ * @param ctx passed to `fill`
+ * @return false if the input is not a gzip stream with deflate data
+ */
+bool inflate_init_gzip(struct inflate_state *state, inflate_fill_cb fill,
+                       void *ctx);
+
+/**
+ * Decode the next bytes of the stream
+ *
+ * @param state started stream
+ * @param buf destination
+ * @param len bytes wanted
+ * @param got bytes decoded are returned here, less than `len` only at the end
+ * of the stream
+ * @return false if the data is corrupted, truncated or the input callback
+ * failed
+ */
+bool inflate_read(struct inflate_state *state, void *buf, uint32_t len,
+                  uint32_t *got);
+
+/**
+ * Decode and drop bytes
+ *
+ * @param state started stream
+ * @param len bytes to drop
+ * @return false if the stream ended before or the data is corrupted
+ */
+bool inflate_skip(struct inflate_state *state, uint32_t len);
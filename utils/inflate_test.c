@@ -0,0 +1,484 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "inflate.h"
+#include "mem/mem_internal.h"
+#include "test/unity.h"
+#include "utils/crc32.h"
+
+#define TEST_HEAP_SIZE (64 * 1024)
+
+// Full-speed bulk throughput of a USB stick behind UHCI, roughly
+#define TEST_USB_RATE (1024 * 1024)
+
+uint8_t test_heap[TEST_HEAP_SIZE] __attribute__((aligned(16)));
+
+// Dummy synbols as no linker script is used
+uint8_t heap_start[1];
+uint8_t heap_end[1];
+
+static struct inflate_state state;
+
+/*
+ * gzip -9 output with the name "kernel.elf", one dynamic Huffman block of
+ * make_text()
+ */
+static const uint8_t gzip_text[] = {
+	0x1f, 0x8b, 0x08, 0x08, 0x00, 0x00, 0x00, 0x00, 0x02, 0xff, 0x6b, 0x65,
+	0x72, 0x6e, 0x65, 0x6c, 0x2e, 0x65, 0x6c, 0x66, 0x00, 0x6d, 0x94, 0x31,
+	0x6e, 0xc4, 0x20, 0x14, 0x05, 0xfb, 0x3d, 0x05, 0x07, 0x48, 0xc1, 0x03,
+	0x0c, 0xf6, 0x21, 0xf6, 0x10, 0x18, 0xb0, 0x14, 0xc5, 0x5a, 0x4b, 0x2b,
+	0x47, 0x4a, 0x6e, 0x9f, 0x6c, 0x13, 0x29, 0xe3, 0xff, 0x3b, 0x8a, 0x29,
+	0x46, 0x9a, 0xc7, 0xfd, 0x73, 0x3f, 0xdf, 0xd7, 0xe3, 0x38, 0xdd, 0xc7,
+	0x78, 0x3e, 0xc6, 0xee, 0xbc, 0xdb, 0x8f, 0xda, 0x47, 0x77, 0xf5, 0x74,
+	0xfe, 0x4b, 0xfe, 0x75, 0x6f, 0x6e, 0x3c, 0xce, 0xe7, 0xf7, 0xdf, 0xfb,
+	0x76, 0x27, 0x25, 0x50, 0x02, 0xa5, 0x10, 0xd3, 0x95, 0x0a, 0xa0, 0x02,
+	0xa8, 0x90, 0xf2, 0x7c, 0xa5, 0x22, 0xa8, 0x08, 0x2a, 0xe6, 0xa5, 0x5d,
+	0xa9, 0x04, 0x2a, 0x81, 0x4a, 0x73, 0x37, 0xbc, 0x26, 0x50, 0x13, 0xa8,
+	0x69, 0xf5, 0x86, 0x57, 0x06, 0x95, 0x41, 0xe5, 0x1e, 0x0d, 0xaf, 0x02,
+	0xaa, 0x80, 0x2a, 0x5b, 0x36, 0xbc, 0x66, 0x50, 0x33, 0xa8, 0x45, 0xd5,
+	0xf0, 0x5a, 0x40, 0x2d, 0xa0, 0x6a, 0xec, 0x86, 0x97, 0x18, 0x47, 0x05,
+	0xb6, 0x66, 0x6f, 0x88, 0x89, 0x75, 0xac, 0xc0, 0xda, 0x1c, 0x0d, 0x33,
+	0x31, 0x8f, 0x06, 0xac, 0xd7, 0x62, 0xa5, 0xc8, 0x3e, 0x3a, 0xb0, 0xd1,
+	0xaa, 0xe5, 0xc6, 0x40, 0x06, 0xb0, 0x6d, 0x74, 0xcb, 0x8d, 0x85, 0x6c,
+	0xff, 0xb1, 0xdf, 0xf3, 0x96, 0x1b, 0x12, 0x11, 0x66, 0xf6, 0xda, 0x8b,
+	0xe5, 0x86, 0x46, 0x84, 0x9d, 0x29, 0x4e, 0xc5, 0x72, 0x43, 0x24, 0xc2,
+	0xd0, 0x94, 0x4a, 0xb5, 0xdc, 0x50, 0x89, 0xb0, 0x34, 0x4d, 0x4b, 0x37,
+	0xdc, 0x02, 0x2a, 0x11, 0xa6, 0xa6, 0xdc, 0x64, 0xb8, 0x05, 0x54, 0x22,
+	0x6c, 0x4d, 0x65, 0x24, 0xeb, 0x0f, 0x41, 0x25, 0xc2, 0xd8, 0xb4, 0xf8,
+	0x62, 0xb8, 0x05, 0x54, 0x22, 0xac, 0x4d, 0x35, 0xd4, 0x76, 0xfb, 0x01,
+	0x44, 0x2d, 0x4f, 0xe0, 0x1e, 0x05, 0x00, 0x00,
+};
+
+// Raw deflate, one stored block of "stored block data\n"
+static const uint8_t raw_stored[] = {
+	0x01, 0x12, 0x00, 0xed, 0xff, 0x73, 0x74, 0x6f, 0x72, 0x65, 0x64, 0x20,
+	0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x20, 0x64, 0x61, 0x74, 0x61, 0x0a,
+};
+
+// Raw deflate, one fixed Huffman block of "abc" and 300 'a'
+static const uint8_t raw_fixed[] = {
+	0x4b, 0x4c, 0x4a, 0x4e, 0x1c, 0x05, 0x44, 0x03, 0x00,
+};
+
+struct test_input {
+	const uint8_t *data;
+	uint32_t len;
+	uint32_t pos;
+	uint32_t chunk; // bytes handed out per call
+	uint32_t fills;
+};
+
+static bool test_fill(void *ctx, const uint8_t **buf, uint32_t *len) {
+	struct test_input *input = ctx;
+	uint32_t left = input->len - input->pos;
+
+	*buf = input->data + input->pos;
+	*len = left < input->chunk ? left : input->chunk;
+	input->pos += *len;
+	input->fills++;
+	return true;
+}
+
+static bool test_fill_fail(void *ctx, const uint8_t **buf, uint32_t *len) {
+	(void)ctx;
+	(void)buf;
+	(void)len;
+	return false;
+}
+
+static uint32_t make_text(char *buf, uint32_t len) {
+	uint32_t pos = 0;
+
+	for (uint32_t i = 0; i < 24; ++i)
+		pos += (uint32_t)snprintf(
+		    buf + pos, len - pos,
+		    "Multiboot kernel %u loaded at 0x%06x, entry 0x%06x\n", i,
+		    0x100000 + i * 0x1000, 0x100000 + i * 0x1234);
+
+	return pos;
+}
+
+/*
+ * Minimal deflate encoder for the tests: greedy LZ77 over a 3 byte hash and
+ * one fixed Huffman block
+ */
+struct test_encoder {
+	uint8_t *out;
+	uint32_t pos;
+	uint32_t bits;
+	uint8_t bits_num;
+};
+
+static void enc_bits(struct test_encoder *enc, uint32_t val, uint8_t num) {
+	enc->bits |= val << enc->bits_num;
+	enc->bits_num = (uint8_t)(enc->bits_num + num);
+	while (enc->bits_num >= 8) {
+		enc->out[enc->pos++] = (uint8_t)enc->bits;
+		enc->bits >>= 8;
+		enc->bits_num = (uint8_t)(enc->bits_num - 8);
+	}
+}
+
+// Huffman codes go MSB first
+static void enc_code(struct test_encoder *enc, uint32_t code, uint8_t len) {
+	uint32_t rev = 0;
+
+	for (uint8_t bit = 0; bit < len; ++bit)
+		rev |= ((code >> bit) & 1) << (len - 1 - bit);
+	enc_bits(enc, rev, len);
+}
+
+static void enc_litlen(struct test_encoder *enc, uint32_t sym) {
+	if (sym < 144)
+		enc_code(enc, 0x30 + sym, 8);
+	else if (sym < 256)
+		enc_code(enc, 0x190 + sym - 144, 9);
+	else if (sym < 280)
+		enc_code(enc, sym - 256, 7);
+	else
+		enc_code(enc, 0xc0 + sym - 280, 8);
+}
+
+static void enc_match(struct test_encoder *enc, uint32_t len, uint32_t dist) {
+	static const uint16_t len_base[29] = {
+	    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+	    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+	static const uint16_t dist_base[30] = {
+	    1,    2,    3,    4,    5,    7,    9,    13,    17,    25,
+	    33,   49,   65,   97,   129,  193,  257,  385,   513,   769,
+	    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+	uint8_t sym = 28;
+	uint8_t extra = 0;
+
+	while (len_base[sym] > len)
+		--sym;
+	extra = (uint8_t)(sym < 8 || sym == 28 ? 0 : (sym - 4) / 4);
+	enc_litlen(enc, 257u + sym);
+	enc_bits(enc, len - len_base[sym], extra);
+
+	sym = 29;
+	while (dist_base[sym] > dist)
+		--sym;
+	extra = (uint8_t)(sym < 4 ? 0 : (sym - 2) / 2);
+	enc_code(enc, sym, 5);
+	enc_bits(enc, dist - dist_base[sym], extra);
+}
+
+static uint32_t test_deflate(const uint8_t *data, uint32_t len, uint8_t *out) {
+	static int32_t head[1 << 15];
+	struct test_encoder enc = {out, 0, 0, 0};
+	uint32_t pos = 0;
+
+	memset(head, 0xff, sizeof(head));
+	enc_bits(&enc, 1, 1); // final
+	enc_bits(&enc, 1, 2); // fixed Huffman
+
+	while (pos < len) {
+		uint32_t best = 0;
+
+		if (pos + 3 <= len) {
+			uint32_t hash = ((uint32_t)data[pos] << 10 ^ (uint32_t)data[pos + 1]
+			                 << 5 ^ data[pos + 2])
+			                & ((1 << 15) - 1);
+			int32_t cand = head[hash];
+
+			head[hash] = (int32_t)pos;
+			if (cand >= 0 && pos - (uint32_t)cand <= INFLATE_WINDOW) {
+				while (best < 258 && pos + best < len
+				       && data[(uint32_t)cand + best] == data[pos + best])
+					++best;
+				if (best >= 3)
+					enc_match(&enc, best, pos - (uint32_t)cand);
+			}
+		}
+
+		if (best < 3) {
+			enc_litlen(&enc, data[pos]);
+			best = 1;
+		}
+		pos += best;
+	}
+
+	enc_litlen(&enc, 256);
+	enc_bits(&enc, 0, 7); // flush
+	return enc.pos;
+}
+
+/*
+ * Something like the code and data of a kernel: short instruction patterns
+ * with few distinct operands, zeroed tables and message strings
+ */
+static void make_kernel(uint8_t *buf, uint32_t len) {
+	static const uint8_t ops[8][4] = {
+	    {0x55, 0x89, 0xe5, 0x53}, {0x8b, 0x45, 0x08, 0x50},
+	    {0xe8, 0x00, 0x00, 0x00}, {0x83, 0xc4, 0x10, 0x85},
+	    {0x5b, 0x5d, 0xc3, 0x90}, {0x89, 0x04, 0x24, 0x8d},
+	    {0x74, 0x0c, 0x31, 0xc0}, {0xc7, 0x44, 0x24, 0x04}};
+	static const char *const msgs[4] = {"out of memory\n", "bad descriptor\n",
+	                                    "device not ready\n", "timeout\n"};
+	uint32_t seed = 12345;
+	uint32_t pos = 0;
+
+	while (pos < len) {
+		seed = seed * 1103515245 + 12345;
+
+		uint32_t kind = (seed >> 16) % 16;
+		if (kind < 12) {
+			const uint8_t *op = ops[(seed >> 8) % 8];
+			for (uint8_t i = 0; i < 4 && pos < len; ++i)
+				buf[pos++] = op[i];
+			// an operand, near addresses repeat a lot
+			for (uint8_t i = 0; i < 2 && pos < len; ++i)
+				buf[pos++] = (uint8_t)(seed >> (20 + i * 4) & 0x3f);
+		} else if (kind < 14) {
+			const char *msg = msgs[(seed >> 24) % 4];
+			while (*msg != '\0' && pos < len)
+				buf[pos++] = (uint8_t)*msg++;
+		} else {
+			for (uint32_t i = 0; i < 64 && pos < len; ++i)
+				buf[pos++] = 0;
+		}
+	}
+}
+
+void setUp(void) {
+	free_block_head = (struct free_block *)test_heap;
+	free_block_head->size = TEST_HEAP_SIZE;
+	free_block_head->next = 0;
+	memset(&state, 0xaa, sizeof(state));
+}
+
+void tearDown(void) {}
+
+static void test_inflate_gzip_dynamic(void) {
+	char text[2048];
+	uint8_t out[2048];
+	uint32_t text_len = make_text(text, sizeof(text));
+	struct test_input input = {gzip_text, sizeof(gzip_text), 0, 64, 0};
+	uint32_t got = 0;
+
+	TEST_ASSERT_TRUE(inflate_init_gzip(&state, test_fill, &input));
+	TEST_ASSERT_TRUE(inflate_read(&state, out, sizeof(out), &got));
+	TEST_ASSERT_EQUAL_UINT32(text_len, got);
+	TEST_ASSERT_EQUAL_MEMORY(text, out, text_len);
+
+	// the end stays the end
+	TEST_ASSERT_TRUE(inflate_read(&state, out, sizeof(out), &got));
+	TEST_ASSERT_EQUAL_UINT32(0, got);
+}
+
+static void test_inflate_gzip_byte_by_byte(void) {
+	char text[2048];
+	uint8_t out[2048];
+	uint32_t text_len = make_text(text, sizeof(text));
+	struct test_input input = {gzip_text, sizeof(gzip_text), 0, 1, 0};
+	uint32_t pos = 0;
+	uint32_t got = 0;
+
+	// 1 byte input buffers, odd output pieces: every resume point is hit
+	TEST_ASSERT_TRUE(inflate_init_gzip(&state, test_fill, &input));
+	while (pos < text_len) {
+		TEST_ASSERT_TRUE(inflate_read(&state, out + pos, 7, &got));
+		TEST_ASSERT_TRUE(got > 0);
+		pos += got;
+	}
+
+	TEST_ASSERT_EQUAL_UINT32(text_len, pos);
+	TEST_ASSERT_EQUAL_MEMORY(text, out, text_len);
+	TEST_ASSERT_TRUE(inflate_read(&state, out, 1, &got));
+	TEST_ASSERT_EQUAL_UINT32(0, got);
+}
+
+static void test_inflate_gzip_corrupted(void) {
+	uint8_t data[sizeof(gzip_text)];
+	uint8_t out[2048];
+	struct test_input input = {data, sizeof(data), 0, 64, 0};
+	uint32_t got = 0;
+
+	// CRC in the trailer
+	memcpy(data, gzip_text, sizeof(data));
+	data[sizeof(data) - 8] ^= 1;
+	TEST_ASSERT_TRUE(inflate_init_gzip(&state, test_fill, &input));
+	TEST_ASSERT_FALSE(inflate_read(&state, out, sizeof(out), &got));
+	TEST_ASSERT_FALSE(inflate_read(&state, out, sizeof(out), &got));
+
+	// size in the trailer
+	memcpy(data, gzip_text, sizeof(data));
+	data[sizeof(data) - 1] ^= 1;
+	input.pos = 0;
+	TEST_ASSERT_TRUE(inflate_init_gzip(&state, test_fill, &input));
+	TEST_ASSERT_FALSE(inflate_read(&state, out, sizeof(out), &got));
+
+	// truncated trailer
+	memcpy(data, gzip_text, sizeof(data));
+	input.len = sizeof(data) - 3;
+	input.pos = 0;
+	TEST_ASSERT_TRUE(inflate_init_gzip(&state, test_fill, &input));
+	TEST_ASSERT_FALSE(inflate_read(&state, out, sizeof(out), &got));
+
+	// truncated data
+	input.len = sizeof(data) / 2;
+	input.pos = 0;
+	TEST_ASSERT_TRUE(inflate_init_gzip(&state, test_fill, &input));
+	TEST_ASSERT_FALSE(inflate_read(&state, out, sizeof(out), &got));
+
+	// not gzip
+	data[0] = 0x1e;
+	input.len = sizeof(data);
+	input.pos = 0;
+	TEST_ASSERT_FALSE(inflate_init_gzip(&state, test_fill, &input));
+
+	// read error
+	TEST_ASSERT_FALSE(inflate_init_gzip(&state, test_fill_fail, NULL));
+}
+
+static void test_inflate_stored(void) {
+	struct test_input input = {raw_stored, sizeof(raw_stored), 0, 5, 0};
+	uint8_t out[64];
+	uint32_t got = 0;
+
+	inflate_init(&state, test_fill, &input);
+	TEST_ASSERT_TRUE(inflate_read(&state, out, 4, &got));
+	TEST_ASSERT_EQUAL_UINT32(4, got);
+	TEST_ASSERT_TRUE(inflate_read(&state, out + 4, sizeof(out) - 4, &got));
+	TEST_ASSERT_EQUAL_UINT32(14, got);
+	TEST_ASSERT_EQUAL_MEMORY("stored block data\n", out, 18);
+
+	// LEN and NLEN disagree
+	uint8_t bad[sizeof(raw_stored)];
+	memcpy(bad, raw_stored, sizeof(bad));
+	bad[3] ^= 1;
+	input.data = bad;
+	input.pos = 0;
+	inflate_init(&state, test_fill, &input);
+	TEST_ASSERT_FALSE(inflate_read(&state, out, sizeof(out), &got));
+}
+
+static void test_inflate_fixed_overlap(void) {
+	struct test_input input = {raw_fixed, sizeof(raw_fixed), 0, 64, 0};
+	uint8_t expected[303];
+	uint8_t out[400];
+	uint32_t got = 0;
+
+	memcpy(expected, "abc", 3);
+	memset(expected + 3, 'a', 300);
+
+	inflate_init(&state, test_fill, &input);
+	TEST_ASSERT_TRUE(inflate_read(&state, out, sizeof(out), &got));
+	TEST_ASSERT_EQUAL_UINT32(sizeof(expected), got);
+	TEST_ASSERT_EQUAL_MEMORY(expected, out, sizeof(expected));
+}
+
+static void test_inflate_invalid(void) {
+	static const uint8_t reserved[] = {0x07, 0x00};
+	// fixed block, a match with distance 1 before any output
+	static const uint8_t far[] = {0x03, 0x02, 0x00};
+	struct test_input input = {reserved, sizeof(reserved), 0, 64, 0};
+	uint8_t out[16];
+	uint32_t got = 0;
+
+	inflate_init(&state, test_fill, &input);
+	TEST_ASSERT_FALSE(inflate_read(&state, out, sizeof(out), &got));
+
+	input.data = far;
+	input.len = sizeof(far);
+	input.pos = 0;
+	inflate_init(&state, test_fill, &input);
+	TEST_ASSERT_FALSE(inflate_read(&state, out, sizeof(out), &got));
+}
+
+static void test_inflate_window(void) {
+	uint32_t len = 512 * 1024;
+	uint8_t *data = malloc(len);
+	uint8_t *packed = malloc(len * 2);
+	uint8_t *out = malloc(len);
+	uint32_t packed_len = 0;
+	uint32_t pos = 0;
+	uint32_t got = 0;
+
+	make_kernel(data, len);
+	packed_len = test_deflate(data, len, packed);
+
+	// odd pieces, so references reach back across calls into the window
+	struct test_input input = {packed, packed_len, 0, 4093, 0};
+	inflate_init(&state, test_fill, &input);
+	TEST_ASSERT_TRUE(inflate_skip(&state, 1000));
+	pos = 1000;
+	while (pos < len) {
+		uint32_t piece = (pos % 3 + 1) * 997;
+		if (piece > len - pos)
+			piece = len - pos;
+
+		TEST_ASSERT_TRUE(inflate_read(&state, out + pos, piece, &got));
+		TEST_ASSERT_EQUAL_UINT32(piece, got);
+		pos += piece;
+	}
+	TEST_ASSERT_EQUAL_MEMORY(data + 1000, out + 1000, len - 1000);
+
+	TEST_ASSERT_TRUE(inflate_read(&state, out, 1, &got));
+	TEST_ASSERT_EQUAL_UINT32(0, got);
+	TEST_ASSERT_FALSE(inflate_skip(&state, 1));
+
+	free(out);
+	free(packed);
+	free(data);
+}
+
+static void test_inflate_bench_4mb(void) {
+	uint32_t len = 4 * 1024 * 1024;
+	uint8_t *data = malloc(len);
+	uint8_t *packed = malloc(len * 2);
+	uint8_t *out = malloc(len);
+	uint32_t packed_len = 0;
+	uint32_t got = 0;
+	uint32_t rounds = 8;
+
+	make_kernel(data, len);
+	packed_len = test_deflate(data, len, packed);
+
+	// 32KB input buffers like loader/stream.c, output straight to the
+	// destination
+	clock_t start = clock();
+	for (uint32_t i = 0; i < rounds; ++i) {
+		struct test_input input = {packed, packed_len, 0, 32 * 1024, 0};
+
+		inflate_init(&state, test_fill, &input);
+		TEST_ASSERT_TRUE(inflate_read(&state, out, len, &got));
+		TEST_ASSERT_EQUAL_UINT32(len, got);
+	}
+	double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	TEST_ASSERT_EQUAL_MEMORY(data, out, len);
+
+	double mbps = (double)len * rounds / secs / (1024 * 1024);
+	double plain = (double)len / TEST_USB_RATE;
+	double packed_time = (double)packed_len / TEST_USB_RATE;
+	double decode = (double)len / (mbps * 1024 * 1024);
+
+	printf("INFLATE 4MB kernel: %u -> %u bytes (%.1f%%), %.1f MB/s, at "
+	       "%u KB/s USB: plain %.2f s, gzip %.2f s read + %.2f s inflate, "
+	       "%.2f s saved\n",
+	       len, packed_len, 100.0 * packed_len / len, mbps,
+	       TEST_USB_RATE / 1024, plain, packed_time, decode,
+	       plain - packed_time - decode);
+
+	free(out);
+	free(packed);
+	free(data);
+}
+
+int main(void) {
+	UNITY_BEGIN();
+	RUN_TEST(test_inflate_gzip_dynamic);
+	RUN_TEST(test_inflate_gzip_byte_by_byte);
+	RUN_TEST(test_inflate_gzip_corrupted);
+	RUN_TEST(test_inflate_stored);
+	RUN_TEST(test_inflate_fixed_overlap);
+	RUN_TEST(test_inflate_invalid);
+	RUN_TEST(test_inflate_window);
+	RUN_TEST(test_inflate_bench_4mb);
+	return UNITY_END();
+}
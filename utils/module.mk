@@ -1,2 +1,10 @@
 SRCS += utils/i386-stub.c \
-        utils/gdbstub.c
+        utils/gdbstub.c \
+        utils/profile.c \
+        utils/sg.c \
+        utils/crc32.c \
+        utils/inflate.c
+
+# Add test target
+$(eval $(call test_target,test_inflate,test/unity.c utils/inflate_test.c utils/inflate.c utils/crc32.c mem/mem.c))
+$(eval $(call test_target,test_crc32,test/unity.c utils/crc32_test.c utils/crc32.c))
\ No newline at end of file
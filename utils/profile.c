@@ -0,0 +1,83 @@
+#ifdef PROFILE
+
+#include <stdint.h>
+
+#include "drivers/display/print.h"
+#include "drivers/serial/serial.h"
+#include "utils/profile.h"
+
+// 16 byte buckets over 256KB. stage2 plus its heap has to fit below the EBDA,
+// so the image stays well inside; samples past the range count as other.
+#define PROFILE_BUCKET_SHIFT 4
+#define PROFILE_BUCKETS      16384
+#define PROFILE_RANGE        ((uint32_t)PROFILE_BUCKETS << PROFILE_BUCKET_SHIFT)
+
+extern uint8_t stage2_start[];
+
+static volatile uint32_t buckets[PROFILE_BUCKETS];
+static volatile uint32_t samples_total = 0;
+static volatile uint32_t samples_other = 0;
+
+void profile_sample(uint32_t eip) {
+	// wraps around for addresses before stage2_start
+	uint32_t off = eip - (uint32_t)stage2_start;
+
+	samples_total++;
+	if (off < PROFILE_RANGE)
+		buckets[off >> PROFILE_BUCKET_SHIFT]++;
+	else
+		samples_other++;
+}
+
+void profile_reset(void) {
+	for (uint32_t i = 0; i < PROFILE_BUCKETS; i++)
+		buckets[i] = 0;
+
+	samples_total = 0;
+	samples_other = 0;
+}
+
+void profile_dump(serial_port port) {
+	serial_print(port, "PROFILE BEGIN ");
+	serial_print(port, itoa_once((int)stage2_start, 16));
+	serial_print(port, " ");
+	serial_print(port, itoa_once(1 << PROFILE_BUCKET_SHIFT, 16));
+	serial_print(port, "\r\n");
+
+	for (uint32_t i = 0; i < PROFILE_BUCKETS; i++) {
+		uint32_t cnt = buckets[i];
+		if (cnt == 0)
+			continue;
+
+		serial_print(port, itoa_once((int)((uint32_t)stage2_start
+		                                   + (i << PROFILE_BUCKET_SHIFT)),
+		                             16));
+		serial_print(port, " ");
+		serial_print(port, itoa_once((int)cnt, 10));
+		serial_print(port, "\r\n");
+	}
+
+	serial_print(port, "PROFILE END ");
+	serial_print(port, itoa_once((int)samples_total, 10));
+	serial_print(port, " ");
+	serial_print(port, itoa_once((int)samples_other, 10));
+	serial_print(port, "\r\n");
+}
+
+void profile_poll(serial_port port) {
+	if (!serial_data_ready(port))
+		return;
+
+	switch (serial_read(port)) {
+	case PROFILE_CMD_DUMP:
+		profile_dump(port);
+		break;
+	case PROFILE_CMD_RESET:
+		profile_reset();
+		break;
+	default:
+		break;
+	}
+}
+
+#endif
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "drivers/serial/serial.h"
+
+/*
+ * PIT sampling profiler. The timer interrupt records the interrupted EIP into
+ * a fixed histogram over the stage2 image. Only built with `make PROFILE=true`,
+ * otherwise the calls below are no-ops.
+ *
+ * Dump format (one line each, hex addresses):
+ *   PROFILE BEGIN <base> <bucket size>
+ *   <bucket address> <samples>
+ *   PROFILE END <total samples> <samples outside stage2>
+ *
+ * Use scripts/profile.py to symbolize the dump.
+ */
+
+// Serial command that dumps the histogram
+#define PROFILE_CMD_DUMP  'p'
+// Serial command that clears the histogram
+#define PROFILE_CMD_RESET 'r'
+
+#ifdef PROFILE
+
+/**
+ * Record one sample. Called from the timer ISR entry.
+ *
+ * @param eip interrupted instruction pointer
+ */
+void profile_sample(uint32_t eip);
+
+/**
+ * Clear all samples
+ */
+void profile_reset(void);
+
+/**
+ * Write the non-empty histogram buckets to a serial port
+ *
+ * @param port port to write to
+ */
+void profile_dump(serial_port port);
+
+/**
+ * Handle a pending profiler command on a serial port, if any
+ *
+ * @param port port to check
+ */
+void profile_poll(serial_port port);
+
+#else
+
+static inline void profile_reset(void) {}
+static inline void profile_dump(serial_port port) { (void)port; }
+static inline void profile_poll(serial_port port) { (void)port; }
+
+#endif
@@ -0,0 +1,35 @@
+#include "sg.h"
+
+uint32_t sg_total(const struct sg_entry *sg, uint8_t sg_num) {
+	uint32_t total = 0;
+
+	for (uint8_t i = 0; i < sg_num; ++i)
+		total += sg[i].len;
+
+	return total;
+}
+
+uint8_t sg_slice(const struct sg_entry *sg, uint8_t sg_num, uint32_t off,
+                 uint32_t len, struct sg_entry *out) {
+	uint8_t out_num = 0;
+
+	for (uint8_t i = 0; i < sg_num && len > 0; ++i) {
+		if (off >= sg[i].len) {
+			off -= sg[i].len;
+			continue;
+		}
+
+		uint32_t part = sg[i].len - off;
+		if (part > len)
+			part = len;
+
+		out[out_num].buf = (uint8_t *)sg[i].buf + off;
+		out[out_num].len = part;
+		++out_num;
+
+		len -= part;
+		off = 0;
+	}
+
+	return len == 0 ? out_num : 0;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+// Max entries of a scatter/gather list accepted by the drivers
+#define SG_MAX 16
+
+// One contiguous piece of a scatter/gather list
+struct sg_entry {
+	void *buf;
+	uint32_t len;
+};
+
+/**
+ * Sum the lengths of a scatter/gather list
+ *
+ * @param sg list
+ * @param sg_num number of entries
+ * @return total length in bytes
+ */
+uint32_t sg_total(const struct sg_entry *sg, uint8_t sg_num);
+
+/**
+ * Describe a byte range of a scatter/gather list with a new list
+ *
+ * @param sg source list
+ * @param sg_num number of entries in `sg`
+ * @param off start of the range
+ * @param len length of the range
+ * @param out the new list is returned here, at least `sg_num` entries
+ * @return number of entries in `out`; 0 if the range is outside of `sg`
+ */
+uint8_t sg_slice(const struct sg_entry *sg, uint8_t sg_num, uint32_t off,
+                 uint32_t len, struct sg_entry *out);